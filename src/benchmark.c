@@ -0,0 +1,824 @@
+/* =========================================================================
+ * File:        BENCHMARK.C
+ * Description: Built in benchmarks that are run from the command line
+ *              with the "--benchmark" option instead of starting the server.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// XML2 lib headers
+#include <libxml2/libxml/parser.h>
+#include <libxml2/libxml/tree.h>
+
+#include "config.h"
+
+#include "tvpvrd.h"
+#include "tvconfig.h"
+#include "utils.h"
+#include "xstr.h"
+#include "capture.h"
+#include "mpegscan.h"
+#include "recs.h"
+#include "tvxmldb.h"
+#include "tvdbsnap.h"
+#include "tvhistory.h"
+#include "datetimeutil.h"
+#include "benchmark.h"
+
+/*
+ * Number of capture modes to compare
+ */
+#define BENCHMARK_NMODES 3
+
+/*
+ * BENCHMARK_RATE integer
+ * Default rate (in MB/s) at which the fake encoder delivers the stream. A real
+ * card gives ~1MB/s so this corresponds to a very large number of cards while
+ * still letting a normal disk keep up so that no data is dropped.
+ */
+#define BENCHMARK_RATE 200
+
+/*
+ * BENCHMARK_CHUNK integer
+ * Size of each chunk given by the fake encoder. Same order of magnitude as
+ * what a real encoder gives in each read.
+ */
+#define BENCHMARK_CHUNK (64*1024)
+
+/*
+ * BENCHMARK_SCAN_MAX integer
+ * Largest part of the file (in MB) that is read into memory for the scan benchmark
+ */
+#define BENCHMARK_SCAN_MAX 512
+
+/*
+ * BENCHMARK_SCAN_ROUNDS integer
+ * Number of times the buffer is scanned by each implementation. The best round
+ * is reported.
+ */
+#define BENCHMARK_SCAN_ROUNDS 3
+
+/*
+ * BENCHMARK_XMLDB_SIZE integer
+ * Default number of recordings in the synthetic XML DB
+ */
+#define BENCHMARK_XMLDB_SIZE 10000
+
+/*
+ * BENCHMARK_XMLDB_CARDS integer
+ * Number of video cards the synthetic schedule is spread over
+ */
+#define BENCHMARK_XMLDB_CARDS 4
+
+/*
+ * BENCHMARK_HISTORY_SIZE integer
+ * Default number of recordings in the synthetic history log
+ */
+#define BENCHMARK_HISTORY_SIZE 100000
+
+/*
+ * BENCHMARK_HISTORY_ROUNDS integer
+ * Number of times each history query is run. The average is reported.
+ */
+#define BENCHMARK_HISTORY_ROUNDS 100
+
+/*
+ * The fake encoder. A thread feeds the file into a pipe at a fixed rate and the
+ * read end of the pipe is used as the encoder by the capture code.
+ */
+struct benchmark_feeder {
+    int fd;                 /* Input file */
+    int pw;                 /* Write end of the pipe */
+    unsigned rate;          /* MB/s */
+    double cpu_ms;          /* CPU used by the feeder thread itself */
+};
+
+/**
+ * Convert a timeval to ms
+ * @param tv
+ * @return ms
+ */
+static double
+_benchmark_ms(const struct timeval *tv) {
+    return (double)tv->tv_sec * 1000.0 + (double)tv->tv_usec / 1000.0;
+}
+
+/**
+ * Fake encoder thread. Moves the file into the pipe in BENCHMARK_CHUNK pieces
+ * and sleeps as necessary to keep the given rate. Closing the pipe signals
+ * end of stream to the capture code.
+ * @param arg Pointer to the feeder structure
+ * @return NULL
+ */
+static void *
+_benchmark_feeder(void *arg) {
+    struct benchmark_feeder *f = arg;
+    struct timespec t0, now;
+    struct rusage ru;
+    unsigned long long sent = 0;
+    ssize_t n;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while( (n = splice(f->fd, NULL, f->pw, NULL, BENCHMARK_CHUNK, SPLICE_F_MOVE)) > 0 ) {
+        sent += (unsigned long long)n;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const double due = (double)sent / ((double)f->rate * 1024.0 * 1024.0);
+        const double elapsed = (double)(now.tv_sec - t0.tv_sec) + (double)(now.tv_nsec - t0.tv_nsec) / 1e9;
+        if( due > elapsed ) {
+            struct timespec ts;
+            ts.tv_sec = (time_t)(due - elapsed);
+            ts.tv_nsec = (long)((due - elapsed - (double)ts.tv_sec) * 1e9);
+            nanosleep(&ts, NULL);
+        }
+    }
+    if( -1 == n ) {
+        fprintf(stderr, "Fake encoder failed ( %d : %s )\n", errno, strerror(errno));
+    }
+
+    getrusage(RUSAGE_THREAD, &ru);
+    f->cpu_ms = _benchmark_ms(&ru.ru_utime) + _benchmark_ms(&ru.ru_stime);
+    _dbg_close(f->pw);
+    return NULL;
+}
+
+/**
+ * Read the file once so that all modes read it from the page cache and the
+ * comparison is not skewed by the first run reading from disk
+ * @param fd
+ */
+static void
+_benchmark_warmup(int fd) {
+    static char buf[VIDBUFSIZE];
+    while( read(fd, buf, VIDBUFSIZE) > 0 )
+        ;
+    (void)lseek(fd, 0, SEEK_SET);
+}
+
+/**
+ * Record the given file with each capture mode and print the CPU time used per
+ * recorded GB. The file is fed through a pipe by a fake encoder thread at a fixed
+ * rate. The CPU used by the fake encoder is not included in the result.
+ * @param filename Input file
+ * @param rate Rate in MB/s for the fake encoder
+ * @return Exit status
+ */
+static int
+_benchmark_capture(const char *filename, unsigned rate) {
+    const int modes[BENCHMARK_NMODES] = {CAPTURE_READWRITE, CAPTURE_SPLICE, CAPTURE_URING};
+    char outname[] = "/tmp/tvpvrd-bench-XXXXXX";
+
+    max_video = 1;
+    abort_video = calloc(1, sizeof (int));
+    capture_buffer_size = DEFAULT_CAPTURE_BUFFER_SIZE*1024*1024;
+    if( abort_video == NULL ) {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+    capture_init();
+
+    int vh = open(filename, O_RDONLY);
+    if( -1 == vh ) {
+        fprintf(stderr, "Cannot open '%s' ( %d : %s )\n", filename, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    _benchmark_warmup(vh);
+    _dbg_close(vh);
+
+    fprintf(stdout, "Fake encoder rate %u MB/s\n", rate);
+    fprintf(stdout, "%-10s %-10s %10s %10s %9s %10s %12s\n",
+            "Mode", "Used", "Stored MB", "Dropped MB", "Wall s", "CPU ms", "CPU ms/GB");
+
+    for(int i=0; i < BENCHMARK_NMODES; i++) {
+        struct rusage ru0, ru1;
+        struct timeval tv0, tv1;
+        struct stat st;
+        unsigned mp2size;
+
+        struct benchmark_feeder feeder;
+        pthread_t feeder_thread;
+        int pfd[2];
+
+        CLEAR(feeder);
+        feeder.fd = open(filename, O_RDONLY);
+        int fh = mkstemp(outname);
+        if( -1 == feeder.fd || -1 == fh || -1 == pipe(pfd) ) {
+            fprintf(stderr, "Cannot open benchmark files ( %d : %s )\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        unlink(outname);
+        strcpy(outname + strlen(outname) - 6, "XXXXXX");
+        feeder.pw = pfd[1];
+        feeder.rate = rate;
+
+        capture_mode = modes[i];
+        const unsigned long long dropped = capture_getstats(0)->bytes_dropped;
+        getrusage(RUSAGE_SELF, &ru0);
+        gettimeofday(&tv0, NULL);
+        if( 0 != pthread_create(&feeder_thread, NULL, _benchmark_feeder, &feeder) ) {
+            fprintf(stderr, "Cannot start fake encoder ( %d : %s )\n", errno, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        int ret = capture_stream(0, pfd[0], fh, "benchmark", time(NULL) + 24*3600, &mp2size);
+        pthread_join(feeder_thread, NULL);
+        gettimeofday(&tv1, NULL);
+        getrusage(RUSAGE_SELF, &ru1);
+
+        // mp2size wraps for files over 4GB so we use the real file size
+        fstat(fh, &st);
+        _dbg_close(fh);
+        _dbg_close(pfd[0]);
+        _dbg_close(feeder.fd);
+
+        // The CPU time is counted per GB read from the encoder, including any data
+        // that was dropped because the disk could not keep up
+        const double mb = (double)st.st_size / (1024.0*1024.0);
+        const double dmb = (double)(capture_getstats(0)->bytes_dropped - dropped) / (1024.0*1024.0);
+        const double wall = (_benchmark_ms(&tv1) - _benchmark_ms(&tv0)) / 1000.0;
+        const double user = _benchmark_ms(&ru1.ru_utime) - _benchmark_ms(&ru0.ru_utime);
+        const double sys = _benchmark_ms(&ru1.ru_stime) - _benchmark_ms(&ru0.ru_stime);
+        const double cpu = user + sys - feeder.cpu_ms;
+        fprintf(stdout, "%-10s %-10s %10.1f %10.1f %9.2f %10.1f %12.1f%s\n",
+                capture_modename(modes[i]),
+                capture_modename(capture_getstats(0)->mode),
+                mb, dmb, wall, cpu,
+                mb + dmb > 0 ? cpu * 1024.0 / (mb + dmb) : 0.0,
+                ret == -1 ? " (aborted)" : "");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Time elapsed since t0 in ms
+ * @param t0
+ * @return ms
+ */
+static double
+_benchmark_elapsed(const struct timespec *t0) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - t0->tv_sec) * 1000.0 + (double)(now.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+/**
+ * Baseline for the scan benchmark. Count start code prefixes by finding each
+ * 0x01 with memchr() and checking the two bytes before it.
+ * @param buf
+ * @param len
+ * @return Number of start codes
+ */
+static unsigned long long
+_benchmark_count_memchr(const unsigned char *buf, size_t len) {
+    const unsigned char *end = buf + len;
+    const unsigned char *p = buf + 2;
+    unsigned long long n = 0;
+    while( p < end && (p = memchr(p, 1, (size_t)(end - p))) != NULL ) {
+        if( p[-1] == 0 && p[-2] == 0 ) {
+            n++;
+            p += 3;
+        } else {
+            p++;
+        }
+    }
+    return n;
+}
+
+/**
+ * Count start code prefixes with the selected scanner implementation
+ * @param buf
+ * @param len
+ * @return Number of start codes
+ */
+static unsigned long long
+_benchmark_count_scan(const unsigned char *buf, size_t len) {
+    const unsigned char *end = buf + len;
+    const unsigned char *p = buf;
+    unsigned long long n = 0;
+    while( (p = mpegscan_find(p, end)) < end ) {
+        n++;
+        p += 3;
+    }
+    return n;
+}
+
+/**
+ * Print one row in the scan benchmark table
+ * @param name
+ * @param codes
+ * @param ms
+ * @param mb
+ */
+static void
+_benchmark_scan_row(const char *name, unsigned long long codes, double ms, double mb) {
+    fprintf(stdout, "%-10s %12llu %10.1f %10.2f %10.0f\n",
+            name, codes, ms, ms > 0 ? mb / ms * 1000.0 / 1024.0 : 0.0, ms > 0 ? mb / ms * 1000.0 : 0.0);
+}
+
+/**
+ * Scan the given file for MPEG start codes with a memchr() based baseline and
+ * with each scanner implementation supported by the CPU. The file is read into
+ * memory first so only the scanning is measured. Finally the complete scanner,
+ * as used while recording, is run over the file in encoder sized chunks.
+ * Since a card gives ~1MB/s the MB/s column is also the number of cards a
+ * single core can index.
+ * @param filename
+ * @return Exit status
+ */
+static int
+_benchmark_scan(const char *filename) {
+    struct stat st;
+    struct timespec t0;
+
+    int fd = open(filename, O_RDONLY);
+    if( -1 == fd || -1 == fstat(fd, &st) ) {
+        fprintf(stderr, "Cannot open '%s' ( %d : %s )\n", filename, errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    size_t len = (size_t)st.st_size;
+    if( len > (size_t)BENCHMARK_SCAN_MAX*1024*1024 ) {
+        len = (size_t)BENCHMARK_SCAN_MAX*1024*1024;
+    }
+    unsigned char *buf = malloc(len);
+    if( buf == NULL ) {
+        fprintf(stderr, "Out of memory.\n");
+        _dbg_close(fd);
+        return EXIT_FAILURE;
+    }
+    size_t nread = 0;
+    ssize_t n;
+    while( nread < len && (n = read(fd, buf + nread, len - nread)) > 0 ) {
+        nread += (size_t)n;
+    }
+    _dbg_close(fd);
+    len = nread;
+
+    const double mb = (double)len / (1024.0*1024.0);
+    fprintf(stdout, "Scanning %.1f MB from '%s'\n", mb, filename);
+    fprintf(stdout, "%-10s %12s %10s %10s %10s\n", "Method", "Start codes", "ms", "GB/s", "MB/s");
+
+    unsigned long long codes = 0;
+    double best = 0;
+    for(int r=0; r < BENCHMARK_SCAN_ROUNDS; r++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        codes = _benchmark_count_memchr(buf, len);
+        const double ms = _benchmark_elapsed(&t0);
+        best = r == 0 || ms < best ? ms : best;
+    }
+    _benchmark_scan_row("memchr", codes, best, mb);
+
+    for(int impl=MPEGSCAN_SCALAR; impl <= MPEGSCAN_AVX2; impl++) {
+        if( -1 == mpegscan_set_impl(impl) ) {
+            fprintf(stdout, "%-10s %12s\n", mpegscan_implname(impl), "unsupported");
+            continue;
+        }
+        for(int r=0; r < BENCHMARK_SCAN_ROUNDS; r++) {
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            codes = _benchmark_count_scan(buf, len);
+            const double ms = _benchmark_elapsed(&t0);
+            best = r == 0 || ms < best ? ms : best;
+        }
+        _benchmark_scan_row(mpegscan_implname(impl), codes, best, mb);
+    }
+
+    // The complete scanner with the fastest search, fed in chunks as while recording
+    struct mpegscan scan;
+    CLEAR(scan);
+    scan.fd = -1;
+    mpegscan_init();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(size_t off=0; off < len; off += BENCHMARK_CHUNK) {
+        mpegscan_feed(&scan, (const char *)buf + off, len - off < BENCHMARK_CHUNK ? len - off : BENCHMARK_CHUNK);
+    }
+    _benchmark_scan_row("index", scan.npacks + scan.nsystem + scan.npictures, _benchmark_elapsed(&t0), mb);
+    fprintf(stdout, "Index: %llu packs, %llu pictures, %llu I-frames, %llu discontinuities, %llu stalls\n",
+            scan.npacks, scan.npictures, scan.niframes, scan.ndiscont, scan.nstalls);
+
+    free(buf);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Result from one loader run in a child process
+ */
+struct benchmark_load {
+    double ms;              /* Time to load the file */
+    unsigned long nrecs;    /* Recordings in the schedule or in the file */
+};
+
+/**
+ * Set up an empty schedule for the XML DB benchmark
+ * @param num Number of recordings that must fit
+ */
+static void
+_benchmark_xmldb_init(unsigned num) {
+    max_video = BENCHMARK_XMLDB_CARDS;
+    max_entries = num;
+    series_horizon = DEFAULT_SERIES_HORIZON;
+    strcpy(default_transcoding_profile, "normal");
+
+    // Only errors are written
+    verbose_log = 0;
+    initrecs();
+}
+
+/**
+ * Build a synthetic schedule and write it as an XML DB. Every 100th recording is
+ * a weekly repeated recording with a few deleted occurrences. The recordings
+ * start one hour apart so the schedule fits on a few cards.
+ * @param filename
+ * @param num Number of recordings
+ * @return Exit status
+ */
+static int
+_benchmark_xmldb_create(const char *filename, unsigned num) {
+    char title[64], fname[64];
+    char *profiles[2] = {"normal", NULL};
+    struct tm tm;
+    const time_t now = time(NULL);
+
+    _benchmark_xmldb_init(num);
+    localtime_r(&now, &tm);
+    tm.tm_mday += 1;
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    const time_t base = mktime(&tm);
+
+    // All repeated recordings have the same deleted occurrences
+    struct bitmap excluded;
+    bitmap_init(&excluded);
+    (void)bitmap_set(&excluded, 3);
+    (void)bitmap_set(&excluded, 7);
+
+    for(unsigned i=0; i < num; i++) {
+        const int repeat = i % 100 == 0;
+        snprintf(title, sizeof(title), "Recording %u", i);
+        snprintf(fname, sizeof(fname), "rec%u.mpg", i);
+        struct recording_entry *e = newrec(title, fname, base + i*3600, base + i*3600 + 45*60, "SVT1",
+                                           repeat, repeat ? 2 : 0, repeat ? 10 : 0, 0, profiles);
+        if( e == NULL || insertrec_any(e, repeat ? &excluded : NULL) <= 0 ) {
+            fprintf(stderr, "Cannot add recording %u to the synthetic schedule.\n", i);
+            freerec(e);
+        }
+    }
+    bitmap_free(&excluded);
+    if( -1 == writeXMLFile(filename) ) {
+        return EXIT_FAILURE;
+    }
+    struct recs_snapshot *s = recs_snapshot_get();
+    const int ret = write_dbsnap(filename, s, 0);
+    recs_snapshot_put(s);
+    return -1 == ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Load the XML DB in a child process so that its peak memory use can be
+ * measured on its own
+ * @param filename
+ * @param num Number of recordings in the file
+ * @param loader 0 to only start the process, 1 for the XML DB loader, 2 to only
+ * parse the file into a document tree and 3 for the binary snapshot
+ * @param[out] res Time and number of recordings
+ * @param[out] maxrss Peak RSS of the child in kB
+ * @return 0 on success, -1 on failure
+ */
+static int
+_benchmark_xmldb_load(const char *filename, unsigned num, int loader, struct benchmark_load *res, long *maxrss) {
+    struct rusage ru;
+    struct timespec t0;
+    int status, pfd[2];
+
+    if( -1 == pipe(pfd) ) {
+        return -1;
+    }
+    const pid_t pid = fork();
+    if( pid == -1 ) {
+        _dbg_close(pfd[0]);
+        _dbg_close(pfd[1]);
+        return -1;
+    }
+    if( pid == 0 ) {
+        struct benchmark_load r;
+        unsigned generation;
+        CLEAR(r);
+        _benchmark_xmldb_init(num);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if( loader == 1 || loader == 3 ) {
+            if( -1 == (loader == 1 ? readXMLFile(filename, &generation) : read_dbsnap(filename, &generation)) ) {
+                _exit(EXIT_FAILURE);
+            }
+            for(unsigned v=0; v < max_video; v++) {
+                r.nrecs += num_entries[v];
+            }
+        } else if( loader == 2 ) {
+            xmlDocPtr doc = xmlParseFile(filename);
+            if( doc == NULL ) {
+                _exit(EXIT_FAILURE);
+            }
+            for(xmlNodePtr node = xmlDocGetRootElement(doc)->xmlChildrenNode; node; node = node->next) {
+                r.nrecs += node->type == XML_ELEMENT_NODE;
+            }
+            xmlFreeDoc(doc);
+        }
+        r.ms = _benchmark_elapsed(&t0);
+        _exit(write(pfd[1], &r, sizeof(r)) == sizeof(r) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    _dbg_close(pfd[1]);
+    const ssize_t n = read(pfd[0], res, sizeof(*res));
+    _dbg_close(pfd[0]);
+    if( -1 == wait4(pid, &status, 0, &ru) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS ||
+        n != sizeof(*res) ) {
+        return -1;
+    }
+    *maxrss = ru.ru_maxrss;
+    return 0;
+}
+
+/**
+ * Measure the time and the peak memory used to load a synthetic XML DB with
+ * the given number of recordings at startup. For comparison the file is also
+ * parsed into a document tree which is what the loader used to do before the
+ * recordings were built, and the schedule is restored from the binary snapshot
+ * written together with the file.
+ * @param num Number of recordings
+ * @return Exit status
+ */
+static int
+_benchmark_xmldb(unsigned num) {
+    char filename[] = "/tmp/tvpvrd-bench-XXXXXX", snapname[64];
+    const char *names[4] = {"none", "stream", "dom-parse", "snapshot"};
+    struct benchmark_load res;
+    struct stat st;
+    long maxrss, base = 0;
+    int status;
+
+    int fd = mkstemp(filename);
+    if( -1 == fd ) {
+        fprintf(stderr, "Cannot create benchmark file ( %d : %s )\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    _dbg_close(fd);
+    snprintf(snapname, sizeof(snapname), "%s%s", filename, DBSNAP_SUFFIX);
+
+    // The schedule is built in a child so it does not add to the memory of the
+    // children that load it
+    const pid_t pid = fork();
+    if( pid == 0 ) {
+        _exit(_benchmark_xmldb_create(filename, num));
+    }
+    if( pid == -1 || -1 == waitpid(pid, &status, 0) || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != EXIT_SUCCESS || -1 == stat(filename, &st) ) {
+        fprintf(stderr, "Cannot create synthetic XML DB '%s'.\n", filename);
+        unlink(filename);
+        unlink(snapname);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "Synthetic XML DB with %u recordings, %.1f MB\n", num, (double)st.st_size / (1024.0*1024.0));
+    fprintf(stdout, "%-10s %12s %10s %14s %14s\n", "Loader", "Recordings", "ms", "Peak RSS kB", "Above base kB");
+    for(int loader=0; loader < 4; loader++) {
+        if( -1 == _benchmark_xmldb_load(filename, num, loader, &res, &maxrss) ) {
+            fprintf(stdout, "%-10s %12s\n", names[loader], "failed");
+            continue;
+        }
+        if( loader == 0 ) {
+            base = maxrss;
+        }
+        fprintf(stdout, "%-10s %12lu %10.1f %14ld %14ld\n", names[loader], res.nrecs, res.ms, maxrss, maxrss - base);
+    }
+
+    unlink(filename);
+    unlink(snapname);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Write a synthetic history log with one recording every 30 minutes up to now.
+ * Every recording is an episode in one of 500 series and is transcoded with one
+ * of four profiles.
+ * @param logname
+ * @param num Number of recordings
+ * @param[out] mid Start of the recording in the middle of the log
+ * @return 0 on success, -1 on failure
+ */
+static int
+_benchmark_history_create(const char *logname, unsigned num, time_t *mid) {
+    static const char *profiles[4] = {"normal", "high", "low", "mp4"};
+    FILE *fp = fopen(logname, "w");
+    if( fp == NULL ) {
+        return -1;
+    }
+    const time_t base = time(NULL) - (time_t)num * 1800;
+    fprintf(fp, "tvpvrd-history 1\n");
+    for(unsigned i=0; i < num; i++) {
+        const time_t ts = base + (time_t)i * 1800;
+        fprintf(fp, "%lld\t%lld\tSeries %u (%u)\tSeries %u\t%s\t/data/pvr/vid/%s/series_%u_%u.mp4\n",
+                (long long)ts, (long long)ts + 1500, i % 500, i / 500, i % 500, profiles[i % 4],
+                profiles[i % 4], i % 500, i / 500);
+    }
+    *mid = base + (time_t)(num / 2) * 1800;
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/**
+ * Measure the time to index a synthetic history log with the given number of
+ * recordings, to start with an existing index and to run typical queries
+ * against it
+ * @param num Number of recordings
+ * @return Exit status
+ */
+static int
+_benchmark_history(unsigned num) {
+    char dir[] = "/tmp/tvpvrd-bench-XXXXXX";
+    char xmldbdir[64], logname[128], idxname[128];
+    struct timespec t0;
+    struct rusage ru;
+    struct stat st;
+    time_t mid;
+    int y, m, d, h, mi, sec;
+
+    if( NULL == mkdtemp(dir) ) {
+        fprintf(stderr, "Cannot create benchmark directory ( %d : %s )\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    snprintf(xmldbdir, sizeof(xmldbdir), "%s/xmldb", dir);
+    snprintf(logname, sizeof(logname), "%s/%s", xmldbdir, HISTORYLOG_FILENAME);
+    snprintf(idxname, sizeof(idxname), "%s/%s", xmldbdir, HISTORYIDX_FILENAME);
+    strcpy(datadir, dir);
+    verbose_log = 0;
+
+    int ret = EXIT_FAILURE;
+    if( -1 == mkdir(xmldbdir, 0700) || -1 == _benchmark_history_create(logname, num, &mid) ||
+        -1 == stat(logname, &st) ) {
+        fprintf(stderr, "Cannot create synthetic history log '%s'.\n", logname);
+        goto out;
+    }
+    fprintf(stdout, "Synthetic history log with %u recordings, %.1f MB\n", num, (double)st.st_size / (1024.0*1024.0));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hist_init();
+    fprintf(stdout, "%-34s %10.1f ms\n", "Start, index built from log", _benchmark_elapsed(&t0));
+    hist_close();
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    hist_init();
+    fprintf(stdout, "%-34s %10.1f ms\n", "Start, index loaded", _benchmark_elapsed(&t0));
+    if( 0 == stat(idxname, &st) ) {
+        fprintf(stdout, "%-34s %10.1f MB\n", "Index size", (double)st.st_size / (1024.0*1024.0));
+    }
+
+    fromtimestamp(mid, &y, &m, &d, &h, &mi, &sec);
+    const time_t month_start = totimestamp(y, m, 1, 0, 0, 0);
+    const time_t month_end = totimestamp(y, m + 1, 1, 0, 0, 0);
+    const struct {
+        const char *name;
+        struct hist_query q;
+    } queries[] = {
+        {"Latest page", {.pagesize = HISTORY_PAGESIZE}},
+        {"Page 1000", {.page = 999, .pagesize = HISTORY_PAGESIZE}},
+        {"Last 20 of a title", {.title = "series 17", .pagesize = 20}},
+        {"One month", {.from = month_start, .to = month_end, .pagesize = HISTORY_PAGESIZE}},
+        {"Profile in one month", {.profile = "high", .from = month_start, .to = month_end, .pagesize = HISTORY_PAGESIZE}},
+        {"Profile, last page", {.profile = "high", .page = (num / 4 - 1) / HISTORY_PAGESIZE, .pagesize = HISTORY_PAGESIZE}},
+        {"Title and profile", {.title = "Series 17", .profile = "high", .pagesize = HISTORY_PAGESIZE}}
+    };
+
+    char *buff = malloc((HISTORY_PAGESIZE + 2) * 1024);
+    if( buff == NULL ) {
+        hist_close();
+        goto out;
+    }
+    fprintf(stdout, "%-34s %10s  %s\n", "Query", "ms", "Result");
+    for(size_t i=0; i < sizeof(queries) / sizeof(queries[0]); i++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(int r=0; r < BENCHMARK_HISTORY_ROUNDS; r++) {
+            if( -1 == hist_listbuff(buff, (HISTORY_PAGESIZE + 2) * 1024, &queries[i].q) ) {
+                strcpy(buff, "failed\n");
+                break;
+            }
+        }
+        const double ms = _benchmark_elapsed(&t0) / BENCHMARK_HISTORY_ROUNDS;
+        char *nl = strchr(buff, '\n');
+        if( nl ) {
+            *nl = '\0';
+        }
+        fprintf(stdout, "%-34s %10.3f  %s\n", queries[i].name, ms, buff);
+    }
+    free(buff);
+
+    getrusage(RUSAGE_SELF, &ru);
+    fprintf(stdout, "%-34s %10ld kB\n", "Peak RSS", ru.ru_maxrss);
+    hist_close();
+    ret = EXIT_SUCCESS;
+
+out:
+    unlink(logname);
+    unlink(idxname);
+    rmdir(xmldbdir);
+    rmdir(dir);
+    return ret;
+}
+
+/**
+ * Run the benchmark given on the command line. The specification has the
+ * form "name:argument".
+ * @param spec Benchmark specification
+ * @return Exit status for the program
+ */
+int
+benchmark_run(const char *spec) {
+
+    // Everything goes to the terminal
+    strcpy(logfile_name, "stdout");
+    if( verbose_log == -1 ) {
+        verbose_log = 1;
+    }
+
+    if( 0 == strncmp(spec, "capture:", 8) && spec[8] ) {
+        // Optional rate given as capture:FILE:RATE
+        char filename[256];
+        unsigned rate = BENCHMARK_RATE;
+        strncpy(filename, spec + 8, 255);
+        filename[255] = '\0';
+        char *p = strrchr(filename, ':');
+        if( p ) {
+            *p++ = '\0';
+            rate = (unsigned)xatoi(p);
+            if( rate == 0 ) {
+                fprintf(stderr, "Invalid rate '%s' for capture benchmark.\n", p);
+                return EXIT_FAILURE;
+            }
+        }
+        return _benchmark_capture(filename, rate);
+    }
+
+    if( 0 == strncmp(spec, "scan:", 5) && spec[5] ) {
+        return _benchmark_scan(spec + 5);
+    }
+
+    if( 0 == strcmp(spec, "xmldb") || 0 == strncmp(spec, "xmldb:", 6) ) {
+        // Optional number of recordings given as xmldb:NUM
+        unsigned num = BENCHMARK_XMLDB_SIZE;
+        if( spec[5] == ':' ) {
+            num = (unsigned)xatoi((char *)spec + 6);
+            if( num == 0 ) {
+                fprintf(stderr, "Invalid number of recordings '%s' for xmldb benchmark.\n", spec + 6);
+                return EXIT_FAILURE;
+            }
+        }
+        return _benchmark_xmldb(num);
+    }
+
+    if( 0 == strcmp(spec, "history") || 0 == strncmp(spec, "history:", 8) ) {
+        // Optional number of recordings given as history:NUM
+        unsigned num = BENCHMARK_HISTORY_SIZE;
+        if( spec[7] == ':' ) {
+            num = (unsigned)xatoi((char *)spec + 8);
+            if( num == 0 ) {
+                fprintf(stderr, "Invalid number of recordings '%s' for history benchmark.\n", spec + 8);
+                return EXIT_FAILURE;
+            }
+        }
+        return _benchmark_history(num);
+    }
+
+    fprintf(stderr, "Unknown benchmark '%s'. See --help for more information.\n", spec);
+    return EXIT_FAILURE;
+}
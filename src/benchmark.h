@@ -0,0 +1,56 @@
+/* =========================================================================
+ * File:        BENCHMARK.H
+ * Description: Built in benchmarks that are run from the command line
+ *              with the "--benchmark" option instead of starting the server.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef BENCHMARK_H
+#define	BENCHMARK_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run the benchmark given on the command line. The specification has the
+ * form "name:argument". Available benchmarks:
+ *   capture:FILE  Record FILE (a previously recorded MPEG stream acting as a fake
+ *                 encoder) with every capture mode and report the CPU time used
+ *                 per recorded GB.
+ *   scan:FILE     Scan FILE for MPEG start codes with a memchr() based search and
+ *                 each of the scanner implementations and report the throughput.
+ *   xmldb[:NUM]   Load a synthetic XML DB with NUM (default 10000) recordings, and
+ *                 its binary snapshot, as at startup and report the time and the
+ *                 peak memory used.
+ *   history[:NUM] Index a synthetic history log with NUM (default 100000)
+ *                 recordings, start with the index and time typical queries.
+ * @param spec Benchmark specification
+ * @return Exit status for the program
+ */
+int
+benchmark_run(const char *spec);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BENCHMARK_H */
+
@@ -0,0 +1,231 @@
+/* =========================================================================
+ * File:        BITMAP.C
+ * Description: Growable bitmap of unsigned integers. Used for the deleted
+ *              occurrences of repeated recordings.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bitmap.h"
+
+/**
+ * Initialize an empty bitmap
+ * @param b
+ */
+void
+bitmap_init(struct bitmap *b) {
+    b->words = NULL;
+    b->first = 0;
+    b->nwords = 0;
+}
+
+/**
+ * Free the memory used by the bitmap and make it empty
+ * @param b
+ */
+void
+bitmap_free(struct bitmap *b) {
+    free(b->words);
+    bitmap_init(b);
+}
+
+/**
+ * Make a copy of a bitmap
+ * @param[out] dst Initialized by the call
+ * @param src
+ * @return 0 on success, -1 if out of memory
+ */
+int
+bitmap_copy(struct bitmap *dst, const struct bitmap *src) {
+    bitmap_init(dst);
+    if( src->nwords == 0 ) {
+        return 0;
+    }
+    if( (dst->words = malloc(src->nwords * sizeof (uint64_t))) == NULL ) {
+        return -1;
+    }
+    memcpy(dst->words, src->words, src->nwords * sizeof (uint64_t));
+    dst->first = src->first;
+    dst->nwords = src->nwords;
+    return 0;
+}
+
+/**
+ * Add a member
+ * @param b
+ * @param n
+ * @return 0 on success, -1 if out of memory
+ */
+int
+bitmap_set(struct bitmap *b, unsigned n) {
+    const unsigned w = n / 64;
+    if( b->nwords == 0 ) {
+        if( (b->words = calloc(1, sizeof (uint64_t))) == NULL ) {
+            return -1;
+        }
+        b->first = w;
+        b->nwords = 1;
+    } else if( w < b->first || w >= b->first + b->nwords ) {
+        // Grow the stored range of words to include w
+        const unsigned first = w < b->first ? w : b->first;
+        const unsigned last = w >= b->first + b->nwords ? w : b->first + b->nwords - 1;
+        uint64_t *words = calloc(last - first + 1, sizeof (uint64_t));
+        if( words == NULL ) {
+            return -1;
+        }
+        memcpy(&words[b->first - first], b->words, b->nwords * sizeof (uint64_t));
+        free(b->words);
+        b->words = words;
+        b->first = first;
+        b->nwords = last - first + 1;
+    }
+    b->words[w - b->first] |= UINT64_C(1) << (n % 64);
+    return 0;
+}
+
+/**
+ * Check for a member
+ * @param b
+ * @param n
+ * @return 1 if n is a member, 0 otherwise
+ */
+int
+bitmap_test(const struct bitmap *b, unsigned n) {
+    const unsigned w = n / 64;
+    if( w < b->first || w >= b->first + b->nwords ) {
+        return 0;
+    }
+    return (b->words[w - b->first] >> (n % 64)) & 1;
+}
+
+/**
+ * Number of members
+ * @param b
+ * @return
+ */
+unsigned
+bitmap_count(const struct bitmap *b) {
+    unsigned num = 0;
+    for (unsigned i = 0; i < b->nwords; i++) {
+        num += (unsigned)__builtin_popcountll(b->words[i]);
+    }
+    return num;
+}
+
+/**
+ * Start an iteration over the members
+ * @param b
+ * @param it
+ */
+void
+bitmap_iter_init(const struct bitmap *b, struct bitmap_iter *it) {
+    it->b = b;
+    it->pos = 0;
+}
+
+/**
+ * Get the next member
+ * @param it
+ * @param[out] n The member
+ * @return 1 if there was a member, 0 at the end
+ */
+int
+bitmap_iter_next(struct bitmap_iter *it, unsigned *n) {
+    const struct bitmap *b = it->b;
+    while( it->pos < b->nwords * 64 ) {
+        // Only the bits from pos and up in the current word are left
+        const uint64_t rest = b->words[it->pos / 64] >> (it->pos % 64);
+        if( rest == 0 ) {
+            it->pos = (it->pos / 64 + 1) * 64;
+        } else {
+            it->pos += (unsigned)__builtin_ctzll(rest);
+            *n = b->first * 64 + it->pos;
+            it->pos++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Write the bitmap as a string of hex digits. Digit i holds the members
+ * base + 4*i to base + 4*i + 3 with the lowest number in the least significant
+ * bit. Trailing zero digits are left out.
+ * @param b
+ * @param[out] base First number covered by the string. Always a multiple of 64.
+ * @param buffer
+ * @param maxlen Size of buffer
+ * @return 0 on success, -1 if the buffer is too small
+ */
+int
+bitmap_format(const struct bitmap *b, unsigned *base, char *buffer, size_t maxlen) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len = 0, used = 0;
+    if( maxlen == 0 ) {
+        return -1;
+    }
+    for (unsigned i = 0; i < b->nwords * 16; i++) {
+        const unsigned digit = (unsigned)(b->words[i / 16] >> (4 * (i % 16))) & 0xf;
+        if( i >= maxlen - 1 ) {
+            if( digit ) {
+                return -1;
+            }
+            continue;
+        }
+        buffer[i] = hex[digit];
+        len++;
+        if( digit ) {
+            used = len;
+        }
+    }
+    buffer[used] = '\0';
+    *base = b->first * 64;
+    return 0;
+}
+
+/**
+ * Add the members in a string written by bitmap_format()
+ * @param b
+ * @param base
+ * @param str
+ * @return 0 on success, -1 if the string is not valid or out of memory
+ */
+int
+bitmap_parse(struct bitmap *b, unsigned base, const char *str) {
+    for (unsigned i = 0; str[i]; i++) {
+        if( !isxdigit((unsigned char)str[i]) ) {
+            return -1;
+        }
+        const unsigned c = (unsigned)tolower((unsigned char)str[i]);
+        const unsigned digit = c <= '9' ? c - '0' : c - 'a' + 10;
+        for (unsigned j = 0; j < 4; j++) {
+            if( ((digit >> j) & 1) && -1 == bitmap_set(b, base + 4 * i + j) ) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
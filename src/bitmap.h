@@ -0,0 +1,150 @@
+/* =========================================================================
+ * File:        BITMAP.H
+ * Description: Growable bitmap of unsigned integers. Used for the deleted
+ *              occurrences of repeated recordings.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef BITMAP_H
+#define	BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Set of unsigned integers stored as one bit each. Only the words between the
+ * lowest and the highest member are kept so a set of occurrence numbers that
+ * starts at a high number or has a single member takes little memory. Testing
+ * for a member is O(1).
+ */
+struct bitmap {
+    uint64_t *words;
+    unsigned first;             /* Word index of words[0] */
+    unsigned nwords;
+};
+
+/*
+ * Iterator over the members in increasing order. Any number of iterators can be
+ * used at the same time. The iterator is invalid once the bitmap is changed.
+ */
+struct bitmap_iter {
+    const struct bitmap *b;
+    unsigned pos;               /* Next bit to look at, relative to words[0] */
+};
+
+/**
+ * Initialize an empty bitmap
+ * @param b
+ */
+void
+bitmap_init(struct bitmap *b);
+
+/**
+ * Free the memory used by the bitmap and make it empty
+ * @param b
+ */
+void
+bitmap_free(struct bitmap *b);
+
+/**
+ * Make a copy of a bitmap
+ * @param[out] dst Initialized by the call
+ * @param src
+ * @return 0 on success, -1 if out of memory
+ */
+int
+bitmap_copy(struct bitmap *dst, const struct bitmap *src);
+
+/**
+ * Add a member
+ * @param b
+ * @param n
+ * @return 0 on success, -1 if out of memory
+ */
+int
+bitmap_set(struct bitmap *b, unsigned n);
+
+/**
+ * Check for a member
+ * @param b
+ * @param n
+ * @return 1 if n is a member, 0 otherwise
+ */
+int
+bitmap_test(const struct bitmap *b, unsigned n);
+
+/**
+ * Number of members
+ * @param b
+ * @return
+ */
+unsigned
+bitmap_count(const struct bitmap *b);
+
+/**
+ * Start an iteration over the members
+ * @param b
+ * @param it
+ */
+void
+bitmap_iter_init(const struct bitmap *b, struct bitmap_iter *it);
+
+/**
+ * Get the next member
+ * @param it
+ * @param[out] n The member
+ * @return 1 if there was a member, 0 at the end
+ */
+int
+bitmap_iter_next(struct bitmap_iter *it, unsigned *n);
+
+/**
+ * Write the bitmap as a string of hex digits. Digit i holds the members
+ * base + 4*i to base + 4*i + 3 with the lowest number in the least significant
+ * bit. Trailing zero digits are left out.
+ * @param b
+ * @param[out] base First number covered by the string. Always a multiple of 64.
+ * @param buffer
+ * @param maxlen Size of buffer
+ * @return 0 on success, -1 if the buffer is too small
+ */
+int
+bitmap_format(const struct bitmap *b, unsigned *base, char *buffer, size_t maxlen);
+
+/**
+ * Add the members in a string written by bitmap_format()
+ * @param b
+ * @param base
+ * @param str
+ * @return 0 on success, -1 if the string is not valid or out of memory
+ */
+int
+bitmap_parse(struct bitmap *b, unsigned base, const char *str);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* BITMAP_H */
+
@@ -0,0 +1,1457 @@
+/* =========================================================================
+ * File:        CAPTURE.C
+ * Description: Move the MPEG stream from the HW encoder to the recording
+ *              file while a recording is ongoing
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#include "tvpvrd.h"
+#include "tvconfig.h"
+#include "utils.h"
+#include "tvplog.h"
+#include "ringbuf.h"
+#include "uring.h"
+#include "mpegscan.h"
+#include "capture.h"
+
+
+/*
+ * Per card capture statistics. Only the threads handling the recording on a
+ * card update its entry so no locking is necessary.
+ */
+static struct capture_stats *capture_stats = NULL;
+
+/*
+ * The writer thread for one ongoing recording
+ */
+struct capture_writer {
+    unsigned video;
+    int fh;                     /* Recording file */
+    int pfd;                    /* Read end of splice pipe, -1 in read/write mode */
+    const char *filename;
+    volatile int error;         /* Set by the writer if it fails to write */
+    capture_sink_cb sink;       /* Extra consumer of the stream (if any) */
+    void *sink_arg;
+    int write_file;             /* Write the stream to the recording file */
+    struct mpegscan *scan;      /* Builds the GOP index, NULL if no index is written */
+    unsigned long long written;
+    pthread_t thread;
+    int running;
+};
+
+/*
+ * Per card capture state. The ring buffer sits between the thread that
+ * reads the stream from the encoder and the thread that writes it to disk
+ * so that a slow disk never delays the next read from the card. The rest of
+ * the structure describes the ongoing recording (if any) on the card.
+ */
+struct capture_card {
+    struct ringbuf *rb;         /* Buffer used in read/write mode */
+    char *dropbuff;             /* Scratch area for data that does not fit in the buffer */
+
+    unsigned video;
+    int vh;                     /* Encoder */
+    int fh;                     /* Recording file */
+    const char *filename;
+    time_t ts_end;
+    int mode;                   /* Mode actually used for this recording */
+    int pfd[2];                 /* Splice pipe */
+    size_t pipesize;
+    int first;                  /* Set until the first data has been moved */
+    int doabort;
+    int eof;                    /* The encoder has signalled end of stream */
+    unsigned long long last_data_ms;
+    struct capture_writer writer;
+
+    int active;                 /* Registered with the reactor */
+    capture_done_cb done_cb;
+    void *done_arg;
+
+    capture_sink_cb sink;       /* Set with capture_set_sink() */
+    void *sink_arg;
+    int sink_write_file;
+
+    capture_handover_cb handover_cb;    /* Set with capture_set_handover() */
+    int cutting;                /* Looking for a GOP boundary to cut the stream at */
+    int handover_done;          /* The stream was cut for a handover */
+    char *carry;                /* Stream after the cut. Starts the next recording. */
+    size_t carry_len;
+    int carry_vh;               /* Encoder the carried data came from */
+
+    struct mpegscan scan;       /* GOP index for the recording */
+
+#ifdef HAVE_LINUX_IO_URING_H
+    struct uring ring;          /* Used in io_uring mode */
+    int ring_fixed;             /* The capture buffer is registered with the ring */
+#endif
+};
+static struct capture_card *capture_cards = NULL;
+
+/*
+ * The reactor. One thread waits with epoll on all active encoder descriptors.
+ * The eventfd is used to wake the reactor up when a new card is added.
+ */
+static int reactor_epfd = -1;
+static int reactor_wakefd = -1;
+static pthread_t reactor_thread;
+static pthread_mutex_t reactor_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * REACTOR_WAKEUP integer
+ * The epoll data value used for the wakeup eventfd. Real cards use their index.
+ */
+#define REACTOR_WAKEUP 0xffffffffu
+
+/*
+ * SPLICE_CHUNK integer
+ * Maximum number of bytes to move in each splice() call.
+ */
+#define SPLICE_CHUNK (1024*1024)
+
+/*
+ * CAPTURE_WRITE_CHUNK integer
+ * The writer thread waits until it has at least this many bytes in the buffer
+ * before it calls write() so that the many small chunks read from the card are
+ * coalesced into a few large writes.
+ */
+#define CAPTURE_WRITE_CHUNK (1024*1024)
+
+/*
+ * CAPTURE_WRITE_MAXWAIT integer
+ * Maximum time (in ms) the writer waits for CAPTURE_WRITE_CHUNK bytes to be
+ * available before it writes whatever it has.
+ */
+#define CAPTURE_WRITE_MAXWAIT 500
+
+/*
+ * CAPTURE_STALL_MS integer
+ * A single write to disk that takes longer than this (in ms) is counted as a stall
+ */
+#define CAPTURE_STALL_MS 200
+
+/*
+ * CAPTURE_TIMEOUT integer
+ * If no data has been received from the card in this many seconds the
+ * recording is aborted
+ */
+#define CAPTURE_TIMEOUT 10
+
+/*
+ * URING_MAXSLOTS integer
+ * In io_uring mode the capture buffer is split in slots of CAPTURE_WRITE_CHUNK
+ * bytes. This is the maximum number of slots (and hence writes in flight).
+ */
+#define URING_MAXSLOTS 64
+
+/*
+ * URING_ENTRIES integer
+ * Size of the io_uring submission queue. Must hold one write per slot plus the
+ * read, the timeout and a cancel request.
+ */
+#define URING_ENTRIES 128
+
+/*
+ * HANDOVER_MAXWAIT integer
+ * Maximum number of seconds after the end time to look for a GOP boundary to
+ * cut the stream at when a recording is handed over to the next
+ */
+#define HANDOVER_MAXWAIT 3
+
+/*
+ * Names of the capture modes as used in the ini file
+ */
+static const char *capture_modenames[] = {"readwrite", "splice", "uring"};
+
+/**
+ * Allocate the per card capture buffers and statistics. Must be called after the
+ * number of video cards (max_video) is known.
+ */
+void
+capture_init(void) {
+    capture_stats = calloc(max_video, sizeof (struct capture_stats));
+    capture_cards = calloc(max_video, sizeof (struct capture_card));
+    if( capture_stats == NULL || capture_cards == NULL ) {
+        logmsg(LOG_ERR,"Cannot allocate memory for capture statistics. ( %d : %s )",errno,strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for(unsigned i=0; i < max_video; i++) {
+        capture_stats[i].mode = capture_mode;
+        capture_cards[i].video = i;
+        capture_cards[i].rb = ringbuf_new(capture_buffer_size);
+        capture_cards[i].dropbuff = malloc(VIDBUFSIZE);
+        capture_cards[i].carry = malloc(VIDBUFSIZE);
+        capture_cards[i].scan.fd = -1;
+        if( capture_cards[i].rb == NULL || capture_cards[i].dropbuff == NULL || capture_cards[i].carry == NULL ) {
+            logmsg(LOG_ERR,"Cannot allocate capture buffer for video card %d. ( %d : %s )",i,errno,strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        capture_stats[i].buffer_size = capture_cards[i].rb->size;
+    }
+    mpegscan_init();
+}
+
+/**
+ * Translate a capture mode name as given in the ini file to its
+ * numeric value
+ * @param name
+ * @return The mode, -1 if the name is not a known capture mode
+ */
+int
+capture_modefromname(const char *name) {
+    for(int i=0; i < (int)(sizeof(capture_modenames)/sizeof(capture_modenames[0])); i++) {
+        if( 0 == strcasecmp(name,capture_modenames[i]) ) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Return the human readable name of a capture mode
+ * @param mode
+ * @return Mode name
+ */
+const char *
+capture_modename(int mode) {
+    if( mode < 0 || mode >= (int)(sizeof(capture_modenames)/sizeof(capture_modenames[0])) ) {
+        return "unknown";
+    }
+    return capture_modenames[mode];
+}
+
+/**
+ * Wait until there is data available from the video capture card via a select()
+ * call. We only wait for the descriptor associated with this capture card.
+ * @param vh Encoder file descriptor
+ * @return 1 data available, 0 on timeout, -1 if interrupted or error
+ */
+static int
+_capture_wait(int vh) {
+    fd_set fds;
+    struct timeval tv;
+
+    FD_ZERO (&fds);
+    FD_SET ((unsigned)vh, &fds);
+
+    /* Timeout. */
+    tv.tv_sec = CAPTURE_TIMEOUT;
+    tv.tv_usec = 0;
+
+    return select (vh + 1, &fds, NULL, NULL, &tv);
+}
+
+/**
+ * Milliseconds on the monotonic clock. Used to measure write latency.
+ * @return ms
+ */
+static unsigned long long
+_capture_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL;
+}
+
+/**
+ * Update the stall statistics for the card after a write that took
+ * the specified time
+ * @param video
+ * @param ms
+ */
+static void
+_capture_account_write(unsigned video, unsigned long long ms) {
+    if( ms >= CAPTURE_STALL_MS ) {
+        capture_stats[video].nstalls++;
+        capture_stats[video].stall_total_ms += ms;
+        if( ms > capture_stats[video].stall_max_ms ) {
+            capture_stats[video].stall_max_ms = (unsigned)ms;
+        }
+        logmsg(LOG_DEBUG,"Write stall of %llu ms on video stream #%02d",ms,video);
+    }
+}
+
+/**
+ * Account for data read from the card that had to be thrown away since the
+ * capture buffer was full
+ * @param video
+ * @param n
+ */
+static void
+_capture_account_drop(unsigned video, size_t n) {
+    if( capture_stats[video].bytes_dropped == 0 ) {
+        logmsg(LOG_ERR,"Capture buffer for video stream #%02d is full. Data is lost. Consider increasing capture_buffer_size",video);
+    }
+    capture_stats[video].bytes_dropped += n;
+}
+
+/**
+ * Keep track of the longest time between two chunks of data from the card.
+ * This is the capture latency as seen from the recording.
+ * @param card
+ */
+static void
+_capture_account_data(struct capture_card *card) {
+    const unsigned long long now = _capture_ms();
+    if( now - card->last_data_ms > capture_stats[card->video].max_gap_ms ) {
+        capture_stats[card->video].max_gap_ms = (unsigned)(now - card->last_data_ms);
+    }
+    card->last_data_ms = now;
+}
+
+/**
+ * Writer thread in read/write mode. Drain the ring buffer for the card to the
+ * recording file in large coalesced writes until the reader closes the buffer.
+ * @param arg Pointer to the writer structure
+ * @return NULL
+ */
+static void *
+_capture_rbwriter(void *arg) {
+    struct capture_writer *w = arg;
+    struct ringbuf *rb = capture_cards[w->video].rb;
+    size_t len;
+
+    for(;;) {
+        ringbuf_wait(rb, CAPTURE_WRITE_CHUNK, CAPTURE_WRITE_MAXWAIT);
+        const int closed = ringbuf_isclosed(rb);
+        char *p = ringbuf_readptr(rb, &len);
+        if( len == 0 ) {
+            if( closed ) {
+                break;
+            }
+            continue;
+        }
+
+        const unsigned long long t0 = _capture_ms();
+        ssize_t nwrite = (ssize_t)len;
+        if( w->write_file ) {
+            nwrite = write(w->fh, p, len);
+            if( -1 == nwrite ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                logmsg(LOG_ERR, "Error while writing to '%s' while recording. (%d : %s) ",
+                        w->filename,errno,strerror(errno));
+                w->error = 1;
+                break;
+            }
+        }
+        if( w->scan ) {
+            mpegscan_feed(w->scan, p, (size_t)nwrite);
+        }
+        if( w->sink && -1 == w->sink(p, (size_t)nwrite, w->sink_arg) ) {
+            logmsg(LOG_ERR, "Stream consumer for video stream #%02d failed. Writing the rest of the stream to '%s'",
+                   w->video,w->filename);
+            w->sink = NULL;
+            w->write_file = 1;
+        }
+        _capture_account_write(w->video, _capture_ms() - t0);
+        ringbuf_consume(rb, (size_t)nwrite);
+        w->written += (unsigned long long)nwrite;
+    }
+
+    return NULL;
+}
+
+/**
+ * Writer thread in splice mode. Move data from the pipe to the recording
+ * file until the reader closes the write end of the pipe.
+ * @param arg Pointer to the writer structure
+ * @return NULL
+ */
+static void *
+_capture_splicewriter(void *arg) {
+    struct capture_writer *w = arg;
+
+    for(;;) {
+        const unsigned long long t0 = _capture_ms();
+        ssize_t nwrite = splice(w->pfd, NULL, w->fh, NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+        if( 0 == nwrite ) {
+            break;
+        } else if( -1 == nwrite ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            logmsg(LOG_ERR, "Error while writing to '%s' while recording. (%d : %s) ",
+                    w->filename,errno,strerror(errno));
+            w->error = 1;
+            break;
+        }
+        _capture_account_write(w->video, _capture_ms() - t0);
+        w->written += (unsigned long long)nwrite;
+        capture_stats[w->video].bytes_spliced += (unsigned long long)nwrite;
+    }
+
+    return NULL;
+}
+
+/**
+ * Try to give the splice pipe the same size as the capture buffer. Unless we
+ * are running as root the kernel limits this to /proc/sys/fs/pipe-max-size
+ * so we try successively smaller sizes.
+ * @param pfd Pipe
+ * @return The size of the pipe
+ */
+static size_t
+_capture_pipesize(int pfd) {
+#ifdef F_SETPIPE_SZ
+    size_t size = capture_buffer_size;
+    while( size >= 64*1024 && -1 == fcntl(pfd, F_SETPIPE_SZ, (int)size) ) {
+        size /= 2;
+    }
+    int ret = fcntl(pfd, F_GETPIPE_SZ);
+    return ret > 0 ? (size_t)ret : 64*1024;
+#else
+    return 64*1024;
+#endif
+}
+
+/**
+ * Start the writer thread for the recording on the card in the mode
+ * set in card->mode
+ * @param card
+ * @return 0 on success, -1 on failure
+ */
+static int
+_capture_start_writer(struct capture_card *card) {
+    CLEAR(card->writer);
+    card->writer.video = card->video;
+    card->writer.fh = card->fh;
+    card->writer.pfd = -1;
+    card->writer.filename = card->filename;
+    card->writer.sink = card->sink;
+    card->writer.sink_arg = card->sink_arg;
+    card->writer.write_file = card->sink == NULL || card->sink_write_file;
+    card->sink = NULL;
+    card->first = 1;
+
+    if( gop_index && card->mode == CAPTURE_READWRITE && card->writer.write_file ) {
+        char idxname[512];
+        snprintf(idxname, sizeof idxname, "%s%s", card->filename, MPEGSCAN_INDEX_SUFFIX);
+        if( 0 == mpegscan_open_index(&card->scan, idxname) ) {
+            card->writer.scan = &card->scan;
+        }
+    }
+
+    if( card->mode == CAPTURE_SPLICE ) {
+        if( -1 == pipe2(card->pfd, O_CLOEXEC) ) {
+            logmsg(LOG_ERR,"Cannot create splice pipe for video stream #%02d. ( %d : %s )",card->video,errno,strerror(errno));
+            return -1;
+        }
+        card->pipesize = _capture_pipesize(card->pfd[1]);
+        capture_stats[card->video].buffer_size = card->pipesize;
+        card->writer.pfd = card->pfd[0];
+        if( 0 != pthread_create(&card->writer.thread, NULL, _capture_splicewriter, &card->writer) ) {
+            logmsg(LOG_ERR,"Cannot create writer thread for video stream #%02d. ( %d : %s )",card->video,errno,strerror(errno));
+            _dbg_close(card->pfd[0]);
+            _dbg_close(card->pfd[1]);
+            return -1;
+        }
+    } else {
+        capture_stats[card->video].buffer_size = card->rb->size;
+        ringbuf_reset(card->rb);
+        if( 0 != pthread_create(&card->writer.thread, NULL, _capture_rbwriter, &card->writer) ) {
+            logmsg(LOG_ERR,"Cannot create writer thread for video stream #%02d. ( %d : %s )",card->video,errno,strerror(errno));
+            return -1;
+        }
+    }
+    card->writer.running = 1;
+    return 0;
+}
+
+/**
+ * Tell the writer that no more data will come. The writer will finish
+ * writing what is left in the buffer and then terminate. This never blocks.
+ * @param card
+ */
+static void
+_capture_close_writer(struct capture_card *card) {
+    if( card->mode == CAPTURE_SPLICE ) {
+        // Closing the write end makes the writer see end of file once the pipe is drained
+        _dbg_close(card->pfd[1]);
+    } else {
+        ringbuf_close(card->rb);
+    }
+}
+
+/**
+ * Wait for the writer to finish and release its resources
+ * @param card
+ * @return 0 if all data was written, -1 on write error
+ */
+static int
+_capture_join_writer(struct capture_card *card) {
+    if( !card->writer.running ) {
+        return -1;
+    }
+    pthread_join(card->writer.thread, NULL);
+    card->writer.running = 0;
+    if( card->writer.scan ) {
+        const struct mpegscan *s = card->writer.scan;
+        (void)mpegscan_close_index(card->writer.scan);
+        card->writer.scan = NULL;
+        logmsg(LOG_INFO,"GOP index for video stream #%02d: %llu packs, %llu pictures, %llu I-frames, %llu discontinuities, %llu stalls",
+               card->video,s->npacks,s->npictures,s->niframes,s->ndiscont,s->nstalls);
+        if( s->ndiscont || s->nstalls ) {
+            logmsg(LOG_NOTICE,"Time stamps in video stream #%02d jumped %llu times and the pictures stalled %llu times.",
+                   card->video,s->ndiscont,s->nstalls);
+        }
+    }
+    if( card->mode == CAPTURE_SPLICE ) {
+        _dbg_close(card->pfd[0]);
+    } else if( card->rb->high_water > capture_stats[card->video].high_water ) {
+        capture_stats[card->video].high_water = card->rb->high_water;
+    }
+    return card->writer.error ? -1 : 0;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+/*
+ * Tags used in the io_uring user data to identify the completed request. The
+ * low 32 bits hold the slot index for writes.
+ */
+#define URING_TAG_READ    (1ULL << 32)
+#define URING_TAG_WRITE   (2ULL << 32)
+#define URING_TAG_TIMEOUT (3ULL << 32)
+#define URING_TAG_CANCEL  (4ULL << 32)
+
+/*
+ * One slot of the capture buffer in io_uring mode. Data from the encoder is
+ * collected in the slot until it is full and then written to the file while
+ * the following slots are filled.
+ */
+struct uring_slot {
+    char *buf;
+    size_t fill;                /* Bytes read into the slot */
+    size_t done;                /* Bytes written so far */
+    unsigned long long off;     /* File offset of the slot */
+    unsigned long long t0;      /* Time the write was submitted */
+    int busy;                   /* Write in flight */
+};
+
+/**
+ * Setup the io_uring instance for a recording on the card and register the
+ * capture buffer with it. The kernel must support reading at the current
+ * file position since the encoder is not seekable.
+ * @param card
+ * @return 0 on success, -1 if io_uring is not available (errno is set)
+ */
+static int
+_capture_uring_init(struct capture_card *card) {
+    struct iovec iov;
+    size_t nslots = capture_buffer_size / CAPTURE_WRITE_CHUNK;
+
+    if( -1 == uring_init(&card->ring, URING_ENTRIES) ) {
+        return -1;
+    }
+    if( !(card->ring.features & IORING_FEAT_RW_CUR_POS) ) {
+        uring_exit(&card->ring);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // If we are not allowed to lock the buffer in memory we can still use
+    // the ordinary (non fixed) read and write operations
+    iov.iov_base = card->rb->buf;
+    iov.iov_len = (nslots > URING_MAXSLOTS ? URING_MAXSLOTS : nslots) * CAPTURE_WRITE_CHUNK;
+    card->ring_fixed = (0 == uring_register_buffers(&card->ring, &iov, 1));
+    if( !card->ring_fixed ) {
+        logmsg(LOG_DEBUG,"Cannot register io_uring buffer for video stream #%02d. ( %d : %s )",
+               card->video,errno,strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * Queue a read from the encoder
+ * @param card
+ * @param buf
+ * @param len
+ * @param fixed Set if buf lies in the registered buffer
+ * @return 0 on success, -1 if the submission queue is full
+ */
+static int
+_capture_uring_read(struct capture_card *card, char *buf, size_t len, int fixed) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&card->ring);
+    if( sqe == NULL ) {
+        return -1;
+    }
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = card->vh;
+    sqe->off = (__u64)-1;
+    sqe->addr = (__u64)(uintptr_t)buf;
+    sqe->len = (__u32)len;
+    sqe->user_data = URING_TAG_READ;
+    return 0;
+}
+
+/**
+ * Queue the write of the remaining data in a slot
+ * @param card
+ * @param slots
+ * @param idx Slot index
+ * @return 0 on success, -1 if the submission queue is full
+ */
+static int
+_capture_uring_write(struct capture_card *card, struct uring_slot *slots, unsigned idx) {
+    struct uring_slot *s = &slots[idx];
+    struct io_uring_sqe *sqe = uring_get_sqe(&card->ring);
+    if( sqe == NULL ) {
+        return -1;
+    }
+    sqe->opcode = card->ring_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = card->fh;
+    sqe->off = s->off + s->done;
+    sqe->addr = (__u64)(uintptr_t)(s->buf + s->done);
+    sqe->len = (__u32)(s->fill - s->done);
+    sqe->user_data = URING_TAG_WRITE | idx;
+    s->busy = 1;
+    return 0;
+}
+
+/**
+ * Queue a timeout so that the recording thread wakes up regularly to flush
+ * partially filled slots and to check if the recording should end
+ * @param card
+ * @param ts
+ * @return 0 on success, -1 if the submission queue is full
+ */
+static int
+_capture_uring_timeout(struct capture_card *card, struct __kernel_timespec *ts) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&card->ring);
+    if( sqe == NULL ) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (__u64)(uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG_TIMEOUT;
+    return 0;
+}
+
+/**
+ * Record the stream in io_uring mode. The recording thread keeps one read from
+ * the encoder and up to one write per slot in flight and only enters the kernel
+ * once for each batch of completions.
+ * @param card
+ * @return 0 if the recording ended normally, -1 if it was aborted
+ */
+static int
+_capture_uring_stream(struct capture_card *card) {
+    struct uring_slot slots[URING_MAXSLOTS];
+    struct __kernel_timespec ts;
+    const unsigned video = card->video;
+    unsigned nslots = (unsigned)(capture_buffer_size / CAPTURE_WRITE_CHUNK);
+    unsigned cur = 0, inflight = 0;
+    int read_pending = 0, dropping = 0, tick = 0, ending = 0, cancelled = 0;
+    size_t pending = 0;
+    unsigned long long file_off;
+    off_t start;
+
+    if( nslots > URING_MAXSLOTS ) {
+        nslots = URING_MAXSLOTS;
+    }
+    CLEAR(slots);
+    for(unsigned i=0; i < nslots; i++) {
+        slots[i].buf = card->rb->buf + i*CAPTURE_WRITE_CHUNK;
+    }
+    CLEAR(card->writer);
+    card->writer.video = video;
+    start = lseek(card->fh, 0, SEEK_CUR);
+    file_off = start > 0 ? (unsigned long long)start : 0;
+
+    ts.tv_sec = CAPTURE_WRITE_MAXWAIT / 1000;
+    ts.tv_nsec = (CAPTURE_WRITE_MAXWAIT % 1000) * 1000000LL;
+    (void)_capture_uring_timeout(card, &ts);
+
+    for(;;) {
+
+        // Move on to the next slot when the current one cannot take another full
+        // read, or flush it regularly so the file grows even with a slow stream
+        struct uring_slot *s = &slots[cur];
+        if( !read_pending && !s->busy && s->fill > 0 &&
+            (ending || tick || s->fill + VIDBUFSIZE > CAPTURE_WRITE_CHUNK) ) {
+            s->off = file_off;
+            s->t0 = _capture_ms();
+            if( 0 == _capture_uring_write(card, slots, cur) ) {
+                file_off += s->fill;
+                inflight++;
+                cur = (cur + 1) % nslots;
+                s = &slots[cur];
+            }
+        }
+        tick = 0;
+
+        if( ending ) {
+            if( read_pending && !cancelled ) {
+                struct io_uring_sqe *sqe = uring_get_sqe(&card->ring);
+                if( sqe ) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->fd = -1;
+                    sqe->addr = URING_TAG_READ;
+                    sqe->user_data = URING_TAG_CANCEL;
+                    cancelled = 1;
+                }
+            }
+            if( !read_pending && inflight == 0 && (s->fill == 0 || s->busy) ) {
+                break;
+            }
+        } else if( !read_pending ) {
+            // If all slots are still being written we must keep the stream going
+            // and read into the drop buffer. That data is lost.
+            dropping = s->busy;
+            if( dropping ) {
+                read_pending = (0 == _capture_uring_read(card, card->dropbuff, VIDBUFSIZE, 0));
+            } else {
+                read_pending = (0 == _capture_uring_read(card, s->buf + s->fill,
+                                                         CAPTURE_WRITE_CHUNK - s->fill, card->ring_fixed));
+            }
+        }
+
+        if( -1 == uring_submit(&card->ring, 1) ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            logmsg(LOG_ERR,"io_uring submit failed for video stream #%02d. ( %d : %s )",video,errno,strerror(errno));
+            card->doabort = 1;
+            break;
+        }
+
+        struct io_uring_cqe *cqe;
+        while( NULL != (cqe = uring_peek_cqe(&card->ring)) ) {
+            const unsigned long long tag = cqe->user_data & 0xffffffff00000000ULL;
+            const unsigned idx = (unsigned)(cqe->user_data & 0xffffffffULL);
+            const int res = cqe->res;
+            uring_cqe_seen(&card->ring);
+
+            if( tag == URING_TAG_READ ) {
+                read_pending = 0;
+                if( res == 0 ) {
+                    card->eof = 1;
+                } else if( res < 0 ) {
+                    if( res != -EINTR && res != -EAGAIN && res != -ECANCELED ) {
+                        logmsg(LOG_ERR,"Unable to read from video stream #%02d on fd=%d. ( %d : %s )",
+                               video,card->vh,-res,strerror(-res));
+                        card->doabort = 1;
+                    }
+                } else if( dropping ) {
+                    _capture_account_drop(video, (size_t)res);
+                    _capture_account_data(card);
+                } else {
+                    slots[cur].fill += (size_t)res;
+                    pending += (size_t)res;
+                    if( pending > capture_stats[video].high_water ) {
+                        capture_stats[video].high_water = pending;
+                    }
+                    capture_stats[video].bytes_uring += (unsigned long long)res;
+                    card->first = 0;
+                    _capture_account_data(card);
+                }
+            } else if( tag == URING_TAG_WRITE ) {
+                struct uring_slot *w = &slots[idx];
+                if( res < 0 && res != -EINTR && res != -EAGAIN ) {
+                    logmsg(LOG_ERR, "Error while writing to '%s' while recording. (%d : %s) ",
+                           card->filename,-res,strerror(-res));
+                    card->writer.error = 1;
+                    w->done = w->fill;
+                } else if( res > 0 ) {
+                    w->done += (size_t)res;
+                    card->writer.written += (unsigned long long)res;
+                }
+                if( w->done < w->fill ) {
+                    // Short write, queue the rest
+                    if( 0 == _capture_uring_write(card, slots, idx) ) {
+                        continue;
+                    }
+                    card->writer.error = 1;
+                }
+                _capture_account_write(video, _capture_ms() - w->t0);
+                pending -= w->fill;
+                w->busy = 0;
+                w->fill = w->done = 0;
+                inflight--;
+            } else if( tag == URING_TAG_TIMEOUT ) {
+                tick = 1;
+                if( !ending ) {
+                    (void)_capture_uring_timeout(card, &ts);
+                }
+            }
+        }
+
+        if( !ending ) {
+            ending = card->doabort || card->eof || abort_video[video] || card->writer.error ||
+                     card->ts_end <= time(NULL);
+            if( !ending && _capture_ms() - card->last_data_ms > CAPTURE_TIMEOUT*1000 ) {
+                logmsg(LOG_ERR,"Timeout on video stream #%02d. Aborting recording to '%s'",video,card->filename);
+                card->doabort = 1;
+                ending = 1;
+            }
+            if( ending && (abort_video[video] || card->writer.error) ) {
+                card->doabort = 1;
+            }
+        }
+    }
+
+    uring_exit(&card->ring);
+    return card->doabort ? -1 : 0;
+}
+
+#else
+
+/**
+ * The server is built without io_uring support
+ * @param card
+ * @return -1
+ */
+static int
+_capture_uring_init(struct capture_card *card) {
+    (void)card;
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/**
+ * Give data that was read into a separate buffer to the writer stage. Used
+ * around the cut of a handover. If the writer stage is full the data is lost.
+ * @param card
+ * @param buf
+ * @param len
+ */
+static void
+_capture_emit(struct capture_card *card, const char *buf, size_t len) {
+    size_t n;
+
+    if( card->mode == CAPTURE_SPLICE ) {
+        while( len > 0 ) {
+            ssize_t nwrite = write(card->pfd[1], buf, len);
+            if( -1 == nwrite ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                break;
+            }
+            buf += nwrite;
+            len -= (size_t)nwrite;
+        }
+    } else {
+        while( len > 0 ) {
+            char *p = ringbuf_writeptr(card->rb, &n);
+            if( n == 0 ) {
+                break;
+            }
+            n = n < len ? n : len;
+            memcpy(p, buf, n);
+            ringbuf_produce(card->rb, n);
+            capture_stats[card->video].bytes_copied += (unsigned long long)n;
+            buf += n;
+            len -= n;
+        }
+    }
+    if( len > 0 ) {
+        _capture_account_drop(card->video, len);
+    }
+}
+
+/**
+ * Read the stream while looking for the place to cut it for a handover. The
+ * data before the cut ends this recording and the rest is kept for the next.
+ * If no cut has been found after HANDOVER_MAXWAIT seconds the stream is cut
+ * after the last read.
+ * @param card
+ * @return 0 on success, -1 on error
+ */
+static int
+_capture_handover_cut(struct capture_card *card) {
+    ssize_t nread = read(card->vh, card->carry, VIDBUFSIZE);
+    if( -1 == nread ) {
+        if( errno == EAGAIN || errno == EINTR ) {
+            return 0;
+        }
+        logmsg(LOG_ERR,"Unable to read from video stream #%02d on fd=%d. ( %d : %s )",
+               card->video,card->vh,errno,strerror(errno));
+        return -1;
+    } else if( 0 == nread ) {
+        card->eof = 1;
+        return 0;
+    }
+    _capture_account_data(card);
+
+    ssize_t cut = mpegscan_find_cut(card->carry, (size_t)nread);
+    if( -1 == cut ) {
+        if( time(NULL) < card->ts_end + HANDOVER_MAXWAIT ) {
+            _capture_emit(card, card->carry, (size_t)nread);
+            return 0;
+        }
+        logmsg(LOG_NOTICE,"No GOP boundary found on video stream #%02d. Cutting stream anyway.",card->video);
+        cut = nread;
+    }
+    _capture_emit(card, card->carry, (size_t)cut);
+    memmove(card->carry, card->carry + cut, (size_t)(nread - cut));
+    card->carry_len = (size_t)(nread - cut);
+    card->carry_vh = card->vh;
+    card->handover_done = 1;
+    card->cutting = 0;
+    return 0;
+}
+
+/**
+ * Called when the end time of the recording has been reached. If a handover has
+ * been requested the card is switched to the next recording and the capture goes
+ * on until the stream can be cut at a GOP boundary.
+ * @param card
+ * @return 1 if the capture should go on, 0 if the recording has ended
+ */
+static int
+_capture_handover_begin(struct capture_card *card) {
+    capture_handover_cb cb = card->handover_cb;
+    card->handover_cb = NULL;
+    if( cb == NULL || card->mode == CAPTURE_URING ) {
+        return 0;
+    }
+    if( -1 == cb(card->video, card->vh) ) {
+        return 0;
+    }
+    logmsg(LOG_INFO,"Handing over video stream #%02d to the next recording.",card->video);
+    card->cutting = 1;
+    return 1;
+}
+
+/**
+ * Start a recording on the card. Sets up the mode and starts the writer thread
+ * (or the io_uring instance in io_uring mode).
+ * @return 0 on success, -1 on failure
+ */
+static int
+_capture_begin(unsigned video, int vh, int fh, const char *filename, time_t ts_end, int mode) {
+    struct capture_card *card = &capture_cards[video];
+
+    card->vh = vh;
+    card->fh = fh;
+    card->filename = filename;
+    card->ts_end = ts_end;
+    card->mode = mode;
+    card->doabort = 0;
+    card->eof = 0;
+    card->last_data_ms = _capture_ms();
+
+    card->cutting = 0;
+    card->handover_done = 0;
+    if( card->carry_len && card->carry_vh != vh ) {
+        card->carry_len = 0;
+    }
+
+    capture_stats[video].nrecordings++;
+
+    if( card->carry_len && card->mode == CAPTURE_URING ) {
+        card->mode = CAPTURE_READWRITE;
+    }
+
+    if( card->sink && card->mode != CAPTURE_READWRITE ) {
+        logmsg(LOG_DEBUG,"Using read()/write() for video stream #%02d since the stream has a consumer",video);
+        card->mode = CAPTURE_READWRITE;
+    }
+
+    if( gop_index && card->mode != CAPTURE_READWRITE ) {
+        logmsg(LOG_DEBUG,"Using read()/write() for video stream #%02d since the GOP index is built",video);
+        card->mode = CAPTURE_READWRITE;
+    }
+
+    if( card->mode == CAPTURE_URING ) {
+        if( 0 == _capture_uring_init(card) ) {
+            capture_stats[video].mode = CAPTURE_URING;
+            capture_stats[video].buffer_size = capture_buffer_size;
+            return 0;
+        }
+        logmsg(LOG_NOTICE,"io_uring is not available ( %d : %s ). Using read()/write() for video stream #%02d.",
+               errno,strerror(errno),video);
+        capture_stats[video].fallbacks++;
+        card->mode = CAPTURE_READWRITE;
+    }
+    capture_stats[video].mode = card->mode;
+
+    if( -1 == _capture_start_writer(card) ) {
+        return -1;
+    }
+
+    // The start of this recording was read as part of the previous one
+    if( card->carry_len ) {
+        _capture_emit(card, card->carry, card->carry_len);
+        card->carry_len = 0;
+    }
+    return 0;
+}
+
+/**
+ * The driver did not accept splice() so restart the writer in read/write mode.
+ * No data has been moved yet so nothing is lost.
+ * @param card
+ * @return 0 on success, -1 on failure
+ */
+static int
+_capture_fallback(struct capture_card *card) {
+    logmsg(LOG_NOTICE,"Video stream #%02d does not support splice(). Using read()/write() instead.",card->video);
+    _capture_close_writer(card);
+    (void)_capture_join_writer(card);
+    capture_stats[card->video].fallbacks++;
+    capture_stats[card->video].mode = CAPTURE_READWRITE;
+    card->mode = CAPTURE_READWRITE;
+    return _capture_start_writer(card);
+}
+
+/**
+ * Move one chunk of data from the encoder to the writer stage. Must only be called
+ * when the encoder has signalled that data is available.
+ * @param card
+ * @return 0 on success (or if no data was available after all), -1 on error
+ */
+static int
+_capture_transfer(struct capture_card *card) {
+    ssize_t nread;
+    size_t len;
+    const unsigned video = card->video;
+
+    if( card->mode == CAPTURE_SPLICE ) {
+
+        nread = splice(card->vh, NULL, card->pfd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if( 0 == nread ) {
+            card->eof = 1;
+            return 0;
+        } else if (-1 == nread ) {
+            int inpipe = 0;
+            if( errno == EINTR ) {
+                return 0;
+            } else if( errno == EAGAIN ) {
+                // Either the pipe is full because the writer has fallen behind or there
+                // was no data after all. In the first case we must still keep the
+                // stream going. The data is lost.
+                if( 0 == ioctl(card->pfd[0], FIONREAD, &inpipe) && (size_t)inpipe + 4096 >= card->pipesize ) {
+                    nread = read(card->vh, card->dropbuff, VIDBUFSIZE);
+                    if( nread > 0 ) {
+                        _capture_account_drop(video, (size_t)nread);
+                        _capture_account_data(card);
+                    }
+                }
+                return 0;
+            } else if( card->first && (errno == EINVAL || errno == ENOSYS) ) {
+                return _capture_fallback(card);
+            }
+            logmsg(LOG_ERR,"Unable to splice from video stream #%02d on fd=%d. ( %d : %s )",
+                   video,card->vh,errno,strerror(errno));
+            return -1;
+        }
+
+        int inpipe = 0;
+        if( 0 == ioctl(card->pfd[0], FIONREAD, &inpipe) && (size_t)inpipe > capture_stats[video].high_water ) {
+            capture_stats[video].high_water = (size_t)inpipe;
+        }
+
+    } else {
+
+        // If the writer has fallen so far behind that the buffer is full we must
+        // still read from the card to keep the stream going. The data is lost.
+        char *p = ringbuf_writeptr(card->rb, &len);
+        const int dropping = (len == 0);
+        if( dropping ) {
+            p = card->dropbuff;
+            len = VIDBUFSIZE;
+        } else if( len > VIDBUFSIZE ) {
+            len = VIDBUFSIZE;
+        }
+
+        nread = read(card->vh, p, len);
+
+        if (-1 == nread ) {
+            switch (errno) {
+                case EAGAIN:
+                case EINTR:
+                    // No data available so just try again
+                    return 0;
+                default:
+                    // Serious problem.
+                    logmsg(LOG_ERR,"Unable to read from video stream #%02d on fd=%d. ( %d : %s )",
+                            video,card->vh,errno,strerror(errno));
+                    return -1;
+            }
+        } else if( 0 == nread ) {
+            card->eof = 1;
+            return 0;
+        }
+
+        if( dropping ) {
+            _capture_account_drop(video, (size_t)nread);
+        } else {
+            ringbuf_produce(card->rb, (size_t)nread);
+            capture_stats[video].bytes_copied += (unsigned long long)nread;
+        }
+    }
+
+    card->first = 0;
+    _capture_account_data(card);
+    return 0;
+}
+
+/**
+ * Read the MPEG stream from the encoder and store it in the file until the
+ * recording end time is reached or the recording is aborted. If the card is
+ * handed over to the next recording the stream ends at the first GOP boundary
+ * after the end time instead (see capture_set_handover()).
+ * @param video Video card the stream belongs to
+ * @param vh Encoder file descriptor
+ * @param fh Recording file descriptor
+ * @param filename Name of recording file (used in messages)
+ * @param ts_end Time when the recording should end
+ * @param[out] mp2size Total number of bytes stored
+ * @return 0 if the recording ended normally, -1 if it was aborted
+ */
+int
+capture_stream(unsigned video, int vh, int fh, const char *filename, time_t ts_end, unsigned *mp2size) {
+    struct capture_card *card = &capture_cards[video];
+    int ret;
+
+    *mp2size = 0;
+    if( -1 == _capture_begin(video, vh, fh, filename, ts_end, capture_mode) ) {
+        return -1;
+    }
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if( card->mode == CAPTURE_URING ) {
+        ret = _capture_uring_stream(card);
+        *mp2size = (unsigned)card->writer.written;
+        return ret;
+    }
+#endif
+
+    do {
+
+        // ---------------------------------------------------------------------------------------
+        // First wait until we have some data available from the video capture card.
+        // If there is no error and the call wasn't interrupted (EINTR) we go ahead
+        // and move as much data as the card wants to give us. Normally this is a whole number of
+        // frames. The data read is normally in the range ~8k to ~80k in size.
+        // ---------------------------------------------------------------------------------------
+
+        ret = _capture_wait(vh);
+
+        if (-1 == ret && EINTR == errno) {
+            continue;
+        } else if (0 == ret ) {
+            logmsg(LOG_ERR,"Timeout on video stream #%02d. Aborting recording to '%s'",video,filename);
+            card->doabort = 1;
+        } else if( -1 == (card->cutting ? _capture_handover_cut(card) : _capture_transfer(card)) ) {
+            card->doabort = 1;
+        } else {
+            card->doabort = abort_video[video] || card->writer.error;
+        }
+
+    } while ( !card->doabort && !card->eof && !card->handover_done &&
+              (card->cutting || ts_end > time(NULL) || _capture_handover_begin(card)) );
+
+    _capture_close_writer(card);
+    if( -1 == _capture_join_writer(card) ) {
+        card->doabort = 1;
+    }
+    *mp2size = (unsigned)card->writer.written;
+
+    return card->doabort ? -1 : 0;
+}
+
+/**
+ * Check if the recording on the card should end, either because the time is up,
+ * it has been aborted or there is a problem with the stream.
+ * @param card
+ * @param now_ms
+ * @return 1 if the recording should end, 0 otherwise
+ */
+static int
+_reactor_isdone(struct capture_card *card, unsigned long long now_ms) {
+    if( card->doabort || abort_video[card->video] || card->writer.error ) {
+        card->doabort = 1;
+        return 1;
+    }
+    if( now_ms - card->last_data_ms > CAPTURE_TIMEOUT*1000 ) {
+        logmsg(LOG_ERR,"Timeout on video stream #%02d. Aborting recording to '%s'",card->video,card->filename);
+        card->doabort = 1;
+        return 1;
+    }
+    return card->eof || card->ts_end <= time(NULL);
+}
+
+/**
+ * The reactor thread. Waits for data on all active encoders and moves it to
+ * the writer stage for each card. When a recording ends the card is removed
+ * and the completion callback is called.
+ * @param arg Not used
+ * @return NULL
+ */
+static void *
+_reactor(void *arg) {
+    struct epoll_event events[16];
+
+    (void)arg;
+    pthread_detach(pthread_self());
+
+    for(;;) {
+
+        // Wake up at least once a second to check the end time of each recording
+        int n = epoll_wait(reactor_epfd, events, 16, 1000);
+        if( -1 == n && (errno == EBADF || errno == EINVAL) ) {
+            logmsg(LOG_CRIT,"Capture reactor event descriptor is no longer valid. Stopping reactor. ( %d : %s )",errno,strerror(errno));
+            break;
+        }
+        if( -1 == n && errno != EINTR ) {
+            logmsg(LOG_ERR,"Capture reactor epoll_wait() failed. ( %d : %s )",errno,strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        pthread_mutex_lock(&reactor_mutex);
+        for(int i=0; i < n; i++) {
+            if( events[i].data.u32 == REACTOR_WAKEUP ) {
+                uint64_t cnt;
+                if( -1 == read(reactor_wakefd, &cnt, sizeof(cnt)) ) {
+                    logmsg(LOG_DEBUG,"Capture reactor failed to clear wakeup event. ( %d : %s )",errno,strerror(errno));
+                }
+                continue;
+            }
+            struct capture_card *card = &capture_cards[events[i].data.u32];
+            if( card->active && -1 == _capture_transfer(card) ) {
+                card->doabort = 1;
+            }
+        }
+
+        const unsigned long long now_ms = _capture_ms();
+        for(unsigned video=0; video < max_video; video++) {
+            struct capture_card *card = &capture_cards[video];
+            if( card->active && _reactor_isdone(card, now_ms) ) {
+                epoll_ctl(reactor_epfd, EPOLL_CTL_DEL, card->vh, NULL);
+                _capture_close_writer(card);
+                card->active = 0;
+                card->done_cb(video, card->done_arg);
+            }
+        }
+        pthread_mutex_unlock(&reactor_mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start the capture reactor thread
+ * @return 0 on success, -1 on failure
+ */
+int
+capture_reactor_init(void) {
+    struct epoll_event ev;
+
+    reactor_epfd = epoll_create1(EPOLL_CLOEXEC);
+    reactor_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if( -1 == reactor_epfd || -1 == reactor_wakefd ) {
+        logmsg(LOG_ERR,"Cannot create capture reactor. ( %d : %s )",errno,strerror(errno));
+        return -1;
+    }
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.u32 = REACTOR_WAKEUP;
+    if( -1 == epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, reactor_wakefd, &ev) ||
+        0 != pthread_create(&reactor_thread, NULL, _reactor, NULL) ) {
+        logmsg(LOG_ERR,"Cannot start capture reactor. ( %d : %s )",errno,strerror(errno));
+        return -1;
+    }
+    logmsg(LOG_INFO,"Capture reactor started.");
+    return 0;
+}
+
+/**
+ * Hand over a recording to the capture reactor. The call returns immediately
+ * and the reactor calls done_cb() (from the reactor thread) when the
+ * recording has ended. The callback must not block and should hand over
+ * to another thread which then calls capture_reactor_finish().
+ * @param video Video card the stream belongs to
+ * @param vh Encoder file descriptor
+ * @param fh Recording file descriptor
+ * @param filename Name of recording file (used in messages)
+ * @param ts_end Time when the recording should end
+ * @param done_cb Completion callback
+ * @param done_arg Argument given to the callback
+ * @return 0 on success, -1 on failure
+ */
+int
+capture_reactor_add(unsigned video, int vh, int fh, const char *filename, time_t ts_end,
+                    capture_done_cb done_cb, void *done_arg) {
+    struct epoll_event ev;
+    struct capture_card *card = &capture_cards[video];
+    const uint64_t one = 1;
+
+    // The reactor has its own event loop so io_uring mode is replaced by read/write mode
+    pthread_mutex_lock(&reactor_mutex);
+    if( -1 == _capture_begin(video, vh, fh, filename, ts_end,
+                             capture_mode == CAPTURE_URING ? CAPTURE_READWRITE : capture_mode) ) {
+        pthread_mutex_unlock(&reactor_mutex);
+        return -1;
+    }
+
+    // The reactor must never block in a read so make sure the encoder is non blocking
+    int flags = fcntl(vh, F_GETFL);
+    if( -1 != flags ) {
+        (void)fcntl(vh, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.u32 = video;
+    if( -1 == epoll_ctl(reactor_epfd, EPOLL_CTL_ADD, vh, &ev) ) {
+        logmsg(LOG_ERR,"Cannot add video stream #%02d to capture reactor. ( %d : %s )",video,errno,strerror(errno));
+        _capture_close_writer(card);
+        (void)_capture_join_writer(card);
+        pthread_mutex_unlock(&reactor_mutex);
+        return -1;
+    }
+    card->done_cb = done_cb;
+    card->done_arg = done_arg;
+    card->active = 1;
+    pthread_mutex_unlock(&reactor_mutex);
+
+    if( -1 == write(reactor_wakefd, &one, sizeof(one)) ) {
+        logmsg(LOG_DEBUG,"Cannot wake up capture reactor. ( %d : %s )",errno,strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * Wait for the writer stage of a recording that has been ended by the reactor
+ * to finish writing all data to disk.
+ * @param video Video card
+ * @param[out] mp2size Total number of bytes stored
+ * @return 0 if the recording ended normally, -1 if it was aborted
+ */
+int
+capture_reactor_finish(unsigned video, unsigned *mp2size) {
+    struct capture_card *card = &capture_cards[video];
+    if( -1 == _capture_join_writer(card) ) {
+        card->doabort = 1;
+    }
+    *mp2size = (unsigned)card->writer.written;
+    return card->doabort ? -1 : 0;
+}
+
+/**
+ * Give the stream of the next recording on the card to a sink in addition
+ * to (or instead of) the recording file
+ * @param video Video card
+ * @param cb Sink callback
+ * @param arg Argument given to the callback
+ * @param write_file Set if the stream should also be written to the recording file
+ */
+void
+capture_set_sink(unsigned video, capture_sink_cb cb, void *arg, int write_file) {
+    capture_cards[video].sink = cb;
+    capture_cards[video].sink_arg = arg;
+    capture_cards[video].sink_write_file = write_file;
+}
+
+/**
+ * Ask for the ongoing recording on the card to be handed over to the next
+ * recording when its end time is reached
+ * @param video
+ * @param cb Callback that switches the card, NULL to cancel the handover
+ */
+void
+capture_set_handover(unsigned video, capture_handover_cb cb) {
+    capture_cards[video].handover_cb = cb;
+    if( cb == NULL ) {
+        capture_cards[video].carry_len = 0;
+    }
+}
+
+/**
+ * Check if the last recording on the card ended with a handover
+ * @param video
+ * @return 1 if the stream was cut for a handover, 0 otherwise
+ */
+int
+capture_handover_done(unsigned video) {
+    return capture_cards[video].handover_done;
+}
+
+/**
+ * Return the capture statistics for a card
+ * @param video
+ * @return Pointer to the statistics
+ */
+const struct capture_stats *
+capture_getstats(unsigned video) {
+    return &capture_stats[video];
+}
+
+/**
+ * Write the capture statistics for all cards to the given socket
+ * @param sockfd
+ */
+void
+capture_dump_stats(int sockfd) {
+    char ctitle[17] = {"Capture"};
+    for(unsigned i=0; i < max_video; i++) {
+        _writef(sockfd,"%-16s: #%02d %-9s rec=%u spliced=%lluMB copied=%lluMB uring=%lluMB fallbacks=%u\n",
+                ctitle, i,
+                capture_modename(capture_stats[i].mode),
+                capture_stats[i].nrecordings,
+                capture_stats[i].bytes_spliced/(1024*1024),
+                capture_stats[i].bytes_copied/(1024*1024),
+                capture_stats[i].bytes_uring/(1024*1024),
+                capture_stats[i].fallbacks);
+        *ctitle='\0'; // We only want the title on the first line
+        _writef(sockfd,"%-16s:     buffer=%zuKB high-water=%zuKB dropped=%lluKB stalls=%u (max %ums, total %llums) max-gap=%ums\n",
+                ctitle,
+                capture_stats[i].buffer_size/1024,
+                capture_stats[i].high_water/1024,
+                capture_stats[i].bytes_dropped/1024,
+                capture_stats[i].nstalls,
+                capture_stats[i].stall_max_ms,
+                capture_stats[i].stall_total_ms,
+                capture_stats[i].max_gap_ms);
+    }
+}
@@ -0,0 +1,221 @@
+/* =========================================================================
+ * File:        CAPTURE.H
+ * Description: Move the MPEG stream from the HW encoder to the recording
+ *              file while a recording is ongoing
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef CAPTURE_H
+#define	CAPTURE_H
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The available ways to move the data from the encoder to the file.
+ * CAPTURE_READWRITE is the classic read()/write() loop through a user space buffer.
+ * CAPTURE_SPLICE moves the data through a kernel pipe with splice() and never copies
+ * it into user space. If the driver does not support splice() the capture falls
+ * back to CAPTURE_READWRITE automatically.
+ * In both modes the stream is read by the recording thread and written to disk by a
+ * separate writer thread. In read/write mode the data passes through a per card ring
+ * buffer of size capture_buffer_size and in splice mode the pipe acts as the buffer.
+ * CAPTURE_URING submits both the reads from the encoder and the writes to the file
+ * through io_uring from the recording thread. The capture buffer is split in slots
+ * that are written asynchronously so many writes can be in flight at the same time.
+ * If the kernel does not support io_uring the capture falls back to CAPTURE_READWRITE.
+ */
+#define CAPTURE_READWRITE 0
+#define CAPTURE_SPLICE 1
+#define CAPTURE_URING 2
+
+/*
+ * Statistics kept for each video card. The counters are accumulated
+ * over all recordings since the server was started.
+ */
+struct capture_stats {
+    int mode;                           /* Mode used by the last started recording */
+    unsigned nrecordings;               /* Number of recordings made */
+    unsigned long long bytes_copied;    /* Bytes moved with read()/write() */
+    unsigned long long bytes_spliced;   /* Bytes moved with splice() */
+    unsigned long long bytes_uring;     /* Bytes moved with io_uring */
+    unsigned fallbacks;                 /* Times the selected mode was not supported */
+    size_t buffer_size;                 /* Size of the capture buffer (or splice pipe) */
+    size_t high_water;                  /* Maximum number of bytes seen waiting in the buffer */
+    unsigned long long bytes_dropped;   /* Bytes lost because the buffer was full */
+    unsigned nstalls;                   /* Number of writes slower than CAPTURE_STALL_MS */
+    unsigned stall_max_ms;              /* Longest single write */
+    unsigned long long stall_total_ms;  /* Total time spent in stalled writes */
+    unsigned max_gap_ms;                /* Longest time between two chunks from the card */
+};
+
+/*
+ * Callback used by the capture reactor to signal that a recording has ended
+ */
+typedef void (*capture_done_cb)(unsigned video, void *arg);
+
+/*
+ * Callback used to give a copy of the stream to another consumer (for example a
+ * live transcoding). It is called from the writer thread and must never block on
+ * the consumer. Returns -1 if the consumer has failed.
+ */
+typedef int (*capture_sink_cb)(const char *buf, size_t len, void *arg);
+
+/*
+ * Callback used to hand a card over to the next recording without closing the
+ * encoder. It is called from the capture thread when the end time is reached
+ * and should switch the card to the next recording. Returns -1 if the handover
+ * should not be done.
+ */
+typedef int (*capture_handover_cb)(unsigned video, int vh);
+
+/**
+ * Allocate the per card capture buffers and statistics. Must be called after the
+ * number of video cards (max_video) is known.
+ */
+void
+capture_init(void);
+
+/**
+ * Translate a capture mode name as given in the ini file to its
+ * numeric value
+ * @param name
+ * @return The mode, -1 if the name is not a known capture mode
+ */
+int
+capture_modefromname(const char *name);
+
+/**
+ * Return the human readable name of a capture mode
+ * @param mode
+ * @return Mode name
+ */
+const char *
+capture_modename(int mode);
+
+/**
+ * Read the MPEG stream from the encoder and store it in the file until the
+ * recording end time is reached or the recording is aborted.
+ * @param video Video card the stream belongs to
+ * @param vh Encoder file descriptor
+ * @param fh Recording file descriptor
+ * @param filename Name of recording file (used in messages)
+ * @param ts_end Time when the recording should end
+ * @param[out] mp2size Total number of bytes stored
+ * @return 0 if the recording ended normally (or the stream ended), -1 if it was aborted
+ */
+int
+capture_stream(unsigned video, int vh, int fh, const char *filename, time_t ts_end, unsigned *mp2size);
+
+/**
+ * Give the stream of the next recording on the card to a sink in addition
+ * to (or instead of) the recording file. A recording with a sink always uses
+ * CAPTURE_READWRITE mode since the data must pass through user space. If the
+ * sink fails the rest of the stream is written to the file. The sink is
+ * only used for the next recording on the card.
+ * @param video Video card
+ * @param cb Sink callback
+ * @param arg Argument given to the callback
+ * @param write_file Set if the stream should also be written to the recording file
+ */
+void
+capture_set_sink(unsigned video, capture_sink_cb cb, void *arg, int write_file);
+
+/**
+ * Ask for the ongoing recording on the card to be handed over to the next
+ * recording. When the end time is reached the callback switches the card and
+ * the stream is cut at the first GOP boundary that follows. The data after the
+ * cut is kept and written first in the next recording that uses the same
+ * encoder descriptor, so nothing is lost between the recordings.
+ * Not used with the capture reactor or in io_uring mode.
+ * @param video
+ * @param cb Callback that switches the card, NULL to cancel the handover
+ */
+void
+capture_set_handover(unsigned video, capture_handover_cb cb);
+
+/**
+ * Check if the last recording on the card ended with a handover
+ * @param video
+ * @return 1 if the stream was cut for a handover, 0 otherwise
+ */
+int
+capture_handover_done(unsigned video);
+
+/**
+ * Return the capture statistics for a card
+ * @param video
+ * @return Pointer to the statistics
+ */
+const struct capture_stats *
+capture_getstats(unsigned video);
+
+/**
+ * Start the capture reactor thread. When the reactor is used a single thread
+ * waits for data on all encoders with epoll instead of one thread per recording.
+ * @return 0 on success, -1 on failure
+ */
+int
+capture_reactor_init(void);
+
+/**
+ * Hand over a recording to the capture reactor. The call returns immediately
+ * and the reactor calls done_cb() (from the reactor thread) when the
+ * recording has ended. The callback must not block and should hand over
+ * to another thread which then calls capture_reactor_finish().
+ * If CAPTURE_URING is selected the recording uses CAPTURE_READWRITE.
+ * @param video Video card the stream belongs to
+ * @param vh Encoder file descriptor
+ * @param fh Recording file descriptor
+ * @param filename Name of recording file (used in messages)
+ * @param ts_end Time when the recording should end
+ * @param done_cb Completion callback
+ * @param done_arg Argument given to the callback
+ * @return 0 on success, -1 on failure
+ */
+int
+capture_reactor_add(unsigned video, int vh, int fh, const char *filename, time_t ts_end,
+                    capture_done_cb done_cb, void *done_arg);
+
+/**
+ * Wait for the writer stage of a recording that has been ended by the reactor
+ * to finish writing all data to disk.
+ * @param video Video card
+ * @param[out] mp2size Total number of bytes stored
+ * @return 0 if the recording ended normally, -1 if it was aborted
+ */
+int
+capture_reactor_finish(unsigned video, unsigned *mp2size);
+
+/**
+ * Write the capture statistics for all cards to the given socket
+ * @param sockfd
+ */
+void
+capture_dump_stats(int sockfd);
+
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* CAPTURE_H */
+
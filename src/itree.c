@@ -0,0 +1,449 @@
+/* =========================================================================
+ * File:        ITREE.C
+ * Description: Interval tree used to find overlapping recordings in the
+ *              schedule for a video card.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "itree.h"
+
+/**
+ * Height of a subtree
+ * @param n
+ * @return Height, 0 for an empty tree
+ */
+static int
+_itree_height(const struct itree_node *n) {
+    return n ? n->height : 0;
+}
+
+/**
+ * Recalculate the height and the largest end time of a node from its children
+ * @param n
+ */
+static void
+_itree_update(struct itree_node *n) {
+    const int hl = _itree_height(n->left);
+    const int hr = _itree_height(n->right);
+    n->height = 1 + (hl > hr ? hl : hr);
+    n->max_end = n->end;
+    if( n->left && n->left->max_end > n->max_end ) {
+        n->max_end = n->left->max_end;
+    }
+    if( n->right && n->right->max_end > n->max_end ) {
+        n->max_end = n->right->max_end;
+    }
+}
+
+static struct itree_node *
+_itree_rotate_right(struct itree_node *n) {
+    struct itree_node *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    _itree_update(n);
+    _itree_update(l);
+    return l;
+}
+
+static struct itree_node *
+_itree_rotate_left(struct itree_node *n) {
+    struct itree_node *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    _itree_update(n);
+    _itree_update(r);
+    return r;
+}
+
+/**
+ * Restore the AVL balance at a node after one of its subtrees has changed
+ * @param n
+ * @return New root of the subtree
+ */
+static struct itree_node *
+_itree_balance(struct itree_node *n) {
+    _itree_update(n);
+    const int bal = _itree_height(n->left) - _itree_height(n->right);
+    if( bal > 1 ) {
+        if( _itree_height(n->left->left) < _itree_height(n->left->right) ) {
+            n->left = _itree_rotate_left(n->left);
+        }
+        return _itree_rotate_right(n);
+    } else if( bal < -1 ) {
+        if( _itree_height(n->right->right) < _itree_height(n->right->left) ) {
+            n->right = _itree_rotate_right(n->right);
+        }
+        return _itree_rotate_left(n);
+    }
+    return n;
+}
+
+/**
+ * Compare the key (start, seq) with a node
+ * @return <0, 0, >0 if the key is before, equal to or after the node
+ */
+static int
+_itree_cmp(time_t start, unsigned seq, const struct itree_node *n) {
+    if( start != n->start ) {
+        return start < n->start ? -1 : 1;
+    }
+    if( seq != n->seq ) {
+        return seq < n->seq ? -1 : 1;
+    }
+    return 0;
+}
+
+static struct itree_node *
+_itree_insert(struct itree_node *root, struct itree_node *n) {
+    if( root == NULL ) {
+        return n;
+    }
+    if( _itree_cmp(n->start, n->seq, root) < 0 ) {
+        root->left = _itree_insert(root->left, n);
+    } else {
+        root->right = _itree_insert(root->right, n);
+    }
+    return _itree_balance(root);
+}
+
+/**
+ * Unlink the leftmost node of a subtree
+ * @param root
+ * @param[out] min The unlinked node
+ * @return New root of the subtree
+ */
+static struct itree_node *
+_itree_unlink_min(struct itree_node *root, struct itree_node **min) {
+    if( root->left == NULL ) {
+        *min = root;
+        return root->right;
+    }
+    root->left = _itree_unlink_min(root->left, min);
+    return _itree_balance(root);
+}
+
+static struct itree_node *
+_itree_remove(struct itree_node *root, time_t start, unsigned seq, int *found) {
+    if( root == NULL ) {
+        return NULL;
+    }
+    const int cmp = _itree_cmp(start, seq, root);
+    if( cmp < 0 ) {
+        root->left = _itree_remove(root->left, start, seq, found);
+    } else if( cmp > 0 ) {
+        root->right = _itree_remove(root->right, start, seq, found);
+    } else {
+        struct itree_node *l = root->left, *r = root->right;
+        free(root);
+        *found = 1;
+        if( r == NULL ) {
+            return l;
+        }
+        struct itree_node *min;
+        r = _itree_unlink_min(r, &min);
+        min->left = l;
+        min->right = r;
+        return _itree_balance(min);
+    }
+    return _itree_balance(root);
+}
+
+static void
+_itree_free(struct itree_node *n) {
+    if( n ) {
+        _itree_free(n->left);
+        _itree_free(n->right);
+        free(n);
+    }
+}
+
+/**
+ * Initialize an empty tree
+ * @param t
+ */
+void
+itree_init(struct itree *t) {
+    t->root = NULL;
+    t->num = 0;
+}
+
+/**
+ * Remove all intervals from the tree. The data pointers are not touched.
+ * @param t
+ */
+void
+itree_clear(struct itree *t) {
+    _itree_free(t->root);
+    itree_init(t);
+}
+
+/**
+ * Add an interval to the tree
+ * @param t
+ * @param start
+ * @param end
+ * @param seq Unique number for the interval. Used to tell intervals with the same start apart.
+ * @param data Returned by the queries
+ * @return 0 on success, -1 if out of memory
+ */
+int
+itree_insert(struct itree *t, time_t start, time_t end, unsigned seq, void *data) {
+    struct itree_node *n = calloc(1, sizeof (struct itree_node));
+    if( n == NULL ) {
+        return -1;
+    }
+    n->start = start;
+    n->end = end;
+    n->max_end = end;
+    n->seq = seq;
+    n->height = 1;
+    n->data = data;
+    t->root = _itree_insert(t->root, n);
+    t->num++;
+    return 0;
+}
+
+/**
+ * Remove an interval from the tree
+ * @param t
+ * @param start Start time the interval was inserted with
+ * @param seq Sequence number the interval was inserted with
+ * @return 0 on success, -1 if the interval is not in the tree
+ */
+int
+itree_remove(struct itree *t, time_t start, unsigned seq) {
+    int found = 0;
+    t->root = _itree_remove(t->root, start, seq, &found);
+    if( !found ) {
+        return -1;
+    }
+    t->num--;
+    return 0;
+}
+
+/**
+ * Replace the data of an interval in the tree
+ * @param t
+ * @param start Start time the interval was inserted with
+ * @param seq Sequence number the interval was inserted with
+ * @param data The new data
+ * @return 0 on success, -1 if the interval is not in the tree
+ */
+int
+itree_set(struct itree *t, time_t start, unsigned seq, void *data) {
+    struct itree_node *n = t->root;
+    while( n ) {
+        const int c = _itree_cmp(start, seq, n);
+        if( c == 0 ) {
+            n->data = data;
+            return 0;
+        }
+        n = c < 0 ? n->left : n->right;
+    }
+    return -1;
+}
+
+/**
+ * Return the interval with the earliest start
+ * @param t
+ * @return The data for the interval, NULL if the tree is empty
+ */
+void *
+itree_first(const struct itree *t) {
+    const struct itree_node *n = t->root;
+    if( n == NULL ) {
+        return NULL;
+    }
+    while( n->left ) {
+        n = n->left;
+    }
+    return n->data;
+}
+
+/**
+ * Push a node and all its left descendants on the iterator stack
+ * @param it
+ * @param n
+ */
+static void
+_itree_push_left(struct itree_iter *it, const struct itree_node *n) {
+    while( n ) {
+        it->stack[it->depth++] = n;
+        n = n->left;
+    }
+}
+
+/**
+ * Start an in order iteration
+ * @param t
+ * @param it Iterator
+ * @return The data for the first interval, NULL if the tree is empty
+ */
+void *
+itree_iter_first(const struct itree *t, struct itree_iter *it) {
+    it->depth = 0;
+    _itree_push_left(it, t->root);
+    return itree_iter_next(it);
+}
+
+/**
+ * Step to the next interval in order
+ * @param it Iterator
+ * @return The data for the next interval, NULL at the end
+ */
+void *
+itree_iter_next(struct itree_iter *it) {
+    if( it->depth == 0 ) {
+        return NULL;
+    }
+    const struct itree_node *n = it->stack[--it->depth];
+    _itree_push_left(it, n->right);
+    return n->data;
+}
+
+/**
+ * Find an interval that overlaps [start, end]
+ * @param t
+ * @param start
+ * @param end
+ * @return The data for an overlapping interval, NULL if there is none
+ */
+void *
+itree_overlap(const struct itree *t, time_t start, time_t end) {
+    const struct itree_node *n = t->root;
+    while( n ) {
+        if( start <= n->end && end >= n->start ) {
+            return n->data;
+        }
+        // If the left subtree reaches far enough any overlap must be there since
+        // everything to the right starts even later
+        if( n->left && n->left->max_end >= start ) {
+            n = n->left;
+        } else if( end >= n->start ) {
+            n = n->right;
+        } else {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Index of the first element in a sorted array that is larger than val
+ */
+static size_t
+_itree_upper(const time_t *a, size_t lo, size_t hi, time_t val) {
+    while( lo < hi ) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if( a[mid] <= val ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Index of the first element in a sorted array that is at least val
+ */
+static size_t
+_itree_lower(const time_t *a, size_t lo, size_t hi, time_t val) {
+    while( lo < hi ) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if( a[mid] < val ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Check the intervals [lo, hi) of the series against a subtree. Since the series
+ * is sorted on both start and end time the intervals that can overlap a node or
+ * subtree always form a range that is narrowed down with binary searches.
+ * @param n
+ * @param start
+ * @param end
+ * @param lo
+ * @param hi
+ * @param[in,out] best Lowest index with an overlap found so far
+ * @param[in,out] hit Data for the overlap at best
+ */
+static void
+_itree_series(const struct itree_node *n, const time_t *start, const time_t *end,
+              size_t lo, size_t hi, size_t *best, void **hit) {
+    while( n ) {
+        // Only overlaps before the best one so far are of interest
+        if( hi > *best ) {
+            hi = *best;
+        }
+        // Nothing in this subtree ends after the intervals that start later than max_end
+        hi = _itree_upper(start, lo, hi, n->max_end);
+        if( lo >= hi ) {
+            return;
+        }
+
+        // The intervals overlapping this node end at or after its start and start at
+        // or before its end
+        const size_t a = _itree_lower(end, lo, hi, n->start);
+        if( a < hi && start[a] <= n->end ) {
+            *best = a;
+            *hit = n->data;
+            hi = a;
+        }
+
+        _itree_series(n->left, start, end, lo, hi, best, hit);
+
+        // Everything in the right subtree starts at or after this node so only
+        // intervals that end after this node starts can overlap
+        lo = a;
+        n = n->right;
+    }
+}
+
+/**
+ * Check a whole series of intervals against the tree in one traversal. The
+ * intervals must be in time order and must not overlap each other, as is the
+ * case for the occurrences of a repeated recording.
+ * @param t
+ * @param start Start times of the intervals
+ * @param end End times of the intervals
+ * @param n Number of intervals
+ * @param[out] idx Index of the first interval in the series with an overlap
+ * @return The data for the interval in the tree that overlaps, NULL if there is no overlap
+ */
+void *
+itree_overlap_series(const struct itree *t, const time_t *start, const time_t *end, size_t n, size_t *idx) {
+    size_t best = n;
+    void *hit = NULL;
+    _itree_series(t->root, start, end, 0, n, &best, &hit);
+    if( hit ) {
+        *idx = best;
+    }
+    return hit;
+}
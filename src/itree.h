@@ -0,0 +1,177 @@
+/* =========================================================================
+ * File:        ITREE.H
+ * Description: Interval tree used to find overlapping recordings in the
+ *              schedule for a video card.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef ITREE_H
+#define	ITREE_H
+
+#include <stddef.h>
+#include <time.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * A balanced (AVL) binary tree of closed time intervals [start, end] ordered by
+ * start time and then by a unique sequence number. Each node also holds the
+ * largest end time in its subtree so that all subtrees that cannot hold an
+ * overlapping interval are skipped. Finding an overlap is O(log n) and
+ * inserting and removing an interval is O(log n). The intervals can also be
+ * visited in order with an iterator.
+ */
+struct itree_node {
+    time_t start;
+    time_t end;
+    time_t max_end;             /* Largest end time in this subtree */
+    unsigned seq;
+    int height;
+    void *data;
+    struct itree_node *left;
+    struct itree_node *right;
+};
+
+struct itree {
+    struct itree_node *root;
+    unsigned num;
+};
+
+/*
+ * ITREE_MAXDEPTH integer
+ * Largest height of a tree. An AVL tree of this height holds far more nodes than
+ * can fit in memory.
+ */
+#define ITREE_MAXDEPTH 64
+
+/*
+ * In order iterator. The nodes on the path to the current node that are still to
+ * be visited are kept on a stack so no parent pointers are needed. The iterator
+ * is invalid once the tree is changed.
+ */
+struct itree_iter {
+    const struct itree_node *stack[ITREE_MAXDEPTH];
+    int depth;
+};
+
+/**
+ * Initialize an empty tree
+ * @param t
+ */
+void
+itree_init(struct itree *t);
+
+/**
+ * Remove all intervals from the tree. The data pointers are not touched.
+ * @param t
+ */
+void
+itree_clear(struct itree *t);
+
+/**
+ * Add an interval to the tree
+ * @param t
+ * @param start
+ * @param end
+ * @param seq Unique number for the interval. Used to tell intervals with the same start apart.
+ * @param data Returned by the queries
+ * @return 0 on success, -1 if out of memory
+ */
+int
+itree_insert(struct itree *t, time_t start, time_t end, unsigned seq, void *data);
+
+/**
+ * Remove an interval from the tree
+ * @param t
+ * @param start Start time the interval was inserted with
+ * @param seq Sequence number the interval was inserted with
+ * @return 0 on success, -1 if the interval is not in the tree
+ */
+int
+itree_remove(struct itree *t, time_t start, unsigned seq);
+
+/**
+ * Replace the data of an interval in the tree
+ * @param t
+ * @param start Start time the interval was inserted with
+ * @param seq Sequence number the interval was inserted with
+ * @param data The new data
+ * @return 0 on success, -1 if the interval is not in the tree
+ */
+int
+itree_set(struct itree *t, time_t start, unsigned seq, void *data);
+
+/**
+ * Return the interval with the earliest start
+ * @param t
+ * @return The data for the interval, NULL if the tree is empty
+ */
+void *
+itree_first(const struct itree *t);
+
+/**
+ * Start an in order iteration
+ * @param t
+ * @param it Iterator
+ * @return The data for the first interval, NULL if the tree is empty
+ */
+void *
+itree_iter_first(const struct itree *t, struct itree_iter *it);
+
+/**
+ * Step to the next interval in order
+ * @param it Iterator
+ * @return The data for the next interval, NULL at the end
+ */
+void *
+itree_iter_next(struct itree_iter *it);
+
+/**
+ * Find an interval that overlaps [start, end]
+ * @param t
+ * @param start
+ * @param end
+ * @return The data for an overlapping interval, NULL if there is none
+ */
+void *
+itree_overlap(const struct itree *t, time_t start, time_t end);
+
+/**
+ * Check a whole series of intervals against the tree in one traversal. The
+ * intervals must be in time order and must not overlap each other, as is the
+ * case for the occurrences of a repeated recording.
+ * @param t
+ * @param start Start times of the intervals
+ * @param end End times of the intervals
+ * @param n Number of intervals
+ * @param[out] idx Index of the first interval in the series with an overlap
+ * @return The data for the interval in the tree that overlaps, NULL if there is no overlap
+ */
+void *
+itree_overlap_series(const struct itree *t, const time_t *start, const time_t *end, size_t n, size_t *idx);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* ITREE_H */
+
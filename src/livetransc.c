@@ -0,0 +1,390 @@
+/* =========================================================================
+ * File:        LIVETRANSC.C
+ * Description: Transcode a recording while it is being recorded by feeding
+ *              the stream to ffmpeg through a pipe
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "config.h"
+
+#include "tvpvrd.h"
+#include "tvconfig.h"
+#include "utils.h"
+#include "tvplog.h"
+#include "stats.h"
+#include "transcprofile.h"
+#include "transc.h"
+#include "livetransc.h"
+
+/*
+ * LIVETRANSC_CHUNK integer
+ * Number of bytes the feeder moves from the spill file to the pipe in each step
+ */
+#define LIVETRANSC_CHUNK (1024*1024)
+
+/**
+ * Write all bytes to the (non blocking) pipe, waiting for the encoder to
+ * read as necessary. Only used by the feeder thread.
+ * @param fd
+ * @param buf
+ * @param len
+ * @return 0 on success, -1 if the encoder has stopped reading
+ */
+static int
+_livetransc_writeall(int fd, const char *buf, size_t len) {
+    struct pollfd pfd;
+    while( len > 0 ) {
+        ssize_t n = write(fd, buf, len);
+        if( n > 0 ) {
+            buf += n;
+            len -= (size_t)n;
+        } else if( -1 == n && (errno == EAGAIN || errno == EINTR) ) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            (void)poll(&pfd, 1, 1000);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Feeder thread. Moves spilled data from the spill file to the encoder as fast as
+ * the encoder reads it. When the backlog is gone the spill file is emptied so that
+ * no disk space is wasted. Closes the pipe when all data has been given to the
+ * encoder after livetransc_finish() has been called.
+ * @param arg Pointer to the live transcoding
+ * @return NULL
+ */
+static void *
+_livetransc_feeder(void *arg) {
+    struct livetransc *lt = arg;
+    char *buf = malloc(LIVETRANSC_CHUNK);
+
+    if( buf == NULL ) {
+        logmsg(LOG_ERR,"Out of memory in live transcoding feeder for '%s'",lt->short_filename);
+        lt->failed = 1;
+    }
+
+    pthread_mutex_lock(&lt->mutex);
+    while( !lt->failed ) {
+        if( lt->spill_rd == lt->spill_wr ) {
+            if( lt->closed ) {
+                break;
+            }
+            pthread_cond_wait(&lt->cond, &lt->mutex);
+            continue;
+        }
+        const unsigned long long rd = lt->spill_rd;
+        const unsigned long long avail = lt->spill_wr - rd;
+        pthread_mutex_unlock(&lt->mutex);
+
+        // New data is only appended to the spill file by livetransc_push() so we can
+        // read the backlog without holding the lock
+        size_t len = avail < LIVETRANSC_CHUNK ? (size_t)avail : LIVETRANSC_CHUNK;
+        ssize_t n = pread(lt->spillfd, buf, len, (off_t)rd);
+        if( n <= 0 || -1 == _livetransc_writeall(lt->fd, buf, (size_t)n) ) {
+            logmsg(LOG_ERR,"Live transcoding of '%s' failed while feeding spilled data. ( %d : %s )",
+                   lt->short_filename,errno,strerror(errno));
+            lt->failed = 1;
+            pthread_mutex_lock(&lt->mutex);
+            break;
+        }
+
+        pthread_mutex_lock(&lt->mutex);
+        lt->spill_rd += (unsigned long long)n;
+        if( lt->spill_rd == lt->spill_wr ) {
+            // We have caught up. Release the disk space used by the backlog.
+            lt->spill_rd = lt->spill_wr = 0;
+            if( -1 == ftruncate(lt->spillfd, 0) ) {
+                logmsg(LOG_DEBUG,"Cannot truncate spill file '%s'. ( %d : %s )",lt->spillname,errno,strerror(errno));
+            }
+        }
+    }
+    pthread_mutex_unlock(&lt->mutex);
+
+    // This gives the encoder end of file
+    _dbg_close(lt->fd);
+    lt->fd = -1;
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Start the encoder for a live transcoding
+ * @param workingdir Working directory for the recording
+ * @param short_filename Name of the recording file
+ * @param profile Profile to use. Must be a single pass profile.
+ * @return The new transcoding, NULL on failure
+ */
+struct livetransc *
+livetransc_start(char *workingdir, char *short_filename, struct transcoding_profile_entry *profile) {
+    char cmdbuff[1024];
+    int pfd[2];
+
+    struct livetransc *lt = calloc(1, sizeof(struct livetransc));
+    if( lt == NULL ) {
+        logmsg(LOG_ERR,"Out of memory in livetransc_start()");
+        return NULL;
+    }
+    // Each encoder runs in its own subdirectory so that several profiles can be
+    // transcoded from the same stream without their files colliding
+    snprintf(lt->workingdir, sizeof(lt->workingdir)-1, "%s/%s", workingdir, profile->name);
+    strncpy(lt->short_filename, short_filename, sizeof(lt->short_filename)-1);
+    snprintf(lt->spillname, sizeof(lt->spillname)-1, "%s/live.spill", lt->workingdir);
+    lt->profile = profile;
+    lt->spillfd = -1;
+    lt->tidx = -1;
+
+    if( -1 == mkdir(lt->workingdir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST ) {
+        logmsg(LOG_ERR,"Cannot create live transcoding directory '%s'. ( %d : %s )",lt->workingdir,errno,strerror(errno));
+        free(lt);
+        return NULL;
+    }
+
+    if( -1 == create_ffmpeg_live_cmdline(short_filename, profile, lt->destfile, sizeof(lt->destfile)-1,
+                                         lt->cmd_ffmpeg, sizeof(lt->cmd_ffmpeg)-1) ) {
+        free(lt);
+        return NULL;
+    }
+    snprintf(cmdbuff, sizeof(cmdbuff)-1, "cd %s;%s", lt->workingdir, lt->cmd_ffmpeg);
+
+    if( -1 == pipe2(pfd, O_CLOEXEC) ) {
+        logmsg(LOG_ERR,"Cannot create pipe for live transcoding of '%s'. ( %d : %s )",short_filename,errno,strerror(errno));
+        free(lt);
+        return NULL;
+    }
+
+    lt->pid = spawn_transcoding(cmdbuff, pfd[0]);
+    _dbg_close(pfd[0]);
+    if( lt->pid < 0 ) {
+        _dbg_close(pfd[1]);
+        free(lt);
+        return NULL;
+    }
+    lt->fd = pfd[1];
+    (void)fcntl(lt->fd, F_SETFL, fcntl(lt->fd, F_GETFL) | O_NONBLOCK);
+    lt->start_ts = time(NULL);
+
+    pthread_mutex_init(&lt->mutex, NULL);
+    pthread_cond_init(&lt->cond, NULL);
+    if( 0 != pthread_create(&lt->feeder, NULL, _livetransc_feeder, lt) ) {
+        logmsg(LOG_ERR,"Cannot create feeder thread for live transcoding of '%s'",short_filename);
+        _dbg_close(lt->fd);
+        (void)killpg(lt->pid, SIGKILL);
+        (void)waitpid(lt->pid, NULL, 0);
+        pthread_mutex_destroy(&lt->mutex);
+        pthread_cond_destroy(&lt->cond);
+        free(lt);
+        return NULL;
+    }
+
+    lt->tidx = record_ongoingtranscoding(lt->workingdir, lt->short_filename, lt->cmd_ffmpeg, profile, lt->pid);
+
+    logmsg(LOG_INFO, "Started live transcoding pid=%d of '%s' using profile '%s'.",lt->pid,short_filename,profile->name);
+    return lt;
+}
+
+/**
+ * Give the next part of the stream to the encoder. Never blocks on the encoder.
+ * If there is a backlog or the pipe is full the data is appended to the spill
+ * file and the feeder thread will hand it over later.
+ * @param buf
+ * @param len
+ * @param arg Pointer to the live transcoding
+ * @return 0 on success, -1 if the encoder has failed
+ */
+int
+livetransc_push(const char *buf, size_t len, void *arg) {
+    struct livetransc *lt = arg;
+
+    pthread_mutex_lock(&lt->mutex);
+    if( lt->failed ) {
+        pthread_mutex_unlock(&lt->mutex);
+        return -1;
+    }
+    lt->nbytes += len;
+
+    if( lt->spill_rd == lt->spill_wr ) {
+        ssize_t n = write(lt->fd, buf, len);
+        if( -1 == n ) {
+            if( errno != EAGAIN && errno != EINTR ) {
+                logmsg(LOG_ERR,"Live transcoding of '%s' failed. ( %d : %s )",lt->short_filename,errno,strerror(errno));
+                lt->failed = 1;
+                pthread_mutex_unlock(&lt->mutex);
+                return -1;
+            }
+            n = 0;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+
+    if( len > 0 ) {
+        if( lt->spillfd == -1 ) {
+            lt->spillfd = open(lt->spillname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+            if( -1 == lt->spillfd ) {
+                logmsg(LOG_ERR,"Cannot create spill file '%s'. ( %d : %s )",lt->spillname,errno,strerror(errno));
+                lt->failed = 1;
+                pthread_mutex_unlock(&lt->mutex);
+                return -1;
+            }
+            logmsg(LOG_DEBUG,"Encoder for '%s' is falling behind. Spilling to '%s'",lt->short_filename,lt->spillname);
+        }
+        while( len > 0 ) {
+            ssize_t n = pwrite(lt->spillfd, buf, len, (off_t)lt->spill_wr);
+            if( -1 == n ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+                logmsg(LOG_ERR,"Cannot write to spill file '%s'. ( %d : %s )",lt->spillname,errno,strerror(errno));
+                lt->failed = 1;
+                pthread_mutex_unlock(&lt->mutex);
+                return -1;
+            }
+            buf += n;
+            len -= (size_t)n;
+            lt->spill_wr += (unsigned long long)n;
+            lt->nspilled += (unsigned long long)n;
+        }
+        if( lt->spill_wr - lt->spill_rd > lt->spill_max ) {
+            lt->spill_max = lt->spill_wr - lt->spill_rd;
+        }
+        pthread_cond_signal(&lt->cond);
+    }
+    pthread_mutex_unlock(&lt->mutex);
+    return 0;
+}
+
+/**
+ * Give the next part of the stream to every encoder in the set. The encoders
+ * are independent so a slow or failed encoder does not affect the others.
+ * @param buf
+ * @param len
+ * @param arg Pointer to the set of live transcodings
+ * @return 0 on success, -1 if all encoders have failed
+ */
+int
+livetransc_push_set(const char *buf, size_t len, void *arg) {
+    struct livetransc_set *set = arg;
+    int ret = -1;
+
+    for(int i=0; i < LIVETRANSC_MAX; i++) {
+        if( set->lt[i] && 0 == livetransc_push(buf, len, set->lt[i]) ) {
+            ret = 0;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Check if the encoder has failed
+ * @param lt
+ * @return 1 if failed, 0 otherwise
+ */
+int
+livetransc_failed(struct livetransc *lt) {
+    return lt->failed;
+}
+
+/**
+ * End the live transcoding. Waits until the encoder has received all data
+ * and finished and then moves the result to its final place just as for an
+ * ordinary transcoding. If the recording was aborted the encoder is killed.
+ * The live transcoding is freed.
+ * @param lt
+ * @param doabort Set if the recording was aborted
+ * @param basedatadir
+ * @param recurrence_title
+ * @param[out] filesize
+ * @param[out] transcode_time
+ * @param[out] avg_5load
+ * @param[out] updatedfilename
+ * @return 0 on success, -1 on failure
+ */
+int
+livetransc_finish(struct livetransc *lt, int doabort, char *basedatadir, char *recurrence_title,
+                  unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename) {
+    struct rusage usage;
+    int ret = -1;
+
+    CLEAR(usage);
+    CLEAR(*transcode_time);
+    *updatedfilename = '\0';
+
+    if( doabort || lt->failed ) {
+        // There is no point in letting the encoder finish
+        (void)killpg(lt->pid, SIGKILL);
+    }
+
+    pthread_mutex_lock(&lt->mutex);
+    lt->closed = 1;
+    pthread_cond_signal(&lt->cond);
+    pthread_mutex_unlock(&lt->mutex);
+    pthread_join(lt->feeder, NULL);
+
+    logmsg(LOG_INFO,"Live transcoding of '%s' got %llu MB, %llu MB was spilled to disk (max backlog %llu MB)",
+           lt->short_filename, lt->nbytes/(1024*1024), lt->nspilled/(1024*1024), lt->spill_max/(1024*1024));
+
+    // The encoder has been running since the recording started
+    int runningtime = (int)(time(NULL) - lt->start_ts);
+    int done = wait_transcoding(lt->pid, lt->tidx, lt->short_filename, &runningtime, &usage, avg_5load);
+
+    if( done == 1 && !doabort && !lt->failed ) {
+        ret = move_transcoded_file(basedatadir, lt->workingdir, lt->short_filename, recurrence_title,
+                                   lt->profile, lt->destfile, runningtime, &usage,
+                                   filesize, transcode_time, updatedfilename);
+    }
+
+    if( lt->spillfd != -1 ) {
+        _dbg_close(lt->spillfd);
+        unlink(lt->spillname);
+    }
+    pthread_mutex_destroy(&lt->mutex);
+    pthread_cond_destroy(&lt->cond);
+    free(lt);
+    return ret;
+}
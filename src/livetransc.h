@@ -0,0 +1,151 @@
+/* =========================================================================
+ * File:        LIVETRANSC.H
+ * Description: Transcode a recording while it is being recorded by feeding
+ *              the stream to ffmpeg through a pipe
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef LIVETRANSC_H
+#define	LIVETRANSC_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "recs.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+struct transcoding_profile_entry;
+struct timeall;
+
+/*
+ * A transcoding that runs while the recording is made. The capture writer
+ * thread hands each chunk of the stream to livetransc_push() which writes it to
+ * the ffmpeg pipe without blocking. If ffmpeg cannot keep up the data is spilled
+ * to a file in the working directory and a feeder thread moves it to the pipe
+ * as fast as ffmpeg reads it. The capture is therefore never slowed down by the
+ * encoder.
+ */
+struct livetransc {
+    pid_t pid;                  /* The ffmpeg process (group) */
+    int tidx;                   /* Index in the list of ongoing transcodings */
+    int fd;                     /* Write end of the pipe to ffmpeg (non blocking) */
+    int spillfd;                /* Spill file, -1 until first needed */
+    char spillname[512];
+    unsigned long long spill_wr;    /* Bytes written to the spill file */
+    unsigned long long spill_rd;    /* Bytes moved from the spill file to the pipe */
+    unsigned long long nbytes;      /* Total number of bytes given to the encoder */
+    unsigned long long nspilled;    /* Total number of bytes that went through the spill file */
+    unsigned long long spill_max;   /* Largest backlog in the spill file */
+    int closed;                 /* No more data will be pushed */
+    volatile int failed;        /* The encoder has stopped reading */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t feeder;
+    time_t start_ts;
+    char workingdir[256];
+    char short_filename[256];
+    char destfile[128];
+    char cmd_ffmpeg[512];
+    struct transcoding_profile_entry *profile;
+};
+
+/*
+ * LIVETRANSC_MAX integer
+ * Maximum number of live transcodings fed from the same stream, one for each
+ * profile of the recording
+ */
+#define LIVETRANSC_MAX REC_MAX_TPROFILES
+
+/*
+ * Several live transcodings fed from the same stream. The entries are indexed
+ * by the profile index in the recording and unused entries are NULL.
+ */
+struct livetransc_set {
+    struct livetransc *lt[LIVETRANSC_MAX];
+};
+
+/**
+ * Start the encoder for a live transcoding
+ * @param workingdir Working directory for the recording
+ * @param short_filename Name of the recording file
+ * @param profile Profile to use. Must be a single pass profile.
+ * @return The new transcoding, NULL on failure
+ */
+struct livetransc *
+livetransc_start(char *workingdir, char *short_filename, struct transcoding_profile_entry *profile);
+
+/**
+ * Give the next part of the stream to the encoder. Never blocks on the encoder.
+ * The signature matches capture_sink_cb so that it can be used directly as a
+ * capture sink.
+ * @param buf
+ * @param len
+ * @param arg Pointer to the live transcoding
+ * @return 0 on success, -1 if the encoder has failed
+ */
+int
+livetransc_push(const char *buf, size_t len, void *arg);
+
+/**
+ * Give the next part of the stream to every encoder in the set. The signature
+ * matches capture_sink_cb.
+ * @param buf
+ * @param len
+ * @param arg Pointer to the set of live transcodings
+ * @return 0 on success, -1 if all encoders have failed
+ */
+int
+livetransc_push_set(const char *buf, size_t len, void *arg);
+
+/**
+ * Check if the encoder has failed
+ * @param lt
+ * @return 1 if failed, 0 otherwise
+ */
+int
+livetransc_failed(struct livetransc *lt);
+
+/**
+ * End the live transcoding. Waits until the encoder has received all data
+ * and finished and then moves the result to its final place just as for an
+ * ordinary transcoding. If the recording was aborted the encoder is killed.
+ * The live transcoding is freed.
+ * @param lt
+ * @param doabort Set if the recording was aborted
+ * @param basedatadir
+ * @param recurrence_title
+ * @param[out] filesize
+ * @param[out] transcode_time
+ * @param[out] avg_5load
+ * @param[out] updatedfilename
+ * @return 0 on success, -1 on failure
+ */
+int
+livetransc_finish(struct livetransc *lt, int doabort, char *basedatadir, char *recurrence_title,
+                  unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LIVETRANSC_H */
+
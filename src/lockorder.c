@@ -0,0 +1,74 @@
+/* =========================================================================
+ * File:        LOCKORDER.C
+ * Description: Run time check of the lock order (see lockorder.h). Only
+ *              active when configured with --enable-lockcheck.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "lockorder.h"
+#include "tvplog.h"
+
+/*
+ * lock_held
+ * Bit mask of the lock levels held by this thread
+ */
+static __thread unsigned lock_held = 0;
+
+/**
+ * Lock a mutex after checking that the calling thread does not already hold a
+ * lock at the same or a later level. A violation is logged and aborts the daemon.
+ * @param mutex
+ * @param level
+ * @param func Calling function
+ * @param line Calling line
+ */
+void
+_lock_acquire(pthread_mutex_t *mutex, enum lock_level level, const char *func, int line) {
+    if( lock_held >> level ) {
+        logmsg(LOG_CRIT,"Lock order violation in %s():%d. Taking lock level %d while holding levels 0x%02x.",
+               func, line, (int)level, lock_held);
+        abort();
+    }
+    pthread_mutex_lock(mutex);
+    lock_held |= 1u << level;
+}
+
+/**
+ * Unlock a mutex taken with _lock_acquire()
+ * @param mutex
+ * @param level
+ * @param func Calling function
+ * @param line Calling line
+ */
+void
+_lock_release(pthread_mutex_t *mutex, enum lock_level level, const char *func, int line) {
+    if( !(lock_held & (1u << level)) ) {
+        logmsg(LOG_CRIT,"Lock level %d released in %s():%d without being held.", (int)level, func, line);
+        abort();
+    }
+    lock_held &= ~(1u << level);
+    pthread_mutex_unlock(mutex);
+}
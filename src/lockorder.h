@@ -0,0 +1,107 @@
+/* =========================================================================
+ * File:        LOCKORDER.H
+ * Description: Lock order of the mutexes that guard the shared data and the
+ *              checks of the order in debug builds.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef LOCKORDER_H
+#define	LOCKORDER_H
+
+#include <pthread.h>
+
+// LOCK_CHECK must be seen in the same way by every file that takes the locks
+#include "config.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The shared data is split over a few mutexes so that a thread working on one
+ * part never waits for a thread working on another. A recording can always be
+ * started even while a transcoding thread updates its bookkeeping or a client
+ * lists the history.
+ *
+ * A thread that holds one of these locks may only take locks further down the
+ * list. Taking them in any other order can deadlock. The order is checked at
+ * run time when the daemon is configured with --enable-lockcheck.
+ *
+ *   LOCK_RECS      recs_mutex       Pending schedule, repeated recording rules and
+ *                                   ongoing_recs[]. Starting a recording moves the
+ *                                   entry from the schedule to ongoing_recs[] so
+ *                                   both are kept under the same lock.
+ *   LOCK_XMLDB     xmldb_mutex      Writing the XML DB file (tvxmldb.c). Held while
+ *                                   a snapshot is written to disk.
+ *   LOCK_XMLDB_QUEUE xmldb_queue_mutex Requests to write the XML DB and the writer
+ *                                   statistics (tvxmldb.c)
+ *   LOCK_TRANSC    transc_mutex     Ongoing and waiting transcodings (transc.c)
+ *   LOCK_HIST      hist_mutex       Recording history (tvhistory.c)
+ *   LOCK_SNAPSHOT  snapshot_mutex   Published schedule snapshot (recs.c)
+ *   LOCK_STRPOOL   pool_mutex       Shared strings (strpool.c)
+ *
+ * The remaining mutexes (the thread counters in transc.c, the sockets and the
+ * signal state in tvpvrsrv.c etc.) are never held while another lock is taken.
+ */
+enum lock_level {
+    LOCK_RECS = 0,
+    LOCK_XMLDB,
+    LOCK_XMLDB_QUEUE,
+    LOCK_TRANSC,
+    LOCK_HIST,
+    LOCK_SNAPSHOT,
+    LOCK_STRPOOL
+};
+
+#ifdef LOCK_CHECK
+#define lock_acquire(mutex,level) _lock_acquire((mutex),(level),__FUNCTION__,__LINE__)
+#define lock_release(mutex,level) _lock_release((mutex),(level),__FUNCTION__,__LINE__)
+#else
+#define lock_acquire(mutex,level) pthread_mutex_lock(mutex)
+#define lock_release(mutex,level) pthread_mutex_unlock(mutex)
+#endif
+
+/**
+ * Lock a mutex after checking that the calling thread does not already hold a
+ * lock at the same or a later level. A violation is logged and aborts the daemon.
+ * @param mutex
+ * @param level
+ * @param func Calling function
+ * @param line Calling line
+ */
+void
+_lock_acquire(pthread_mutex_t *mutex, enum lock_level level, const char *func, int line);
+
+/**
+ * Unlock a mutex taken with _lock_acquire()
+ * @param mutex
+ * @param level
+ * @param func Calling function
+ * @param line Calling line
+ */
+void
+_lock_release(pthread_mutex_t *mutex, enum lock_level level, const char *func, int line);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* LOCKORDER_H */
+
@@ -0,0 +1,493 @@
+/* =========================================================================
+ * File:        MPEGSCAN.C
+ * Description: Fast scanner for start codes in the MPEG program stream
+ *              from the encoder. Builds an index of the I-frames while
+ *              the stream is captured so that no second pass over the
+ *              recording is needed.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "config.h"
+
+#include "tvpvrd.h"
+#include "utils.h"
+#include "tvplog.h"
+#include "mpegscan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MPEGSCAN_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * MPEGSCAN_PENDING integer
+ * Number of index entries collected before they are written to the index file
+ */
+#define MPEGSCAN_PENDING 128
+
+/*
+ * Picture coding type for an I-frame in the picture header
+ */
+#define MPEG_I_FRAME 1
+
+typedef const unsigned char *(*mpegscan_find_fn)(const unsigned char *p, const unsigned char *end);
+
+static const char *mpegscan_implnames[] = {"scalar", "sse2", "avx2"};
+
+/**
+ * Scalar search for 00 00 01. If the third byte is larger than one no start code
+ * can begin at any of the three bytes so we can step three bytes at a time over
+ * most of the stream.
+ * @param p
+ * @param end
+ * @return Start of the prefix, end if none found
+ */
+static const unsigned char *
+_mpegscan_find_scalar(const unsigned char *p, const unsigned char *end) {
+    while( p + 2 < end ) {
+        if( p[2] > 1 ) {
+            p += 3;
+        } else if( p[2] == 1 && p[1] == 0 && p[0] == 0 ) {
+            return p;
+        } else {
+            p++;
+        }
+    }
+    return end;
+}
+
+#ifdef MPEGSCAN_X86
+
+/**
+ * SSE2 search for 00 00 01. Compares 16 positions at a time by loading the block
+ * at offsets 0, 1 and 2 and checking them against 0, 0 and 1.
+ * @param p
+ * @param end
+ * @return Start of the prefix, end if none found
+ */
+__attribute__((target("sse2")))
+static const unsigned char *
+_mpegscan_find_sse2(const unsigned char *p, const unsigned char *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while( p + 16 + 2 <= end ) {
+        // Most blocks hold no 0x01 at all and are skipped after a single compare
+        const __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + 2)), one);
+        if( _mm_movemask_epi8(c) ) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)p);
+            const __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+            const __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), c);
+            const unsigned mask = (unsigned)_mm_movemask_epi8(m);
+            if( mask ) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        p += 16;
+    }
+    return _mpegscan_find_scalar(p, end);
+}
+
+/**
+ * AVX2 search for 00 00 01. Same method as for SSE2 but 32 positions at a time.
+ * @param p
+ * @param end
+ * @return Start of the prefix, end if none found
+ */
+__attribute__((target("avx2")))
+static const unsigned char *
+_mpegscan_find_avx2(const unsigned char *p, const unsigned char *end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while( p + 32 + 2 <= end ) {
+        const __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + 2)), one);
+        if( _mm256_movemask_epi8(c) ) {
+            const __m256i a = _mm256_loadu_si256((const __m256i *)p);
+            const __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+            const __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)), c);
+            const unsigned mask = (unsigned)_mm256_movemask_epi8(m);
+            if( mask ) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        p += 32;
+    }
+    return _mpegscan_find_scalar(p, end);
+}
+
+#endif
+
+/*
+ * The search used by mpegscan_find(). Set by mpegscan_init()
+ */
+static mpegscan_find_fn mpegscan_findfn = _mpegscan_find_scalar;
+
+/**
+ * Force a specific start code search implementation
+ * @param impl MPEGSCAN_SCALAR, MPEGSCAN_SSE2 or MPEGSCAN_AVX2
+ * @return 0 on success, -1 if the implementation is not supported
+ */
+int
+mpegscan_set_impl(int impl) {
+    switch( impl ) {
+        case MPEGSCAN_SCALAR:
+            mpegscan_findfn = _mpegscan_find_scalar;
+            return 0;
+#ifdef MPEGSCAN_X86
+        case MPEGSCAN_SSE2:
+            __builtin_cpu_init();
+            if( __builtin_cpu_supports("sse2") ) {
+                mpegscan_findfn = _mpegscan_find_sse2;
+                return 0;
+            }
+            break;
+        case MPEGSCAN_AVX2:
+            __builtin_cpu_init();
+            if( __builtin_cpu_supports("avx2") ) {
+                mpegscan_findfn = _mpegscan_find_avx2;
+                return 0;
+            }
+            break;
+#endif
+        default:
+            break;
+    }
+    return -1;
+}
+
+/**
+ * Return the name of a start code search implementation
+ * @param impl
+ * @return Name
+ */
+const char *
+mpegscan_implname(int impl) {
+    if( impl < MPEGSCAN_SCALAR || impl > MPEGSCAN_AVX2 ) {
+        return "unknown";
+    }
+    return mpegscan_implnames[impl];
+}
+
+/**
+ * Select the fastest start code search the CPU supports. Called once before
+ * any scanning is done.
+ */
+void
+mpegscan_init(void) {
+    int impl = MPEGSCAN_AVX2;
+    while( impl > MPEGSCAN_SCALAR && -1 == mpegscan_set_impl(impl) ) {
+        impl--;
+    }
+    if( impl == MPEGSCAN_SCALAR ) {
+        (void)mpegscan_set_impl(MPEGSCAN_SCALAR);
+    }
+    logmsg(LOG_DEBUG,"Using %s search for MPEG start codes",mpegscan_implname(impl));
+}
+
+/**
+ * Find the next start code prefix (00 00 01)
+ * @param p Where to start the search
+ * @param end End of the data
+ * @return Pointer to the first byte of the prefix, end if there is none
+ */
+const unsigned char *
+mpegscan_find(const unsigned char *p, const unsigned char *end) {
+    return mpegscan_findfn(p, end);
+}
+
+/**
+ * Find where to cut the stream so that the next part starts with a new GOP.
+ * That is the pack header of the first pack that holds a sequence or GOP header.
+ * @param buf
+ * @param len
+ * @return Offset of the cut, -1 if there is no suitable cut in the buffer
+ */
+long
+mpegscan_find_cut(const char *buf, size_t len) {
+    const unsigned char *start = (const unsigned char *)buf;
+    const unsigned char *end = start + len;
+    const unsigned char *p = start;
+    long pack = -1;
+
+    while( end - (p = mpegscan_findfn(p, end)) > 3 ) {
+        if( p[3] == MPEG_PACK_START ) {
+            pack = (long)(p - start);
+        } else if( pack != -1 && (p[3] == MPEG_SEQ_START || p[3] == MPEG_GOP_START) ) {
+            return pack;
+        }
+        p += 3;
+    }
+    return -1;
+}
+
+/**
+ * Reset the scanner for a new stream
+ * @param s
+ */
+void
+mpegscan_reset(struct mpegscan *s) {
+    struct mpegscan_entry *pending = s->pending;
+    const int fd = s->fd;
+    CLEAR(*s);
+    s->pending = pending;
+    s->fd = fd;
+}
+
+/**
+ * Write the collected index entries to the index file
+ * @param s
+ * @return 0 on success, -1 on failure
+ */
+static int
+_mpegscan_flush(struct mpegscan *s) {
+    const size_t len = s->npending * sizeof (struct mpegscan_entry);
+    s->npending = 0;
+    if( -1 == s->fd || len == 0 ) {
+        return 0;
+    }
+    if( (ssize_t)len != write(s->fd, s->pending, len) ) {
+        logmsg(LOG_ERR,"Cannot write GOP index. Index disabled for the rest of the recording. ( %d : %s )",
+               errno,strerror(errno));
+        _dbg_close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Start writing an index for the stream
+ * @param s
+ * @param filename Name of the index file
+ * @return 0 on success, -1 on failure
+ */
+int
+mpegscan_open_index(struct mpegscan *s, const char *filename) {
+    s->fd = -1;
+    mpegscan_reset(s);
+    if( s->pending == NULL ) {
+        s->pending = calloc(MPEGSCAN_PENDING, sizeof (struct mpegscan_entry));
+        if( s->pending == NULL ) {
+            logmsg(LOG_ERR,"Cannot allocate memory for GOP index. ( %d : %s )",errno,strerror(errno));
+            return -1;
+        }
+    }
+    s->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( -1 == s->fd ) {
+        logmsg(LOG_ERR,"Cannot create GOP index '%s'. ( %d : %s )",filename,errno,strerror(errno));
+        return -1;
+    }
+    if( sizeof MPEGSCAN_MAGIC != write(s->fd, MPEGSCAN_MAGIC, sizeof MPEGSCAN_MAGIC) ) {
+        logmsg(LOG_ERR,"Cannot write GOP index '%s'. ( %d : %s )",filename,errno,strerror(errno));
+        _dbg_close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write any buffered index entries and close the index file
+ * @param s
+ * @return 0 on success, -1 on failure
+ */
+int
+mpegscan_close_index(struct mpegscan *s) {
+    int ret = _mpegscan_flush(s);
+    if( -1 != s->fd ) {
+        _dbg_close(s->fd);
+        s->fd = -1;
+    }
+    return ret;
+}
+
+/**
+ * Decode the system clock reference in a pack header. Both MPEG-2 and MPEG-1
+ * pack headers are understood.
+ * @param p Start of the pack header (at the 00 00 01 prefix)
+ * @param[out] scr The SCR base in 90kHz units
+ * @return 0 on success, -1 if the header is not recognized
+ */
+static int
+_mpegscan_scr(const unsigned char *p, uint64_t *scr) {
+    if( (p[4] & 0xC0) == 0x40 ) {
+        *scr = ((uint64_t)((p[4] >> 3) & 0x07) << 30) |
+               ((uint64_t)(p[4] & 0x03) << 28) |
+               ((uint64_t)p[5] << 20) |
+               ((uint64_t)((p[6] >> 3) & 0x1F) << 15) |
+               ((uint64_t)(p[6] & 0x03) << 13) |
+               ((uint64_t)p[7] << 5) |
+               ((uint64_t)p[8] >> 3);
+        return 0;
+    } else if( (p[4] & 0xF0) == 0x20 ) {
+        *scr = ((uint64_t)((p[4] >> 1) & 0x07) << 30) |
+               ((uint64_t)p[5] << 22) |
+               ((uint64_t)(p[6] >> 1) << 15) |
+               ((uint64_t)p[7] << 7) |
+               ((uint64_t)p[8] >> 1);
+        return 0;
+    }
+    return -1;
+}
+
+/**
+ * Handle one start code. There are always MPEGSCAN_HOLD bytes available from
+ * the start of the prefix.
+ * @param s
+ * @param p Start of the prefix
+ * @param off Stream offset of the prefix
+ */
+static void
+_mpegscan_code(struct mpegscan *s, const unsigned char *p, uint64_t off) {
+    uint64_t scr;
+
+    switch( p[3] ) {
+        case MPEG_PACK_START:
+            s->pack_off = off;
+            if( 0 == _mpegscan_scr(p, &scr) ) {
+                if( s->npacks > 0 && (scr < s->scr || scr - s->scr > MPEGSCAN_MAX_SCR_JUMP) ) {
+                    s->ndiscont++;
+                    s->last_iscr = scr;
+                }
+                s->scr = scr;
+            }
+            s->npacks++;
+            break;
+
+        case MPEG_SYSTEM_START:
+            s->nsystem++;
+            break;
+
+        case MPEG_SEQ_START:
+        case MPEG_GOP_START:
+            // The first pack with a sequence or GOP header before an I-frame is where
+            // a decoder can start
+            if( s->npacks > 0 && !s->cut_valid ) {
+                s->cut_off = s->pack_off;
+                s->cut_scr = s->scr;
+                s->cut_valid = 1;
+            }
+            break;
+
+        case MPEG_PICTURE_START:
+            s->npictures++;
+            if( ((p[5] >> 3) & 0x07) != MPEG_I_FRAME ) {
+                break;
+            }
+            s->niframes++;
+            if( !s->cut_valid ) {
+                break;
+            }
+            s->cut_valid = 0;
+            if( s->niframes > 1 && s->cut_scr > s->last_iscr && s->cut_scr - s->last_iscr > MPEGSCAN_MAX_GOP ) {
+                s->nstalls++;
+            }
+            s->last_iscr = s->cut_scr;
+            if( -1 != s->fd ) {
+                s->pending[s->npending].offset = s->cut_off;
+                s->pending[s->npending].scr = s->cut_scr;
+                if( ++s->npending == MPEGSCAN_PENDING ) {
+                    (void)_mpegscan_flush(s);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/**
+ * Handle all start codes that begin before limit
+ * @param s
+ * @param buf
+ * @param limit Only prefixes starting before this are handled. There must be
+ * MPEGSCAN_HOLD-1 more bytes in the buffer after limit.
+ * @param off Stream offset of the start of the buffer
+ */
+static void
+_mpegscan_scan(struct mpegscan *s, const unsigned char *buf, size_t limit, uint64_t off) {
+    const unsigned char *end = buf + limit + 2;
+    const unsigned char *p = buf;
+    while( (p = mpegscan_findfn(p, end)) < end ) {
+        _mpegscan_code(s, p, off + (uint64_t)(p - buf));
+        p += 3;
+    }
+}
+
+/**
+ * Scan the next chunk of the stream. A start code is only handled once the
+ * whole header is available so the last bytes of each chunk are held back and
+ * scanned together with the start of the next chunk.
+ * @param s
+ * @param buf
+ * @param len
+ */
+void
+mpegscan_feed(struct mpegscan *s, const char *buf, size_t len) {
+    const unsigned char *data = (const unsigned char *)buf;
+    unsigned char tmp[2*MPEGSCAN_HOLD];
+
+    if( len == 0 ) {
+        return;
+    }
+
+    if( s->nhold > 0 ) {
+        const size_t take = len < MPEGSCAN_HOLD ? len : MPEGSCAN_HOLD;
+        const size_t n = s->nhold + take;
+        memcpy(tmp, s->hold, s->nhold);
+        memcpy(tmp + s->nhold, data, take);
+        if( take == len ) {
+            // The whole chunk fits together with what was held back
+            const size_t limit = n >= MPEGSCAN_HOLD ? n - MPEGSCAN_HOLD + 1 : 0;
+            _mpegscan_scan(s, tmp, limit, s->offset - s->nhold);
+            s->nhold = n - limit;
+            memmove(s->hold, tmp + limit, s->nhold);
+            s->offset += len;
+            return;
+        }
+        _mpegscan_scan(s, tmp, s->nhold, s->offset - s->nhold);
+    } else if( len < MPEGSCAN_HOLD ) {
+        memcpy(s->hold, data, len);
+        s->nhold = len;
+        s->offset += len;
+        return;
+    }
+
+    const size_t limit = len - MPEGSCAN_HOLD + 1;
+    _mpegscan_scan(s, data, limit, s->offset);
+    s->nhold = len - limit;
+    memcpy(s->hold, data + limit, s->nhold);
+    s->offset += len;
+}
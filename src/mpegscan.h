@@ -0,0 +1,204 @@
+/* =========================================================================
+ * File:        MPEGSCAN.H
+ * Description: Fast scanner for start codes in the MPEG program stream
+ *              from the encoder. Builds an index of the I-frames while
+ *              the stream is captured.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef MPEGSCAN_H
+#define	MPEGSCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Start codes (the byte following 00 00 01) we care about
+ */
+#define MPEG_PICTURE_START  0x00
+#define MPEG_SEQ_START      0xB3
+#define MPEG_GOP_START      0xB8
+#define MPEG_PACK_START     0xBA
+#define MPEG_SYSTEM_START   0xBB
+
+/*
+ * Implementations of the start code search
+ */
+#define MPEGSCAN_SCALAR 0
+#define MPEGSCAN_SSE2   1
+#define MPEGSCAN_AVX2   2
+
+/*
+ * MPEGSCAN_HOLD integer
+ * Number of bytes at the end of each chunk that are kept until the next chunk
+ * so that headers split between two chunks can be parsed
+ */
+#define MPEGSCAN_HOLD 12
+
+/*
+ * MPEGSCAN_MAX_SCR_JUMP integer
+ * Largest forward step in the system clock reference between two packs (in
+ * 90kHz units) that is not counted as a discontinuity
+ */
+#define MPEGSCAN_MAX_SCR_JUMP (90000)
+
+/*
+ * MPEGSCAN_MAX_GOP integer
+ * Largest distance in time between two I-frames (in 90kHz units) before the
+ * picture stream is considered to have stalled. The encoder normally gives an
+ * I-frame every half second.
+ */
+#define MPEGSCAN_MAX_GOP (2*90000)
+
+/*
+ * One entry in the index file. The offset is where the pack holding the
+ * sequence/GOP header before the I-frame starts, i.e. where the stream can be
+ * cut or a decoder can start. The timestamp is the system clock reference of
+ * that pack in 90kHz units. Stored in host byte order.
+ */
+struct mpegscan_entry {
+    uint64_t offset;
+    uint64_t scr;
+};
+
+/*
+ * The index file starts with this magic string (including the terminating 0)
+ */
+#define MPEGSCAN_MAGIC "TVPIDX1"
+
+/*
+ * MPEGSCAN_INDEX_SUFFIX string
+ * Appended to the name of the recording to get the name of the index
+ */
+#define MPEGSCAN_INDEX_SUFFIX ".idx"
+
+/*
+ * State of the scanner for one stream. The stream is given in chunks of any
+ * size with mpegscan_feed().
+ */
+struct mpegscan {
+    uint64_t offset;            /* Stream offset of the next byte to be fed */
+    unsigned char hold[MPEGSCAN_HOLD];
+    size_t nhold;
+
+    uint64_t pack_off;          /* Offset of the last pack header */
+    uint64_t scr;               /* System clock reference of the last pack */
+    uint64_t cut_off;           /* Pack with the last sequence/GOP header */
+    uint64_t cut_scr;
+    int cut_valid;
+    uint64_t last_iscr;         /* SCR of the last indexed I-frame */
+
+    unsigned long long npacks;
+    unsigned long long nsystem;
+    unsigned long long npictures;
+    unsigned long long niframes;
+    unsigned long long ndiscont;    /* Jumps in the SCR between two packs */
+    unsigned long long nstalls;     /* I-frames further apart than MPEGSCAN_MAX_GOP */
+
+    int fd;                     /* Index file, -1 if no index is written */
+    struct mpegscan_entry *pending;
+    unsigned npending;
+};
+
+/**
+ * Select the fastest start code search the CPU supports. Called once before
+ * any scanning is done.
+ */
+void
+mpegscan_init(void);
+
+/**
+ * Force a specific start code search implementation
+ * @param impl MPEGSCAN_SCALAR, MPEGSCAN_SSE2 or MPEGSCAN_AVX2
+ * @return 0 on success, -1 if the implementation is not supported
+ */
+int
+mpegscan_set_impl(int impl);
+
+/**
+ * Return the name of a start code search implementation
+ * @param impl
+ * @return Name
+ */
+const char *
+mpegscan_implname(int impl);
+
+/**
+ * Find the next start code prefix (00 00 01)
+ * @param p Where to start the search
+ * @param end End of the data
+ * @return Pointer to the first byte of the prefix, end if there is none
+ */
+const unsigned char *
+mpegscan_find(const unsigned char *p, const unsigned char *end);
+
+/**
+ * Reset the scanner for a new stream
+ * @param s
+ */
+void
+mpegscan_reset(struct mpegscan *s);
+
+/**
+ * Start writing an index for the stream
+ * @param s
+ * @param filename Name of the index file
+ * @return 0 on success, -1 on failure
+ */
+int
+mpegscan_open_index(struct mpegscan *s, const char *filename);
+
+/**
+ * Write any buffered index entries and close the index file
+ * @param s
+ * @return 0 on success, -1 on failure
+ */
+int
+mpegscan_close_index(struct mpegscan *s);
+
+/**
+ * Scan the next chunk of the stream
+ * @param s
+ * @param buf
+ * @param len
+ */
+void
+mpegscan_feed(struct mpegscan *s, const char *buf, size_t len);
+
+/**
+ * Find where to cut the stream so that the next part starts with a new GOP.
+ * That is the pack header of the first pack that holds a sequence or GOP header.
+ * @param buf
+ * @param len
+ * @return Offset of the cut, -1 if there is no suitable cut in the buffer
+ */
+long
+mpegscan_find_cut(const char *buf, size_t len);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* MPEGSCAN_H */
+
@@ -42,6 +42,7 @@
 #include <errno.h>
 #include <sys/param.h> // Needed to get MIN()/MAX()
 #include <time.h>
+#include <pthread.h>
 #include <readline/chardefs.h>
 
 #include "tvpvrd.h"
@@ -55,16 +56,197 @@
 #include "tvplog.h"
 #include "listhtml.h"
 #include "xstr.h"
+#include "itree.h"
+#include "uhash.h"
+#include "strpool.h"
+#include "lockorder.h"
 
 /*
- * recs
- * A two dimensional array with a list of recordings per video stream
- * The REC_IDX macro is a shorthand to get hold of elements in the array
- * since this should be treated as a two-dimensional array
- * The reason this is not implemented as a two dimensional array is that
- * this is dynamically allocated as a single array.
+ * rec_itree
+ * The pending recordings per video stream. Each stream has a balanced tree
+ * ordered by start time (and sequence number) which gives the next recording,
+ * inserts and deletes in O(log n) and is also used to find collisions without
+ * looking at every entry.
  */
-struct recording_entry **recs; // [MAX_VIDEO][MAX_ENTRIES];
+static struct itree *rec_itree = NULL;
+
+/*
+ * seq_index
+ * All pending recordings (on all video streams) keyed on their sequence number
+ */
+static struct uhash seq_index;
+
+/*
+ * series_index
+ * The first pending occurrence of each repeated recording keyed on its
+ * recurrence id. The rest of the occurrences are linked from it.
+ */
+static struct uhash series_index;
+
+/*
+ * excluded_index
+ * The deleted occurrences (struct bitmap) of each repeated recording keyed on
+ * its recurrence id. Kept until neither the rule nor any of its occurrences is
+ * pending since the series is restored from the XML database with them.
+ */
+static struct uhash excluded_index;
+
+struct recording_series {
+    // The first occurrence with the unmangled title and filename
+    struct recording_entry *rule;
+
+    // Recurrence id of the series
+    unsigned id;
+
+    // Occurrence i of the series has sequence number first_seqnbr + i
+    unsigned first_seqnbr;
+
+    // The first occurrence that is not yet in the schedule
+    struct series_iter next;
+
+    // End of the last occurrence. Nothing that starts later can overlap the series.
+    time_t ts_last;
+
+    // Video stream for each occurrence when the series is spread over several
+    // cards. NULL if all occurrences are on the video stream of the rule.
+    unsigned char *cards;
+
+    // Set when the video stream of the next occurrence was full. The series is
+    // not refilled until a recording is removed from that video stream.
+    int blocked;
+    unsigned blocked_video;
+};
+
+/*
+ * series
+ * All repeated recordings sorted on their first sequence number, which is the
+ * order they were created in.
+ */
+static struct recording_series **series = NULL;
+static size_t num_series = 0, size_series = 0;
+
+/*
+ * num_blocked
+ * Number of series that are waiting for room on a video stream
+ */
+static size_t num_blocked = 0;
+
+/*
+ * rule_index
+ * The repeated recordings keyed on their recurrence id
+ */
+static struct uhash rule_index;
+
+/*
+ * snapshot
+ * The latest published snapshot. Only the pointer swap and the reference
+ * counts are protected by snapshot_mutex so readers of an up to date snapshot
+ * never wait for recs_mutex.
+ */
+static struct recs_snapshot *snapshot = NULL;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * snapshot_stale
+ * Set when the schedule has changed since the snapshot was published. Only
+ * changed with recs_mutex held but read without it.
+ */
+static int snapshot_stale = 1;
+
+static void _publish_recs(void);
+
+/*
+ * Take a reference to the latest published snapshot
+ */
+static struct recs_snapshot *
+_snapshot_ref(void) {
+    lock_acquire(&snapshot_mutex, LOCK_SNAPSHOT);
+    struct recs_snapshot *s = snapshot;
+    if( s ) {
+        s->refs++;
+    }
+    lock_release(&snapshot_mutex, LOCK_SNAPSHOT);
+    return s;
+}
+
+/**
+ * Get a reference to a snapshot of the current schedule. A new snapshot is only
+ * taken when the schedule has changed since the last one, which briefly takes
+ * recs_mutex. Must not be called with recs_mutex or any lock after it held.
+ * @return The snapshot
+ */
+struct recs_snapshot *
+recs_snapshot_get(void) {
+    if( __atomic_load_n(&snapshot_stale, __ATOMIC_ACQUIRE) ) {
+        lock_acquire(&recs_mutex, LOCK_RECS);
+        _publish_recs();
+        lock_release(&recs_mutex, LOCK_RECS);
+    }
+    return _snapshot_ref();
+}
+
+/**
+ * Same as recs_snapshot_get() for a caller that already holds recs_mutex
+ * @return The snapshot
+ */
+struct recs_snapshot *
+recs_snapshot_locked(void) {
+    _publish_recs();
+    return _snapshot_ref();
+}
+
+/**
+ * Let go of a reference to a snapshot. The last one frees it.
+ * @param s
+ */
+void
+recs_snapshot_put(struct recs_snapshot *s) {
+    if( s == NULL ) {
+        return;
+    }
+    lock_acquire(&snapshot_mutex, LOCK_SNAPSHOT);
+    const unsigned refs = --s->refs;
+    lock_release(&snapshot_mutex, LOCK_SNAPSHOT);
+    if( refs == 0 ) {
+        for (size_t i = 0; i < s->num; i++) {
+            freerec(s->entries[i]);
+        }
+        free(s->entries);
+        for (size_t i = 0; i < s->num_excluded; i++) {
+            bitmap_free(&s->excluded[i].items);
+        }
+        free(s->excluded);
+        for (size_t i = 0; i < s->num_series; i++) {
+            freerec(s->series[i].rule);
+            free(s->series[i].cards);
+        }
+        free(s->series);
+        free(s);
+    }
+}
+
+/**
+ * Get the deleted occurrences of a repeated recording as they were when the
+ * snapshot was taken
+ * @param s
+ * @param series_id
+ * @return The occurrence numbers, NULL if no occurrence has been deleted
+ */
+const struct bitmap *
+recs_snapshot_excluded(const struct recs_snapshot *s, unsigned series_id) {
+    size_t lo = 0, hi = s->num_excluded;
+    while( lo < hi ) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if( s->excluded[mid].id == series_id ) {
+            return &s->excluded[mid].items;
+        } else if( s->excluded[mid].id < series_id ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
 
 /*
  * num_entries
@@ -104,150 +286,6 @@ set_initial_recurrence_start_number(const int n) {
     initial_recurrence_start_number = n;
 }
 
-/**
- * Check if the submitted entry is colliding/overlapping with an existing
- * entry in the pending recordings for the specified video stream or
- * any ongoing recordings.
- *
- * Return 1 if there is a collision 0 otherwise
- */
-static int
-isentryoverlapping(unsigned video, struct recording_entry* entry) {
-    // Check all existing entries if the start or stop
-    // time is in between the existing start and stop time
-
-    if (entry->recurrence == 0) {
-        // No recurrence
-        for (size_t i = 0; i < num_entries[video]; ++i) {
-            if (entry->ts_start >= recs[REC_IDX(video, i)]->ts_start &&
-                entry->ts_start <= recs[REC_IDX(video, i)]->ts_end) {
-
-                logmsg(LOG_NOTICE,"New entry collides with: '%s'",recs[REC_IDX(video, i)]->title);
-                return 1;
-            }
-
-            if (entry->ts_end >= recs[REC_IDX(video, i)]->ts_start &&
-                entry->ts_end <= recs[REC_IDX(video, i)]->ts_end) {
-
-                logmsg(LOG_NOTICE,"New entry collides with: '%s'",recs[REC_IDX(video, i)]->title);
-                return 1;
-            }
-            if (entry->ts_start < recs[REC_IDX(video, i)]->ts_start &&
-                entry->ts_end > recs[REC_IDX(video, i)]->ts_end) {
-
-                logmsg(LOG_NOTICE,"New entry collides with: '%s'",recs[REC_IDX(video, i)]->title);
-                return 1;
-            }
-        }
-
-        if( ongoing_recs[video] ) {
-            if (entry->ts_start >= ongoing_recs[video]->ts_start &&
-                entry->ts_start <= ongoing_recs[video]->ts_end) {
-
-                logmsg(LOG_DEBUG,"New recurring entry collides with ongoing recording at video=%d",video);
-                return 1;
-            }
-            if (entry->ts_end >= ongoing_recs[video]->ts_start &&
-                entry->ts_end <= ongoing_recs[video]->ts_end) {
-
-                logmsg(LOG_DEBUG,"New recurring entry collides with ongoing recording at video=%d",video);
-                return 1;
-            }
-            if (entry->ts_start < ongoing_recs[video]->ts_start &&
-                entry->ts_end > ongoing_recs[video]->ts_end) {
-
-                logmsg(LOG_DEBUG,"New recurring entry collides with ongoing recording at video=%d",video);
-                return 1;
-            }
-        }
-
-    } else {
-        int sy, sm, sd, sh, smin, ssec;
-        int ey, em, ed, eh, emin, esec;
-
-        int esy, esm, esd, esh, esmin, essec;
-        int eey, eem, eed, eeh, eemin, eesec;
-
-        // Recurrence. This means we need to check all future
-        // recurrences for collisions as well.
-        fromtimestamp(entry->ts_start, &sy, &sm, &sd, &sh, &smin, &ssec);
-        fromtimestamp(entry->ts_end, &ey, &em, &ed, &eh, &emin, &esec);
-        time_t ts_start = entry->ts_start;
-        time_t ts_end = entry->ts_end;
-
-        for (size_t j = 0; j < entry->recurrence_num; j++) {
-
-            for (size_t i = 0; i < num_entries[video]; ++i) {
-                struct recording_entry *e = recs[REC_IDX(video, i)];
-                if (ts_start >= e->ts_start && ts_start <= e->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New recurring entry collides at occurence %d with: '%s' on video %d in position %d",
-                            j,e->title,video,i);
-                    fromtimestamp(e->ts_start, &esy, &esm, &esd, &esh, &esmin, &essec);
-                    fromtimestamp(e->ts_end, &eey, &eem, &eed, &eeh, &eemin, &eesec);
-                    logmsg(LOG_DEBUG,"[e->ts_start=%u, e->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d-%02d/%02d)",
-                                      e->ts_start,e->ts_end,esh,esmin,eeh,eemin,esd,esm,eed,eem);
-                    logmsg(LOG_DEBUG,"[entry->ts_start=%u, entry->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d)",
-                                      ts_start,ts_end,sh,smin,eh,emin,sd,sm);
-                    return 1;
-                }
-                if (ts_end >= e->ts_start && ts_end <= e->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New recurring entry collides at occurence %d with: '%s' on video %d in position %d",
-                            j,e->title,video,i);
-                    fromtimestamp(e->ts_start, &esy, &esm, &esd, &esh, &esmin, &essec);
-                    fromtimestamp(e->ts_end, &eey, &eem, &eed, &eeh, &eemin, &eesec);
-                    logmsg(LOG_DEBUG,"[e->ts_start=%u, e->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d-%02d/%02d)",
-                                      e->ts_start,e->ts_end,esh,esmin,eeh,eemin,esd,esm,eed,eem);
-                    logmsg(LOG_DEBUG,"[entry->ts_start=%u, entry->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d)",
-                                      ts_start,ts_end,sh,smin,eh,emin,sd,sm);
-                    return 1;
-                }
-                if (ts_start < e->ts_start && ts_end > e->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New recurring entry collides at occurence %d with: '%s' on video %d in position %d",
-                            j,e->title,video,i);
-                    fromtimestamp(e->ts_start, &esy, &esm, &esd, &esh, &esmin, &essec);
-                    fromtimestamp(e->ts_end, &eey, &eem, &eed, &eeh, &eemin, &eesec);
-                    logmsg(LOG_DEBUG,"[e->ts_start=%u, e->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d-%02d/%02d)",
-                                      e->ts_start,e->ts_end,esh,esmin,eeh,eemin,esd,esm,eed,eem);
-                    logmsg(LOG_DEBUG,"[entry->ts_start=%u, entry->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d)",
-                                      ts_start,ts_end,sh,smin,eh,emin,sd,sm);
-                    return 1;
-                }
-            }
-
-            if( ongoing_recs[video] ) {
-                if (ts_start >= ongoing_recs[video]->ts_start && ts_start <= ongoing_recs[video]->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New entry collides at occurrence %d with ongoing recording at video=%d",j,video);
-                    return 1;
-                }
-                if (ts_end >= ongoing_recs[video]->ts_start && ts_end <= ongoing_recs[video]->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New entry collides at occurrence %d with ongoing recording at video=%d",j,video);
-                    return 1;
-                }
-
-                if (ts_start < ongoing_recs[video]->ts_start && ts_end > ongoing_recs[video]->ts_end) {
-
-                    logmsg(LOG_DEBUG,"New entry collides at occurrence %d with ongoing recording at video=%d",j,video);
-                    return 1;
-                }
-            }
-
-            // Prepare to check next recurrency
-            increcdays(entry->recurrence_type,
-                    &ts_start, &ts_end,
-                    &sy, &sm, &sd, &sh, &smin, &ssec,
-                    &ey, &em, &ed, &eh, &emin, &esec);
-        }
-
-    }
-
-    return 0;
-}
-
 /* ----------------------------------------------------------------------------------
  * Routines to manage the list of pending recordings for each
  * video stream.
@@ -259,14 +297,22 @@ isentryoverlapping(unsigned video, struct recording_entry* entry) {
  */
 void
 initrecs(void) {
-    recs            = (struct recording_entry **) calloc(max_video, max_entries * sizeof (struct recording_entry *));
     ongoing_recs    = (struct recording_entry **) calloc(max_video, sizeof (struct recording_entry *));
     num_entries     = (unsigned *) calloc(max_video, sizeof (int));
+    rec_itree       = (struct itree *) calloc(max_video, sizeof (struct itree));
 
-    if( recs == NULL || ongoing_recs == NULL || num_entries == NULL ) {
+    if( ongoing_recs == NULL || num_entries == NULL || rec_itree == NULL ||
+        -1 == uhash_init(&seq_index) || -1 == uhash_init(&series_index) ||
+        -1 == uhash_init(&rule_index) || -1 == uhash_init(&excluded_index) ) {
         fprintf(stderr,"FATAL: Out of memory. Aborting program.\n");
         exit(EXIT_FAILURE);
     }
+    for (unsigned i = 0; i < max_video; ++i) {
+        itree_init(&rec_itree[i]);
+    }
+
+    // Start out with an empty snapshot so there is always one to read
+    _publish_recs();
 }
 
 /**
@@ -276,14 +322,38 @@ void
 freerecs(void) {
 
     for (unsigned i = 0; i < max_video; ++i) {
-        for (unsigned j = 0; j < num_entries[i]; ++j) {
-            if( recs[REC_IDX(i,j)] ) {
-                freerec(recs[REC_IDX(i,j)]);
-                recs[REC_IDX(i,j)] = NULL ;
-            }
+        struct itree_iter it;
+        for (struct recording_entry *e = rec_iter_first(i, &it); e; e = rec_iter_next(&it)) {
+            freerec(e);
         }
+        itree_clear(&rec_itree[i]);
     }
-    free(recs);
+    free(rec_itree);
+    uhash_free(&seq_index);
+    uhash_free(&series_index);
+
+    for (size_t i = 0; i < num_series; ++i) {
+        freerec(series[i]->rule);
+        free(series[i]->cards);
+        free(series[i]);
+    }
+    free(series);
+    series = NULL;
+    num_blocked = 0;
+    num_series = size_series = 0;
+    uhash_free(&rule_index);
+
+    for (size_t i = 0; i < excluded_index.size; ++i) {
+        if( excluded_index.vals[i] ) {
+            bitmap_free(excluded_index.vals[i]);
+            free(excluded_index.vals[i]);
+        }
+    }
+    uhash_free(&excluded_index);
+
+    recs_snapshot_put(snapshot);
+    snapshot = NULL;
+    __atomic_store_n(&snapshot_stale, 1, __ATOMIC_RELEASE);
 
     for (unsigned i = 0; i < max_video; ++i) {
         if( ongoing_recs[i] ) {
@@ -296,66 +366,110 @@ freerecs(void) {
 }
 
 /**
- * Free a single recording entry
+ * Let go of a recording entry. The memory is freed when the last holder of a
+ * shared entry lets go of it.
  * @param entry Pointer to record entry to erase
- * @param caller String for name of caller (used for enhanced memory debugging)
  */
 void 
-freerec(struct recording_entry *entry ) { // ,char *caller) {
-    //logmsg(LOG_DEBUG,"freerec() called from '%s'",caller);
+freerec(struct recording_entry *entry ) {
+    if( __atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) > 0 ) {
+        return;
+    }
     for(int i=0; i < REC_MAX_TPROFILES ; i++) {
-        free(entry->transcoding_profiles[i]);
+        strpool_put(entry->transcoding_profiles[i]);
     }
+    strpool_put(entry->channel);
+    strpool_put(entry->recurrence_filename);
+    strpool_put(entry->recurrence_title);
     free(entry);
 }
 
-/**
- * Create a new record from the given fields. This will in essence create a new
- * entry for a TV-program recording
+/*
+ * Take one more reference to a recording entry, see freerec()
+ * @return The entry
  */
-struct recording_entry *
-newrec(const char *title, const char *filename, const time_t start,
+static struct recording_entry *
+_holdrec(struct recording_entry *entry) {
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+    return entry;
+}
+
+/*
+ * Get the shared copy of a string cut to at most maxlen-1 characters
+ * @return The shared copy, NULL if out of memory
+ */
+static char *
+_intern(const char *str, size_t maxlen) {
+    char buff[REC_MAX_NTITLE];
+    const size_t len = strnlen(str, MIN(maxlen, sizeof(buff)) - 1);
+    memcpy(buff, str, len);
+    buff[len] = '\0';
+    return strpool_get(buff);
+}
+
+/*
+ * Create a new record from the given fields with the start number 1. Unlike
+ * newrec() no global state is used so it can be called without recs_mutex.
+ * @return The new entry, NULL if out of memory
+ */
+static struct recording_entry *
+_allocrec(const char *title, const char *filename, const time_t start,
         const time_t end, const char *channel, const int recurrence,
         const int recurrence_type, const unsigned recurrence_num,
         const int recurrence_mangling,
         char *profiles[]) {
 
+    // The title and filename are stored after the structure, cut to the
+    // same maximum length as before
+    const size_t tlen = strnlen(title, REC_MAX_NTITLE - 1);
+    const size_t flen = strnlen(filename, REC_MAX_NFILENAME - 1);
     struct recording_entry* ptr = 
-        (struct recording_entry *) calloc(1, sizeof (struct recording_entry));
+        (struct recording_entry *) calloc(1, sizeof (struct recording_entry) + tlen + flen + 2);
     if (ptr == NULL) {
         logmsg(LOG_ERR, "Failed to allocate new entry due to no memory left.");
         return NULL;
     }
+    ptr->refs = 1;
 
-    int i;
-    for(i=0; i < REC_MAX_TPROFILES ; i++) {
-        ptr->transcoding_profiles[i] = calloc(1,REC_MAX_TPROFILE_LEN);
-    }
+    ptr->title = ptr->strings;
+    memcpy(ptr->title, title, tlen);
+    ptr->title[tlen] = '\0';
 
+    ptr->filename = ptr->title + tlen + 1;
+    memcpy(ptr->filename, filename, flen);
+    ptr->filename[flen] = '\0';
+
+    int i;
     for(i=0; i < REC_MAX_TPROFILES && profiles[i] && strnlen(profiles[i],REC_MAX_TPROFILE_LEN) > 0; i++) {
-        strncpy(ptr->transcoding_profiles[i],profiles[i],REC_MAX_TPROFILE_LEN-1);
-        ptr->transcoding_profiles[i][REC_MAX_TPROFILE_LEN-1] = '\0';
+        ptr->transcoding_profiles[i] = _intern(profiles[i], REC_MAX_TPROFILE_LEN);
     }
     
     if( i == 0 ) {
-        strncpy(ptr->transcoding_profiles[0],default_transcoding_profile,REC_MAX_TPROFILE_LEN-1);
-        ptr->transcoding_profiles[0][REC_MAX_TPROFILE_LEN-1] = '\0';
+        ptr->transcoding_profiles[i++] = _intern(default_transcoding_profile, REC_MAX_TPROFILE_LEN);
     }
 
-    // This will be updated after a successful insertrec()
-    ptr->seqnbr = -1;
+    for(; i < REC_MAX_TPROFILES ; i++) {
+        ptr->transcoding_profiles[i] = strpool_get("");
+    }
+
+    ptr->channel = _intern(channel, REC_MAX_NCHANNEL);
 
-    // Secure that the string is 0 terminated in case it has been
-    // truncated by the max length. Remember that strncpy() will not
-    // set a 0 in case the string is truncated.
-    strncpy(ptr->title, title, REC_MAX_NTITLE - 1);
-    ptr->title[REC_MAX_NTITLE - 1] = 0;
+    // Set by the series for each occurrence of a repeated recording
+    ptr->recurrence_filename = strpool_get("");
+    ptr->recurrence_title = strpool_get("");
 
-    strncpy(ptr->filename, filename, REC_MAX_NFILENAME - 1);
-    ptr->filename[REC_MAX_NFILENAME - 1] = 0;
+    int nomem = ptr->channel == NULL || ptr->recurrence_filename == NULL || ptr->recurrence_title == NULL;
+    for(i=0; i < REC_MAX_TPROFILES ; i++) {
+        nomem |= ptr->transcoding_profiles[i] == NULL;
+    }
+    if( nomem ) {
+        logmsg(LOG_ERR, "Failed to allocate new entry due to no memory left.");
+        freerec(ptr);
+        return NULL;
+    }
 
-    strncpy(ptr->channel, channel, REC_MAX_NCHANNEL - 1);
-    ptr->channel[REC_MAX_NCHANNEL - 1] = 0;
+    // This will be updated after a successful insertrec()
+    ptr->seqnbr = -1;
 
     strncpy(ptr->recurrence_mangling_prefix, "_", REC_MAX_NPREFIX - 1);
     ptr->recurrence_mangling_prefix[REC_MAX_NPREFIX - 1] = 0;
@@ -378,6 +492,29 @@ newrec(const char *title, const char *filename, const time_t start,
     // Mangling type.
     ptr->recurrence_mangling = recurrence_mangling;
 
+    ptr->recurrence_start_number = 1;
+
+    return ptr;
+}
+
+/**
+ * Create a new record from the given fields. This will in essence create a new
+ * entry for a TV-program recording
+ */
+struct recording_entry *
+newrec(const char *title, const char *filename, const time_t start,
+        const time_t end, const char *channel, const int recurrence,
+        const int recurrence_type, const unsigned recurrence_num,
+        const int recurrence_mangling,
+        char *profiles[]) {
+
+    struct recording_entry *ptr = _allocrec(title, filename, start, end, channel, recurrence,
+                                            recurrence_type, recurrence_num, recurrence_mangling,
+                                            profiles);
+    if( ptr == NULL ) {
+        return NULL;
+    }
+
     // The initial number to use in the title mangling of a repeated sequence
     ptr->recurrence_start_number = initial_recurrence_start_number;
     
@@ -390,7 +527,7 @@ newrec(const char *title, const char *filename, const time_t start,
 
 /*
  * Comparison function for qsort in order to sort the list of recordings
- * (per video stream) in order of start timestamp
+ * (per video stream) in order of start timestamp and then sequence number
  */
 int
 _cmprec(const void *r1, const void *r2) {
@@ -400,16 +537,152 @@ _cmprec(const void *r1, const void *r2) {
         return -1;
     else if (e1->ts_start > e2->ts_start)
         return 1;
+    else if (e1->seqnbr != e2->seqnbr)
+        return e1->seqnbr < e2->seqnbr ? -1 : 1;
     else
         return 0;
 }
 
+/**
+ * Return the next pending recording on the video stream
+ * @param video
+ * @return The recording with the earliest start, NULL if there is none
+ */
+struct recording_entry *
+rec_top(const unsigned video) {
+    return itree_first(&rec_itree[video]);
+}
+
+/**
+ * Start iterating over the pending recordings on the video stream in order of
+ * start time. The schedule must not be changed during the iteration.
+ * @param video
+ * @param it
+ * @return The first recording, NULL if there is none
+ */
+struct recording_entry *
+rec_iter_first(const unsigned video, struct itree_iter *it) {
+    return itree_iter_first(&rec_itree[video], it);
+}
+
+/**
+ * Step to the next pending recording
+ * @param it
+ * @return The next recording, NULL at the end
+ */
+struct recording_entry *
+rec_iter_next(struct itree_iter *it) {
+    return itree_iter_next(it);
+}
+
 /*
- * Sort list of pending recordings according to start timestamp
+ * Note that the schedule has changed. The scheduler is woken up so it can
+ * recalculate when to wake up next. A new snapshot is taken the next time one
+ * is asked for.
  */
-void
-sortrecs(const unsigned video) {
-    qsort(&recs[video * max_entries], (size_t)num_entries[video], sizeof (struct recording_entry *), _cmprec);
+static void
+_recs_changed(void) {
+    __atomic_store_n(&snapshot_stale, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&recs_cond);
+}
+
+/*
+ * Total number of pending recordings on all video streams
+ */
+static size_t
+_total_entries(void) {
+    size_t n = 0;
+    for (unsigned video = 0; video < max_video; video++) {
+        n += num_entries[video];
+    }
+    return n;
+}
+
+/*
+ * Add a recording last in the list of pending occurrences of its series
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_series_add(struct recording_entry *entry) {
+    struct recording_entry *head = uhash_get(&series_index, entry->recurrence_id);
+    if( head == NULL ) {
+        if( -1 == uhash_put(&series_index, entry->recurrence_id, entry) ) {
+            return -1;
+        }
+        entry->series_next = NULL;
+        entry->series_prev = entry;
+    } else {
+        struct recording_entry *tail = head->series_prev;
+        tail->series_next = entry;
+        entry->series_prev = tail;
+        entry->series_next = NULL;
+        head->series_prev = entry;
+    }
+    return 0;
+}
+
+/*
+ * Unlink a recording from the list of pending occurrences of its series
+ */
+static void
+_series_remove(struct recording_entry *entry) {
+    struct recording_entry *head = uhash_get(&series_index, entry->recurrence_id);
+    if( head == entry ) {
+        struct recording_entry *next = entry->series_next;
+        if( next == NULL ) {
+            (void)uhash_del(&series_index, entry->recurrence_id);
+        } else {
+            next->series_prev = entry->series_prev;
+            (void)uhash_put(&series_index, entry->recurrence_id, next);
+        }
+    } else if( head ) {
+        entry->series_prev->series_next = entry->series_next;
+        if( entry->series_next ) {
+            entry->series_next->series_prev = entry->series_prev;
+        } else {
+            head->series_prev = entry->series_prev;
+        }
+    }
+    entry->series_next = NULL;
+    entry->series_prev = NULL;
+}
+
+/*
+ * Free the deleted occurrences of a repeated recording once neither the rule
+ * nor any occurrence is left
+ */
+static void
+_excluded_forget(unsigned id) {
+    struct bitmap *b = uhash_get(&excluded_index, id);
+    if( b && uhash_get(&rule_index, id) == NULL && uhash_get(&series_index, id) == NULL ) {
+        (void)uhash_del(&excluded_index, id);
+        bitmap_free(b);
+        free(b);
+    }
+}
+
+/*
+ * Store a recording in the schedule for the video stream without checking the
+ * maximum number of entries
+ */
+static int
+_storerec(unsigned video, struct recording_entry* entry) {
+
+    if( -1 == itree_insert(&rec_itree[video], entry->ts_start, entry->ts_end, entry->seqnbr, entry) ) {
+        logmsg(LOG_ERR, "Can not store recording on video %d. Out of memory.",video);
+        return 0;
+    }
+    if( -1 == uhash_put(&seq_index, entry->seqnbr, entry) ||
+        (entry->recurrence_id && -1 == _series_add(entry)) ) {
+        (void)itree_remove(&rec_itree[video], entry->ts_start, entry->seqnbr);
+        (void)uhash_del(&seq_index, entry->seqnbr);
+        logmsg(LOG_ERR, "Can not store recording on video %d. Out of memory.",video);
+        return 0;
+    }
+    entry->video = video;
+    num_entries[video]++;
+    _recs_changed();
+    return 1;
 }
 
 /*
@@ -423,11 +696,7 @@ _insertrec(unsigned video, struct recording_entry* entry) {
         logmsg(LOG_ERR, "Can not store more recordings on video %d. Maximum %d allowed.",video, max_entries);
         return 0;
     }
-    entry->video = video;
-    recs[REC_IDX(video, num_entries[video])] = entry;
-    num_entries[video]++;
-    sortrecs(video);
-    return 1;
+    return _storerec(video, entry);
 }
 
 /**
@@ -463,139 +732,1339 @@ rec_title_mangling(struct recording_entry *entry, size_t num, char *orgname, cha
                     (int)num + entry->recurrence_start_number);
             break;
 
-        default:
-            logmsg(LOG_ERR,"Unknown name mangling type (%d) for recording '%s' on %d-%02d-%02d",
-                   entry->recurrence_mangling, orgname,sy,sm,sd);
-            return -1;            
-            break;
+        default:
+            logmsg(LOG_ERR,"Unknown name mangling type (%d) for recording '%s' on %d-%02d-%02d",
+                   entry->recurrence_mangling, orgname,sy,sm,sd);
+            return -1;            
+            break;
+    }
+    return 0;
+    
+}
+
+/* ----------------------------------------------------------------------------------
+ * Repeated recordings are kept as a rule. Only the occurrences that start within
+ * series_horizon days, and always the first pending occurrence, are stored as
+ * entries in the schedule. The later occurrences are generated from the rule when
+ * they are needed and are added to the schedule by refill_series() as time goes by.
+ * ----------------------------------------------------------------------------------
+ */
+
+/*
+ * Position an iterator at the first occurrence of the series
+ */
+static void
+_series_iter_init(const struct recording_series *s, struct series_iter *it) {
+    it->idx = 0;
+    it->ts_start = s->rule->ts_start;
+    it->ts_end = s->rule->ts_end;
+    fromtimestamp(it->ts_start, &it->sy, &it->sm, &it->sd, &it->sh, &it->smin, &it->ssec);
+    fromtimestamp(it->ts_end, &it->ey, &it->em, &it->ed, &it->eh, &it->emin, &it->esec);
+}
+
+/*
+ * Step an iterator to the following occurrence, deleted or not
+ * @return 0 on success, -1 if the date could not be calculated
+ */
+static int
+_series_step(const struct recording_series *s, struct series_iter *it) {
+    if( ++it->idx >= s->rule->recurrence_num ) {
+        return 0;
+    }
+    if( -1 == increcdays(s->rule->recurrence_type,
+                         &it->ts_start, &it->ts_end,
+                         &it->sy, &it->sm, &it->sd, &it->sh, &it->smin, &it->ssec,
+                         &it->ey, &it->em, &it->ed, &it->eh, &it->emin, &it->esec) ) {
+        it->idx = s->rule->recurrence_num;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Skip past the occurrences in the set of deleted occurrences
+ * @param s
+ * @param excluded The deleted occurrences, NULL if there are none
+ * @param it
+ * @return 1 if the iterator is at a pending occurrence, 0 at the end of the series
+ */
+static int
+_series_skip(const struct recording_series *s, const struct bitmap *excluded, struct series_iter *it) {
+    while( it->idx < s->rule->recurrence_num ) {
+        if( excluded == NULL || !bitmap_test(excluded, it->idx + s->rule->recurrence_start_number) ) {
+            return 1;
+        }
+        (void)_series_step(s, it);
+    }
+    return 0;
+}
+
+/*
+ * Skip past the occurrences that have been deleted from the series
+ * @return 1 if the iterator is at a pending occurrence, 0 at the end of the series
+ */
+static int
+_series_valid(const struct recording_series *s, struct series_iter *it) {
+    return _series_skip(s, uhash_get(&excluded_index, s->id), it);
+}
+
+/*
+ * Step an iterator to the next pending occurrence
+ * @return 1 if the iterator is at a pending occurrence, 0 at the end of the series
+ */
+static int
+_series_next(const struct recording_series *s, struct series_iter *it) {
+    return -1 != _series_step(s, it) && _series_valid(s, it);
+}
+
+/*
+ * Position an iterator at the occurrence with the given index if it is one that
+ * is not yet in the schedule
+ * @return 1 if found, 0 otherwise
+ */
+static int
+_series_seek(const struct recording_series *s, unsigned idx, struct series_iter *it) {
+    *it = s->next;
+    int ok = _series_valid(s, it);
+    while( ok && it->idx < idx ) {
+        ok = _series_next(s, it);
+    }
+    return ok && it->idx == idx;
+}
+
+/*
+ * The video stream an occurrence of the series is recorded on
+ */
+static unsigned
+_series_card(const struct recording_series *s, unsigned idx) {
+    return s->cards ? s->cards[idx] : s->rule->video;
+}
+
+/*
+ * Create the recording entry for the occurrence the iterator is at. Only the
+ * series is read so it can also be called for the rule in a snapshot.
+ * @return The new entry, NULL if out of memory
+ */
+static struct recording_entry *
+_series_newrec(const struct recording_series *s, const struct series_iter *it) {
+    struct recording_entry *r = s->rule;
+    char bnamecore[256], filename_mangling[256];
+    char titlebuff[512], filenamebuff[512], bname_buffer[256], dname_buffer[256];
+
+    strncpy(bname_buffer, r->filename, 255);
+    bname_buffer[255] = '\0';
+    char *bname = basename(bname_buffer);
+
+    strncpy(dname_buffer, r->filename, 255);
+    dname_buffer[255] = '\0';
+    char *dname = dirname(dname_buffer);
+
+    char *filetype = strchr(bname, '.');
+    if( filetype == NULL ) {
+        filetype = bname + strlen(bname);
+    }
+    size_t len = (size_t)MIN((filetype - bname), 255);
+    strncpy(bnamecore, bname, len);
+    bnamecore[len] = 0;
+
+    (void)rec_title_mangling(r,it->idx,r->title,titlebuff,sizeof(titlebuff));
+    (void)rec_title_mangling(r,it->idx,bnamecore,filename_mangling,sizeof(filename_mangling));
+    snprintf(filenamebuff, 512, "%s/%s%s", dname, filename_mangling, filetype);
+
+    struct recording_entry *e = _allocrec(titlebuff, filenamebuff,
+                                          it->ts_start, it->ts_end,
+                                          r->channel, r->recurrence,
+                                          r->recurrence_type,
+                                          r->recurrence_num - it->idx,
+                                          r->recurrence_mangling,
+                                          r->transcoding_profiles);
+    if( e == NULL ) {
+        return NULL;
+    }
+
+    e->seqnbr = s->first_seqnbr + it->idx;
+    e->recurrence_id = s->id;
+    e->recurrence_start_number = it->idx + r->recurrence_start_number;
+    e->video = _series_card(s, it->idx);
+
+    // Store an unmangled filename and title with the recording. They are the
+    // same for all occurrences so they are shared.
+    strpool_put(e->recurrence_filename);
+    e->recurrence_filename = _intern(bname, REC_MAX_NFILENAME);
+    strpool_put(e->recurrence_title);
+    e->recurrence_title = _intern(r->title, REC_MAX_NTITLE);
+    if( e->recurrence_filename == NULL || e->recurrence_title == NULL ) {
+        freerec(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+/*
+ * Add a new series last in the list of series
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_series_store(struct recording_series *s) {
+    if( num_series == size_series ) {
+        const size_t size = size_series ? 2*size_series : 16;
+        struct recording_series **tmp = realloc(series, size * sizeof (struct recording_series *));
+        if( tmp == NULL ) {
+            return -1;
+        }
+        series = tmp;
+        size_series = size;
+    }
+    if( -1 == uhash_put(&rule_index, s->id, s) ) {
+        return -1;
+    }
+    series[num_series++] = s;
+    _recs_changed();
+    return 0;
+}
+
+/*
+ * Position in the list of series of the series that holds the sequence number
+ * @return Index of the last series with a first sequence number <= seqnbr
+ */
+static size_t
+_series_pos(unsigned seqnbr) {
+    size_t lo = 0, hi = num_series;
+    while( lo < hi ) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if( series[mid]->first_seqnbr <= seqnbr ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+/*
+ * Find the series that owns a sequence number
+ * @return The series, NULL if the sequence number is not part of a series
+ */
+static struct recording_series *
+_series_byseqnbr(unsigned seqnbr) {
+    if( num_series == 0 || series[0]->first_seqnbr > seqnbr ) {
+        return NULL;
+    }
+    struct recording_series *s = series[_series_pos(seqnbr)];
+    return seqnbr - s->first_seqnbr < s->rule->recurrence_num ? s : NULL;
+}
+
+/*
+ * Remove a series from the list of series and free it. Occurrences already in
+ * the schedule are not touched.
+ */
+static void
+_series_drop(struct recording_series *s) {
+    const size_t i = _series_pos(s->first_seqnbr);
+    memmove(&series[i], &series[i+1], (num_series - i - 1) * sizeof (struct recording_series *));
+    num_series--;
+    (void)uhash_del(&rule_index, s->id);
+    _recs_changed();
+    if( s->blocked ) {
+        num_blocked--;
+    }
+    if( s->rule ) {
+        freerec(s->rule);
+    }
+    free(s->cards);
+    free(s);
+}
+
+/*
+ * Add the next pending occurrence of the series to the schedule. The first
+ * pending occurrence of a series is always stored even if the schedule is full.
+ * If there is no room for the occurrence the series is marked as blocked.
+ * @return 1 on success, 0 otherwise
+ */
+static int
+_series_fill_one(struct recording_series *s) {
+    if( s->blocked ) {
+        return 0;
+    }
+    const unsigned video = _series_card(s, s->next.idx);
+    if( num_entries[video] >= max_entries && uhash_get(&series_index, s->id) != NULL ) {
+        logmsg(LOG_NOTICE, "No room for more occurrences of '%s' on video %d. Maximum %d allowed. "
+               "Waiting until a recording is removed from the card.",s->rule->title,video,max_entries);
+        s->blocked = 1;
+        s->blocked_video = video;
+        num_blocked++;
+        return 0;
+    }
+    struct recording_entry *e = _series_newrec(s, &s->next);
+    if( e == NULL ) {
+        return 0;
+    }
+    if( !_storerec(video, e) ) {
+        freerec(e);
+        return 0;
+    }
+    (void)_series_next(s, &s->next);
+    return 1;
+}
+
+/*
+ * Add the pending occurrences of the series that start before horizon to the
+ * schedule
+ */
+static void
+_series_fill(struct recording_series *s, time_t horizon) {
+    while( _series_valid(s, &s->next) &&
+           (s->next.ts_start <= horizon || uhash_get(&series_index, s->id) == NULL) &&
+           _series_fill_one(s) ) {
+        // Empty
+    }
+}
+
+/*
+ * The latest start of an occurrence that is added to the schedule
+ */
+static time_t
+_series_horizon(void) {
+    return time(NULL) + (time_t)series_horizon * 24 * 3600;
+}
+
+/**
+ * Add the occurrences of the repeated recordings that start within the series
+ * horizon to the schedule. This is called regularly so the schedule keeps up
+ * as time goes by.
+ * @param now
+ */
+void
+refill_series(time_t now) {
+    const time_t horizon = now + (time_t)series_horizon * 24 * 3600;
+    for (size_t i = 0; i < num_series; i++) {
+        _series_fill(series[i], horizon);
+    }
+}
+
+/**
+ * Time when the next occurrence of a repeated recording comes within the series
+ * horizon and has to be added to the schedule
+ * @return The time, 0 if there is no such occurrence
+ */
+time_t
+series_next_refill(void) {
+    time_t t = 0;
+    for (size_t i = 0; i < num_series; i++) {
+        if( !series[i]->blocked && _series_valid(series[i], &series[i]->next) ) {
+            const time_t r = series[i]->next.ts_start - (time_t)series_horizon * 24 * 3600;
+            if( t == 0 || r < t ) {
+                t = r;
+            }
+        }
+    }
+    return t;
+}
+
+/*
+ * Make a private copy of a recording. The shared strings are shared with the
+ * original.
+ * @return The copy, NULL if out of memory
+ */
+static struct recording_entry *
+_copyrec(const struct recording_entry *e) {
+    const size_t tlen = strlen(e->title);
+    const size_t flen = strlen(e->filename);
+    struct recording_entry *c = malloc(sizeof (struct recording_entry) + tlen + flen + 2);
+    if( c == NULL ) {
+        return NULL;
+    }
+    *c = *e;
+    c->title = c->strings;
+    memcpy(c->title, e->title, tlen + 1);
+    c->filename = c->title + tlen + 1;
+    memcpy(c->filename, e->filename, flen + 1);
+    c->channel = strpool_dup(e->channel);
+    for (int i = 0; i < REC_MAX_TPROFILES; i++) {
+        c->transcoding_profiles[i] = strpool_dup(e->transcoding_profiles[i]);
+    }
+    c->recurrence_filename = strpool_dup(e->recurrence_filename);
+    c->recurrence_title = strpool_dup(e->recurrence_title);
+    c->series_next = NULL;
+    c->series_prev = NULL;
+    c->refs = 1;
+    return c;
+}
+
+/*
+ * Collect references to all pending recordings on all video streams in order of
+ * start time. The schedule of each video stream is already in order so they are
+ * merged.
+ * @param[out] num Number of recordings
+ * @return Array with the recordings
+ */
+static struct recording_entry **
+_gather_recs(size_t *num) {
+    const size_t n = _total_entries();
+    struct recording_entry **entries = calloc(n + 1, sizeof (struct recording_entry *));
+    struct recording_entry **top = calloc(max_video, sizeof (struct recording_entry *));
+    struct itree_iter *it = calloc(max_video, sizeof (struct itree_iter));
+    if( entries == NULL || top == NULL || it == NULL ) {
+        logmsg(LOG_ERR,"_gather_recs() : Out of memory. Aborting program.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (unsigned video = 0; video < max_video; video++) {
+        top[video] = rec_iter_first(video, &it[video]);
+    }
+    for (size_t k = 0; k < n; k++) {
+        unsigned first = max_video;
+        for (unsigned video = 0; video < max_video; video++) {
+            if( top[video] && (first == max_video || _cmprec(&top[video], &top[first]) < 0) ) {
+                first = video;
+            }
+        }
+        entries[k] = _holdrec(top[first]);
+        top[first] = rec_iter_next(&it[first]);
+    }
+
+    free(top);
+    free(it);
+    *num = n;
+    return entries;
+}
+
+static int
+_cmpexcluded(const void *e1, const void *e2) {
+    const unsigned id1 = ((const struct snapshot_excluded *)e1)->id;
+    const unsigned id2 = ((const struct snapshot_excluded *)e2)->id;
+    return id1 < id2 ? -1 : id1 > id2;
+}
+
+/*
+ * Collect copies of the deleted occurrences of all repeated recordings sorted
+ * on the recurrence id
+ * @param[out] num Number of repeated recordings
+ * @return Array with the deleted occurrences
+ */
+static struct snapshot_excluded *
+_gather_excluded(size_t *num) {
+    size_t k = 0;
+    struct snapshot_excluded *excluded = calloc(excluded_index.num + 1, sizeof (struct snapshot_excluded));
+    if( excluded == NULL ) {
+        logmsg(LOG_ERR,"_gather_excluded() : Out of memory. Aborting program.");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < excluded_index.size; ++i) {
+        if( excluded_index.vals[i] && 0 == bitmap_copy(&excluded[k].items, excluded_index.vals[i]) ) {
+            excluded[k++].id = excluded_index.keys[i];
+        }
+    }
+    qsort(excluded, k, sizeof (struct snapshot_excluded), _cmpexcluded);
+    *num = k;
+    return excluded;
+}
+
+/*
+ * Collect references to the rules of all repeated recordings in the order they
+ * were created
+ * @param[out] num Number of repeated recordings
+ * @return Array with the rules
+ */
+static struct snapshot_series *
+_gather_series(size_t *num) {
+    size_t k = 0;
+    struct snapshot_series *ss = calloc(num_series + 1, sizeof (struct snapshot_series));
+    if( ss == NULL ) {
+        logmsg(LOG_ERR,"_gather_series() : Out of memory. Aborting program.");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < num_series; i++) {
+        const struct recording_series *rs = series[i];
+        const size_t n = rs->rule->recurrence_num;
+        if( rs->cards && (ss[k].cards = malloc(n)) == NULL ) {
+            continue;
+        }
+        if( rs->cards ) {
+            memcpy(ss[k].cards, rs->cards, n);
+        }
+        ss[k].rule = _holdrec(rs->rule);
+        ss[k].id = rs->id;
+        ss[k].first_seqnbr = rs->first_seqnbr;
+        ss[k].next = rs->next;
+        ss[k].ts_last = rs->ts_last;
+        k++;
+    }
+    *num = k;
+    return ss;
+}
+
+/*
+ * Publish a new snapshot of the schedule if it has changed since the last one.
+ * The entries and rules are shared with the schedule so this is linear in the
+ * number of entries in the schedule. Must be called with recs_mutex held.
+ */
+static void
+_publish_recs(void) {
+    if( !__atomic_load_n(&snapshot_stale, __ATOMIC_ACQUIRE) ) {
+        return;
+    }
+    struct recs_snapshot *s = calloc(1, sizeof (struct recs_snapshot));
+    if( s == NULL ) {
+        logmsg(LOG_ERR,"Can not publish the schedule. Out of memory.");
+        return;
+    }
+    s->entries = _gather_recs(&s->num);
+    s->excluded = _gather_excluded(&s->num_excluded);
+    s->series = _gather_series(&s->num_series);
+    s->global_seqnbr = (unsigned)global_seqnbr;
+    s->recurrence_id = recurrence_id;
+    s->refs = 1;
+
+    lock_acquire(&snapshot_mutex, LOCK_SNAPSHOT);
+    struct recs_snapshot *old = snapshot;
+    snapshot = s;
+    lock_release(&snapshot_mutex, LOCK_SNAPSHOT);
+
+    __atomic_store_n(&snapshot_stale, 0, __ATOMIC_RELEASE);
+    recs_snapshot_put(old);
+}
+
+/*
+ * The next occurrence of a repeated recording in a snapshot that is not yet in
+ * the schedule
+ */
+struct snapshot_cursor {
+    struct recording_series s;          // The rule in the snapshot
+    const struct bitmap *excluded;
+    struct series_iter it;
+};
+
+/*
+ * Check if a cursor is at an earlier occurrence than another one
+ */
+static int
+_cursor_before(const struct snapshot_cursor *c1, const struct snapshot_cursor *c2) {
+    if( c1->it.ts_start != c2->it.ts_start ) {
+        return c1->it.ts_start < c2->it.ts_start;
+    }
+    return c1->s.first_seqnbr + c1->it.idx < c2->s.first_seqnbr + c2->it.idx;
+}
+
+/*
+ * Move the cursor at position i down the heap until the earliest occurrence is
+ * on top again
+ */
+static void
+_cursor_down(struct snapshot_cursor *heap, size_t n, size_t i) {
+    for(;;) {
+        const size_t l = 2*i + 1, r = 2*i + 2;
+        size_t first = i;
+        if( l < n && _cursor_before(&heap[l], &heap[first]) ) {
+            first = l;
+        }
+        if( r < n && _cursor_before(&heap[r], &heap[first]) ) {
+            first = r;
+        }
+        if( first == i ) {
+            return;
+        }
+        const struct snapshot_cursor tmp = heap[i];
+        heap[i] = heap[first];
+        heap[first] = tmp;
+        i = first;
+    }
+}
+
+/*
+ * Collect the pending recordings of a snapshot in order of start time. The
+ * occurrences of the repeated recordings that are not yet in the schedule are
+ * generated from their rules. Does not need recs_mutex.
+ * @param s
+ * @param maxrecs Largest number of recordings to collect, 0 for all
+ * @param[out] num Number of recordings
+ * @return The recordings. Let go of them with _snapshot_list_free().
+ */
+static struct recording_entry **
+_snapshot_list(const struct recs_snapshot *s, size_t maxrecs, size_t *num) {
+    size_t n = 0, nheap = 0, size = maxrecs > 0 ? maxrecs + 1 : s->num + 16;
+    struct recording_entry **entries = calloc(size, sizeof (struct recording_entry *));
+    struct snapshot_cursor *heap = calloc(s->num_series + 1, sizeof (struct snapshot_cursor));
+    if( entries == NULL || heap == NULL ) {
+        logmsg(LOG_ERR,"_snapshot_list() : Out of memory. Aborting program.");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < s->num_series; i++) {
+        struct snapshot_cursor *c = &heap[nheap];
+        c->s.rule = s->series[i].rule;
+        c->s.id = s->series[i].id;
+        c->s.first_seqnbr = s->series[i].first_seqnbr;
+        c->s.cards = s->series[i].cards;
+        c->excluded = recs_snapshot_excluded(s, c->s.id);
+        c->it = s->series[i].next;
+        if( _series_skip(&c->s, c->excluded, &c->it) ) {
+            nheap++;
+        }
+    }
+    for (size_t i = nheap; i-- > 0; ) {
+        _cursor_down(heap, nheap, i);
+    }
+
+    size_t i = 0;
+    while( (maxrecs == 0 || n < maxrecs) && (i < s->num || nheap > 0) ) {
+        struct recording_entry *e;
+        if( i < s->num &&
+            (nheap == 0 || s->entries[i]->ts_start < heap[0].it.ts_start ||
+             (s->entries[i]->ts_start == heap[0].it.ts_start &&
+              s->entries[i]->seqnbr < heap[0].s.first_seqnbr + heap[0].it.idx)) ) {
+            e = _holdrec(s->entries[i++]);
+        } else {
+            struct snapshot_cursor *c = &heap[0];
+            e = _series_newrec(&c->s, &c->it);
+            if( -1 == _series_step(&c->s, &c->it) || !_series_skip(&c->s, c->excluded, &c->it) ) {
+                heap[0] = heap[--nheap];
+            }
+            _cursor_down(heap, nheap, 0);
+            if( e == NULL ) {
+                continue;
+            }
+        }
+        if( n + 1 >= size ) {
+            size *= 2;
+            struct recording_entry **tmp = realloc(entries, size * sizeof (struct recording_entry *));
+            if( tmp == NULL ) {
+                logmsg(LOG_ERR,"_snapshot_list() : Out of memory. Aborting program.");
+                exit(EXIT_FAILURE);
+            }
+            entries = tmp;
+        }
+        entries[n++] = e;
+    }
+
+    free(heap);
+    *num = n;
+    return entries;
+}
+
+/*
+ * Let go of the recordings collected by _snapshot_list()
+ */
+static void
+_snapshot_list_free(struct recording_entry **entries, size_t num) {
+    for (size_t i = 0; i < num; i++) {
+        freerec(entries[i]);
+    }
+    free(entries);
+}
+
+/*
+ * Put back a repeated recording from a snapshot
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_restore_series(const struct snapshot_series *ss) {
+    struct recording_series *rs = calloc(1, sizeof (struct recording_series));
+    if( rs == NULL ) {
+        return -1;
+    }
+    rs->rule = _holdrec(ss->rule);
+    const size_t n = rs->rule->recurrence_num;
+    if( ss->cards && (rs->cards = malloc(n)) == NULL ) {
+        freerec(rs->rule);
+        free(rs);
+        return -1;
+    }
+    if( ss->cards ) {
+        memcpy(rs->cards, ss->cards, n);
+    }
+    rs->id = ss->id;
+    rs->first_seqnbr = ss->first_seqnbr;
+    rs->ts_last = ss->ts_last;
+    if( -1 == _series_store(rs) ) {
+        freerec(rs->rule);
+        free(rs->cards);
+        free(rs);
+        return -1;
+    }
+    // Only the index is stored on disk so the iterator is stepped up to it
+    _series_iter_init(rs, &rs->next);
+    while( rs->next.idx < ss->next.idx && rs->next.idx < n ) {
+        (void)_series_step(rs, &rs->next);
+    }
+    return 0;
+}
+
+/*
+ * Put back the deleted occurrences of a repeated recording from a snapshot
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_restore_excluded(const struct snapshot_excluded *se) {
+    struct bitmap *b = malloc(sizeof (struct bitmap));
+    if( b == NULL || -1 == bitmap_copy(b, &se->items) ) {
+        free(b);
+        return -1;
+    }
+    if( -1 == uhash_put(&excluded_index, se->id, b) ) {
+        bitmap_free(b);
+        free(b);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild the schedule from a snapshot, such as one read back from disk at
+ * startup. The schedule must be empty. Nothing is checked for collisions since
+ * the snapshot was taken from a consistent schedule. The entries and rules are
+ * shared with the snapshot. Must be called with recs_mutex held.
+ * @param s Snapshot. Its reference is taken over.
+ * @return 0 on success, -1 if out of memory in which case the schedule is left empty
+ */
+int
+recs_restore(struct recs_snapshot *s) {
+    int ret = 0;
+    for (size_t i = 0; i < s->num_excluded && ret == 0; i++) {
+        ret = _restore_excluded(&s->excluded[i]);
+    }
+    for (size_t i = 0; i < s->num_series && ret == 0; i++) {
+        ret = _restore_series(&s->series[i]);
+    }
+
+    // The occurrences of a repeated recording from the first one that is not
+    // yet in the schedule and on are generated from the rule
+    for (size_t i = 0; i < s->num && ret == 0; i++) {
+        struct recording_entry *e = s->entries[i];
+        if( e->recurrence_id ) {
+            const struct recording_series *rs = uhash_get(&rule_index, e->recurrence_id);
+            if( rs && e->seqnbr - rs->first_seqnbr >= rs->next.idx ) {
+                continue;
+            }
+        }
+        if( !_storerec(e->video, _holdrec(e)) ) {
+            freerec(e);
+            ret = -1;
+        }
+    }
+
+    if( ret == -1 ) {
+        logmsg(LOG_ERR,"Can not restore the schedule. Out of memory.");
+        recs_snapshot_put(s);
+        freerecs();
+        initrecs();
+        return -1;
+    }
+
+    global_seqnbr = (int)s->global_seqnbr;
+    recurrence_id = s->recurrence_id;
+
+    // A snapshot read from disk has no iterators for the repeated recordings
+    // so the next reader gets a new one taken from the schedule
+    recs_snapshot_put(s);
+    return 0;
+}
+
+/*
+ * Remove a pending recording from the schedule for the video stream. The entry
+ * itself is not freed.
+ */
+static void
+_removerec(unsigned video, struct recording_entry *entry) {
+    if( -1 == itree_remove(&rec_itree[video], entry->ts_start, entry->seqnbr) ) {
+        logmsg(LOG_ERR,"Internal error. Recording '%s' missing in schedule for video %d.",entry->title,video);
+        return;
+    }
+    (void)uhash_del(&seq_index, entry->seqnbr);
+    num_entries[video]--;
+    _recs_changed();
+
+    // There is now room for the series that were waiting for this video stream
+    for (size_t i = 0; num_blocked > 0 && i < num_series; i++) {
+        if( series[i]->blocked && series[i]->blocked_video == video ) {
+            series[i]->blocked = 0;
+            num_blocked--;
+        }
+    }
+
+    if( entry->recurrence_id ) {
+        _series_remove(entry);
+
+        // Make sure the next pending occurrence of the series is in the schedule
+        // or let go of the series if there are none left
+        struct recording_series *s = uhash_get(&rule_index, entry->recurrence_id);
+        if( s && uhash_get(&series_index, s->id) == NULL ) {
+            if( _series_valid(s, &s->next) ) {
+                _series_fill(s, _series_horizon());
+            } else {
+                _series_drop(s);
+            }
+        }
+        _excluded_forget(entry->recurrence_id);
+    }
+}
+
+/*
+ * Find the pending recording with the given sequence number
+ * @param seqnbr
+ * @param[out] video The video stream the recording is on
+ * @return The recording, NULL if not found
+ */
+static struct recording_entry *
+_findrec(unsigned seqnbr, unsigned *video) {
+    struct recording_entry *e = uhash_get(&seq_index, seqnbr);
+    if( e ) {
+        *video = e->video;
+    }
+    return e;
+}
+
+/*
+ * Delete a repeated recording and all its pending occurrences
+ */
+static void
+_series_delete(unsigned id) {
+    // Drop the rule first so that no new occurrences are added to the schedule
+    // when the pending ones are removed
+    struct recording_series *s = uhash_get(&rule_index, id);
+    if( s ) {
+        _series_drop(s);
+    }
+    struct recording_entry *e;
+    while( (e = uhash_get(&series_index, id)) != NULL ) {
+        _removerec(e->video, e);
+        freerec(e);
+    }
+    _excluded_forget(id);
+}
+
+/*
+ * Check the occurrences of a series on a video stream that are not yet in the
+ * schedule against the intervals [start[j], end[j]]
+ * @param s
+ * @param video
+ * @param start
+ * @param end
+ * @param n Number of intervals
+ * @param sorted The intervals are in time order and do not overlap each other
+ * @param[out] hit Index of the interval that overlaps
+ * @return 1 if there is an overlap, 0 otherwise
+ */
+static int
+_series_overlap(const struct recording_series *s, unsigned video, const time_t *start, const time_t *end,
+                size_t n, int sorted, size_t *hit) {
+    time_t first = n > 0 ? start[0] : 0, last = 0;
+    for (size_t j = 0; j < n; j++) {
+        first = MIN(first, start[j]);
+        last = MAX(last, end[j]);
+    }
+    if( s->ts_last < first ) {
+        return 0;
+    }
+    struct series_iter it = s->next;
+    for (int ok = _series_valid(s, &it); ok && it.ts_start <= last; ok = _series_next(s, &it)) {
+        if( _series_card(s, it.idx) != video ) {
+            continue;
+        }
+        if( sorted ) {
+            // The first interval that ends after the occurrence starts is the only
+            // one that can overlap it
+            size_t lo = 0, hi = n;
+            while( lo < hi ) {
+                const size_t mid = lo + (hi - lo) / 2;
+                if( end[mid] < it.ts_start ) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            if( lo < n && start[lo] <= it.ts_end ) {
+                *hit = lo;
+                return 1;
+            }
+        } else {
+            for (size_t j = 0; j < n; j++) {
+                if( start[j] <= it.ts_end && end[j] >= it.ts_start ) {
+                    *hit = j;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Log the details of a collision between an occurrence of a repeated recording
+ * and an existing entry
+ */
+static void
+_log_collision(unsigned video, size_t occurrence, const struct recording_entry *e, time_t ts_start, time_t ts_end) {
+    int sy, sm, sd, sh, smin, ssec;
+    int ey, em, ed, eh, emin, esec;
+    int esy, esm, esd, esh, esmin, essec;
+    int eey, eem, eed, eeh, eemin, eesec;
+
+    logmsg(LOG_DEBUG,"New recurring entry collides at occurence %d with: '%s' on video %d",
+            occurrence,e->title,video);
+    fromtimestamp(ts_start, &sy, &sm, &sd, &sh, &smin, &ssec);
+    fromtimestamp(ts_end, &ey, &em, &ed, &eh, &emin, &esec);
+    fromtimestamp(e->ts_start, &esy, &esm, &esd, &esh, &esmin, &essec);
+    fromtimestamp(e->ts_end, &eey, &eem, &eed, &eeh, &eemin, &eesec);
+    logmsg(LOG_DEBUG,"[e->ts_start=%u, e->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d-%02d/%02d)",
+                      e->ts_start,e->ts_end,esh,esmin,eeh,eemin,esd,esm,eed,eem);
+    logmsg(LOG_DEBUG,"[entry->ts_start=%u, entry->ts_end=%u]=(%02d:%02d-%02d:%02d %02d/%02d)",
+                      ts_start,ts_end,sh,smin,eh,emin,sd,sm);
+}
+
+/**
+ * Check if the interval [ts_start, ts_end] overlaps the ongoing recording
+ * on the video stream
+ */
+static int
+_overlaps_ongoing(unsigned video, time_t ts_start, time_t ts_end) {
+    return ongoing_recs[video] &&
+           ts_start <= ongoing_recs[video]->ts_end && ts_end >= ongoing_recs[video]->ts_start;
+}
+
+/* ----------------------------------------------------------------------------------
+ * Assignment of new recordings to video cards. All occurrences of a new recording
+ * are calculated once and checked against the schedule of each card, cheapest
+ * card first. If no single card is free for all of them the occurrences are
+ * spread over the smallest set of cards where every occurrence has a free card.
+ * ----------------------------------------------------------------------------------
+ */
+
+/*
+ * The occurrences of a new recording and the video streams they are put on
+ */
+struct rec_plan {
+    size_t n;
+    time_t *start, *end;
+    unsigned *idx;              // Index of the occurrence in the series
+    unsigned *free;             // Bit v is set if the occurrence fits on video v
+    unsigned char *video;       // The video stream the occurrence is assigned to
+    int sorted;                 // In time order and not overlapping each other
+};
+
+static void
+_plan_free(struct rec_plan *p) {
+    free(p->start);
+    free(p->end);
+    free(p->idx);
+    free(p->free);
+    free(p->video);
+}
+
+/*
+ * Check if an occurrence of a new repeated recording is one of the excluded ones
+ */
+static int
+_plan_excluded(const struct recording_entry *entry, const struct bitmap *excluded, unsigned idx) {
+    return excluded && bitmap_test(excluded, idx + entry->recurrence_start_number);
+}
+
+/*
+ * Calculate the occurrences of a new recording that are to be added
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_plan_init(struct rec_plan *p, struct recording_entry *entry, const struct bitmap *excluded) {
+    const size_t num = entry->recurrence ? (size_t)entry->recurrence_num : 1;
+
+    CLEAR(*p);
+    p->start = calloc(num, sizeof (time_t));
+    p->end = calloc(num, sizeof (time_t));
+    p->idx = calloc(num, sizeof (unsigned));
+    p->free = calloc(num, sizeof (unsigned));
+    p->video = calloc(num, sizeof (unsigned char));
+    if( p->start == NULL || p->end == NULL || p->idx == NULL || p->free == NULL || p->video == NULL ) {
+        _plan_free(p);
+        return -1;
+    }
+    p->sorted = 1;
+
+    if( entry->recurrence == 0 ) {
+        p->start[0] = entry->ts_start;
+        p->end[0] = entry->ts_end;
+        p->n = 1;
+        return 0;
+    }
+
+    // Step through the occurrences the same way as the stored series are
+    struct recording_series tmp;
+    struct series_iter it;
+    CLEAR(tmp);
+    tmp.rule = entry;
+    for (_series_iter_init(&tmp, &it); it.idx < entry->recurrence_num; (void)_series_step(&tmp, &it)) {
+        if( !_plan_excluded(entry, excluded, it.idx) ) {
+            p->sorted &= p->n == 0 || it.ts_start > p->end[p->n - 1];
+            p->start[p->n] = it.ts_start;
+            p->end[p->n] = it.ts_end;
+            p->idx[p->n] = it.idx;
+            p->n++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Check if any of the occurrences collide with a pending, ongoing or not yet
+ * scheduled recording on the video stream
+ * @return 1 if there is a collision 0 otherwise
+ */
+static int
+_plan_collides(unsigned video, const struct recording_entry *entry, const struct rec_plan *p) {
+    struct recording_entry *e = NULL;
+    size_t hit = 0;
+
+    if( p->sorted ) {
+        e = itree_overlap_series(&rec_itree[video], p->start, p->end, p->n, &hit);
+    } else {
+        // The occurrences overlap each other so they have to be checked one by one
+        for (size_t j = 0; j < p->n && e == NULL; j++) {
+            e = itree_overlap(&rec_itree[video], p->start[j], p->end[j]);
+            hit = j;
+        }
+    }
+    if( e ) {
+        if( entry->recurrence ) {
+            _log_collision(video, p->idx[hit], e, p->start[hit], p->end[hit]);
+        } else {
+            logmsg(LOG_NOTICE,"New entry collides with: '%s'",e->title);
+        }
+        return 1;
+    }
+
+    for (size_t j = 0; j < p->n; j++) {
+        if( _overlaps_ongoing(video, p->start[j], p->end[j]) ) {
+            logmsg(LOG_DEBUG,"New entry collides at occurrence %d with ongoing recording at video=%d",p->idx[j],video);
+            return 1;
+        }
+    }
+
+    // The occurrences of repeated recordings that are not yet in the schedule
+    for (size_t i = 0; i < num_series; i++) {
+        if( _series_overlap(series[i], video, p->start, p->end, p->n, p->sorted, &hit) ) {
+            if( entry->recurrence ) {
+                logmsg(LOG_DEBUG,"New recurring entry collides at occurence %d with repeated recording '%s' on video %d",
+                       p->idx[hit],series[i]->rule->title,video);
+            } else {
+                logmsg(LOG_NOTICE,"New entry collides with: '%s'",series[i]->rule->title);
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Find the video streams each occurrence fits on
+ * @param p
+ * @param allowed Bit mask of the video streams that can be used
+ */
+static void
+_plan_busy(struct rec_plan *p, unsigned allowed) {
+    time_t first = p->n > 0 ? p->start[0] : 0, last = 0;
+    for (size_t j = 0; j < p->n; j++) {
+        p->free[j] = allowed;
+        first = MIN(first, p->start[j]);
+        last = MAX(last, p->end[j]);
+    }
+
+    for (unsigned video = 0; video < max_video; video++) {
+        if( allowed & (1u << video) ) {
+            for (size_t j = 0; j < p->n; j++) {
+                if( itree_overlap(&rec_itree[video], p->start[j], p->end[j]) ||
+                    _overlaps_ongoing(video, p->start[j], p->end[j]) ) {
+                    p->free[j] &= ~(1u << video);
+                }
+            }
+        }
+    }
+
+    // The occurrences of repeated recordings that are not yet in the schedule
+    for (size_t i = 0; i < num_series; i++) {
+        struct recording_series *s = series[i];
+        if( s->ts_last < first ) {
+            continue;
+        }
+        struct series_iter it = s->next;
+        for (int ok = _series_valid(s, &it); ok && it.ts_start <= last; ok = _series_next(s, &it)) {
+            const unsigned bit = 1u << _series_card(s, it.idx);
+            size_t j = 0;
+            if( p->sorted ) {
+                // Skip the occurrences that end before this one starts
+                size_t hi = p->n;
+                while( j < hi ) {
+                    const size_t mid = j + (hi - j) / 2;
+                    if( p->end[mid] < it.ts_start ) {
+                        j = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+            }
+            for (; j < p->n; j++) {
+                if( p->start[j] <= it.ts_end && p->end[j] >= it.ts_start ) {
+                    p->free[j] &= ~bit;
+                } else if( p->sorted && p->start[j] > it.ts_end ) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/*
+ * Cost of putting a new recording on a video stream
+ */
+static int
+_card_cost(unsigned video) {
+    return card_cost[video] + card_load_cost * (int)num_entries[video];
+}
+
+/*
+ * The cheapest video stream among a set of streams. Ties go to the lowest number.
+ * @param mask Bit mask of video streams
+ * @return The video stream, -1 if the set is empty
+ */
+static int
+_cheapest_card(unsigned mask) {
+    int best = -1;
+    for (unsigned video = 0; video < max_video; video++) {
+        if( (mask & (1u << video)) && (best == -1 || _card_cost(video) < _card_cost((unsigned)best)) ) {
+            best = (int)video;
+        }
+    }
+    return best;
+}
+
+/*
+ * Spread the occurrences over the smallest set of video streams where every
+ * occurrence has a free stream. Among sets of the same size the one with the
+ * lowest total cost is used. Each occurrence goes on the cheapest free stream
+ * in the set. With at most a handful of cards all sets are simply tried.
+ * @return 0 on success, -1 if some occurrence has no free stream at all
+ */
+static int
+_plan_spread(struct rec_plan *p, unsigned allowed) {
+    unsigned best = 0;
+    int best_num = 0, best_cost = 0;
+
+    for (unsigned set = allowed; set; set = (set - 1) & allowed) {
+        size_t j = 0;
+        while( j < p->n && (p->free[j] & set) ) {
+            j++;
+        }
+        if( j < p->n ) {
+            continue;
+        }
+        int num = 0, cost = 0;
+        for (unsigned video = 0; video < max_video; video++) {
+            if( set & (1u << video) ) {
+                num++;
+                cost += _card_cost(video);
+            }
+        }
+        if( best == 0 || num < best_num || (num == best_num && cost < best_cost) ) {
+            best = set;
+            best_num = num;
+            best_cost = cost;
+        }
+    }
+
+    if( best == 0 ) {
+        return -1;
+    }
+    for (size_t j = 0; j < p->n; j++) {
+        p->video[j] = (unsigned char)_cheapest_card(p->free[j] & best);
     }
     return 0;
-    
 }
 
 /*
- * Insert a new recording in the list after checking that it doesn't
- * collide with an existing recording.
- * Return last used sequence number > 0 on success and -1 on failure
+ * Find video streams for all occurrences of a new recording. A single stream
+ * for all of them is preferred and the streams are tried cheapest first.
+ * @param entry
+ * @param p
+ * @param allowed Bit mask of the video streams that can be used
+ * @return 0 on success, -1 if there is no way to fit the recording
  */
-int
-insertrec(unsigned video, struct recording_entry * entry, struct excluded_items *excluded) {
-    size_t len;
-    char *filetype;
-    char *bname, *dname;
-    char bnamecore[256], filename_mangling[256];
-    char titlebuff[512], filenamebuff[512], bname_buffer[256], dname_buffer[256];
-    time_t ts_start, ts_end;
-    int sy, sm, sd, sh, smin, ssec;
-    int ey, em, ed, eh, emin, esec;            
-    
-    struct recording_entry *newentry = NULL;
+static int
+_plan_assign(const struct recording_entry *entry, struct rec_plan *p, unsigned allowed) {
+    unsigned left = allowed;
+    int video;
+    while( (video = _cheapest_card(left)) != -1 ) {
+        left &= ~(1u << video);
+        if( !_plan_collides((unsigned)video, entry, p) ) {
+            memset(p->video, video, p->n);
+            return 0;
+        }
+    }
 
-    if (isentryoverlapping(video, entry)) {
+    if( entry->recurrence == 0 || (allowed & (allowed - 1)) == 0 ) {
         return -1;
     }
 
-    if (entry->recurrence) {
-
-        // Make sure there is enough room on this video to store
-        // all repeated recordings
-        if( num_entries[video]+entry->recurrence_num > max_entries ) {
-            return -1;
+    _plan_busy(p, allowed);
+    if( -1 == _plan_spread(p, allowed) ) {
+        for (size_t j = 0; j < p->n; j++) {
+            if( (p->free[j] & allowed) == 0 ) {
+                logmsg(LOG_NOTICE,"Occurrence %d of '%s' collides on all video cards",
+                       p->idx[j] + entry->recurrence_start_number,entry->title);
+                break;
+            }
         }
+        return -1;
+    }
+    logmsg(LOG_INFO,"Repeated recording '%s' does not fit on one video card and is spread over several",entry->title);
+    return 0;
+}
 
-        strncpy(bname_buffer, entry->filename, 255);
-        bname = basename(bname_buffer);
-
-        strncpy(dname_buffer, entry->filename, 255);
-        dname = dirname(dname_buffer);
+/*
+ * Add a new recording to the schedule on the video streams in the allowed set
+ * Return last used sequence number > 0 on success, 0 if every occurrence of a
+ * repeated recording is excluded and -1 on failure. The schedule takes over the
+ * entry only on success.
+ */
+static int
+_insertplan(struct recording_entry *entry, const struct bitmap *excluded, unsigned allowed) {
 
-        filetype = strchr(bname, '.');
-        len = (size_t)MIN((filetype - bname), 255);
-        strncpy(bnamecore, bname, len);
-        bnamecore[len] = 0;
+    // Only the first occurrence of a repeated recording has to fit on the card
+    // right away. The rest are added to the schedule by refill_series() later on.
+    for (unsigned video = 0; video < max_video; video++) {
+        if( num_entries[video] >= max_entries ) {
+            allowed &= ~(1u << video);
+        }
+    }
+    if( allowed == 0 ) {
+        logmsg(LOG_ERR, "Can not store more recordings. Maximum %d per video card allowed.",max_entries);
+        return -1;
+    }
 
+    if (entry->recurrence) {
+        assert(entry->recurrence_num > 0);
         (void)adjust_initital_repeat_date(&entry->ts_start, &entry->ts_end, entry->recurrence_type);
+    }
 
-        fromtimestamp(entry->ts_start, &sy, &sm, &sd, &sh, &smin, &ssec);
-        fromtimestamp(entry->ts_end, &ey, &em, &ed, &eh, &emin, &esec);
-        ts_start = entry->ts_start;
-        ts_end = entry->ts_end;
+    struct rec_plan p;
+    if( -1 == _plan_init(&p, entry, excluded) ) {
+        logmsg(LOG_ERR,"Out of memory when checking for collisions.");
+        return -1;
+    }
+    if( p.n > 0 && -1 == _plan_assign(entry, &p, allowed) ) {
+        _plan_free(&p);
+        return -1;
+    }
 
-        assert(entry->recurrence_num > 0);
+    // If every occurrence is excluded the series is dropped again below
+    const unsigned video = p.n > 0 ? p.video[0] : (unsigned)_cheapest_card(allowed);
 
-        /*
-         * Expand all the recurring entries to single entries
-         */
-        for (size_t i=0; i < entry->recurrence_num; i++) {
-            
-            // Check if this recording should be excluded
-            _Bool found = FALSE;
-            if( excluded ) {            
-                for( size_t j=0; j < excluded->num && !found; ++j ) {
-                    found = (i + entry->recurrence_start_number == excluded->excluded_items[j]);
+    if (entry->recurrence) {
+
+        struct recording_series *s = calloc(1, sizeof (struct recording_series));
+        if( s == NULL ) {
+            logmsg(LOG_ERR, "Can not store repeated recording on video %d. Out of memory.",video);
+            _plan_free(&p);
+            return -1;
+        }
+        for (size_t j = 1; j < p.n && s->cards == NULL; j++) {
+            if( p.video[j] != video ) {
+                if( (s->cards = malloc(entry->recurrence_num)) == NULL ) {
+                    logmsg(LOG_ERR, "Can not store repeated recording on video %d. Out of memory.",video);
+                    free(s);
+                    _plan_free(&p);
+                    return -1;
+                }
+                memset(s->cards, (int)video, entry->recurrence_num);
+                for (size_t k = 0; k < p.n; k++) {
+                    s->cards[p.idx[k]] = p.video[k];
                 }
             }
-            
-            if( found ) {
-                logmsg(LOG_DEBUG,"Excluding item %d (out of %d exclusions) from series \"%s\" (startnumber=%d)",
-                        i + entry->recurrence_start_number,excluded->num,bname,
+        }
+        for (size_t j = 0; j < p.n; j++) {
+            s->ts_last = MAX(s->ts_last, p.end[j]);
+        }
+        _plan_free(&p);
+
+        entry->video = video;
+        s->rule = entry;
+        s->id = recurrence_id;
+        s->first_seqnbr = global_seqnbr;
+        if( -1 == _series_store(s) ) {
+            logmsg(LOG_ERR, "Can not store repeated recording on video %d. Out of memory.",video);
+            free(s->cards);
+            free(s);
+            return -1;
+        }
+        recurrence_id++;
+
+        // Each occurrence keeps the sequence number it would have had if the
+        // whole series was added at once
+        global_seqnbr += entry->recurrence_num;
+
+        if( excluded ) {
+            struct bitmap_iter bit;
+            unsigned item;
+            bitmap_iter_init(excluded, &bit);
+            while( bitmap_iter_next(&bit, &item) ) {
+                logmsg(LOG_DEBUG,"Excluding item %u (out of %u exclusions) from series \"%s\" (startnumber=%d)",
+                        item,bitmap_count(excluded),entry->title,
                         entry->recurrence_start_number);
+                (void)add_excluded_from_repeated_recording(s->id, item);
             }
-            
-            if( !found ) {
-
-                (void)rec_title_mangling(entry,i,entry->title,titlebuff,sizeof(titlebuff));
-                (void)rec_title_mangling(entry,i,bnamecore,filename_mangling,sizeof(filename_mangling));
-
-                // Name mangling of filename
-//                snprintf(filenamebuff, 512, "%s/%s%s%d-%02d-%02d%s",
-//                        dname, bnamecore, entry->recurrence_mangling_prefix, sy, sm, sd, filetype);
-                
-                snprintf(filenamebuff, 512, "%s/%s%s", dname, filename_mangling, filetype);                
-
-                newentry = newrec(titlebuff, filenamebuff,
-                        ts_start, ts_end,
-                        entry->channel, entry->recurrence,
-                        entry->recurrence_type,
-                        entry->recurrence_num - i,
-                        entry->recurrence_mangling,
-                        entry->transcoding_profiles);
-
-                newentry->seqnbr =  global_seqnbr++;
-                newentry->recurrence_id = recurrence_id;
-                newentry->recurrence_start_number = i + entry->recurrence_start_number;
-
-                // Store an unmangled filename with the recording
-                strncpy(newentry->recurrence_filename, bname, REC_MAX_NFILENAME - 1);
-                newentry->recurrence_filename[REC_MAX_NFILENAME - 1] = '\0';
-
-                // Store an unmangled title with the recording
-                strncpy(newentry->recurrence_title, entry->title, REC_MAX_NTITLE - 1);
-                newentry->recurrence_title[REC_MAX_NTITLE - 1] = '\0';
-
-                (void)_insertrec(video, newentry);
-
-                // Find out the new date for the next recording in sequence
-                if( -1 == increcdays(entry->recurrence_type,
-                        &ts_start, &ts_end,
-                        &sy, &sm, &sd, &sh, &smin, &ssec,
-                        &ey, &em, &ed, &eh, &emin, &esec) )  {
-                    return 0;
-                }
-                
+        }
+
+        _series_iter_init(s, &s->next);
+        _series_fill(s, _series_horizon());
+
+        if( uhash_get(&series_index, s->id) == NULL ) {
+            // Either every occurrence was excluded or the first one could not be stored
+            const int empty = !_series_valid(s, &s->next);
+            const unsigned id = s->id;
+            s->rule = NULL;
+            _series_drop(s);
+            _excluded_forget(id);
+            if( !empty ) {
+                return -1;
             }
-            
+            logmsg(LOG_NOTICE,"All occurrences of repeated recording '%s' are excluded. Nothing added.",entry->title);
+            return 0;
         }
-        recurrence_id++;
-        freerec(entry);
     } else {
+        _plan_free(&p);
         entry->seqnbr = global_seqnbr++;
-        _insertrec(video, entry);
+        if( !_insertrec(video, entry) ) {
+            return -1;
+        }
     }
     // Return the last used sequence number
     return global_seqnbr-1;
 }
 
+/*
+ * Insert a new recording in the list for the video stream after checking that
+ * it doesn't collide with an existing recording.
+ * Return last used sequence number > 0 on success, 0 if every occurrence is
+ * excluded and -1 on failure
+ */
+int
+insertrec(unsigned video, struct recording_entry * entry, const struct bitmap *excluded) {
+    if( video >= max_video ) {
+        return -1;
+    }
+    return _insertplan(entry, excluded, 1u << video);
+}
+
+/*
+ * Insert a new recording on the cheapest video stream(s) where it fits. A
+ * repeated recording that does not fit on any single stream is spread over
+ * several.
+ * Return last used sequence number > 0 on success, 0 if every occurrence is
+ * excluded and -1 on failure
+ */
+int
+insertrec_any(struct recording_entry * entry, const struct bitmap *excluded) {
+    return _insertplan(entry, excluded, (1u << max_video) - 1);
+}
+
 /**
  * Give a textual representation to the recurrence type
  * It is the callers responsibility that the buff parameter is large
@@ -935,27 +2404,14 @@ listhtml_recsbuff(char *buffer, size_t maxlen, size_t maxrecs, size_t style, int
     bzero(&ts, sizeof(struct css_table_style));
     set_listhtmlcss(&ts, style);
 
-    entries = calloc((size_t)(max_video*max_entries),sizeof (struct recording_entry *));
-    if( entries == NULL ) {
-        logmsg(LOG_ERR,"_listrecs() : Out of memory. Aborting program.");
-        exit(EXIT_FAILURE);
-    }
+    struct recs_snapshot *snap = recs_snapshot_get();
+    size_t nentries;
+    entries = _snapshot_list(snap, maxrecs, &nentries);
+    recs_snapshot_put(snap);
     bzero(tmpbuffer, n_tmpbuff);
     *buffer = '\0';
 
-    // We combine all recordings on all videos in order to
-    // give a combined sorted list of pending recordings
-    size_t k=0;
-    for (unsigned video = 0; video < max_video; video++) {
-        for (unsigned i = 0; i < num_entries[video]; ++i) {
-            entries[k++] = recs[REC_IDX(video, i)];
-        }
-    }
-
-    qsort(entries, k, sizeof (struct recording_entry *), _cmprec);
-
-    if( maxrecs > 0 )
-        k = MIN(k,maxrecs);
+    size_t k = nentries;
 
     int max = maxlen;
 
@@ -1048,7 +2504,7 @@ listhtml_recsbuff(char *buffer, size_t maxlen, size_t maxrecs, size_t style, int
         buffer[maxlen-1] = '\0';
     }
 
-    free(entries);
+    _snapshot_list_free(entries, nentries);
     free(recs_to_dump);
     
     return max > 0 ? 0 : -1;
@@ -1062,33 +2518,25 @@ _list_repeatrecsbuff(char *buffer, size_t maxlen, size_t maxrecs, size_t style,
     size_t const n_tmpbuff = 2048;
     struct css_table_style ts;
     int max = maxlen;
-    unsigned saved_recrec[2 * MAX_ENTRIES];
+    unsigned *saved_recrec;
 
     bzero(&ts, sizeof (struct css_table_style));
     set_listhtmlcss(&ts, style);
 
-    entries = calloc((size_t) (max_video * max_entries), sizeof (struct recording_entry *));
-    if (entries == NULL) {
-        logmsg(LOG_ERR, "_listrecs() : Out of memory. Aborting program.");
-        exit(EXIT_FAILURE);
-    }
+    struct recs_snapshot *snap = recs_snapshot_get();
+    size_t numrecs;
+    entries = _snapshot_list(snap, maxrecs, &numrecs);
+    recs_snapshot_put(snap);
     bzero(tmpbuffer, n_tmpbuff);
     *buffer = '\0';
 
-    // We combine all recordings on all videos in order to
-    // give a combined sorted list of pending recordings
-    size_t numrecs = 0;
-    for (unsigned video = 0; video < max_video; video++) {
-        for (unsigned i = 0; i < num_entries[video]; ++i) {
-            entries[numrecs++] = recs[REC_IDX(video, i)];
-        }
+    // There can never be more series than recordings
+    saved_recrec = calloc(numrecs + 1, sizeof (unsigned));
+    if (saved_recrec == NULL) {
+        logmsg(LOG_ERR, "_listrecs() : Out of memory. Aborting program.");
+        exit(EXIT_FAILURE);
     }
 
-    qsort(entries, numrecs, sizeof (struct recording_entry *), _cmprec);
-
-    if (maxrecs > 0)
-        numrecs = MIN(numrecs, maxrecs);
-
     time_t ts_tmp = time(NULL);
 
     if( use_csshtml ) {
@@ -1176,7 +2624,8 @@ _list_repeatrecsbuff(char *buffer, size_t maxlen, size_t maxrecs, size_t style,
         buffer[maxlen-1] = '\0';
     }
 
-    free(entries);
+    free(saved_recrec);
+    _snapshot_list_free(entries, numrecs);
 
     return max > 0 ? 0 : -1;
 }
@@ -1416,53 +2865,81 @@ dump_record(struct recording_entry* entry, int style, size_t idx,char *buffer, s
  * repeated recording and 'repeats' is != 0 then all repeated records will
  * all be dumped to the specified buffer
  */
+/*
+ * Add a dumped record to the buffer. If there is no room left "..." is added
+ * instead.
+ * @return 0 on success, -1 if the buffer is full
+ */
+static int
+_append_dump(char *buffer, size_t bufflen, size_t *left, const char *tmpbuff) {
+    if( *left > strnlen(tmpbuff,511)) {
+        strncat(buffer, tmpbuff, *left);
+        *left -= strnlen(tmpbuff,512);
+        return 0;
+    }
+    if( *left > 3 )
+        strncat( buffer, "...\n", bufflen-1-strlen(buffer));
+    return -1;
+}
+
 int
 dump_recordid(unsigned seqnbr, int repeats, int style, size_t idx, char *buffer, size_t bufflen) {
-    int found;
-    unsigned i, video, rid;
+    unsigned video = 0;
     struct recording_entry *entry=NULL;
+    struct recording_series *s=NULL;
+    struct series_iter it;
     char tmpbuff[512];
 
     *buffer = '\0';
     
-    found = 0;
-    for (video = 0; video < max_video && !found; video++) {
-        for (i = 0; i < num_entries[video] && !found; i++) {
-            if (recs[REC_IDX(video, i)]->seqnbr == seqnbr) {
-                entry = recs[REC_IDX(video, i)];
-                found = 1;
+    entry = _findrec(seqnbr, &video);
+    if (entry == NULL) {
+        // It can be an occurrence of a repeated recording that is not yet in
+        // the schedule
+        s = _series_byseqnbr(seqnbr);
+        if( s == NULL || !_series_seek(s, seqnbr - s->first_seqnbr, &it) ) {
+            return 0;
+        }
+        if( !repeats ) {
+            struct recording_entry *e = _series_newrec(s, &it);
+            if( e ) {
+                dump_record(e, style, idx, buffer, bufflen);
+                freerec(e);
             }
+            return 1;
         }
+    } else if (entry->recurrence && repeats) {
+        s = uhash_get(&rule_index, entry->recurrence_id);
+    } else {
+        dump_record(entry, style, idx, buffer, bufflen);
+        return 1;
     }
 
-    --video;
-    *buffer = 0;
-    if (found) {
-        size_t left = bufflen ;
-        if (entry->recurrence && repeats) {
-            rid = entry->recurrence_id;
-            for (i = 0; i < num_entries[video]; i++) {
-                if (recs[REC_IDX(video, i)]->recurrence_id == rid) {
-                    dump_record(recs[REC_IDX(video, i)], style, idx, tmpbuff, 512);
-                    if( left > strnlen(tmpbuff,511)) {
-                        strncat(buffer, tmpbuff, left);
-                        left -= strnlen(tmpbuff,sizeof(tmpbuff));
-                    }
-                    else {
-
-                        if( left > 3 )
-                            strncat( buffer, "...\n", bufflen-1-strlen(buffer));
-                        return found;
-
-                    }
-                }
+    // Dump all pending occurrences of the repeated recording. First the ones in
+    // the schedule and then the ones still to be generated from the rule.
+    size_t left = bufflen ;
+    const unsigned rid = entry ? entry->recurrence_id : s->id;
+    for (struct recording_entry *e = uhash_get(&series_index, rid); e; e = e->series_next) {
+        dump_record(e, style, idx, tmpbuff, 512);
+        if( -1 == _append_dump(buffer, bufflen, &left, tmpbuff) ) {
+            return 1;
+        }
+    }
+    if( s ) {
+        it = s->next;
+        for (int ok = _series_valid(s, &it); ok; ok = _series_next(s, &it)) {
+            struct recording_entry *e = _series_newrec(s, &it);
+            if( e == NULL ) {
+                break;
+            }
+            dump_record(e, style, idx, tmpbuff, 512);
+            freerec(e);
+            if( -1 == _append_dump(buffer, bufflen, &left, tmpbuff) ) {
+                return 1;
             }
-
-        } else {
-            dump_record(entry, style, idx, buffer, bufflen);
         }
     }
-    return found;
+    return 1;
 }
 
 /*
@@ -1473,21 +2950,13 @@ list_recs(size_t maxrecs, int style, int fd) {
     struct recording_entry **entries;
     char buffer[2048];
 
-    entries = calloc((size_t)(max_video*max_entries), sizeof (struct recording_entry *));
-    if( entries == NULL ) {
-        logmsg(LOG_ERR,"listrecs() : Out of memory. Aborting program.");
-        exit(EXIT_FAILURE);
-    }
+    struct recs_snapshot *snap = recs_snapshot_get();
+    size_t nentries;
+    entries = _snapshot_list(snap, maxrecs, &nentries);
+    recs_snapshot_put(snap);
     bzero(buffer, sizeof(buffer));
 
-    // We combine all recordings on all videos in order to
-    // give a combined sorted list of pending recordings
-    size_t k=0;
-    for (size_t video = 0; video < max_video; video++) {
-        for (size_t i = 0; i < num_entries[video]; ++i) {
-            entries[k++] = recs[REC_IDX(video, i)];
-        }
-    }
+    size_t k = nentries;
 
     // If we use the fancy style and there are no records
     // we only print a "- - -" to indicate an empty list.
@@ -1499,11 +2968,6 @@ list_recs(size_t maxrecs, int style, int fd) {
 
     } else {
 
-        qsort(entries, k, sizeof (struct recording_entry *), _cmprec);
-
-        if( maxrecs > 0 )
-            k = MIN(k,maxrecs);
-
         dump_recordheader(style, buffer, sizeof(buffer));
         _writef(fd, buffer);
     
@@ -1513,7 +2977,7 @@ list_recs(size_t maxrecs, int style, int fd) {
         }
 
     }
-    free(entries);
+    _snapshot_list_free(entries, nentries);
 }
 
 /*
@@ -1525,28 +2989,13 @@ list_recsbuff(char *buffer, size_t maxlen, size_t maxrecs, int style) {
     struct recording_entry **entries;
     char tmpbuffer[2048];
 
-    entries = calloc((size_t)(max_video*max_entries),sizeof (struct recording_entry *));
-    if( entries == NULL ) {
-        logmsg(LOG_ERR,"_listrecs() : Out of memory. Aborting program.");
-        exit(EXIT_FAILURE);
-    }
+    struct recs_snapshot *snap = recs_snapshot_get();
+    size_t k;
+    entries = _snapshot_list(snap, maxrecs, &k);
+    recs_snapshot_put(snap);
     bzero(tmpbuffer, 2048);
     *buffer = '\0';
 
-    // We combine all recordings on all videos in order to
-    // give a combined sorted list of pending recordings
-    size_t k=0;
-    for (unsigned video = 0; video < max_video; video++) {
-        for (unsigned i = 0; i < num_entries[video]; ++i) {
-            entries[k++] = recs[REC_IDX(video, i)];
-        }
-    }
-
-    qsort(entries, k, sizeof (struct recording_entry *), _cmprec);
-
-    if( maxrecs > 0 )
-        k = MIN(k,maxrecs);
-
     int max = maxlen;
     for(size_t i=0; i < k && max > 0; i++ ) {
         dump_record(entries[i], style, i+1, tmpbuffer, 2048);
@@ -1562,7 +3011,7 @@ list_recsbuff(char *buffer, size_t maxlen, size_t maxrecs, int style) {
 
     buffer[maxlen-1] = '\0';
 
-    free(entries);
+    _snapshot_list_free(entries, k);
 
     return max > 0 ? 0 : -1;
 
@@ -1579,29 +3028,17 @@ list_recskeyval(struct skeysval_t **list, int style) {
     struct recording_entry **entries;
     char tmpbuffer[2048];
 
-    entries = calloc((size_t)(max_video*max_entries),sizeof (struct recording_entry *));
-    if( entries == NULL ) {
-        logmsg(LOG_ERR,"_listrecskeyval() : Out of memory. Aborting program.");
-        exit(EXIT_FAILURE);
-    }
+    struct recs_snapshot *snap = recs_snapshot_get();
+    size_t k;
+    entries = _snapshot_list(snap, 0, &k);
+    recs_snapshot_put(snap);
 
-    *list = calloc((size_t)(2*max_entries),sizeof (struct skeysval_t));
+    *list = calloc(2*k + 1,sizeof (struct skeysval_t));
     if( *list == NULL ) {
         logmsg(LOG_ERR,"_listrecskeyval() : Out of memory. Aborting program.");
         exit(EXIT_FAILURE);
     }
 
-    // We combine all recordings on all videos in order to
-    // give a combined sorted list of pending recordings
-    size_t k=0;
-    for (unsigned video = 0; video < max_video; video++) {
-        for (unsigned i = 0; i < num_entries[video]; ++i) {
-            entries[k++] = recs[REC_IDX(video, i)];
-        }
-    }
-
-    qsort(entries, k, sizeof (struct recording_entry *), _cmprec);
-
     for(size_t i=0; i < k; i++ ) {
         dump_record(entries[i], style, i+1, tmpbuffer, 2048);
         (*list)[i].val = strdup(tmpbuffer);
@@ -1609,7 +3046,7 @@ list_recskeyval(struct skeysval_t **list, int style) {
         (*list)[i].key = strdup(tmpbuffer);
     }
 
-    free(entries);
+    _snapshot_list_free(entries, k);
     
     return (int)k;
 }
@@ -1621,19 +3058,12 @@ list_recskeyval(struct skeysval_t **list, int style) {
  */
 void
 delete_toprec(const unsigned video) {
-    if (num_entries[video] < 1) {
+    struct recording_entry *entry = rec_top(video);
+    if (entry == NULL) {
         logmsg(LOG_ERR, "Cannot delete records since there are no recordings for video %d\n", video);
     } else {
-        if( recs[REC_IDX(video, 0)] ) {
-            freerec(recs[REC_IDX(video, 0)]);
-            recs[REC_IDX(video, 0)] = recs[REC_IDX(video, num_entries[video] - 1)];
-            recs[REC_IDX(video, num_entries[video] - 1)] = NULL;
-            num_entries[video]--;
-            sortrecs(video);
-        }
-        else {
-            logmsg(LOG_ERR,"Internal error. Trying to delete non existent recording.");
-        }
+        _removerec(video, entry);
+        freerec(entry);
     }
 }
 
@@ -1645,14 +3075,40 @@ delete_toprec(const unsigned video) {
  */
 void
 remove_toprec(const unsigned video) {
-    if (num_entries[video] < 1) {
+    struct recording_entry *entry = rec_top(video);
+    if (entry == NULL) {
         logmsg(LOG_ERR, "Cannot delete records since there are no recordings for video %d.",video);
     } else {
-        recs[REC_IDX(video, 0)] = recs[REC_IDX(video, num_entries[video] - 1)];
-        recs[REC_IDX(video, num_entries[video] - 1)] = NULL;
-        num_entries[video]--;
-        sortrecs(video);
+        _removerec(video, entry);
+    }
+}
+
+/*
+ * Put a copy in the place of a pending recording in the schedule
+ * @param old
+ * @param c The copy
+ */
+static void
+_replacerec(struct recording_entry *old, struct recording_entry *c) {
+    (void)itree_set(&rec_itree[old->video], old->ts_start, old->seqnbr, c);
+    (void)uhash_put(&seq_index, old->seqnbr, c);
+    if( old->recurrence_id ) {
+        struct recording_entry *head = uhash_get(&series_index, old->recurrence_id);
+        c->series_next = old->series_next;
+        c->series_prev = old->series_prev == old ? c : old->series_prev;
+        if( head == old ) {
+            (void)uhash_put(&series_index, old->recurrence_id, c);
+            head = c;
+        } else {
+            old->series_prev->series_next = c;
+        }
+        if( old->series_next ) {
+            old->series_next->series_prev = c;
+        } else {
+            head->series_prev = c;
+        }
     }
+    freerec(old);
 }
 
 /**
@@ -1670,27 +3126,126 @@ update_profile(unsigned seqnbr, char *profile) {
     }
 
     // First find the record with this sequence number
-    int foundidx=-1, foundvideo=-1,found = 0;
-    for (unsigned video = 0; video < max_video && !found; video++) {
-        for (unsigned i = 0; i < num_entries[video] && !found; i++) {
-            if (recs[REC_IDX(video, i)]->seqnbr == seqnbr) {
-                found = 1;
-                foundidx = (int)i;
-                foundvideo = (int)video;
+    unsigned video;
+    struct recording_entry *entry = _findrec(seqnbr, &video);
+    if (entry == NULL) {
+        // An occurrence of a repeated recording has to be in the schedule to
+        // have a profile of its own
+        struct recording_series *s = _series_byseqnbr(seqnbr);
+        if( s ) {
+            while( _series_valid(s, &s->next) && s->next.idx <= seqnbr - s->first_seqnbr &&
+                   _series_fill_one(s) ) {
+                // Empty
             }
+            entry = _findrec(seqnbr, &video);
         }
     }
-    if (!found) {
+    if (entry == NULL) {
         return 0;
     } else {
-        strncpy(recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->transcoding_profiles[0],
-                profile,
-                (size_t)(REC_MAX_TPROFILE_LEN-1));
-        recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->transcoding_profiles[0][REC_MAX_TPROFILE_LEN-1] = '\0';
+        char *tmp = _intern(profile, REC_MAX_TPROFILE_LEN);
+        if( tmp == NULL ) {
+            return 0;
+        }
+
+        // An entry that is shared with a snapshot is copied before it is changed
+        if( __atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE) > 1 ) {
+            struct recording_entry *c = _copyrec(entry);
+            if( c == NULL ) {
+                strpool_put(tmp);
+                return 0;
+            }
+            _replacerec(entry, c);
+            entry = c;
+        }
+        strpool_put(entry->transcoding_profiles[0]);
+        entry->transcoding_profiles[0] = tmp;
+        _recs_changed();
         return seqnbr;
     }
 }
 
+/*
+ * Fill in a key from its parts
+ */
+static void
+_reckey_set(struct rec_key *key, time_t ts_start, const char *channel, const char *title) {
+    key->ts_start = ts_start;
+    strncpy(key->channel, channel, REC_MAX_NCHANNEL - 1);
+    key->channel[REC_MAX_NCHANNEL - 1] = '\0';
+    strncpy(key->title, title, REC_MAX_NTITLE - 1);
+    key->title[REC_MAX_NTITLE - 1] = '\0';
+}
+
+/*
+ * Check if a pending recording has the given key
+ */
+static int
+_reckey_match(const struct recording_entry *e, const struct rec_key *key) {
+    return e->ts_start == key->ts_start &&
+           strcmp(e->channel, key->channel) == 0 &&
+           strcmp(e->recurrence ? e->recurrence_title : e->title, key->title) == 0;
+}
+
+/**
+ * Get the key for the recording with the specified seqnbr
+ * @param seqnbr
+ * @param[out] key
+ * @return 0 on success, -1 if there is no such pending recording
+ */
+int
+get_reckey(unsigned seqnbr, struct rec_key *key) {
+    unsigned video;
+    struct recording_entry *e = _findrec(seqnbr, &video);
+    if( e ) {
+        _reckey_set(key, e->ts_start, e->channel, e->recurrence ? e->recurrence_title : e->title);
+        return 0;
+    }
+    struct recording_series *s = _series_byseqnbr(seqnbr);
+    struct series_iter it;
+    if( s == NULL || !_series_seek(s, seqnbr - s->first_seqnbr, &it) ) {
+        return -1;
+    }
+    _reckey_set(key, it.ts_start, s->rule->channel, s->rule->title);
+    return 0;
+}
+
+/**
+ * Find the pending recording with the given key. All recordings are looked at
+ * so this is only meant for the rare cases where the sequence number is not known.
+ * @param key
+ * @return The sequence number of the recording, 0 if not found
+ */
+unsigned
+find_reckey(const struct rec_key *key) {
+    for (unsigned video = 0; video < max_video; video++) {
+        struct itree_iter it;
+        for (struct recording_entry *e = rec_iter_first(video, &it);
+             e && e->ts_start <= key->ts_start; e = rec_iter_next(&it)) {
+            if( _reckey_match(e, key) ) {
+                return e->seqnbr;
+            }
+        }
+    }
+
+    // An occurrence of a repeated recording that is not yet in the schedule
+    for (size_t i = 0; i < num_series; i++) {
+        struct recording_series *s = series[i];
+        if( strcmp(s->rule->channel, key->channel) || strcmp(s->rule->title, key->title) ) {
+            continue;
+        }
+        struct series_iter it = s->next;
+        int ok = _series_valid(s, &it);
+        while( ok && it.ts_start < key->ts_start ) {
+            ok = _series_next(s, &it);
+        }
+        if( ok && it.ts_start == key->ts_start ) {
+            return s->first_seqnbr + it.idx;
+        }
+    }
+    return 0;
+}
+
 /*
  * Delete a recording with specified sequence number.
  * If "allrecurrences" is true then all recurrent recording
@@ -1699,71 +3254,46 @@ update_profile(unsigned seqnbr, char *profile) {
  */
 int
 delete_recid(unsigned seqnbr, int allrecurrences) {
-    int found=0, foundidx=-1, foundvideo=-1;
-    unsigned rid, nbr;
+    unsigned video;
 
     // First find the record with this sequence number
-    found = 0;
-    for (unsigned video = 0; video < max_video && !found; video++) {
-        for (unsigned i = 0; i < num_entries[video] && !found; i++) {
-            if (recs[REC_IDX(video, i)]->seqnbr == seqnbr) {
-                found = 1;
-                foundidx = (int)i;
-                foundvideo = (int)video;
-            }
+    struct recording_entry *entry = _findrec(seqnbr, &video);
+    if (entry == NULL) {
+
+        // It can be an occurrence of a repeated recording that is not yet in
+        // the schedule
+        struct recording_series *s = _series_byseqnbr(seqnbr);
+        struct series_iter it;
+        if( s == NULL || !_series_seek(s, seqnbr - s->first_seqnbr, &it) ) {
+            return 0;
         }
-    }
-
-    if (!found) {
-
-        return 0;
+        if( allrecurrences ) {
+            _series_delete(s->id);
+        } else {
+            add_excluded_from_repeated_recording(s->id, it.idx + s->rule->recurrence_start_number);
+        }
+        return 1;
         
     } else {
 
         // Check if the is part of a recurrence sequence
-        if (recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->recurrence && allrecurrences) {
+        if (entry->recurrence && allrecurrences) {
 
             // Delete all recordings part of this repeated recording
-            rid = recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->recurrence_id;
-            for (unsigned i = 0; i < num_entries[foundvideo]; i++) {
-                if (recs[REC_IDX((unsigned)foundvideo, i)]->recurrence_id == rid) {
-                    freerec(recs[REC_IDX((unsigned)foundvideo, i)]);
-                    recs[REC_IDX((unsigned)foundvideo, i)] = NULL;
-                }
-            }
-
-            // Now we need to compact the array of recordings
-            nbr = 0;
-            struct recording_entry **tmprecs = calloc((size_t)max_entries, sizeof (struct recording_entry *));
-            for (unsigned i = 0; i < num_entries[foundvideo]; i++) {
-                if (recs[REC_IDX((unsigned)foundvideo, i)]) {
-                    tmprecs[nbr] = recs[REC_IDX((unsigned)foundvideo, i)];
-                    nbr++;
-                }
-            }
-            for (unsigned i = 0; i < nbr; i++) {
-                recs[REC_IDX((unsigned)foundvideo, i)] = tmprecs[i];
-            }
-            num_entries[foundvideo] = nbr;
-            free(tmprecs);
+            _series_delete(entry->recurrence_id);
 
         } else {                        
             
             // If we delete any record except for the first one we have to mark it as an excluded
             // recording in the middle of the series
-            if (recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->recurrence ) {
-                add_excluded_from_repeated_recording(
-                        recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->recurrence_id,
-                        recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]->recurrence_start_number);
+            if (entry->recurrence ) {
+                add_excluded_from_repeated_recording(entry->recurrence_id, entry->recurrence_start_number);
             }
 
             // Delete this record
-            freerec(recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)]);
-            recs[REC_IDX((unsigned)foundvideo, (unsigned)foundidx)] = recs[REC_IDX((unsigned)foundvideo, num_entries[foundvideo] - 1)];
-            recs[REC_IDX((unsigned)foundvideo, num_entries[foundvideo] - 1)] = NULL;
-            num_entries[foundvideo]--;
+            _removerec(video, entry);
+            freerec(entry);
         }
-        sortrecs((unsigned)foundvideo);
         return 1;
     }
 }
@@ -1778,23 +3308,21 @@ get_nextsched_rec(struct recording_entry **nextrec, int *nextrec_video, time_t *
     *nextrec_ts = (time_t)0;
     *nextrec_video=0;
     *nextrec = (struct recording_entry *)NULL;
-    int const nextrec_idx=0;
     
     // Find the first video card with a scheduled recording
-    while ( num_entries[*nextrec_video]==0  && *nextrec_video < (int)max_video)
+    while ( *nextrec_video < (int)max_video && num_entries[*nextrec_video]==0 )
        (*nextrec_video)++;
     
     if (*nextrec_video < (int)max_video) {
-        *nextrec_ts = recs[REC_IDX(*nextrec_video, nextrec_idx)]->ts_start;
-        *nextrec = recs[REC_IDX(*nextrec_video, nextrec_idx)];
+        *nextrec = rec_top((unsigned)*nextrec_video);
+        *nextrec_ts = (*nextrec)->ts_start;
         for (unsigned video = *nextrec_video + 1; video < max_video; ++video) {
             // We must check for empty slot in case there are no future recordings for this card
-            if (num_entries[video] > 0) {
-                if (recs[REC_IDX(video, nextrec_idx)]->ts_start < *nextrec_ts) {
-                    *nextrec_ts = recs[REC_IDX(video, nextrec_idx)]->ts_start;
-                    *nextrec = recs[REC_IDX(*nextrec_video, nextrec_idx)];
-                    *nextrec_video = video;
-                }
+            struct recording_entry *top = rec_top(video);
+            if (top && top->ts_start < *nextrec_ts) {
+                *nextrec_ts = top->ts_start;
+                *nextrec = top;
+                *nextrec_video = video;
             }
         }
     } else {
@@ -1808,105 +3336,54 @@ get_nextsched_rec(struct recording_entry **nextrec, int *nextrec_video, time_t *
 // Keep track of individual recordings that have been deleted from recurring (series) 
 // recordings.
 
-struct excluded {
-    unsigned recurrence_id;
-    size_t num;
-    unsigned excluded_items[1024];
-};
-
-// An array with elements for each series that has one or more deleted individual recordings
-static struct excluded *excluded_recordings[1024];
-
-// Number of series with a deleted recording
-static size_t num_excluded_recordings = 0 ;
-
 /**
- *
+ * Mark an occurrence of a repeated recording as deleted
+ * @param series_id Recurrence id of the repeated recording
+ * @param recurrence_number Number of the occurrence (counted from its start number)
  * @return 0 on success, -1 on failure
  */
 int 
 add_excluded_from_repeated_recording(const unsigned series_id, const unsigned recurrence_number) {
-    
-    // First check if this series already has an entry
-    size_t i=0;
-    while(i < num_excluded_recordings ) {
-        if( excluded_recordings[i]->recurrence_id == series_id ) {
-            excluded_recordings[i]->excluded_items[excluded_recordings[i]->num++] = recurrence_number;
-            return 0;
+
+    _recs_changed();
+
+    struct bitmap *b = uhash_get(&excluded_index, series_id);
+    if( b == NULL ) {
+        b = calloc(1, sizeof (struct bitmap));
+        if( b == NULL || -1 == uhash_put(&excluded_index, series_id, b) ) {
+            logmsg(LOG_ERR,"Failed to allocate memory for excluded recording");
+            free(b);
+            return -1;
         }
-        ++i;
+        bitmap_init(b);
     }
-    
-    // Not found so add a new excluded series
-    excluded_recordings[num_excluded_recordings] = calloc(1,sizeof(struct excluded));
-    if( NULL == excluded_recordings[num_excluded_recordings] ) {
+    if( -1 == bitmap_set(b, recurrence_number) ) {
         logmsg(LOG_ERR,"Failed to allocate memory for excluded recording");
         return -1;
     }
-    excluded_recordings[num_excluded_recordings]->num = 1;
-    excluded_recordings[num_excluded_recordings]->recurrence_id = series_id;
-    excluded_recordings[num_excluded_recordings]->excluded_items[0] = recurrence_number;
-    ++num_excluded_recordings;
     return 0;
 }
 
-_Bool 
-has_excluded_items(const unsigned series_id) {
-    for(size_t i=0; i < num_excluded_recordings; ++i) {
-        if( excluded_recordings[i]->recurrence_id == series_id ) {
-            return TRUE;
-        }
-    }    
-    return FALSE;
-}
-
-static size_t iterate_idx=0;
-static unsigned iterate_series_id = 0;
-static struct excluded *iterate_serie=NULL;
-
-int
-iterate_excluded_init(const unsigned series_id) {
-    iterate_idx = 0;
-    iterate_series_id = series_id;
-    for( size_t i=0; i < num_excluded_recordings; ++i ) {
-        if( excluded_recordings[i]->recurrence_id == iterate_series_id ) {
-            iterate_serie = excluded_recordings[i];
-            return 0;
-        }
-    }
-    return -1;
-}
-
-int
-next_excluded_item(void) {
-    if( NULL == iterate_serie ) {
-        return -1;
-    }
-    
-    if( iterate_idx < iterate_serie->num ) {
-        return iterate_serie->excluded_items[iterate_idx++];
-    } else {
-        return -1;
-    }
+/**
+ * Get the deleted occurrences of a repeated recording. Use bitmap_iter_init() to
+ * step through them.
+ * @param series_id
+ * @return The occurrence numbers, NULL if no occurrence has been deleted
+ */
+const struct bitmap *
+get_excluded_items(const unsigned series_id) {
+    return uhash_get(&excluded_index, series_id);
 }
 
-
 /**
- *
- * @return TRUE if found on success, FALSE if not found
+ * Check if an occurrence of a repeated recording has been deleted
+ * @param series_id
+ * @param recurrence_number
+ * @return TRUE if the occurrence is deleted, FALSE otherwise
  */
 _Bool 
 is_excluded_from_repeated_recording(const unsigned series_id, const unsigned recurrence_number) {
-    for(size_t i=0; i < num_excluded_recordings; ++i) {
-        if( excluded_recordings[i]->recurrence_id == series_id ) {
-            for(size_t j=0; j < excluded_recordings[i]->num; ++j) {
-                if( recurrence_number == excluded_recordings[i]->excluded_items[j] ) {
-                    return TRUE;
-                }
-            }
-            return FALSE;
-        }
-    }    
-    return FALSE;
+    const struct bitmap *b = uhash_get(&excluded_index, series_id);
+    return b && bitmap_test(b, recurrence_number) ? TRUE : FALSE;
 }
 /* EOF */
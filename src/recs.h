@@ -27,14 +27,13 @@
 #ifndef _RECS_H
 #define	_RECS_H
 
+#include "itree.h"
+#include "bitmap.h"
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
-// Calculate the correct offset i the memory for record with index 'i' for capture
-// card 'video'
-#define REC_IDX(a,b) (a*max_entries+b)
-
 /*
  
  */
@@ -47,28 +46,37 @@ extern "C" {
 
 /**
  * This is the main structure to hold the information about one recording.
- * Each video stream has an array of pointers to these records which stores
- * the pending recordings. Up to MAX_ENTRIES recordings per video channel can
- * be stored
+ * Each video stream keeps its pending recordings ordered by start time, see
+ * rec_top() and rec_iter_first(). Up to max_entries recordings per video
+ * channel can be stored
  *
  * Each entry corresponds to a one recording. A recording can either be
  * an individual recording or it can be part of a recurrent series of recordings.
  * Each recording has a uniqe sequence number and each recurrent recording has
  * in addition a recurrence id to be able to link  recording of the same
  * recurrent sequence together.
+ *
+ * The strings that many recordings have in common (channel, profiles and the
+ * base title and filename of a series) are shared through the string pool and
+ * must never be written to. The title and filename are stored right after the
+ * structure in the same allocation.
+ *
+ * An entry in the schedule is shared with the snapshots taken of it, so once it
+ * has been stored only the series links may change. The last one to call
+ * freerec() frees it.
  */
 struct recording_entry {
     // A unique sequence number for all recordings in memory
     unsigned seqnbr;
 
     // Title of recording
-    char title[REC_MAX_NTITLE];
+    char *title;
 
-    // Channel (as text string)
-    char channel[REC_MAX_NCHANNEL];
+    // Channel (as text string, shared)
+    char *channel;
 
     // The full filename (including path)
-    char filename[REC_MAX_NFILENAME];
+    char *filename;
 
     // Timestamp for start time
     time_t ts_start;
@@ -76,7 +84,7 @@ struct recording_entry {
     // Timestamp for end time
     time_t ts_end;
 
-    // The profile(s) to use for this recording
+    // The profile(s) to use for this recording (shared). Unused slots hold "".
     char *transcoding_profiles[REC_MAX_TPROFILES];
 
     /* ------------------ */
@@ -102,17 +110,40 @@ struct recording_entry {
     // The unique id for this recurrent sequence
     unsigned recurrence_id; // A unique id for each recurrence sequence
 
-    // The basename, i.e. the filename without the sequence information added
-    char recurrence_filename[REC_MAX_NFILENAME]; // The basename
+    // The basename, i.e. the filename without the sequence information added (shared)
+    char *recurrence_filename;
 
-    // The title of this recurrent recording
-    char recurrence_title[REC_MAX_NTITLE]; // The basename
+    // The title of this recurrent recording (shared)
+    char *recurrence_title;
 
     // The start number to use when mangling title/file names as 01 / 99
     unsigned recurrence_start_number; // What start number to use in the title mangling
 
     // What video card should be used for this recording
     unsigned video;
+
+    // The other pending occurrences of the same repeated recording in time order.
+    // The list is circular in the backwards direction so the first occurrence
+    // links back to the last one.
+    struct recording_entry *series_next;
+    struct recording_entry *series_prev;
+
+    // Number of holders of the entry (the schedule and the snapshots)
+    unsigned refs;
+
+    // Storage for title and filename
+    char strings[];
+};
+
+/*
+ * Identifies a pending recording, or an occurrence of a repeated recording, by
+ * its start time, channel and unmangled title. Unlike the sequence number the
+ * key stays the same when the schedule is read back from the XML DB.
+ */
+struct rec_key {
+    time_t ts_start;
+    char channel[REC_MAX_NCHANNEL];
+    char title[REC_MAX_NTITLE];
 };
 
 /* Basic key/val structure. Used with listreckeyval to return a list of recordings
@@ -123,15 +154,6 @@ struct skeysval_t {
     char *val;
 };
 
-/**
- * Used to record which entries in a recurring series has been deleted when we insert
- * a new recurring record.
- */
-struct excluded_items {
-    size_t num;
-    unsigned excluded_items[1024];
-};
-
 /*
  * The initial number for a recurrence series. This can be modified by the 'ss'
  * command. This will then affect the next repeated recording and then be reset
@@ -139,11 +161,6 @@ struct excluded_items {
  */
 extern int initial_recurrence_start_number;
 
-/**
- * The list with all planned recordings
- */
-extern struct recording_entry **recs; // [MAX_VIDEO][MAX_ENTRIES];
-
 /**
  * The number of entries/recordings for each video card
  */
@@ -151,7 +168,7 @@ extern unsigned *num_entries; //[MAX_VIDEO];
 
 /**
  * A list of current ongoing recordings. When a recording is started
- * it is moved from the global list of planned recordings 'recs' to the
+ * it is moved from the planned recordings for the video card to the
  * the position in this list that corresponds to the video card used.
  */
 extern struct recording_entry **ongoing_recs; //[MAX_VIDEO];
@@ -171,6 +188,137 @@ initrecs(void);
 void
 freerecs(void);
 
+/**
+ * Return the 'top' recording, i.e the next recording to be recorded
+ * @param video
+ * @return The recording, NULL if there are no pending recordings
+ */
+struct recording_entry *
+rec_top(const unsigned video);
+
+/**
+ * Start iterating over the pending recordings for a video card in order of
+ * start time. The recordings must not be changed while iterating.
+ * @param video
+ * @param it Iterator
+ * @return The first recording, NULL if there are no pending recordings
+ */
+struct recording_entry *
+rec_iter_first(const unsigned video, struct itree_iter *it);
+
+/**
+ * Step to the next pending recording
+ * @param it Iterator
+ * @return The next recording, NULL when there are no more
+ */
+struct recording_entry *
+rec_iter_next(struct itree_iter *it);
+
+/**
+ * Add the occurrences of the repeated recordings that start within the series
+ * horizon to the schedule
+ * @param now
+ */
+void
+refill_series(time_t now);
+
+/*
+ * Position among the occurrences of a repeated recording. The broken down times
+ * are kept since increcdays() steps them and not the timestamps.
+ */
+struct series_iter {
+    unsigned idx;
+    time_t ts_start, ts_end;
+    int sy, sm, sd, sh, smin, ssec;
+    int ey, em, ed, eh, emin, esec;
+};
+
+/*
+ * Immutable view of the schedule: the pending recordings in order of start time,
+ * the rules of the repeated recordings with the position of their first
+ * occurrence that is not yet in the schedule, the deleted occurrences and the
+ * sequence counters. The entries and rules are shared with the schedule and are
+ * freed when the last holder lets go of them. The later occurrences of the
+ * repeated recordings are generated from the rules by the readers that need them.
+ */
+struct snapshot_excluded {
+    unsigned id;                /* Recurrence id */
+    struct bitmap items;
+};
+
+struct snapshot_series {
+    unsigned id;                        /* Recurrence id */
+    unsigned first_seqnbr;              /* Sequence number of occurrence 0 */
+    struct series_iter next;            /* First occurrence not yet in the schedule */
+    time_t ts_last;                     /* End of the last occurrence */
+    struct recording_entry *rule;       /* Occurrence 0 with the unmangled title and filename */
+    unsigned char *cards;               /* Video stream per occurrence, NULL if all on the rule's */
+};
+
+struct recs_snapshot {
+    unsigned refs;
+    size_t num;
+    struct recording_entry **entries;
+    size_t num_excluded;
+    struct snapshot_excluded *excluded;     /* Sorted on id */
+    size_t num_series;
+    struct snapshot_series *series;         /* In the order they were created */
+    unsigned global_seqnbr;                 /* Next sequence number to hand out */
+    unsigned recurrence_id;                 /* Next recurrence id to hand out */
+};
+
+/**
+ * Get a reference to a snapshot of the current schedule. A new snapshot is only
+ * taken when the schedule has changed since the last one, which briefly takes
+ * recs_mutex. Must not be called with recs_mutex or any lock after it held.
+ * @return The snapshot
+ */
+struct recs_snapshot *
+recs_snapshot_get(void);
+
+/**
+ * Same as recs_snapshot_get() for a caller that already holds recs_mutex
+ * @return The snapshot
+ */
+struct recs_snapshot *
+recs_snapshot_locked(void);
+
+/**
+ * Let go of a reference to a snapshot. The last one frees it.
+ * @param s
+ */
+void
+recs_snapshot_put(struct recs_snapshot *s);
+
+/**
+ * Rebuild the schedule from a snapshot, such as one read back from disk at
+ * startup. The schedule must be empty. Nothing is checked for collisions since
+ * the snapshot was taken from a consistent schedule. The entries and rules are
+ * shared with the snapshot. Must be called with recs_mutex held.
+ * @param s Snapshot. Its reference is taken over.
+ * @return 0 on success, -1 if out of memory in which case the schedule is left empty
+ */
+int
+recs_restore(struct recs_snapshot *s);
+
+/**
+ * Get the deleted occurrences of a repeated recording as they were when the
+ * snapshot was taken
+ * @param s
+ * @param series_id
+ * @return The occurrence numbers, NULL if no occurrence has been deleted
+ */
+const struct bitmap *
+recs_snapshot_excluded(const struct recs_snapshot *s, unsigned series_id);
+
+/**
+ * Time when the next occurrence of a repeated recording comes within the series
+ * horizon and has to be added to the schedule
+ * @return The time, 0 if there is no such occurrence
+ */
+time_t
+series_next_refill(void);
+
 /**
  * Delete the 'top' recording, i.e the next recording to be recorded.
  * This will also free all memory associated with this recording
@@ -212,9 +360,9 @@ newrec(const char *title, const char *filename, const time_t start,
         char *profiles[]);
 
 /**
- * Free memory associated with the given recording entry
+ * Let go of a recording entry. The memory is freed when the last holder of a
+ * shared entry lets go of it.
  * @param entry The entry to be freed
- * @param caller The name of the calling function. USed in memory tracing
  */
 void freerec(struct recording_entry *entry); //,char *caller);
 
@@ -223,10 +371,23 @@ void freerec(struct recording_entry *entry); //,char *caller);
  * @param video
  * @param entry
  * @param excluded
- * @return Boolean., 0 = failed to insert, 1 success
+ * @return Last used sequence number on success, 0 if every occurrence is
+ * excluded and -1 on failure. The entry is only kept on success.
  */
 int
-insertrec(unsigned video, struct recording_entry * entry, struct excluded_items *excluded);
+insertrec(unsigned video, struct recording_entry * entry, const struct bitmap *excluded);
+
+/**
+ * Insert a recording on the cheapest video card(s) where it fits. The occurrences
+ * of a repeated recording that does not fit on one card are spread over the
+ * smallest set of cards that has room for all of them.
+ * @param entry
+ * @param excluded
+ * @return Last used sequence number on success, 0 if every occurrence is
+ * excluded and -1 if there is no room. The entry is only kept on success.
+ */
+int
+insertrec_any(struct recording_entry * entry, const struct bitmap *excluded);
 
 
 /**
@@ -330,6 +491,23 @@ delete_recid(unsigned seqnbr, int allrecurrences);
 int
 update_profile(unsigned seqnbr, char *profile);
 
+/**
+ * Get the key for the recording with the specified seqnbr
+ * @param seqnbr
+ * @param[out] key
+ * @return 0 on success, -1 if there is no such pending recording
+ */
+int
+get_reckey(unsigned seqnbr, struct rec_key *key);
+
+/**
+ * Find the pending recording with the given key
+ * @param key
+ * @return The sequence number of the recording, 0 if not found
+ */
+unsigned
+find_reckey(const struct rec_key *key);
+
 /**
  * Find the next scheduled recording among all video cards
  * @param nextrec
@@ -342,20 +520,32 @@ get_nextsched_rec(struct recording_entry **nextrec, int *nextrec_video, time_t *
 
 
 
+/**
+ * Mark an occurrence of a repeated recording as deleted
+ * @param series_id Recurrence id of the repeated recording
+ * @param recurrence_number Number of the occurrence (counted from its start number)
+ * @return 0 on success, -1 on failure
+ */
 int 
 add_excluded_from_repeated_recording(const unsigned series_id, const unsigned recurrence_number);
 
-_Bool 
-has_excluded_items(const unsigned series_id);
-
+/**
+ * Check if an occurrence of a repeated recording has been deleted
+ * @param series_id
+ * @param recurrence_number
+ * @return TRUE if the occurrence is deleted, FALSE otherwise
+ */
 _Bool 
 is_excluded_from_repeated_recording(const unsigned series_id, const unsigned recurrence_number);
 
-int
-iterate_excluded_init(const unsigned series_id);
-
-int
-next_excluded_item(void);
+/**
+ * Get the deleted occurrences of a repeated recording. Use bitmap_iter_init() to
+ * step through them.
+ * @param series_id
+ * @return The occurrence numbers, NULL if no occurrence has been deleted
+ */
+const struct bitmap *
+get_excluded_items(const unsigned series_id);
 
 
 #ifdef	__cplusplus
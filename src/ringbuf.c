@@ -0,0 +1,230 @@
+/* =========================================================================
+ * File:        RINGBUF.C
+ * Description: Lock free single producer/single consumer ring buffer used
+ *              to decouple the reading of the video stream from the
+ *              writing to disk.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ringbuf.h"
+
+/**
+ * Create a new ring buffer
+ * @param size Size in bytes. Rounded up to the nearest power of two.
+ * @return Pointer to the new buffer, NULL on failure
+ */
+struct ringbuf *
+ringbuf_new(size_t size) {
+    size_t pow2 = 1;
+    while( pow2 < size ) {
+        if( pow2 > ((size_t)-1) / 2 ) {
+            return NULL;
+        }
+        pow2 *= 2;
+    }
+    size = pow2;
+
+    struct ringbuf *rb = calloc(1, sizeof (struct ringbuf));
+    if( rb == NULL ) {
+        return NULL;
+    }
+    // We deliberately use malloc() and not calloc() so that the pages are
+    // not touched until the buffer is actually used by a recording
+    rb->buf = malloc(size);
+    if( rb->buf == NULL ) {
+        free(rb);
+        return NULL;
+    }
+    rb->size = size;
+    rb->mask = size - 1;
+    pthread_mutex_init(&rb->mutex, NULL);
+    pthread_cond_init(&rb->cond, NULL);
+    return rb;
+}
+
+/**
+ * Free a ring buffer previously allocated with ringbuf_new()
+ * @param rb
+ */
+void
+ringbuf_free(struct ringbuf *rb) {
+    if( rb ) {
+        pthread_mutex_destroy(&rb->mutex);
+        pthread_cond_destroy(&rb->cond);
+        free(rb->buf);
+        free(rb);
+    }
+}
+
+/**
+ * Reset the buffer to its initial empty state. Must only be called when
+ * neither the producer nor the consumer is using the buffer.
+ * @param rb
+ */
+void
+ringbuf_reset(struct ringbuf *rb) {
+    __atomic_store_n(&rb->head, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rb->tail, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rb->closed, 0, __ATOMIC_SEQ_CST);
+    rb->high_water = 0;
+    rb->waiting = 0;
+}
+
+/**
+ * Return the number of bytes currently stored in the buffer
+ * @param rb
+ * @return Number of bytes
+ */
+size_t
+ringbuf_used(struct ringbuf *rb) {
+    return __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Get a pointer to the contiguous free space in the buffer (producer side)
+ * @param rb
+ * @param[out] len Number of bytes that can be written at the returned pointer
+ * @return Pointer to free space. If the buffer is full len is set to 0
+ */
+char *
+ringbuf_writeptr(struct ringbuf *rb, size_t *len) {
+    const size_t head = rb->head;
+    const size_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    const size_t pos = head & rb->mask;
+    const size_t free_bytes = rb->size - (head - tail);
+    *len = free_bytes < rb->size - pos ? free_bytes : rb->size - pos;
+    return rb->buf + pos;
+}
+
+/**
+ * Publish n bytes written at the pointer returned by ringbuf_writeptr()
+ * and wake up the consumer if it is waiting (producer side)
+ * @param rb
+ * @param n
+ */
+void
+ringbuf_produce(struct ringbuf *rb, size_t n) {
+    const size_t head = rb->head + n;
+    __atomic_store_n(&rb->head, head, __ATOMIC_SEQ_CST);
+
+    const size_t used = head - __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    if( used > rb->high_water ) {
+        rb->high_water = used;
+    }
+
+    if( __atomic_load_n(&rb->waiting, __ATOMIC_SEQ_CST) ) {
+        pthread_mutex_lock(&rb->mutex);
+        pthread_cond_signal(&rb->cond);
+        pthread_mutex_unlock(&rb->mutex);
+    }
+}
+
+/**
+ * Mark that no more data will be produced (producer side)
+ * @param rb
+ */
+void
+ringbuf_close(struct ringbuf *rb) {
+    pthread_mutex_lock(&rb->mutex);
+    __atomic_store_n(&rb->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_signal(&rb->cond);
+    pthread_mutex_unlock(&rb->mutex);
+}
+
+/**
+ * Check if the producer has closed the buffer
+ * @param rb
+ * @return 1 if closed, 0 otherwise
+ */
+int
+ringbuf_isclosed(struct ringbuf *rb) {
+    return __atomic_load_n(&rb->closed, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Get a pointer to the contiguous data available in the buffer (consumer side)
+ * @param rb
+ * @param[out] len Number of bytes available at the returned pointer
+ * @return Pointer to data
+ */
+char *
+ringbuf_readptr(struct ringbuf *rb, size_t *len) {
+    const size_t tail = rb->tail;
+    const size_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    const size_t pos = tail & rb->mask;
+    const size_t used = head - tail;
+    *len = used < rb->size - pos ? used : rb->size - pos;
+    return rb->buf + pos;
+}
+
+/**
+ * Release n bytes read from the pointer returned by ringbuf_readptr()
+ * (consumer side)
+ * @param rb
+ * @param n
+ */
+void
+ringbuf_consume(struct ringbuf *rb, size_t n) {
+    __atomic_store_n(&rb->tail, rb->tail + n, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until at least minbytes are available, the producer has closed the
+ * buffer or the timeout expires (consumer side)
+ * @param rb
+ * @param minbytes
+ * @param timeout_ms
+ * @return Number of bytes available
+ */
+size_t
+ringbuf_wait(struct ringbuf *rb, size_t minbytes, unsigned timeout_ms) {
+    size_t used = ringbuf_used(rb);
+    if( used >= minbytes || ringbuf_isclosed(rb) ) {
+        return used;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if( ts.tv_nsec >= 1000000000L ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&rb->mutex);
+    __atomic_store_n(&rb->waiting, 1, __ATOMIC_SEQ_CST);
+    int ret = 0;
+    while( ret == 0 && (used = ringbuf_used(rb)) < minbytes && !ringbuf_isclosed(rb) ) {
+        ret = pthread_cond_timedwait(&rb->cond, &rb->mutex, &ts);
+    }
+    __atomic_store_n(&rb->waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&rb->mutex);
+
+    return ringbuf_used(rb);
+}
@@ -0,0 +1,158 @@
+/* =========================================================================
+ * File:        RINGBUF.H
+ * Description: Lock free single producer/single consumer ring buffer used
+ *              to decouple the reading of the video stream from the
+ *              writing to disk.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef RINGBUF_H
+#define	RINGBUF_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The buffer is shared between exactly one producer thread and one consumer
+ * thread. The producer gets a pointer to the free space with ringbuf_writeptr(),
+ * fills it and publishes the data with ringbuf_produce(). The consumer gets
+ * a pointer to the available data with ringbuf_readptr() and releases it
+ * with ringbuf_consume(). Only the positions are shared, and they are updated
+ * with atomic operations so no lock is taken while moving data. The mutex is
+ * only used to let the consumer sleep when there is no data. The positions
+ * are free running counters that wrap around, so the size is always a power
+ * of two and the offset in the buffer is found with a mask.
+ */
+struct ringbuf {
+    char *buf;
+    size_t size;            /* Always a power of two */
+    size_t mask;            /* size - 1 */
+    size_t head;            /* Total number of bytes produced */
+    size_t tail;            /* Total number of bytes consumed */
+    size_t high_water;      /* Maximum number of used bytes seen */
+    int closed;             /* Set by the producer when no more data will come */
+    int waiting;            /* Set by the consumer when sleeping */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Create a new ring buffer
+ * @param size Size in bytes. Rounded up to the nearest power of two.
+ * @return Pointer to the new buffer, NULL on failure
+ */
+struct ringbuf *
+ringbuf_new(size_t size);
+
+/**
+ * Free a ring buffer previously allocated with ringbuf_new()
+ * @param rb
+ */
+void
+ringbuf_free(struct ringbuf *rb);
+
+/**
+ * Reset the buffer to its initial empty state. Must only be called when
+ * neither the producer nor the consumer is using the buffer.
+ * @param rb
+ */
+void
+ringbuf_reset(struct ringbuf *rb);
+
+/**
+ * Return the number of bytes currently stored in the buffer
+ * @param rb
+ * @return Number of bytes
+ */
+size_t
+ringbuf_used(struct ringbuf *rb);
+
+/**
+ * Get a pointer to the contiguous free space in the buffer (producer side)
+ * @param rb
+ * @param[out] len Number of bytes that can be written at the returned pointer
+ * @return Pointer to free space. If the buffer is full len is set to 0
+ */
+char *
+ringbuf_writeptr(struct ringbuf *rb, size_t *len);
+
+/**
+ * Publish n bytes written at the pointer returned by ringbuf_writeptr()
+ * and wake up the consumer if it is waiting (producer side)
+ * @param rb
+ * @param n
+ */
+void
+ringbuf_produce(struct ringbuf *rb, size_t n);
+
+/**
+ * Mark that no more data will be produced (producer side)
+ * @param rb
+ */
+void
+ringbuf_close(struct ringbuf *rb);
+
+/**
+ * Get a pointer to the contiguous data available in the buffer (consumer side)
+ * @param rb
+ * @param[out] len Number of bytes available at the returned pointer
+ * @return Pointer to data
+ */
+char *
+ringbuf_readptr(struct ringbuf *rb, size_t *len);
+
+/**
+ * Release n bytes read from the pointer returned by ringbuf_readptr()
+ * (consumer side)
+ * @param rb
+ * @param n
+ */
+void
+ringbuf_consume(struct ringbuf *rb, size_t n);
+
+/**
+ * Wait until at least minbytes are available, the producer has closed the
+ * buffer or the timeout expires (consumer side)
+ * @param rb
+ * @param minbytes
+ * @param timeout_ms
+ * @return Number of bytes available
+ */
+size_t
+ringbuf_wait(struct ringbuf *rb, size_t minbytes, unsigned timeout_ms);
+
+/**
+ * Check if the producer has closed the buffer
+ * @param rb
+ * @return 1 if closed, 0 otherwise
+ */
+int
+ringbuf_isclosed(struct ringbuf *rb);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* RINGBUF_H */
+
@@ -69,6 +69,21 @@ get_stats(char *name, struct profile_stat_entry **entry) {
     return 0;
 }
 
+/**
+ * Get the learned size in bytes of one minute of MP2 recording for a profile
+ * @param name Profile name
+ * @return Bytes per minute, 0 if nothing has been learned yet
+ */
+unsigned
+stats_mp2size_1min(char *name) {
+    for(unsigned i=0; i < num_stats; i++) {
+        if( 0 == strncmp(name,profile_stats[i]->profile_name,32) ) {
+            return profile_stats[i]->mp2size_1min;
+        }
+    }
+    return 0;
+}
+
 int
 stats_update(char *name,unsigned mp2size,unsigned recorded_time,unsigned mp4size,
              struct timeall *transcode_time, float avg_5load) {
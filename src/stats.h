@@ -59,6 +59,14 @@ struct timeall {
 
 #define STAT_DIR "stats"
 
+/**
+ * Get the learned size in bytes of one minute of MP2 recording for a profile
+ * @param name Profile name
+ * @return Bytes per minute, 0 if nothing has been learned yet
+ */
+unsigned
+stats_mp2size_1min(char *name);
+
 /**
  * Read stored statistics for the specified profile name
  * @param profilename
@@ -0,0 +1,173 @@
+/* =========================================================================
+ * File:        STRPOOL.C
+ * Description: Pool of shared, reference counted strings.
+ *              Used for the strings that many recordings have in common.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "strpool.h"
+#include "lockorder.h"
+
+/*
+ * STRPOOL_INITSIZE integer
+ * Number of hash buckets in a new pool
+ */
+#define STRPOOL_INITSIZE 256
+
+struct strpool_entry {
+    struct strpool_entry *next;
+    uint32_t hash;
+    unsigned refs;
+    char str[];
+};
+
+static struct strpool_entry **pool = NULL;
+static size_t pool_size = 0, pool_num = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * FNV-1a hash of a string
+ * @param str
+ * @return Hash value
+ */
+static uint32_t
+_strpool_hash(const char *str) {
+    uint32_t h = UINT32_C(2166136261);
+    while( *str ) {
+        h ^= (unsigned char)*str++;
+        h *= UINT32_C(16777619);
+    }
+    return h;
+}
+
+/**
+ * Double the number of buckets. If there is no memory for a larger table the
+ * chains just get longer.
+ */
+static void
+_strpool_grow(void) {
+    const size_t size = pool_size ? 2*pool_size : STRPOOL_INITSIZE;
+    struct strpool_entry **tmp = calloc(size, sizeof (struct strpool_entry *));
+    if( tmp == NULL ) {
+        return;
+    }
+    for(size_t i=0; i < pool_size; i++) {
+        struct strpool_entry *e = pool[i];
+        while( e ) {
+            struct strpool_entry *next = e->next;
+            e->next = tmp[e->hash & (size - 1)];
+            tmp[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+    free(pool);
+    pool = tmp;
+    pool_size = size;
+}
+
+/**
+ * Get the shared copy of a string. The string is added to the pool if it
+ * is not already there.
+ * @param str
+ * @return The shared copy, NULL if out of memory
+ */
+char *
+strpool_get(const char *str) {
+    const uint32_t hash = _strpool_hash(str);
+    char *ret = NULL;
+
+    lock_acquire(&pool_mutex, LOCK_STRPOOL);
+    if( pool_num >= pool_size ) {
+        _strpool_grow();
+    }
+    if( pool_size > 0 ) {
+        struct strpool_entry **b = &pool[hash & (pool_size - 1)];
+        struct strpool_entry *e = *b;
+        while( e && (e->hash != hash || strcmp(e->str, str)) ) {
+            e = e->next;
+        }
+        if( e == NULL ) {
+            const size_t len = strlen(str);
+            if( (e = malloc(sizeof (struct strpool_entry) + len + 1)) != NULL ) {
+                memcpy(e->str, str, len + 1);
+                e->hash = hash;
+                e->refs = 0;
+                e->next = *b;
+                *b = e;
+                pool_num++;
+            }
+        }
+        if( e ) {
+            e->refs++;
+            ret = e->str;
+        }
+    }
+    lock_release(&pool_mutex, LOCK_STRPOOL);
+    return ret;
+}
+
+/**
+ * Take one more reference to a string that is already in the pool
+ * @param str A shared copy returned by strpool_get()
+ * @return str
+ */
+char *
+strpool_dup(char *str) {
+    struct strpool_entry *e = (struct strpool_entry *)(str - offsetof(struct strpool_entry, str));
+    lock_acquire(&pool_mutex, LOCK_STRPOOL);
+    e->refs++;
+    lock_release(&pool_mutex, LOCK_STRPOOL);
+    return str;
+}
+
+/**
+ * Release a string returned by strpool_get(). It is freed when it has no
+ * users left.
+ * @param str The shared copy, NULL is ignored
+ */
+void
+strpool_put(char *str) {
+    if( str == NULL ) {
+        return;
+    }
+    struct strpool_entry *e = (struct strpool_entry *)(str - offsetof(struct strpool_entry, str));
+
+    lock_acquire(&pool_mutex, LOCK_STRPOOL);
+    if( --e->refs == 0 ) {
+        struct strpool_entry **p = &pool[e->hash & (pool_size - 1)];
+        while( *p != e ) {
+            p = &(*p)->next;
+        }
+        *p = e->next;
+        pool_num--;
+        free(e);
+    }
+    lock_release(&pool_mutex, LOCK_STRPOOL);
+}
@@ -0,0 +1,73 @@
+/* =========================================================================
+ * File:        STRPOOL.H
+ * Description: Pool of shared, reference counted strings.
+ *              Used for the strings that many recordings have in common.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+#ifndef STRPOOL_H
+#define	STRPOOL_H
+
+#include <stddef.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Strings such as the channel, the transcoding profiles and the base title of a
+ * repeated recording are the same for many recordings. Each distinct string is
+ * stored once in the pool together with a count of its users. The returned
+ * pointers must never be written to. The pool has its own lock so strings can
+ * be taken and released from any thread.
+ */
+
+/**
+ * Get the shared copy of a string. The string is added to the pool if it
+ * is not already there.
+ * @param str
+ * @return The shared copy, NULL if out of memory
+ */
+char *
+strpool_get(const char *str);
+
+/**
+ * Take one more reference to a string that is already in the pool
+ * @param str A shared copy returned by strpool_get()
+ * @return str
+ */
+char *
+strpool_dup(char *str);
+
+/**
+ * Release a string returned by strpool_get(). It is freed when it has no
+ * users left.
+ * @param str The shared copy, NULL is ignored
+ */
+void
+strpool_put(char *str);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* STRPOOL_H */
+
@@ -59,11 +59,19 @@
 #include "xstr.h"
 #include "tvplog.h"
 #include "transcprofile.h"
+#include "lockorder.h"
 
 struct ongoing_transcoding *ongoing_transcodings[3] ;
 const size_t max_ongoing_transcoding = 2;
 struct waiting_transcoding_t wtrans[MAX_WAITING_TRANSCODINGS] ;
 
+/*
+ * transc_mutex
+ * Protects ongoing_transcodings[] and wtrans[]. Taken by the functions below so
+ * the transcoding threads never have to wait for recs_mutex (see lockorder.h)
+ */
+static pthread_mutex_t transc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 /**
  * Check if ffmpeg binaries can be found at the specified location
  * @return -1 on failure, 0 on success
@@ -90,13 +98,6 @@ check_ffmpeg_bin(void) {
 int
 record_ongoingtranscoding(char *workingdir,char *short_filename,char *cmd_ffmpeg,
                           struct transcoding_profile_entry *profile, pid_t pid) {
-    size_t i;
-    for(i=0; i < max_ongoing_transcoding && ongoing_transcodings[i]; i++)
-       ;
-    if( i >= max_ongoing_transcoding ) {
-        logmsg(LOG_ERR,"Can only record at most %d ongoing transcodings.",max_ongoing_transcoding);
-        return -1;
-    }
     struct ongoing_transcoding *entry = calloc(1,sizeof(struct ongoing_transcoding));
     if( entry == NULL ) {
         logmsg(LOG_ERR,"FATAL: Out of memory in record_ongoingtranscoding()");
@@ -108,7 +109,21 @@ record_ongoingtranscoding(char *workingdir,char *short_filename,char *cmd_ffmpeg
     entry->cmd = cmd_ffmpeg;
     entry->profile = profile;
     entry->pid = pid;
-    ongoing_transcodings[i] = entry;
+
+    size_t i;
+    lock_acquire(&transc_mutex, LOCK_TRANSC);
+    for(i=0; i < max_ongoing_transcoding && ongoing_transcodings[i]; i++)
+       ;
+    if( i < max_ongoing_transcoding ) {
+        ongoing_transcodings[i] = entry;
+    }
+    lock_release(&transc_mutex, LOCK_TRANSC);
+
+    if( i >= max_ongoing_transcoding ) {
+        logmsg(LOG_ERR,"Can only record at most %d ongoing transcodings.",max_ongoing_transcoding);
+        free(entry);
+        return -1;
+    }
     return i;
 }
 
@@ -120,10 +135,12 @@ record_ongoingtranscoding(char *workingdir,char *short_filename,char *cmd_ffmpeg
 void
 forget_ongoingtranscoding(int idx) {
     if( idx >= 0 && idx < (int)max_ongoing_transcoding ) {
+        lock_acquire(&transc_mutex, LOCK_TRANSC);
         struct ongoing_transcoding *entry = ongoing_transcodings[idx];
+        ongoing_transcodings[idx] = (struct ongoing_transcoding *)NULL;
+        lock_release(&transc_mutex, LOCK_TRANSC);
         if( entry ) {
             (void)free(entry);
-            ongoing_transcodings[idx] = (struct ongoing_transcoding *)NULL;
         } else {
             logmsg(LOG_ERR,"forget_ongoingtranscoding() : Internal error. 'Trying to remove non-existing record' idx=%d",idx);
         }
@@ -132,8 +149,12 @@ forget_ongoingtranscoding(int idx) {
     }
 }
 
-size_t
-get_num_ongoing_transcodings(void) {
+/**
+ * Number of ongoing transcodings. Must be called with transc_mutex held.
+ * @return
+ */
+static size_t
+_num_ongoing_transcodings(void) {
     size_t num=0;
     for (size_t i = 0; i < max_ongoing_transcoding; i++) {
         num += ongoing_transcodings[i] ? 1 : 0;
@@ -141,6 +162,38 @@ get_num_ongoing_transcodings(void) {
     return num;
 }
 
+size_t
+get_num_ongoing_transcodings(void) {
+    lock_acquire(&transc_mutex, LOCK_TRANSC);
+    const size_t num = _num_ongoing_transcodings();
+    lock_release(&transc_mutex, LOCK_TRANSC);
+    return num;
+}
+
+/**
+ * Get the start time and file name of an ongoing transcoding
+ * @param idx
+ * @param[out] start_ts
+ * @param[out] filename
+ * @param maxlen Size of the filename buffer
+ * @return 0 on success, -1 if there is no ongoing transcoding with that index
+ */
+int
+get_ongoing_transcoding(int idx, time_t *start_ts, char *filename, size_t maxlen) {
+    int ret = -1;
+    if( idx >= 0 && idx < (int)max_ongoing_transcoding ) {
+        lock_acquire(&transc_mutex, LOCK_TRANSC);
+        if( ongoing_transcodings[idx] && ongoing_transcodings[idx]->filename ) {
+            *start_ts = ongoing_transcodings[idx]->start_ts;
+            strncpy(filename, ongoing_transcodings[idx]->filename, maxlen-1);
+            filename[maxlen-1] = '\0';
+            ret = 0;
+        }
+        lock_release(&transc_mutex, LOCK_TRANSC);
+    }
+    return ret;
+}
+
 /**
  * Fill a buffer with information (text) on all the ongoing recordings
  * @param obuff
@@ -154,9 +207,11 @@ list_ongoing_transcodings(char *obuff, size_t size, int show_ffmpegcmd) {
     time_t now = time(NULL);
 
     *obuff = '\0';
-    int num=get_num_ongoing_transcodings();
+    lock_acquire(&transc_mutex, LOCK_TRANSC);
+    int num=_num_ongoing_transcodings();
 
     if( num == 0 ) {
+        lock_release(&transc_mutex, LOCK_TRANSC);
         strncpy(obuff,"None.\n",size-1);
         return 0;
     }
@@ -197,6 +252,7 @@ list_ongoing_transcodings(char *obuff, size_t size, int show_ffmpegcmd) {
             }
         }
     }
+    lock_release(&transc_mutex, LOCK_TRANSC);
     obuff[size - 1] = '\0';
     return num;
 }
@@ -246,11 +302,13 @@ int
 remember_waiting_transcoding(char *short_filename,char *profile_name) {
 
     // Find the first empty slot
+    lock_acquire(&transc_mutex, LOCK_TRANSC);
     int idx=0;
     while( idx < MAX_WAITING_TRANSCODINGS && *wtrans[idx].filename )
         ++idx;
 
     if( idx >= MAX_WAITING_TRANSCODINGS ) {
+        lock_release(&transc_mutex, LOCK_TRANSC);
         logmsg(LOG_ERR,"Can only record a maximum of %d waiting transcoding", MAX_WAITING_TRANSCODINGS);
         return -1;
     }
@@ -260,6 +318,7 @@ remember_waiting_transcoding(char *short_filename,char *profile_name) {
     strncpy(wtrans[idx].profilename,profile_name,254);
     wtrans[idx].profilename[254] = '\0';
     wtrans[idx].timestamp = time(NULL);
+    lock_release(&transc_mutex, LOCK_TRANSC);
 
     return idx;
 }
@@ -270,7 +329,9 @@ remember_waiting_transcoding(char *short_filename,char *profile_name) {
 int
 forget_waiting_transcoding(int idx) {
     if( idx >= 0 && idx < MAX_WAITING_TRANSCODINGS ) {
+        lock_acquire(&transc_mutex, LOCK_TRANSC);
         *wtrans[idx].filename = '\0';
+        lock_release(&transc_mutex, LOCK_TRANSC);
         return 0;
     } else {
         logmsg(LOG_ERR,"Internal error. Illegal index for forget_waiting_transcoding()");
@@ -287,6 +348,7 @@ list_waiting_transcodings(char *buffer,size_t maxlen) {
     int idx=0;
     char tmpbuff[1024];
     *buffer = '\0';
+    lock_acquire(&transc_mutex, LOCK_TRANSC);
     while( idx < MAX_WAITING_TRANSCODINGS ) {
         if( *wtrans[idx].filename ) {
             ++num;
@@ -304,12 +366,14 @@ list_waiting_transcodings(char *buffer,size_t maxlen) {
                 strcat(buffer,tmpbuff);
                 maxlen -= strlen(tmpbuff);
             } else {
+                lock_release(&transc_mutex, LOCK_TRANSC);
                 logmsg(LOG_ERR,"Buffer to use to store waiting transcodings is too small.");
                 return -1;
             }
         }
         ++idx;
     }
+    lock_release(&transc_mutex, LOCK_TRANSC);
 
     if( num == 0 ) {
         strncpy(buffer,"None.\n",maxlen-1);
@@ -322,7 +386,8 @@ list_waiting_transcodings(char *buffer,size_t maxlen) {
 
 /**
  * Construct the command line for ffmpeg
- * @param file
+ * @param filename Name of the file to transcode, used to name the destination file
+ * @param input What to give ffmpeg as input
  * @param profile
  * @param destfile
  * @param destsize
@@ -330,8 +395,8 @@ list_waiting_transcodings(char *buffer,size_t maxlen) {
  * @param size
  * @return
  */
-int
-create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile, char *destfile, size_t destsize, char *cmd, size_t size) {
+static int
+_create_ffmpeg_cmdline(char *filename, char *input, struct transcoding_profile_entry *profile, char *destfile, size_t destsize, char *cmd, size_t size) {
  
     // Build command line for ffmpeg
     strncpy(destfile, filename,destsize);
@@ -364,7 +429,7 @@ create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile,
     char * const input_placeholder="INPUT";
     char * const output_placeholder="OUTPUT";
     struct keypairs fnames[2] = {
-        {.key = input_placeholder, .val = filename},
+        {.key = input_placeholder, .val = input},
         {.key = output_placeholder, .val = destfile},
     };
 
@@ -400,6 +465,42 @@ create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile,
 
 }
 
+/**
+ * Construct the command line for ffmpeg
+ * @param file
+ * @param profile
+ * @param destfile
+ * @param destsize
+ * @param cmd
+ * @param size
+ * @return
+ */
+int
+create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile, char *destfile, size_t destsize, char *cmd, size_t size) {
+    return _create_ffmpeg_cmdline(filename, filename, profile, destfile, destsize, cmd, size);
+}
+
+/**
+ * Construct the command line for ffmpeg when the stream is given on stdin
+ * while it is being recorded. Only single pass profiles can be used since
+ * the stream can only be read once.
+ * @param filename Name of the recording, used to name the destination file
+ * @param profile
+ * @param destfile
+ * @param destsize
+ * @param cmd
+ * @param size
+ * @return -1 failure, 0 on success
+ */
+int
+create_ffmpeg_live_cmdline(char *filename, struct transcoding_profile_entry *profile, char *destfile, size_t destsize, char *cmd, size_t size) {
+    if( profile->pass != 1 ) {
+        logmsg(LOG_ERR, "Profile '%s' uses 2-pass encoding and can not be used for live transcoding.",profile->name);
+        return -1;
+    }
+    return _create_ffmpeg_cmdline(filename, "pipe:0", profile, destfile, destsize, cmd, size);
+}
+
 
 /**
  * Kill ongoing transcoding with index idx
@@ -409,11 +510,14 @@ int
 kill_ongoing_transcoding(int idx) {
 
     if( idx >= 0 && idx < (int)max_ongoing_transcoding ) {
-        if (ongoing_transcodings[idx]) {
-            logmsg(LOG_NOTICE,"Killing 'ffmpeg' process group %d",ongoing_transcodings[idx]->pid);
-            (void)killpg(ongoing_transcodings[idx]->pid,SIGSTOP);
+        lock_acquire(&transc_mutex, LOCK_TRANSC);
+        const pid_t pid = ongoing_transcodings[idx] ? ongoing_transcodings[idx]->pid : 0;
+        lock_release(&transc_mutex, LOCK_TRANSC);
+        if (pid > 0) {
+            logmsg(LOG_NOTICE,"Killing 'ffmpeg' process group %d",pid);
+            (void)killpg(pid,SIGSTOP);
             usleep(50000);
-            (void)killpg(ongoing_transcodings[idx]->pid,SIGKILL);
+            (void)killpg(pid,SIGKILL);
         }
     } else {
         logmsg(LOG_ERR,"No ongoing transcoding with index=%d",idx);
@@ -601,9 +705,7 @@ _transcode_file(void *arg) {
         // In parent which will be watching the ffmpeg command execution
         logmsg(LOG_INFO, "Successfully started process pid=%d for transcoding '%s'.", pid, basename(filename));
 
-        pthread_mutex_lock(&recs_mutex);
         int tidx = record_ongoingtranscoding(workingdir, basename(filename), cmd_ffmpeg, profile, pid);
-        pthread_mutex_unlock(&recs_mutex);
 
         if (tidx != -1) {
 
@@ -641,9 +743,7 @@ _transcode_file(void *arg) {
 
             } while (pid != rpid && runningtime < watchdog);
 
-            pthread_mutex_lock(&recs_mutex);
             forget_ongoingtranscoding(tidx);
-            pthread_mutex_unlock(&recs_mutex);
 
             int rh = runningtime / 3600;
             int rm = (runningtime - rh*3600)/60;
@@ -1384,14 +1484,353 @@ transcode_whole_directory(char *dirpath, char *profilename) {
 }
 
 
+/**
+ * Start a transcoding process running the given shell command. The process is
+ * put in its own process group so that the whole group can be killed.
+ * @param cmdbuff Shell command to run
+ * @param infd Descriptor to use as stdin for the process, -1 to keep stdin
+ * @return The pid of the new process, -1 on failure
+ */
+pid_t
+spawn_transcoding(char *cmdbuff, int infd) {
+    pid_t pid;
+    if ((pid = fork()) == 0) {
+        // In fork child process
+        if( infd >= 0 && infd != STDIN_FILENO ) {
+            (void)dup2(infd, STDIN_FILENO);
+        }
+
+        // Make absolutely sure everything is cleaned up except the standard
+        // descriptors
+        for (int i = getdtablesize(); i > 2; --i) {
+            (void)close(i);
+        }
+
+        // Since the ffmpeg command is run as a child process (via the sh comamnd)
+        // we need to make sure all of this is in the same process group. This is
+        // done in order so that we can kill the ffmpeg command if the server
+        // is stopped by the user. The pid returned by the fork() will not be
+        // the same process as is running the 'ffmpeg' command !
+        setpgid(getpid(),0); // This sets the PGID to be the same as the PID
+        if ( -1 == nice(20) ) {
+            logmsg(LOG_ERR, "Error when calling 'nice()' : (%d : %s)",errno,strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+
+        if ( -1 == execl("/bin/sh", "sh", "-c", cmdbuff, (char *) 0) ) {
+            logmsg(LOG_ERR, "Error when calling execl() '/bin/sh/%s' : ( %d : %s )", cmdbuff, errno, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+    } else if (pid < 0) {
+        logmsg(LOG_ERR, "Fatal. Can not create process to do transcoding '%s' (%d : %s)",
+                cmdbuff, errno, strerror(errno));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Wait for a transcoding process to finish and log how it ended
+ * @param pid Process to wait for
+ * @param tidx Index in the list of ongoing transcodings, the entry is removed when done
+ * @param short_filename Name of the file being transcoded (used in messages)
+ * @param[in,out] runningtime Time in seconds the process has been running. Must be
+ * set by the caller (normally to 0) and is updated while waiting.
+ * @param[out] usage Resource usage of the process
+ * @param[out] avg_5load Average 5 min load while transcoding
+ * @return 1 if the transcoding finished successfully, 0 if it was hung and killed,
+ * -1 on failure
+ */
 int
-transcode_and_move_file(char *basedatadir, char *workingdir, char *short_filename, char *recurrence_title,
-                        struct transcoding_profile_entry *profile,
-                        unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename) {
+wait_transcoding(pid_t pid, int tidx, char *short_filename, int *runningtime, struct rusage *usage, float *avg_5load) {
+
+    // Now wait for the transcoding to finish and print the status of the
+    // transcoding to the log. We do this in a busy waiting loop for simplicity.
+    // since we can have such a long sleep period without really affecting the
+    // performance.
+    pid_t rpid;
+
+    // We only allow one transcoding to run for a maximum of 8 h any longer than
+    // that and we consider the transcoding process as hung
+    const int watchdog = 8 * 3600;
+    int ret;
+    float avg1,avg5,avg15;
+    getsysload(&avg1,&avg5,&avg15);
+    *avg_5load = avg5;
+    float avg_n = 1;
+    do {
+        // Transcoding usually takes hours so we don't bother waking up and check
+        // if we are done more often than once every couple of seconds. This
+        // might still seem like a short time but keep in mind that in the case the
+        // user terminates the transcoding process the server will not notice this
+        // until this check is made. Therefore we want this to be reasonable
+        // short as well. Ideally the wait4() should have a timeout argument in
+        // which case we would have been notified sooner.
+
+        // Why exactly 6s wait? Well, in case the user terminates the process it
+        // means that on average it will take 3s before the structures are updated
+        // with the removed transcoding which is the longest time a user ever should
+        // have to wait for feedback.
+        sleep(6);
+        *runningtime += 6;
+        getsysload(&avg1,&avg5,&avg15);
+        *avg_5load += avg5;
+        avg_n++;
+        rpid = wait4(pid, &ret, WCONTINUED | WNOHANG | WUNTRACED, usage);
+
+    } while (pid != rpid && *runningtime < watchdog);
+
+    *avg_5load /= avg_n;
+
+    if( tidx != -1 ) {
+        forget_ongoingtranscoding(tidx);
+    }
+
+    const int rh = *runningtime / 3600;
+    const int rm = (*runningtime - rh*3600)/60;
+    const int rs = *runningtime % 60;
+
+    if (*runningtime >= watchdog) {
+        // Something is terrible wrong if the transcoding haven't
+        // finished after the watchdog timeout
+        logmsg(LOG_NOTICE, "Transcoding process for file '%s' seems hung. Have run more than %02d:%02d:%02d h",
+                short_filename, rh,rm,rs);
+        (void) kill(pid, SIGKILL);
+        return 0;
+    }
+
+    if (WIFEXITED(ret)) {
+        if (WEXITSTATUS(ret) == 0) {
+            if( *runningtime < 10 ) {
+                logmsg(LOG_NOTICE, "Transcoding process finished in less than 10s for file '%s'. This most likely indicates a problem",
+                    short_filename);
+                return -1;
+            }
+            logmsg(LOG_INFO, "Transcoding process for file '%s' finished normally after %02d:%02d:%02d h. (utime=%d s, stime=%d s))",
+                short_filename, rh,rm,rs, usage->ru_utime.tv_sec, usage->ru_stime.tv_sec);
+            return 1;
+        }
+        logmsg(LOG_INFO, "Error in transcoding process for file '%s', exit status=%d after %02d:%02d h",
+                short_filename,WEXITSTATUS(ret),rh,rm);
+        return -1;
+    }
+
+    if (WIFSIGNALED(ret)) {
+        logmsg(LOG_NOTICE, "Transcoding process for file '%s' was terminated by signal=%d (possibly by user) after %02d:%02d:%02d h",
+                short_filename, WTERMSIG(ret),rh,rm,rs);
 
+        // If we don't signal a kill with -1 then a user stopped transcoding will have its
+        // original files removed and we don't want that. The files are only kept if the transcode
+        // process signals an error by returning -1
+        return -1;
+    }
+
+    // Child must have been stopped/paused. If so we have no choice than to kill it
+    logmsg(LOG_NOTICE, "Transcoding process for file '%s' was unexpectedly stopped by signal=%d after %02d:%02d:%02d h",
+            short_filename, WSTOPSIG(ret),rh,rm,rs);
+    (void) kill(pid, SIGKILL);
+    return -1;
+}
+
+/**
+ * Move a finished transcoding from the working directory to the MP4 directory, run
+ * the post transcoding script and send the notification mail if enabled.
+ * @param basedatadir
+ * @param workingdir
+ * @param short_filename
+ * @param recurrence_title
+ * @param profile
+ * @param destfile Name of the transcoded file in the working directory
+ * @param runningtime Time in seconds the transcoding took
+ * @param usage Resource usage of the transcoding process
+ * @param[out] filesize
+ * @param[out] transcode_time
+ * @param[out] updatedfilename
+ * @return 0 on success, -1 on failure
+ */
+int
+move_transcoded_file(char *basedatadir, char *workingdir, char *short_filename, char *recurrence_title,
+                     struct transcoding_profile_entry *profile, char *destfile,
+                     int runningtime, struct rusage *usage,
+                     unsigned *filesize, struct timeall *transcode_time, char *updatedfilename) {
+    const int rh = runningtime / 3600;
+    const int rm = (runningtime - rh*3600)/60;
+
+    char tmpbuff[256], tmpbuff2[256], tmpbuff3[256], rectitle[256];
+
+    // Move MP4 file
+    if( use_profiledirectories ) {
+        snprintf(tmpbuff3, sizeof(tmpbuff3)-1, "%s/mp4/%s", basedatadir, profile->name);
+    } else {
+        snprintf(tmpbuff3, sizeof(tmpbuff3)-1, "%s/mp4", basedatadir);
+    }
+
+    strncpy(rectitle,recurrence_title,255);
+    rectitle[255] = '\0';
+    if( -1 == xstrtolower(rectitle) ) {
+        logmsg(LOG_ERR,"Failed to normalice title or recording");
+        return -1;
+    }
+    if( use_repeat_rec_basedir && *rectitle) {
+        logmsg(LOG_DEBUG,"Using basedir '%s' for recurring recording",rectitle);
+        if( 0 == chkcreatedir(tmpbuff3,rectitle) ) {
+            snprintf(tmpbuff2, sizeof(tmpbuff2)-1,"%s/%s",tmpbuff3,rectitle);
+            strncpy(tmpbuff3,tmpbuff2,sizeof(tmpbuff3)-1);
+            tmpbuff3[sizeof(tmpbuff3)-1] = '\0';
+        } else {
+            logmsg(LOG_ERR,"Failed to create recurring recording");
+        }
+    }
+
+    snprintf(tmpbuff,sizeof(tmpbuff)-1,"%s/%s",tmpbuff3, destfile);
+
+    tmpbuff[sizeof(tmpbuff)-1] = '\0';
+    snprintf(tmpbuff2, sizeof(tmpbuff2)-1, "%s/%s", workingdir, destfile);
+
+    tmpbuff2[255] = '\0';
+    int ret = mv_and_rename(tmpbuff2, tmpbuff, updatedfilename, sizeof(tmpbuff2)-1);
+    if (ret) {
+        logmsg(LOG_ERR, "Could not move '%s' to '%s'", tmpbuff2, updatedfilename);
+        return -1;
+    } else {
+        logmsg(LOG_INFO, "Moved '%s' to '%s'", tmpbuff2, updatedfilename);
+        struct stat filestat;
+        // Find out the size of the transcoded file
+        if( 0 == stat(updatedfilename,&filestat) ) {
+
+            *filesize = (unsigned)filestat.st_size;
+            transcode_time->rtime.tv_sec = runningtime ;
+            transcode_time->utime.tv_sec = usage->ru_utime.tv_sec;
+            transcode_time->stime.tv_sec = usage->ru_stime.tv_sec;
+
+        } else {
+            logmsg(LOG_ERR,"Can not determine size of transcoded file '%s'. ( %d : %s) ",
+                   updatedfilename,errno,strerror(errno));
+        }
+
+        if (use_posttransc_processing) {
+            logmsg(LOG_DEBUG, "Post transcoding processing enabled.");
+            char posttransc_fullname[128];
+            snprintf(posttransc_fullname, sizeof(posttransc_fullname)-1, "%s/tvpvrd/shellscript/%s", CONFDIR, posttransc_script);
+            int csfd = open(posttransc_fullname, O_RDONLY);
+            if (csfd == -1) {
+                logmsg(LOG_WARNING, "Cannot open post transcoding script '%s' ( %d : %s )",
+                        posttransc_fullname, errno, strerror(errno));
+            } else {
+                close(csfd);
+                char cmd[255];
+                snprintf(cmd, sizeof(cmd)-1, "%s -f \"%s\" -l %u > /dev/null 2>&1", posttransc_fullname, updatedfilename, *filesize);
+                logmsg(LOG_DEBUG, "Running post transcoding script '%s'", cmd);
+                int rc = system(cmd);
+                if (rc == -1 || WEXITSTATUS(rc)) {
+                    logmsg(LOG_ERR, "Post transcoding script '%s' ended with exit status %d", posttransc_fullname, WEXITSTATUS(rc));
+                } else {
+                    logmsg(LOG_INFO, "Post transcoding script '%s' ended normally with exit status %d", posttransc_fullname, WEXITSTATUS(rc));
+                }
+            }
+        }
+
+
+        // The complete transcoding and file relocation has been successful. Now check
+        // if we should send a mail with this happy news!
+        if( send_mail_on_transcode_end ) {
+            size_t const maxkeys=16;
+            struct keypairs *keys = new_keypairlist(maxkeys);
+            size_t const n_str_buff = 2048;
+            char str_buff[n_str_buff];
+            size_t ki = 0 ;
+
+            // Include system load average in mail
+            float l1,l5,l15;
+            getsysload(&l1,&l5,&l15);
+            snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l1);
+            add_keypair(keys,maxkeys,"SL1",str_buff,&ki);
+            snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l5);
+            add_keypair(keys,maxkeys,"SL5",str_buff,&ki);
+            snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l15);
+            add_keypair(keys,maxkeys,"SL15",str_buff,&ki);
+
+            // Get full current time to include in mail
+            time_t now = time(NULL);
+            ctime_r(&now,str_buff);
+            str_buff[strnlen(str_buff,n_str_buff-1)-1] = 0; // Remove trailing newline
+            add_keypair(keys,maxkeys,"TIME",str_buff,&ki);
+
+            // Transcoding time
+            snprintf(str_buff,n_str_buff-1,"%02d:%02d",rh,rm);
+            add_keypair(keys,maxkeys,"TRANSCTIME",str_buff,&ki);
+
+            // Add file size (in MB)
+            snprintf(str_buff,n_str_buff-1,"%.1f",*filesize / 1024.0 / 1024.0);
+            add_keypair(keys,maxkeys,"FILESIZE",str_buff,&ki);
+
+            // Include the server name in the mail
+            gethostname(str_buff,80);
+            str_buff[n_str_buff-1] = '\0';
+            add_keypair(keys,maxkeys,"SERVERNAME",str_buff,&ki);
+
+            // Include all ongoing transcodings
+            list_ongoing_transcodings(str_buff,n_str_buff-1,0);
+            str_buff[n_str_buff-1] = '\0';
+            add_keypair(keys,maxkeys,"ONGOINGTRANS",str_buff,&ki);
+
+            // Also include all waiting transcodings
+            list_waiting_transcodings(str_buff,n_str_buff-1);
+            str_buff[n_str_buff-1] = '\0';
+            add_keypair(keys,maxkeys,"WAITTRANS",str_buff,&ki);
+
+            // Add information on disk usage
+            char ds_fs[255],ds_size[128],ds_avail[128],ds_used[128];
+            int ds_use;
+            if( 0 == get_diskspace(basedatadir,ds_fs,ds_size,ds_used,ds_avail,&ds_use) ) {
+                add_keypair(keys,maxkeys,"DISK_SIZE",ds_size,&ki);
+                add_keypair(keys,maxkeys,"DISK_USED",ds_used,&ki);
+                snprintf(str_buff,sizeof(str_buff)-1,"%d",ds_use);
+                add_keypair(keys,maxkeys,"DISK_PERCENT_USED",str_buff,&ki);
+            }
+
+            // Finally list the three next recordings
+            list_recsbuff(str_buff,n_str_buff-1,3,4);
+            str_buff[n_str_buff-1] = '\0';
+            add_keypair(keys,maxkeys,"NEXTRECS",str_buff,&ki);
+            add_keypair(keys,maxkeys,"FILENAME",short_filename,&ki);
+            add_keypair(keys,maxkeys,"PROFILE",profile->name,&ki);
+            add_keypair(keys,maxkeys,"DIRNAME",dirname(tmpbuff),&ki);
+
+            char subjectbuff[256];
+            snprintf(subjectbuff,sizeof(subjectbuff)-1,"Transcoding %s done",short_filename);
+            subjectbuff[255] = '\0';
+
+            if( -1 == send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,"mail_transcend", keys, ki) ) {
+                logmsg(LOG_ERR,"Failed to send mail using template \"mail_transcend\"");
+            } else {
+                logmsg(LOG_DEBUG,"Successfully sent mail using template \"mail_transcend\"!");
+            }
+
+            free_keypairlist(keys,ki);
+
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Transcode the MP2 file with one profile and move the result. If subdir is given
+ * the transcoding is run in that subdirectory of the working directory so that
+ * several transcodings of the same file can run at the same time without their
+ * output and log files colliding.
+ * @return 0 on success, -1 on failure
+ */
+static int
+_transcode_and_move_file(char *basedatadir, char *workingdir, char *subdir, char *short_filename, char *recurrence_title,
+                         struct transcoding_profile_entry *profile,
+                         unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename) {
+
+    char rundir[256], input[256];
     struct rusage usage;
     CLEAR(*transcode_time);
-    int rh, rm, rs;
+    CLEAR(usage);
 
     // Keep track of the possible new filename we created in case of collision
     *updatedfilename = '\0';
@@ -1406,182 +1845,67 @@ transcode_and_move_file(char *basedatadir, char *workingdir, char *short_filenam
 
     } else  {
 
+        if( subdir ) {
+            snprintf(rundir, sizeof(rundir)-1, "%s/%s", workingdir, subdir);
+            snprintf(input, sizeof(input)-1, "../%s", short_filename);
+            if( -1 == mkdir(rundir, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST ) {
+                logmsg(LOG_ERR, "Cannot create transcoding directory '%s'. ( %d : %s )",rundir,errno,strerror(errno));
+                return -1;
+            }
+        } else {
+            strncpy(rundir, workingdir, sizeof(rundir)-1);
+            strncpy(input, short_filename, sizeof(input)-1);
+        }
+        rundir[sizeof(rundir)-1] = '\0';
+        input[sizeof(input)-1] = '\0';
+
         // If recording was successful then do the transcoding
         char cmdbuff[1024], cmd_ffmpeg[512], destfile[128] ;
         int runningtime = 0;
 
         // We remember all wating transcodings by storing them in global queue
         // This way we can easily list all transcoding that are waiting
-        pthread_mutex_lock(&recs_mutex);
         int rid=remember_waiting_transcoding(short_filename,profile->name);
-        pthread_mutex_unlock(&recs_mutex);
 
         if (0 == wait_to_transcode(short_filename)) {
             // The system load is below the treshold to start a new transcoding
 
-            pthread_mutex_lock(&recs_mutex);
             forget_waiting_transcoding(rid);
-            pthread_mutex_unlock(&recs_mutex);
 
             logmsg(LOG_INFO, "Using profile '%s' for transcoding of '%s'", profile->name, short_filename);
 
-            if( -1 == create_ffmpeg_cmdline(short_filename, profile, destfile, sizeof(destfile)-1, cmd_ffmpeg, sizeof(cmd_ffmpeg)-1) ) {
+            if( -1 == _create_ffmpeg_cmdline(short_filename, input, profile, destfile, sizeof(destfile)-1, cmd_ffmpeg, sizeof(cmd_ffmpeg)-1) ) {
                 return -1;    
             }
 
-            snprintf(cmdbuff, sizeof(cmdbuff)-1, "cd %s;%s", workingdir, cmd_ffmpeg);
+            snprintf(cmdbuff, sizeof(cmdbuff)-1, "cd %s;%s", rundir, cmd_ffmpeg);
 
 #ifdef DEBUG_SIMULATE
 
-            snprintf(cmdbuff, 256, "%s/%s", workingdir, destfile);
+            snprintf(cmdbuff, 256, "%s/%s", rundir, destfile);
             const mode_t fmode =  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
             int sfd = open(cmdbuff, O_WRONLY | O_CREAT | O_TRUNC, fmode);
             logmsg(LOG_INFO, "Simulation mode: No real transcoding. Creating fake file '%s'",cmdbuff);
             _writef(sfd, "Fake MP4 file created during simulation at ts=%u\n", time(NULL));
             (void) close(sfd);
-            rh = rm = rs = -1;
+            *avg_5load = 0;
             transcoding_done = 1;
-            CLEAR(usage);
 
 #else
-            pid_t pid;
-            if ((pid = fork()) == 0) {
-                // In fork child process
-                // Make absolutely sure everything is cleaned up except the standard
-                // descriptors
-                for (int i = getdtablesize(); i > 2; --i) {
-                    (void)close(i);
-                }
-
-                // Since the ffmpeg command is run as a child process (via the sh comamnd)
-                // we need to make sure all of this is in the same process group. This is
-                // done in order so that we can kill the ffmpeg command if the server
-                // is stopped by the user. The pid returned by the fork() will not be
-                // the same process as is running the 'ffmpeg' command !
-                setpgid(getpid(),0); // This sets the PGID to be the same as the PID
-                if ( -1 == nice(20) ) {
-                    logmsg(LOG_ERR, "Error when calling 'nice()' : (%d : %s)",errno,strerror(errno));
-                    _exit(EXIT_FAILURE);
-                }
-
-                if ( -1 == execl("/bin/sh", "sh", "-c", cmdbuff, (char *) 0) ) {
-                    logmsg(LOG_ERR, "Error when calling execl() '/bin/sh/%s' : ( %d : %s )", cmdbuff, errno, strerror(errno));
-                    _exit(EXIT_FAILURE);
-                }
-            } else if (pid < 0) {
-                logmsg(LOG_ERR, "Fatal. Can not create process to do transcoding for file '%s' (%d : %s)",
-                        short_filename, errno, strerror(errno));
-            } else {
+            pid_t pid = spawn_transcoding(cmdbuff, -1);
+            if (pid > 0) {
 
                 // In parent process
                 logmsg(LOG_INFO, "Successfully started process pid=%d for transcoding '%s'.",pid,short_filename);
 
-                pthread_mutex_lock(&recs_mutex);
-                int tidx = record_ongoingtranscoding(workingdir, short_filename, cmd_ffmpeg, profile,pid);
-                pthread_mutex_unlock(&recs_mutex);
+                int tidx = record_ongoingtranscoding(rundir, short_filename, cmd_ffmpeg, profile,pid);
 
                 if (tidx != -1) {
-
-                    // Now wait for the transcoding to finish and print the status of the
-                    // transcoding to the log. We do this in a busy waiting loop for simplicity.
-                    // since we can have such a long sleep period without really affecting the
-                    // performance.
-                    pid_t rpid;
-
-                    // We only allow one transcoding to run for a maximum of 8 h any longer than
-                    // that and we consider the transcoding process as hung
-                    const int watchdog = 8 * 3600;
-                    int ret;
-                    float avg1,avg5,avg15;
-                    getsysload(&avg1,&avg5,&avg15);
-                    *avg_5load = avg5;
-                    float avg_n = 1;
-                    do {
-                        // Transcoding usually takes hours so we don't bother waking up and check
-                        // if we are done more often than once every couple of seconds. This
-                        // might still seem like a short time but keep in mind that in the case the
-                        // user terminates the transcoding process the server will not notice this
-                        // until this check is made. Therefore we want this to be reasonable
-                        // short as well. Ideally the wait4() should have a timeout argument in
-                        // which case we would have been notified sooner.
-
-                        // Why exactly 6s wait? Well, in case the user terminates the process it
-                        // means that on average it will take 3s before the structures are updated
-                        // with the removed transcoding which is the longest time a user ever should
-                        // have to wait for feedback.
-                        sleep(6);
-                        runningtime += 6;
-                        getsysload(&avg1,&avg5,&avg15);
-                        *avg_5load += avg5;
-                        avg_n++;
-                        rpid = wait4(pid, &ret, WCONTINUED | WNOHANG | WUNTRACED, &usage);
-
-                    } while (pid != rpid && runningtime < watchdog);
-
-                    *avg_5load /= avg_n;
-
-                    pthread_mutex_lock(&recs_mutex);
-                    forget_ongoingtranscoding(tidx);
-                    pthread_mutex_unlock(&recs_mutex);
-
-                    rh = runningtime / 3600;
-                    rm = (runningtime - rh*3600)/60;
-                    rs = runningtime % 60;
-
-                    if (runningtime >= watchdog) {
-                        // Something is terrible wrong if the transcoding haven't
-                        // finished after the watchdog timeout
-                        logmsg(LOG_NOTICE, "Transcoding process for file '%s' seems hung. Have run more than %02d:%02d:%02d h",
-                                short_filename, rh,rm,rs);
-                        (void) kill(pid, SIGKILL);
-                    } else {
-
-                        if (WIFEXITED(ret)) {
-                            transcoding_done = (WEXITSTATUS(ret) == 0);
-                            if (transcoding_done) {
-                                if( runningtime < 10 ) {
-                                    logmsg(LOG_NOTICE, "Transcoding process finished in less than 10s for file '%s'. This most likely indicates a problem",
-                                        short_filename);
-                                    return -1;
-
-                                } else {
-                                    logmsg(LOG_INFO, "Transcoding process for file '%s' finished normally after %02d:%02d:%02d h. (utime=%d s, stime=%d s))",
-                                        short_filename, rh,rm,rs, usage.ru_utime.tv_sec, usage.ru_stime.tv_sec);
-
-                                }
-                            } else {
-                                logmsg(LOG_INFO, "Error in transcoding process for file '%s', exit status=%d after %02d:%02d h",
-                                        short_filename,WEXITSTATUS(ret),rh,rm);
-                                return -1;
-                            }
-                        } else {
-                            if (WIFSIGNALED(ret)) {
-                                logmsg(LOG_NOTICE, "Transcoding process for file '%s' was terminated by signal=%d (possibly by user) after %02d:%02d:%02d h",
-                                        short_filename, WTERMSIG(ret),rh,rm,rs);
-
-                                // If we don't signal a kill with -1 then a user stopped transcoding will have its
-                                // original files removed and we don't want that. The files are only kept if the transcode
-                                // process signals an error by returning -1
-                                return -1;
-/*
-                                if( WTERMSIG(ret) == SIGKILL ) {
-                                    // Stopped by user so we don't signal this as a true error
-                                    return 0;
-                                } else {
-                                    return -1;
-                                }
-
-*/
-                            } else {
-                                // Child must have been stopped/paused. If so we have no choice than to kill it
-                                logmsg(LOG_NOTICE, "Transcoding process for file '%s' was unexpectedly stopped by signal=%d after %02d:%02d:%02d h",
-                                        short_filename, WSTOPSIG(ret),rh,rm,rs);
-                                (void) kill(pid, SIGKILL);
-                                return -1;
-                            }
-
-                        }
+                    int ret = wait_transcoding(pid, tidx, short_filename, &runningtime, &usage, avg_5load);
+                    if( -1 == ret ) {
+                        return -1;
                     }
+                    transcoding_done = ret;
                 }
             }
 #endif
@@ -1592,162 +1916,102 @@ transcode_and_move_file(char *basedatadir, char *workingdir, char *short_filenam
 
         // If transcoding was successful then move the transcoded file to the correct subdirectory
         if (transcoding_done) {
-            char tmpbuff[256], tmpbuff2[256], tmpbuff3[256], rectitle[256];
-
-            // Move MP4 file
-            if( use_profiledirectories ) {
-                snprintf(tmpbuff3, sizeof(tmpbuff3)-1, "%s/mp4/%s", basedatadir, profile->name);
-            } else {
-                snprintf(tmpbuff3, sizeof(tmpbuff3)-1, "%s/mp4", basedatadir);
-            }
-
-            strncpy(rectitle,recurrence_title,255);
-            rectitle[255] = '\0';
-            if( -1 == xstrtolower(rectitle) ) {
-                logmsg(LOG_ERR,"Failed to normalice title or recording");
-                return -1;
-            }
-            if( use_repeat_rec_basedir && *rectitle) {
-                logmsg(LOG_DEBUG,"Using basedir '%s' for recurring recording",rectitle);
-                if( 0 == chkcreatedir(tmpbuff3,rectitle) ) {
-                    snprintf(tmpbuff2, sizeof(tmpbuff2)-1,"%s/%s",tmpbuff3,rectitle);
-                    strncpy(tmpbuff3,tmpbuff2,sizeof(tmpbuff3)-1);
-                    tmpbuff3[sizeof(tmpbuff3)-1] = '\0';
-                } else {
-                    logmsg(LOG_ERR,"Failed to create recurring recording");
-                }
-            }
-
-            snprintf(tmpbuff,sizeof(tmpbuff)-1,"%s/%s",tmpbuff3, destfile);
-
-            tmpbuff[sizeof(tmpbuff)-1] = '\0';
-            snprintf(tmpbuff2, sizeof(tmpbuff2)-1, "%s/%s", workingdir, destfile);
-
-            tmpbuff2[255] = '\0';
-            int ret = mv_and_rename(tmpbuff2, tmpbuff, updatedfilename, sizeof(tmpbuff2)-1);
-            if (ret) {
-                logmsg(LOG_ERR, "Could not move '%s' to '%s'", tmpbuff2, updatedfilename);
-                return -1;
-            } else {
-                logmsg(LOG_INFO, "Moved '%s' to '%s'", tmpbuff2, updatedfilename);
-                struct stat filestat;
-                // Find out the size of the transcoded file
-                if( 0 == stat(updatedfilename,&filestat) ) {
-
-                    *filesize = (unsigned)filestat.st_size;
-                    transcode_time->rtime.tv_sec = runningtime ;
-                    transcode_time->utime.tv_sec = usage.ru_utime.tv_sec;
-                    transcode_time->stime.tv_sec = usage.ru_stime.tv_sec;
-
-                } else {
-                    logmsg(LOG_ERR,"Can not determine size of transcoded file '%s'. ( %d : %s) ",
-                           updatedfilename,errno,strerror(errno));
-                }
-
-                if (use_posttransc_processing) {
-                    logmsg(LOG_DEBUG, "Post transcoding processing enabled.");
-                    char posttransc_fullname[128];
-                    snprintf(posttransc_fullname, sizeof(posttransc_fullname)-1, "%s/tvpvrd/shellscript/%s", CONFDIR, posttransc_script);
-                    int csfd = open(posttransc_fullname, O_RDONLY);
-                    if (csfd == -1) {
-                        logmsg(LOG_WARNING, "Cannot open post transcoding script '%s' ( %d : %s )",
-                                posttransc_fullname, errno, strerror(errno));
-                    } else {
-                        close(csfd);
-                        char cmd[255];
-                        snprintf(cmd, sizeof(cmd)-1, "%s -f \"%s\" -l %u > /dev/null 2>&1", posttransc_fullname, updatedfilename, *filesize);
-                        logmsg(LOG_DEBUG, "Running post transcoding script '%s'", cmd);
-                        int rc = system(cmd);
-                        if (rc == -1 || WEXITSTATUS(rc)) {
-                            logmsg(LOG_ERR, "Post transcoding script '%s' ended with exit status %d", posttransc_fullname, WEXITSTATUS(rc));
-                        } else {
-                            logmsg(LOG_INFO, "Post transcoding script '%s' ended normally with exit status %d", posttransc_fullname, WEXITSTATUS(rc));
-                        }
-                    }
-                }
-
+            return move_transcoded_file(basedatadir, rundir, short_filename, recurrence_title, profile, destfile,
+                                        runningtime, &usage, filesize, transcode_time, updatedfilename);
+        }
+    }
+    return 0;
+}
 
-                // The complete transcoding and file relocation has been successful. Now check
-                // if we should send a mail with this happy news!
-                if( send_mail_on_transcode_end ) {
-                    size_t const maxkeys=16;
-                    struct keypairs *keys = new_keypairlist(maxkeys);
-                    size_t const n_str_buff = 2048;
-                    char str_buff[n_str_buff];
-                    size_t ki = 0 ;
-
-                    // Include system load average in mail
-                    float l1,l5,l15;
-                    getsysload(&l1,&l5,&l15);
-                    snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l1);
-                    add_keypair(keys,maxkeys,"SL1",str_buff,&ki);
-                    snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l5);
-                    add_keypair(keys,maxkeys,"SL5",str_buff,&ki);
-                    snprintf(str_buff,sizeof(str_buff)-1,"%.1f",l15);
-                    add_keypair(keys,maxkeys,"SL15",str_buff,&ki);
-
-                    // Get full current time to include in mail
-                    time_t now = time(NULL);
-                    ctime_r(&now,str_buff);
-                    str_buff[strnlen(str_buff,n_str_buff-1)-1] = 0; // Remove trailing newline
-                    add_keypair(keys,maxkeys,"TIME",str_buff,&ki);
-
-                    // Transcoding time
-                    snprintf(str_buff,n_str_buff-1,"%02d:%02d",rh,rm);
-                    add_keypair(keys,maxkeys,"TRANSCTIME",str_buff,&ki);
-
-                    // Add file size (in MB)
-                    snprintf(str_buff,n_str_buff-1,"%.1f",*filesize / 1024.0 / 1024.0);
-                    add_keypair(keys,maxkeys,"FILESIZE",str_buff,&ki);
-
-                    // Include the server name in the mail
-                    gethostname(str_buff,80);
-                    str_buff[n_str_buff-1] = '\0';
-                    add_keypair(keys,maxkeys,"SERVERNAME",str_buff,&ki);
-
-                    // Include all ongoing transcodings
-                    list_ongoing_transcodings(str_buff,n_str_buff-1,0);
-                    str_buff[n_str_buff-1] = '\0';
-                    add_keypair(keys,maxkeys,"ONGOINGTRANS",str_buff,&ki);
-
-                    // Also include all waiting transcodings
-                    list_waiting_transcodings(str_buff,n_str_buff-1);
-                    str_buff[n_str_buff-1] = '\0';
-                    add_keypair(keys,maxkeys,"WAITTRANS",str_buff,&ki);
-
-                    // Add information on disk usage
-                    char ds_fs[255],ds_size[128],ds_avail[128],ds_used[128];
-                    int ds_use;
-                    if( 0 == get_diskspace(basedatadir,ds_fs,ds_size,ds_used,ds_avail,&ds_use) ) {
-                        add_keypair(keys,maxkeys,"DISK_SIZE",ds_size,&ki);
-                        add_keypair(keys,maxkeys,"DISK_USED",ds_used,&ki);
-                        snprintf(str_buff,sizeof(str_buff)-1,"%d",ds_use);
-                        add_keypair(keys,maxkeys,"DISK_PERCENT_USED",str_buff,&ki);
-                    }
+int
+transcode_and_move_file(char *basedatadir, char *workingdir, char *short_filename, char *recurrence_title,
+                        struct transcoding_profile_entry *profile,
+                        unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename) {
+    return _transcode_and_move_file(basedatadir, workingdir, NULL, short_filename, recurrence_title, profile,
+                                    filesize, transcode_time, avg_5load, updatedfilename);
+}
 
-                    // Finally list the three next recordings
-                    list_recsbuff(str_buff,n_str_buff-1,3,4);
-                    str_buff[n_str_buff-1] = '\0';
-                    add_keypair(keys,maxkeys,"NEXTRECS",str_buff,&ki);
-                    add_keypair(keys,maxkeys,"FILENAME",short_filename,&ki);
-                    add_keypair(keys,maxkeys,"PROFILE",profile->name,&ki);
-                    add_keypair(keys,maxkeys,"DIRNAME",dirname(tmpbuff),&ki);
+// Arguments to each thread in a parallel transcoding
+struct parallel_transcoding {
+    char *basedatadir;
+    char *workingdir;
+    char *short_filename;
+    char *recurrence_title;
+    struct transcoding_result *res;
+};
 
-                    char subjectbuff[256];
-                    snprintf(subjectbuff,sizeof(subjectbuff)-1,"Transcoding %s done",short_filename);
-                    subjectbuff[255] = '\0';
+/**
+ * Thread running one profile of a parallel transcoding
+ * @param arg Pointer to the parallel_transcoding structure
+ * @return NULL
+ */
+static void *
+_parallel_transcoding_thread(void *arg) {
+    struct parallel_transcoding *p = arg;
+    struct transcoding_result *res = p->res;
+
+    res->ret = _transcode_and_move_file(p->basedatadir, p->workingdir, res->profile->name, p->short_filename,
+                                        p->recurrence_title, res->profile,
+                                        &res->filesize, &res->transcode_time, &res->avg_5load, res->updatedfilename);
+    return NULL;
+}
 
-                    if( -1 == send_mail_template(subjectbuff, daemon_email_from, send_mailaddress,"mail_transcend", keys, ki) ) {
-                        logmsg(LOG_ERR,"Failed to send mail using template \"mail_transcend\"");
-                    } else {
-                        logmsg(LOG_DEBUG,"Successfully sent mail using template \"mail_transcend\"!");
-                    }
+/**
+ * Transcode the MP2 file with several profiles at the same time. Each profile
+ * is run by its own thread in a subdirectory of the working directory named
+ * after the profile. The total time is therefore roughly the time of the
+ * slowest profile instead of the sum of all of them. The result for each
+ * profile is stored in its transcoding_result.
+ * @param basedatadir
+ * @param workingdir
+ * @param short_filename
+ * @param recurrence_title
+ * @param res One entry for each profile with the profile filled in
+ * @param n Number of profiles
+ * @return 0 if all profiles were successful, -1 otherwise
+ */
+int
+transcode_and_move_file_parallel(char *basedatadir, char *workingdir, char *short_filename, char *recurrence_title,
+                                 struct transcoding_result *res, unsigned n) {
+    struct parallel_transcoding p[n];
+    pthread_t threads[n];
+    int started[n];
+    int ret = 0;
+
+    for(unsigned i=0; i < n; i++) {
+        res[i].ret = -1;
+        res[i].filesize = 0;
+        res[i].avg_5load = 0;
+        res[i].updatedfilename[0] = '\0';
+        CLEAR(res[i].transcode_time);
+    }
 
-                    free_keypairlist(keys,ki);
+    if( n == 1 ) {
+        res[0].ret = transcode_and_move_file(basedatadir, workingdir, short_filename, recurrence_title, res[0].profile,
+                                             &res[0].filesize, &res[0].transcode_time, &res[0].avg_5load,
+                                             res[0].updatedfilename);
+        return res[0].ret;
+    }
 
-                }
-            }
+    logmsg(LOG_INFO, "Starting %u parallel transcodings of '%s'", n, short_filename);
+    for(unsigned i=0; i < n; i++) {
+        p[i].basedatadir = basedatadir;
+        p[i].workingdir = workingdir;
+        p[i].short_filename = short_filename;
+        p[i].recurrence_title = recurrence_title;
+        p[i].res = &res[i];
+        started[i] = 0 == pthread_create(&threads[i], NULL, _parallel_transcoding_thread, &p[i]);
+        if( !started[i] ) {
+            logmsg(LOG_ERR, "Cannot create transcoding thread for profile '%s'. Transcoding in sequence.",
+                   res[i].profile->name);
+            _parallel_transcoding_thread(&p[i]);
         }
     }
-    return 0;
+    for(unsigned i=0; i < n; i++) {
+        if( started[i] ) {
+            pthread_join(threads[i], NULL);
+        }
+        ret |= res[i].ret;
+    }
+    return ret;
 }
@@ -24,6 +24,10 @@
 #ifndef _TRANSC_H
 #define	_TRANSC_H
 
+#include <sys/types.h>
+#include <sys/resource.h>
+#include "stats.h"
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
@@ -40,6 +44,8 @@ struct ongoing_transcoding {
     struct transcoding_profile_entry *profile;
     pid_t pid;
 };
+// Only accessed through the functions below since they are protected by a
+// mutex local to transc.c
 extern struct ongoing_transcoding *ongoing_transcodings[] ;
 extern const size_t max_ongoing_transcoding;
 
@@ -112,6 +118,66 @@ int
 create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile,
                       char *destfile, size_t destsize, char *cmd, size_t size);
 
+/**
+ * Create the ffmpeg command line for a transcoding that reads the stream
+ * from stdin while it is being recorded
+ * @param filename
+ * @param profile
+ * @param destfile
+ * @param destsize
+ * @param cmd
+ * @param size
+ * @return -1 failure, 0 on success
+ */
+int
+create_ffmpeg_live_cmdline(char *filename, struct transcoding_profile_entry *profile,
+                           char *destfile, size_t destsize, char *cmd, size_t size);
+
+/**
+ * Start a transcoding process running the given shell command in its
+ * own process group
+ * @param cmdbuff Shell command
+ * @param infd Descriptor to use as stdin, -1 to keep stdin
+ * @return pid of the process, -1 on failure
+ */
+pid_t
+spawn_transcoding(char *cmdbuff, int infd);
+
+/**
+ * Wait for a transcoding process to finish
+ * @param pid
+ * @param tidx Index in list of ongoing transcodings (removed when done), -1 if none
+ * @param short_filename
+ * @param[in,out] runningtime Time the process has already run, updated while waiting
+ * @param[out] usage
+ * @param[out] avg_5load
+ * @return 1 if finished successfully, 0 if hung and killed, -1 on failure
+ */
+int
+wait_transcoding(pid_t pid, int tidx, char *short_filename, int *runningtime, struct rusage *usage, float *avg_5load);
+
+/**
+ * Move a finished transcoding to the MP4 directory, run the post transcoding
+ * script and send the notification mail if enabled
+ * @param datadir
+ * @param workingdir
+ * @param short_filename
+ * @param recurrence_title
+ * @param profile
+ * @param destfile Transcoded file in the working directory
+ * @param runningtime
+ * @param usage
+ * @param filesize
+ * @param transcode_time
+ * @param updatedfilename
+ * @return 0 on success, -1 on failure
+ */
+int
+move_transcoded_file(char *datadir, char *workingdir, char *short_filename, char *recurrence_title,
+                     struct transcoding_profile_entry *profile, char *destfile,
+                     int runningtime, struct rusage *usage,
+                     unsigned *filesize, struct timeall *transcode_time, char *updatedfilename);
+
 
 
 /**
@@ -121,6 +187,17 @@ create_ffmpeg_cmdline(char *filename, struct transcoding_profile_entry *profile,
 size_t
 get_num_ongoing_transcodings(void);
 
+/**
+ * Get the start time and file name of an ongoing transcoding
+ * @param idx
+ * @param[out] start_ts
+ * @param[out] filename
+ * @param maxlen Size of the filename buffer
+ * @return 0 on success, -1 if there is no ongoing transcoding with that index
+ */
+int
+get_ongoing_transcoding(int idx, time_t *start_ts, char *filename, size_t maxlen);
+
 
 /**
  * Kill_ongoing transcoding processes.
@@ -230,6 +307,33 @@ transcode_and_move_file(char *datadir, char *workingdir, char *short_filename, c
                         struct transcoding_profile_entry *profile,
                         unsigned *filesize, struct timeall *transcode_time, float *avg_5load, char *updatedfilename);
 
+// The result of one profile in a parallel transcoding
+struct transcoding_result {
+    struct transcoding_profile_entry *profile;
+    int ret;
+    unsigned filesize;
+    struct timeall transcode_time;
+    float avg_5load;
+    char updatedfilename[256];
+};
+
+/**
+ * Transcode a MP2 file with several profiles at the same time. Each profile is
+ * run in its own subdirectory (named after the profile) of the working directory
+ * so the output files do not collide. The total time is roughly the time of the
+ * slowest profile instead of the sum.
+ * @param datadir
+ * @param workingdir
+ * @param short_filename
+ * @param recurrence_title
+ * @param res One entry per profile. The profile must be set by the caller.
+ * @param n Number of entries in res
+ * @return 0 if all profiles succeeded, -1 otherwise
+ */
+int
+transcode_and_move_file_parallel(char *datadir, char *workingdir, char *short_filename, char *recurrence_title,
+                                 struct transcoding_result *res, unsigned n);
+
 #ifdef	__cplusplus
 }
 #endif
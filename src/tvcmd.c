@@ -64,6 +64,7 @@
 #include "futils.h"
 #include "recs.h"
 #include "tvxmldb.h"
+#include "tvjournal.h"
 #include "freqmap.h"
 #include "vctrl.h"
 #include "stats.h"
@@ -76,6 +77,8 @@
 #include "tvplog.h"
 #include "tvhistory.h"
 #include "mailutil.h"
+#include "capture.h"
+#include "lockorder.h"
 
 /*
  * Indexes into the command table
@@ -147,6 +150,13 @@ typedef void (*ptrcmd)(const char *, int);
  */
 static ptrcmd cmdtable[MAX_COMMANDS];
 
+/**
+ * Commands that only read the schedule snapshot, data with its own lock (the
+ * transcodings and the history) or no shared data at all, and can run without
+ * recs_mutex
+ */
+static int cmdlockfree[MAX_COMMANDS];
+
 // Forward declaration
 static ptrcmd _getCmdPtr(const char *cmd);
 
@@ -210,7 +220,7 @@ _cmd_help(const char *cmd, int sockfd) {
             "  ot   - list the ongoing transcoding(s)\n"\
             "  q    - quick recording\n"\
             "  rst  - reset all statistics\n"\
-            "  rh   - view history of previous transcodings\n"\
+            "  rh   - view/search history of previous transcodings\n"\
             "  rhm  - mail history of previous transcodings\n"\
             "  rp   - refresh transcoding profiles from file\n"\
             "  s    - print server status\n"\
@@ -243,7 +253,7 @@ _cmd_help(const char *cmd, int sockfd) {
             "  lq n - list queued transcodings\n"\
             "  ot   - list the ongoing transcoding(s)\n"\
             "  rst  - reset all statistics\n"\
-            "  rh   - view history of previous transcodings\n"\
+            "  rh   - view/search history of previous transcodings\n"\
             "  rhm  - mail history of previous transcodings\n"\
             "  rp   - refresh transcoding profiles from file\n"\
             "  s    - print server status\n"\
@@ -321,6 +331,7 @@ _cmd_setprofile(const char *cmd, int sockfd) {
 
     if ( ! err && ret > 2 ) {
         if( update_profile((unsigned)xatoi(field[1]),field[2]) ) {
+            (void)journal_profile((unsigned)xatoi(field[1]),field[2]);
             snprintf(msgbuff,255,"Updated profile to '%s' on recording %03d\n",field[2],xatoi(field[1]));
         } else {
             snprintf(msgbuff,255,"Failed to set profile '%s' on recording %03d\n",field[2],xatoi(field[1]));
@@ -433,6 +444,7 @@ _cmd_delete(const char *cmd, int sockfd) {
     if ( ! err ) {
 
         id = (unsigned)xatoi(field[1]);
+        (void)journal_delete(id, cmd[1] == 'r');
         ret = delete_recid(id, cmd[1] == 'r');
 
         if (ret) {
@@ -451,16 +463,6 @@ _cmd_delete(const char *cmd, int sockfd) {
 
     if( ! err ) {
         logmsg(LOG_INFO,msgbuff);
-        char logmsgbuff[256];
-        if (writeXMLFile(xmldbfile) >= 0 ) {
-            snprintf(logmsgbuff, 255,"Database successfully updated '%s' after delete command", xmldbfile);
-            logmsgbuff[255] = 0 ;
-            logmsg(LOG_DEBUG,logmsgbuff);
-        } else {
-            snprintf(logmsgbuff, 255,"Failed to update database '%s' after delete command", xmldbfile);
-            logmsgbuff[255] = 0 ;
-            logmsg(LOG_ERR,logmsgbuff);
-        }
     }
     else {
         logmsg(LOG_ERR,msgbuff);
@@ -1208,16 +1210,16 @@ _cmd_add(const char *cmd, int sockfd) {
 
             } else {
 
-                // Take the first video stream available
-                for (size_t video = 0; video < max_video && (-1 == ret); video++) {
-                    ret = insertrec(video, entry, NULL);
-                }
+                // Let the server pick the card(s)
+                ret = insertrec_any(entry, NULL);
             }
 
-            if (-1 == ret) {
+            if (ret <= 0) {
                 freerec(entry);
                 err = 5;
             } else {
+                // Synchronize the DB file with the added recording
+                (void)journal_add(entry, input_card);
                 dump_recordid((unsigned)ret, 1, 0, 0, msgbuff, sizeof(msgbuff)-1);
             }
         }
@@ -1226,18 +1228,6 @@ _cmd_add(const char *cmd, int sockfd) {
     if (err) {
         sprintf(msgbuff, "Error:%d:%s:%s", err,add_errstr[err],last_logmsg+26);
         logmsg(LOG_ERR,"Can not add record. ( %d : %s )", err,add_errstr[err]);
-    } else {
-        // Synchronize the DB file with the added recordings
-        char logmsgbuff[256];
-        if (writeXMLFile(xmldbfile) >= 0 ) {
-            snprintf(logmsgbuff, sizeof(logmsgbuff)-1,"Database successfully updated '%s' after add command", xmldbfile);
-            logmsgbuff[sizeof(logmsgbuff)-1] = 0 ;
-            logmsg(LOG_INFO,logmsgbuff);
-        } else {
-            snprintf(logmsgbuff, sizeof(logmsgbuff)-1,"Failed to update database '%s' after add command", xmldbfile);
-            logmsgbuff[sizeof(logmsgbuff)-1] = 0 ;
-            logmsg(LOG_ERR,logmsgbuff);
-        }
     }
 
     for(int i=0; i < REC_MAX_TPROFILES; i++) {
@@ -2372,6 +2362,11 @@ _cmd_status(const char *cmd, int sockfd) {
         }
     }
 
+    if( is_master_server ) {
+        capture_dump_stats(sockfd);
+        xmldb_dump_stats(sockfd);
+    }
+
     if( verbose_log >= 3 ) {
         tvp_mem_list(sockfd);
     }
@@ -2486,6 +2481,17 @@ _cmd_getSettings(const char *cmd, int sockfd) {
             "%-30s: %d\n"
             "%-30s: %d\n"
             "%-30s: %d (%0.1fMB)\n"
+            "%-30s: %s\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
+            "%-30s: %d\n"
             "%-30s: %02d:%02d (h:min)\n"
             "%-30s: %s\n"
             "%-30s: %s\n"
@@ -2540,7 +2546,18 @@ _cmd_getSettings(const char *cmd, int sockfd) {
             "client_idle_time",max_idle_time,
             "port",tcpip_port,
             "time_resolution",time_resolution,
-            "video_buffer_size",VIDBUFSIZE,(float)VIDBUFSIZE/1024.0/1024.0,
+            "capture_buffer_size",(int)capture_buffer_size,(float)capture_buffer_size/1024.0/1024.0,
+            "capture_mode",capture_modename(capture_mode),
+            "capture_reactor",capture_reactor,
+            "preallocate_recordings",preallocate_recordings,
+            "live_transcoding",live_transcoding,
+            "parallel_transcoding",parallel_transcoding,
+            "prewarm_lead",prewarm_lead,
+            "handover_gap",handover_gap,
+            "gop_index",gop_index,
+            "series_horizon",series_horizon,
+            "card_load_cost",card_load_cost,
+            "journal_compact_size",journal_compact_size,
             "default_recording_time",defaultDurationHour,defaultDurationMin,
             "xawtv_station file",xawtv_channel_file,
             "default_profile",default_transcoding_profile,
@@ -2625,7 +2642,8 @@ _cmd_updatexmlfile(const char *cmd, int sockfd) {
         return;        
     }
 
-    if (writeXMLFile(xmldbfile) >= 0 ) {
+    // This also starts a new empty journal
+    if (write_xmldb() >= 0 ) {
         snprintf(msgbuff, 255,"Database successfully updated '%s'\n", xmldbfile);
         msgbuff[255] = '\0' ;
         logmsg(LOG_INFO,msgbuff);
@@ -2666,13 +2684,13 @@ _cmd_nextrec(const char *cmd, int sockfd) {
         if (num_entries[video] > 0) {
             /*
             time_t ts_now = time(NULL);
-            time_t until = recs[REC_IDX(video, 0)]->ts_start - ts_now;
+            time_t until = rec_top(video)->ts_start - ts_now;
             //int days = until / (24*3600);
             int hours = until/3600;
             int minutes = (until - hours*3600)/60;
             _writef(sockfd,"(%02d:%02d) : ",hours,minutes);
             */
-            dump_record(recs[REC_IDX(video, 0)], cmd[1] == 'l' ? 2 : 0, 0,  tmpbuff, 512);
+            dump_record(rec_top(video), cmd[1] == 'l' ? 2 : 0, 0,  tmpbuff, 512);
             _writef(sockfd,tmpbuff);
         }
     }
@@ -2982,10 +3000,10 @@ _cmd_killtranscoding(const char *cmd, int sockfd) {
     if( ret == 2 ) {
 
         int tidx = xatoi(field[1]);
-        char *filename = (char *)NULL;
-        if( ongoing_transcodings[tidx] && ongoing_transcodings[tidx]->filename ) {
+        char filename[256];
+        time_t start_ts;
+        if( 0 == get_ongoing_transcoding(tidx, &start_ts, filename, sizeof(filename)) ) {
 
-            filename = strdup(ongoing_transcodings[tidx]->filename);
             if( -1 == kill_ongoing_transcoding(tidx) ) {
                 logmsg(LOG_ERR,"Transcoding with index=%d does not exist.",tidx);
                 _writef(sockfd,"Transcoding with index=%d does not exist.\n",tidx);
@@ -2993,7 +3011,6 @@ _cmd_killtranscoding(const char *cmd, int sockfd) {
                 logmsg(LOG_DEBUG,"Stopped transcoding with index=%d ('%s')",tidx,filename);
                 _writef(sockfd,"Stopped transcoding of '%s'\n",filename);
             }
-            free(filename);
 
         } else {
             logmsg(LOG_ERR,"Transcoding with index=%d does not exist.",tidx);
@@ -3339,15 +3356,125 @@ _cmd_list_waiting_transcodings(const char *cmd, int sockfd) {
     _writef(sockfd,buff);
 }
 
+/**
+ * Read a date of the form yyyy-mm-dd, or yyyy-mm if day is NULL, from the value
+ * of a history option
+ * @param val
+ * @param[out] year
+ * @param[out] month
+ * @param[out] day
+ * @return 0 on success, -1 if the date is not valid
+ */
+static int
+_cmd_history_date(const char *val, int *year, int *month, int *day) {
+    int n = -1;
+    if( day ) {
+        (void)sscanf(val, "%4d-%2d-%2d%n", year, month, day, &n);
+    } else {
+        (void)sscanf(val, "%4d-%2d%n", year, month, &n);
+    }
+    if( n < 0 || val[n] || *year < 1970 || *month < 1 || *month > 12 || (day && (*day < 1 || *day > 31)) ) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read the options of the history command into a query. The options come first
+ * and anything after them is the title.
+ * @param args The command line after the command name. Modified in place.
+ * @param[out] q
+ * @return 0 on success, -1 on a syntax error
+ */
+static int
+_cmd_history_query(char *args, struct hist_query *q) {
+    int y, m, d;
+    CLEAR(*q);
+    q->pagesize = HISTORY_PAGESIZE;
+
+    char *p = args;
+    while( *p ) {
+        while( *p == ' ' ) {
+            p++;
+        }
+        if( *p == '\0' ) {
+            break;
+        }
+        char *tok = p;
+        while( *p && *p != ' ' ) {
+            p++;
+        }
+        if( *p ) {
+            *p++ = '\0';
+        }
+
+        if( isdigit((unsigned char)*tok) ) {
+            q->pagesize = (size_t)xatoi(tok);
+            if( q->pagesize < 1 || q->pagesize > HISTORY_MAXPAGESIZE ) {
+                return -1;
+            }
+        } else if( 0 == strncmp(tok, "p=", 2) ) {
+            const int page = xatoi(tok + 2);
+            if( page < 1 || page > 1000000 ) {
+                return -1;
+            }
+            q->page = (size_t)(page - 1);
+        } else if( *tok == '@' && tok[1] ) {
+            q->profile = tok + 1;
+        } else if( 0 == strncmp(tok, "from=", 5) ) {
+            if( -1 == _cmd_history_date(tok + 5, &y, &m, &d) ) {
+                return -1;
+            }
+            q->from = totimestamp(y, m, d, 0, 0, 0);
+        } else if( 0 == strncmp(tok, "to=", 3) ) {
+            // The last day is included
+            if( -1 == _cmd_history_date(tok + 3, &y, &m, &d) ) {
+                return -1;
+            }
+            q->to = totimestamp(y, m, d + 1, 0, 0, 0);
+        } else if( 0 == strncmp(tok, "month=", 6) ) {
+            if( -1 == _cmd_history_date(tok + 6, &y, &m, NULL) ) {
+                return -1;
+            }
+            q->from = totimestamp(y, m, 1, 0, 0, 0);
+            q->to = m == 12 ? totimestamp(y + 1, 1, 1, 0, 0, 0) : totimestamp(y, m + 1, 1, 0, 0, 0);
+        } else {
+            // The rest of the line is the title
+            if( *p ) {
+                p[-1] = ' ';
+            }
+            q->title = tok;
+            break;
+        }
+    }
+    return 0;
+}
+
 static void
 _cmd_view_history(const char *cmd, int sockfd) {
     if (cmd[0] == 'h') {
         _writef(sockfd,
-                "Return a list of previous N transcodings\n"
+                "rh [n] [p=<page>] [@profile] [from=yyyy-mm-dd] [to=yyyy-mm-dd] [month=yyyy-mm] [title]\n"
+                "              - List previous transcodings, latest first, n (default %d) on each page.\n"
+                "                Only list the transcodings with the profile, starting between the dates\n"
+                "                or in the month, and with the title. For a repeated recording the title\n"
+                "                is the base title of the series.\n",
+                HISTORY_PAGESIZE
                 );
         return;
     }
-    hist_list(sockfd);
+
+    char args[512];
+    struct hist_query q;
+    strncpy(args, cmd + 2, sizeof(args) - 1);
+    args[sizeof(args) - 1] = '\0';
+    if( -1 == _cmd_history_query(args, &q) ) {
+        _cmd_syntaxerror(cmd, sockfd);
+        return;
+    }
+    if( -1 == hist_list(sockfd, &q) ) {
+        _writef(sockfd,"Could NOT read the history.\n");
+    }
 }
 
 static void
@@ -3433,6 +3560,24 @@ cmdinit(void) {
     cmdtable[CMD_SET_IMAGE_CONTROLS]    = _cmd_set_image_controls;
     cmdtable[CMD_SET_AUDIO_CONTROLS]    = _cmd_set_audio_controls;
     cmdtable[CMD_SET_VOLUME]            = _cmd_set_volume;
+
+    cmdlockfree[CMD_LIST]               = 1;
+    cmdlockfree[CMD_LIST_TS]            = 1;
+    cmdlockfree[CMD_LIST_RECHUMAN]      = 1;
+    cmdlockfree[CMD_LISTRECREC]         = 1;
+    cmdlockfree[CMD_LISTRECSINGLE]      = 1;
+    cmdlockfree[CMD_GETXML]             = 1;
+    cmdlockfree[CMD_GETXMLHTML]         = 1;
+    cmdlockfree[CMD_MAILLIST_HTML]      = 1;
+    cmdlockfree[CMD_MAILLIST_RECSINGLE_HTML] = 1;
+    cmdlockfree[CMD_DISK_USED]          = 1;
+    cmdlockfree[CMD_TIME]               = 1;
+    cmdlockfree[CMD_VERSION]            = 1;
+    cmdlockfree[CMD_ONGOINGTRANS]       = 1;
+    cmdlockfree[CMD_KILLTRANSCODING]    = 1;
+    cmdlockfree[CMD_LISTWAITINGTRANSC]  = 1;
+    cmdlockfree[CMD_VIEWHIST]           = 1;
+    cmdlockfree[CMD_MAILHIST]           = 1;
 }
 
 /**
@@ -3447,8 +3592,8 @@ struct cmd_entry {
     int  cmd_idx;
 };
 
-static ptrcmd
-_getCmdPtr(const char *cmd) {
+static int
+_getCmdIdx(const char *cmd) {
 
     // We dispatch to command handler based on the first character
     // value. It is then up to the command handler to verify the
@@ -3567,12 +3712,17 @@ _getCmdPtr(const char *cmd) {
         cmd -= 2;
 
     if (i < cmdlen) {
-        return cmdtable[cmdfunc[i].cmd_idx];
+        return cmdfunc[i].cmd_idx;
     } else {
-        return cmdtable[CMD_UNDEFINED];
+        return CMD_UNDEFINED;
     }
 }
 
+static ptrcmd
+_getCmdPtr(const char *cmd) {
+    return cmdtable[_getCmdIdx(cmd)];
+}
+
 /**
  * Read a command string and execute the corresponding command giving the rest
  * of the command string as argument for that specific command to deal with
@@ -3588,7 +3738,16 @@ cmdinterp(char *cmd, int sockfd) {
             --n;
         cmd[n] = '\0';
     }
-    (_getCmdPtr(cmd))(cmd,sockfd);
+    const int idx = _getCmdIdx(cmd);
+    if( cmdlockfree[idx] ) {
+        cmdtable[idx](cmd,sockfd);
+    } else {
+        // Commands might alter the data structures so only one thread at a time
+        // may run them. The readers take a new snapshot when they next need one.
+        lock_acquire(&recs_mutex, LOCK_RECS);
+        cmdtable[idx](cmd,sockfd);
+        lock_release(&recs_mutex, LOCK_RECS);
+    }
     _writef(sockfd,"\r\n"); // Add \r\n as an indication that the output from the command is finished
 
 }
@@ -63,7 +63,8 @@ extern "C" {
  * Command interpretator. Givena  command string and
  * socket to communnicate on the function will execute
  * the parsed command and write the output back to the given
- * descriptor.
+ * descriptor. Takes recs_mutex itself for the commands that need it
+ * so it must be called without it.
  * @param cmd
  * @param sockfd
  */
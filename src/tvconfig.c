@@ -48,6 +48,7 @@
 #include "recs.h"
 #include "tvplog.h"
 #include "listhtml.h"
+#include "capture.h"
 
 /*
  * The value of the following variables are read from the ini-file.
@@ -78,6 +79,43 @@ char logfile_name[256] = {'\0'};
 // Time resolution for checks
 unsigned time_resolution;
 
+// How the stream is moved from the encoder to the file
+int capture_mode;
+
+// Size in bytes of the per card capture buffer
+size_t capture_buffer_size;
+
+// Use a single capture thread for all cards
+int capture_reactor;
+
+// Reserve disk space for recordings when they start
+int preallocate_recordings;
+
+// Transcode single pass profiles while recording
+int live_transcoding;
+
+// Transcode all profiles of a recording at the same time
+int parallel_transcoding;
+
+// Seconds before the start of a recording that the card is setup
+int prewarm_lead;
+
+// Largest gap in seconds between two recordings that still hands the card over
+int handover_gap;
+
+// Build an I-frame index next to each recording
+int gop_index;
+
+// Days ahead that occurrences of repeated recordings are scheduled
+int series_horizon;
+
+// Cost of using each card and of each pending recording on a card
+int card_cost[16];
+int card_load_cost;
+
+// Number of journal entries before they are merged into the XML DB
+int journal_compact_size;
+
 // The default base data diectory
 char datadir[256];
 
@@ -376,6 +414,33 @@ read_inisettings(void) {
     time_resolution     = (unsigned)validate(1,30,"time_resolution",
                                     iniparser_getint(dict, "config:time_resolution", TIME_RESOLUTION));
 
+    capture_mode = capture_modefromname(iniparser_getstring(dict, "config:capture_mode", DEFAULT_CAPTURE_MODE));
+    if( -1 == capture_mode ) {
+        logmsg(LOG_ERR,"Unknown capture_mode specified in config. Using default '%s'",DEFAULT_CAPTURE_MODE);
+        capture_mode = capture_modefromname(DEFAULT_CAPTURE_MODE);
+    }
+
+    capture_buffer_size = (size_t)validate(1,256,"capture_buffer_size",
+                                    iniparser_getint(dict, "config:capture_buffer_size", DEFAULT_CAPTURE_BUFFER_SIZE));
+    capture_buffer_size *= 1024*1024; // Convert to bytes
+
+    capture_reactor = iniparser_getboolean(dict, "config:capture_reactor", DEFAULT_CAPTURE_REACTOR);
+
+    preallocate_recordings = iniparser_getboolean(dict, "config:preallocate_recordings", DEFAULT_PREALLOCATE_RECORDINGS);
+    live_transcoding = iniparser_getboolean(dict, "config:live_transcoding", DEFAULT_LIVE_TRANSCODING);
+    parallel_transcoding = iniparser_getboolean(dict, "config:parallel_transcoding", DEFAULT_PARALLEL_TRANSCODING);
+    prewarm_lead = validate(0,PREWARM_MAX_LEAD,"prewarm_lead",
+                            iniparser_getint(dict, "config:prewarm_lead", DEFAULT_PREWARM_LEAD));
+    handover_gap = validate(0,600,"handover_gap",
+                            iniparser_getint(dict, "config:handover_gap", DEFAULT_HANDOVER_GAP));
+    gop_index = iniparser_getboolean(dict, "config:gop_index", DEFAULT_GOP_INDEX);
+    series_horizon = validate(1,366,"series_horizon",
+                              iniparser_getint(dict, "config:series_horizon", DEFAULT_SERIES_HORIZON));
+    card_load_cost = validate(0,1000,"card_load_cost",
+                              iniparser_getint(dict, "config:card_load_cost", DEFAULT_CARD_LOAD_COST));
+    journal_compact_size = validate(0,10000,"journal_compact_size",
+                                    iniparser_getint(dict, "config:journal_compact_size", DEFAULT_JOURNAL_COMPACT_SIZE));
+
     default_repeat_name_mangle_type = validate(0,2,"default_repeat_name_mangle_type",
                                     iniparser_getint(dict, "config:default_repeat_name_mangle_type", DEFAULT_REPEAT_NAME_MANGLE_TYPE));
 
@@ -468,6 +533,13 @@ read_inisettings(void) {
 
     use_mobile = iniparser_getboolean(dict, "config:use_mobile", USE_MOBILE);
 
+    // Cost of using each card for a new recording
+    for(unsigned int i=0; i < max_video && i<16; ++i) {
+        char costname[64];
+        snprintf(costname,64,"config:card_cost%d",i);
+        card_cost[i] = validate(0,1000,costname+7,iniparser_getint(dict, costname, DEFAULT_CARD_COST));
+    }
+
     // Try to read explicitely specified encoder devices
     for(unsigned int i=0; i < max_video && i<16; ++i) {
         char encoderdevice[64];
@@ -163,14 +163,130 @@ extern "C" {
 
 /*
  * TIME_RESOLUTION integer
- * This time determnes how often (in seconds) the daemon wakes up to check the pending list
- * of recordings if a recording is about to be started. In ractice this means that we can
- * be up to TIME_RESOLUTION s before the specified time when the recording starts. A loweer
- * value means better accuracy but higher system load. The default 3 seconds should be ok
- * for most circumstances.
+ * How many seconds before the specified time a recording is started. The daemon
+ * sleeps until this time for the next recording and is woken up whenever the list
+ * of recordings changes. This is also how often a recording is retried while the
+ * previous recording on the same card has not yet stopped.
  */
 #define TIME_RESOLUTION 3
 
+/*
+ * DEFAULT_CAPTURE_MODE string
+ * How the MPEG stream is moved from the encoder to the recording file.
+ * "splice" moves the data through a kernel pipe without copying it into user
+ * space and falls back to "readwrite" if the driver does not support it.
+ * "uring" uses io_uring for both reads and writes and falls back to
+ * "readwrite" if the kernel does not support it.
+ */
+#define DEFAULT_CAPTURE_MODE "splice"
+
+/*
+ * DEFAULT_CAPTURE_BUFFER_SIZE integer
+ * Size (in MB) of the per card buffer between the thread reading the stream
+ * from the card and the thread writing it to disk. At a typical bitrate of
+ * 6 Mbps 8 MB will absorb a disk stall of roughly 10 s without losing data.
+ */
+#define DEFAULT_CAPTURE_BUFFER_SIZE 8
+
+/*
+ * DEFAULT_CAPTURE_REACTOR boolean
+ * Use a single epoll driven thread to capture the stream from all cards instead
+ * of one thread per ongoing recording
+ */
+#define DEFAULT_CAPTURE_REACTOR 0
+
+/*
+ * DEFAULT_PREALLOCATE_RECORDINGS boolean
+ * Reserve disk space for the whole recording with fallocate() when the
+ * recording file is created. The expected size is based on the learned
+ * MP2 size per minute for the profile (see stats.c).
+ */
+#define DEFAULT_PREALLOCATE_RECORDINGS 1
+
+/*
+ * PREALLOCATE_MARGIN integer
+ * Extra space (in percent of the expected size) reserved when preallocating a
+ * recording file to allow for variations in the bitrate
+ */
+#define PREALLOCATE_MARGIN 10
+
+/*
+ * DEFAULT_LIVE_TRANSCODING boolean
+ * Transcode while recording by feeding the stream directly to ffmpeg instead
+ * of transcoding the MP2 file after the recording has ended. Only used for
+ * single pass profiles.
+ */
+#define DEFAULT_LIVE_TRANSCODING 0
+
+/*
+ * DEFAULT_PARALLEL_TRANSCODING boolean
+ * Transcode a recording with all its profiles at the same time instead of one
+ * profile after another
+ */
+#define DEFAULT_PARALLEL_TRANSCODING 1
+
+/*
+ * DEFAULT_PREWARM_LEAD integer
+ * Number of seconds before the start of a recording that the card is opened,
+ * tuned and configured so that the capture can start exactly at the start
+ * time. The lead is automatically increased for cards that are slow to setup.
+ * 0 disables pre-warming.
+ */
+#define DEFAULT_PREWARM_LEAD 5
+
+/*
+ * PREWARM_MAX_LEAD integer
+ * The largest lead time used for pre-warming regardless of the measured setup
+ * time for the card
+ */
+#define PREWARM_MAX_LEAD 60
+
+/*
+ * DEFAULT_HANDOVER_GAP integer
+ * If the next recording on a card starts at most this many seconds after the
+ * ongoing recording ends the card is kept open and switched over to the next
+ * recording without any gap in the capture. 0 disables handover. Off by
+ * default since not all drivers accept encoder changes while capturing.
+ */
+#define DEFAULT_HANDOVER_GAP 0
+
+/*
+ * DEFAULT_GOP_INDEX boolean
+ * Build an index of the I-frames in the stream while it is recorded. The index
+ * is stored next to the MP2 file.
+ */
+#define DEFAULT_GOP_INDEX 0
+
+/*
+ * DEFAULT_SERIES_HORIZON integer
+ * Number of days ahead that the occurrences of a repeated recording are added
+ * to the schedule. Later occurrences are generated when they come within range.
+ */
+#define DEFAULT_SERIES_HORIZON 14
+
+/*
+ * DEFAULT_CARD_COST integer
+ * Cost of putting a recording on a video card when no card_cost<n> is given.
+ * A new recording that is added without a card goes on the cheapest card(s)
+ * that are free.
+ */
+#define DEFAULT_CARD_COST 0
+
+/*
+ * DEFAULT_CARD_LOAD_COST integer
+ * Extra cost per pending recording already on a video card. With 0 the card
+ * with the lowest number is used when all cards cost the same.
+ */
+#define DEFAULT_CARD_LOAD_COST 0
+
+/*
+ * DEFAULT_JOURNAL_COMPACT_SIZE integer
+ * Number of changes kept in the journal next to the XML DB before they are
+ * merged into the XML DB file by the writer thread. With 0 the whole XML DB is
+ * written after each change (bursts of changes are still written once).
+ */
+#define DEFAULT_JOURNAL_COMPACT_SIZE 100
+
 /*
  * VIDEO_DEVICE_BASENAME string
  * Basename of video device. Each stream will be assumed accessible as
@@ -436,6 +552,43 @@ extern char logfile_name[];
 // Time resolution for checks
 extern unsigned time_resolution;
 
+// How the stream is moved from the encoder to the file (see capture.h)
+extern int capture_mode;
+
+// Size in bytes of the per card capture buffer
+extern size_t capture_buffer_size;
+
+// Use a single capture thread for all cards
+extern int capture_reactor;
+
+// Reserve disk space for recordings when they start
+extern int preallocate_recordings;
+
+// Transcode while recording
+extern int live_transcoding;
+
+// Transcode all profiles of a recording at the same time
+extern int parallel_transcoding;
+
+// Seconds before the start of a recording that the card is setup
+extern int prewarm_lead;
+
+// Hand the card over to the next recording if it starts within this many seconds
+extern int handover_gap;
+
+// Write an index of the I-frames next to the MP2 file
+extern int gop_index;
+
+// Days ahead that the occurrences of repeated recordings are put in the schedule
+extern int series_horizon;
+
+// Cost of each video card and of each pending recording on a card
+extern int card_cost[];
+extern int card_load_cost;
+
+// Number of changes in the journal before it is merged into the XML DB
+extern int journal_compact_size;
+
 // The default base data diectory
 extern char datadir[];
 
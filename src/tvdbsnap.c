@@ -0,0 +1,620 @@
+/* =========================================================================
+ * File:        TVDBSNAP.C
+ * Description: Binary snapshot of the recording database that is read
+ *              back at startup instead of parsing the XML DB file.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "tvdbsnap.h"
+#include "tvconfig.h"
+#include "transcprofile.h"
+#include "strpool.h"
+#include "tvplog.h"
+#include "recs.h"
+
+/*
+ * DBSNAP_MAGIC string
+ * First bytes of a snapshot file
+ */
+#define DBSNAP_MAGIC "TVPVRSNP"
+
+/*
+ * File header. All numbers are in the byte order of the machine that wrote the
+ * file, which is the one that reads it back.
+ */
+struct dbsnap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;            /* Generation of the XML DB file */
+    uint32_t max_video;             /* Settings the schedule was built with */
+    uint32_t max_entries;
+    uint32_t global_seqnbr;
+    uint32_t recurrence_id;
+    uint32_t num_entries;
+    uint32_t num_series;
+    uint32_t num_excluded;
+    uint32_t crc;                   /* CRC-32 of everything after the header */
+    uint64_t data_len;              /* Size of everything after the header */
+    int64_t xml_mtime;              /* The XML DB file written with the snapshot */
+    int64_t xml_mtime_nsec;
+    uint64_t xml_size;
+    uint64_t xml_ino;
+};
+
+/*
+ * A recording. The strings are offsets into the data block where offset 0 is
+ * the empty string.
+ */
+struct dbsnap_rec {
+    int64_t ts_start;
+    int64_t ts_end;
+    uint32_t seqnbr;
+    uint32_t video;
+    uint32_t recurrence_id;
+    uint32_t recurrence_num;
+    uint32_t recurrence_start_number;
+    int32_t recurrence;
+    int32_t recurrence_type;
+    int32_t recurrence_mangling;
+    char recurrence_mangling_prefix[8];
+    uint32_t title;
+    uint32_t filename;
+    uint32_t channel;
+    uint32_t recurrence_title;
+    uint32_t recurrence_filename;
+    uint32_t profiles[REC_MAX_TPROFILES];
+};
+
+/*
+ * A repeated recording. The video streams of the occurrences are an offset into
+ * the data block, 0 if all occurrences are on the video stream of the rule.
+ */
+struct dbsnap_series {
+    struct dbsnap_rec rule;
+    int64_t ts_last;
+    uint32_t id;
+    uint32_t first_seqnbr;
+    uint32_t next_idx;
+    uint32_t cards;
+};
+
+/*
+ * The deleted occurrences of a repeated recording. The words of the bitmap are
+ * an offset into the data block.
+ */
+struct dbsnap_excluded {
+    uint32_t id;
+    uint32_t first;
+    uint32_t nwords;
+    uint32_t words;
+};
+
+/*
+ * Growing buffer the file is built in
+ */
+struct dbsnap_buf {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed;                 /* Set if out of memory */
+};
+
+/**
+ * Name of the snapshot or of a temporary file next to the XML DB
+ * @param xmlfile
+ * @param suffix
+ * @param buffer
+ * @param maxlen
+ * @return 0 on success, -1 if the name is too long
+ */
+static int
+_dbsnap_name(const char *xmlfile, const char *suffix, char *buffer, size_t maxlen) {
+    const int len = snprintf(buffer, maxlen, "%s%s%s", xmlfile, DBSNAP_SUFFIX, suffix);
+    return len < 0 || (size_t)len >= maxlen ? -1 : 0;
+}
+
+/**
+ * Update a CRC-32 (IEEE 802.3) with more data
+ * @param crc CRC of the data before, 0 to start
+ * @param data
+ * @param len
+ * @return The updated CRC
+ */
+static uint32_t
+_dbsnap_crc(uint32_t crc, const void *data, size_t len) {
+    uint32_t table[256];
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    const unsigned char *p = data;
+    crc = ~crc;
+    while( len-- > 0 ) {
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * Append data to a buffer
+ * @param b
+ * @param data
+ * @param len
+ * @return Offset of the data in the buffer
+ */
+static uint32_t
+_dbsnap_add(struct dbsnap_buf *b, const void *data, size_t len) {
+    if( b->failed || b->len + len > UINT32_MAX ) {
+        b->failed = 1;
+        return 0;
+    }
+    if( b->len + len > b->size ) {
+        size_t size = b->size ? b->size : 4096;
+        while( size < b->len + len ) {
+            size *= 2;
+        }
+        char *tmp = realloc(b->data, size);
+        if( tmp == NULL ) {
+            b->failed = 1;
+            return 0;
+        }
+        b->data = tmp;
+        b->size = size;
+    }
+    const size_t off = b->len;
+    memcpy(b->data + off, data, len);
+    b->len += len;
+    return (uint32_t)off;
+}
+
+/**
+ * Append a string to the data block
+ * @param b
+ * @param str
+ * @return Offset of the string
+ */
+static uint32_t
+_dbsnap_addstr(struct dbsnap_buf *b, const char *str) {
+    return *str ? _dbsnap_add(b, str, strlen(str) + 1) : 0;
+}
+
+/**
+ * Fill in the file record for a recording
+ * @param r
+ * @param e
+ * @param data Data block for the strings
+ */
+static void
+_dbsnap_putrec(struct dbsnap_rec *r, const struct recording_entry *e, struct dbsnap_buf *data) {
+    memset(r, 0, sizeof (*r));
+    r->ts_start = e->ts_start;
+    r->ts_end = e->ts_end;
+    r->seqnbr = e->seqnbr;
+    r->video = e->video;
+    r->recurrence_id = e->recurrence_id;
+    r->recurrence_num = e->recurrence_num;
+    r->recurrence_start_number = e->recurrence_start_number;
+    r->recurrence = e->recurrence;
+    r->recurrence_type = e->recurrence_type;
+    r->recurrence_mangling = e->recurrence_mangling;
+    memcpy(r->recurrence_mangling_prefix, e->recurrence_mangling_prefix, REC_MAX_NPREFIX);
+    r->title = _dbsnap_addstr(data, e->title);
+    r->filename = _dbsnap_addstr(data, e->filename);
+    r->channel = _dbsnap_addstr(data, e->channel);
+    r->recurrence_title = _dbsnap_addstr(data, e->recurrence_title);
+    r->recurrence_filename = _dbsnap_addstr(data, e->recurrence_filename);
+    for (int k = 0; k < REC_MAX_TPROFILES; k++) {
+        r->profiles[k] = _dbsnap_addstr(data, e->transcoding_profiles[k]);
+    }
+}
+
+/**
+ * Write a whole buffer to a file
+ * @param fd
+ * @param buffer
+ * @param len
+ * @return 0 on success, -1 on failure
+ */
+static int
+_dbsnap_writeall(int fd, const char *buffer, size_t len) {
+    while( len > 0 ) {
+        const ssize_t n = write(fd, buffer, len);
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Write a snapshot of the schedule next to the XML DB file that has just been
+ * written from it. The snapshot is first written and synced to a temporary
+ * file that then replaces the old snapshot.
+ * @param xmlfile Name of the XML DB file
+ * @param s
+ * @param generation Generation of the XML DB file
+ * @return 0 on success, -1 on failure
+ */
+int
+write_dbsnap(const char *xmlfile, const struct recs_snapshot *s, unsigned generation) {
+    char filename[300], tmpname[300];
+    struct dbsnap_header hdr;
+    struct dbsnap_buf recs = {NULL, 0, 0, 0}, data = {NULL, 0, 0, 0};
+    struct stat st;
+
+    if( -1 == _dbsnap_name(xmlfile, "", filename, sizeof(filename)) ||
+        -1 == _dbsnap_name(xmlfile, ".tmp", tmpname, sizeof(tmpname)) ) {
+        logmsg(LOG_ERR, "Name of XML DB '%s' is too long.", xmlfile);
+        return -1;
+    }
+    if( -1 == stat(xmlfile, &st) ) {
+        logmsg(LOG_ERR, "Cannot write DB snapshot. XML DB '%s' is missing. (%d : %s)",
+               xmlfile, errno, strerror(errno));
+        return -1;
+    }
+
+    // Offset 0 in the data block is the empty string
+    (void)_dbsnap_add(&data, "", 1);
+    for (size_t i = 0; i < s->num; i++) {
+        struct dbsnap_rec r;
+        _dbsnap_putrec(&r, s->entries[i], &data);
+        (void)_dbsnap_add(&recs, &r, sizeof (r));
+    }
+    for (size_t i = 0; i < s->num_series; i++) {
+        const struct snapshot_series *ss = &s->series[i];
+        struct dbsnap_series r;
+        memset(&r, 0, sizeof (r));
+        _dbsnap_putrec(&r.rule, ss->rule, &data);
+        r.ts_last = ss->ts_last;
+        r.id = ss->id;
+        r.first_seqnbr = ss->first_seqnbr;
+        r.next_idx = ss->next.idx;
+        if( ss->cards ) {
+            r.cards = _dbsnap_add(&data, ss->cards, ss->rule->recurrence_num);
+        }
+        (void)_dbsnap_add(&recs, &r, sizeof (r));
+    }
+    for (size_t i = 0; i < s->num_excluded; i++) {
+        const struct bitmap *b = &s->excluded[i].items;
+        struct dbsnap_excluded r;
+        r.id = s->excluded[i].id;
+        r.first = b->first;
+        r.nwords = b->nwords;
+        r.words = b->nwords ? _dbsnap_add(&data, b->words, b->nwords * sizeof (uint64_t)) : 0;
+        (void)_dbsnap_add(&recs, &r, sizeof (r));
+    }
+
+    memset(&hdr, 0, sizeof (hdr));
+    memcpy(hdr.magic, DBSNAP_MAGIC, sizeof (hdr.magic));
+    hdr.version = DBSNAP_VERSION;
+    hdr.generation = generation;
+    hdr.max_video = max_video;
+    hdr.max_entries = max_entries;
+    hdr.global_seqnbr = s->global_seqnbr;
+    hdr.recurrence_id = s->recurrence_id;
+    hdr.num_entries = (uint32_t)s->num;
+    hdr.num_series = (uint32_t)s->num_series;
+    hdr.num_excluded = (uint32_t)s->num_excluded;
+    hdr.data_len = recs.len + data.len;
+    hdr.crc = _dbsnap_crc(_dbsnap_crc(0, recs.data, recs.len), data.data, data.len);
+    hdr.xml_mtime = st.st_mtim.tv_sec;
+    hdr.xml_mtime_nsec = st.st_mtim.tv_nsec;
+    hdr.xml_size = (uint64_t)st.st_size;
+    hdr.xml_ino = (uint64_t)st.st_ino;
+
+    int ret = -1;
+    if( recs.failed || data.failed ) {
+        logmsg(LOG_ERR, "Cannot write DB snapshot '%s'. Out of memory.", filename);
+    } else {
+        const int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if( fd >= 0 ) {
+            ret = _dbsnap_writeall(fd, (const char *)&hdr, sizeof (hdr));
+            if( 0 == ret ) {
+                ret = _dbsnap_writeall(fd, recs.data, recs.len);
+            }
+            if( 0 == ret ) {
+                ret = _dbsnap_writeall(fd, data.data, data.len);
+            }
+            // Make sure the file is on disk before it replaces the old snapshot
+            if( 0 == ret ) {
+                ret = fsync(fd);
+            }
+            if( -1 == close(fd) ) {
+                ret = -1;
+            }
+        }
+        if( fd < 0 || -1 == ret || -1 == rename(tmpname, filename) ) {
+            logmsg(LOG_ERR, "Failed to write DB snapshot '%s'. (%d : %s)", filename, errno, strerror(errno));
+            (void)unlink(tmpname);
+            ret = -1;
+        }
+    }
+    free(recs.data);
+    free(data.data);
+    return ret;
+}
+
+/**
+ * Check that a snapshot file is complete, undamaged and belongs to the XML DB
+ * file
+ * @param hdr
+ * @param size Size of the snapshot file
+ * @param st The XML DB file
+ * @return NULL if the snapshot can be used, otherwise the reason why not
+ */
+static const char *
+_dbsnap_check(const struct dbsnap_header *hdr, size_t size, const struct stat *st) {
+    if( size < sizeof (*hdr) || memcmp(hdr->magic, DBSNAP_MAGIC, sizeof (hdr->magic)) ) {
+        return "not a snapshot";
+    }
+    if( hdr->version != DBSNAP_VERSION ) {
+        return "different version";
+    }
+    const uint64_t nrecs = (uint64_t)hdr->num_entries * sizeof (struct dbsnap_rec) +
+                           (uint64_t)hdr->num_series * sizeof (struct dbsnap_series) +
+                           (uint64_t)hdr->num_excluded * sizeof (struct dbsnap_excluded);
+    if( hdr->data_len != size - sizeof (*hdr) || nrecs >= hdr->data_len ) {
+        return "truncated";
+    }
+    const char *p = (const char *)hdr + sizeof (*hdr);
+    if( hdr->crc != _dbsnap_crc(0, p, hdr->data_len) || p[hdr->data_len - 1] != '\0' ) {
+        return "checksum mismatch";
+    }
+    if( hdr->xml_mtime != st->st_mtim.tv_sec || hdr->xml_mtime_nsec != st->st_mtim.tv_nsec ||
+        hdr->xml_size != (uint64_t)st->st_size || hdr->xml_ino != (uint64_t)st->st_ino ) {
+        return "XML DB has changed";
+    }
+    if( hdr->max_video != max_video || hdr->max_entries != max_entries ) {
+        return "video card settings have changed";
+    }
+    return NULL;
+}
+
+/**
+ * Create a recording from its file record
+ * @param r
+ * @param data Data block with the strings
+ * @param len Size of the data block, which ends with a '\0'
+ * @return The recording, NULL if the record is damaged or out of memory
+ */
+static struct recording_entry *
+_dbsnap_getrec(const struct dbsnap_rec *r, const char *data, size_t len) {
+    char *profiles[REC_MAX_TPROFILES + 1];
+    char prefix[REC_MAX_NPREFIX];
+
+    int bad = r->title >= len || r->filename >= len || r->channel >= len ||
+              r->recurrence_title >= len || r->recurrence_filename >= len ||
+              r->video >= max_video || r->ts_start >= r->ts_end;
+    for (int k = 0; k < REC_MAX_TPROFILES && !bad; k++) {
+        bad = r->profiles[k] >= len;
+    }
+    if( bad ) {
+        return NULL;
+    }
+
+    for (int k = 0; k < REC_MAX_TPROFILES; k++) {
+        profiles[k] = (char *)data + r->profiles[k];
+        if( *profiles[k] && !transcoding_profile_exist(profiles[k]) ) {
+            logmsg(LOG_NOTICE, "Transcoding profile %s does not exist. Falling back on default profile.", profiles[k]);
+            profiles[k] = default_transcoding_profile;
+        }
+    }
+    profiles[REC_MAX_TPROFILES] = NULL;
+
+    // newrec() resets the start number set with the 'ss' command
+    const int start_number = initial_recurrence_start_number;
+    struct recording_entry *e = newrec(data + r->title, data + r->filename,
+                                       (time_t)r->ts_start, (time_t)r->ts_end,
+                                       data + r->channel,
+                                       r->recurrence, r->recurrence_type, r->recurrence_num,
+                                       r->recurrence_mangling, profiles);
+    initial_recurrence_start_number = start_number;
+    if( e == NULL ) {
+        return NULL;
+    }
+
+    e->seqnbr = r->seqnbr;
+    e->video = r->video;
+    e->recurrence_id = r->recurrence_id;
+    e->recurrence_start_number = r->recurrence_start_number;
+    memcpy(prefix, r->recurrence_mangling_prefix, REC_MAX_NPREFIX - 1);
+    prefix[REC_MAX_NPREFIX - 1] = '\0';
+    strcpy(e->recurrence_mangling_prefix, prefix);
+
+    strpool_put(e->recurrence_title);
+    e->recurrence_title = strpool_get(data + r->recurrence_title);
+    strpool_put(e->recurrence_filename);
+    e->recurrence_filename = strpool_get(data + r->recurrence_filename);
+    if( e->recurrence_title == NULL || e->recurrence_filename == NULL ) {
+        freerec(e);
+        return NULL;
+    }
+    return e;
+}
+
+/**
+ * Build a schedule snapshot from a mapped snapshot file that has been checked
+ * @param hdr
+ * @return The snapshot, NULL if the file is damaged or out of memory
+ */
+static struct recs_snapshot *
+_dbsnap_build(const struct dbsnap_header *hdr) {
+    const struct dbsnap_rec *recs = (const struct dbsnap_rec *)(hdr + 1);
+    const struct dbsnap_series *series = (const struct dbsnap_series *)(recs + hdr->num_entries);
+    const struct dbsnap_excluded *excluded = (const struct dbsnap_excluded *)(series + hdr->num_series);
+    const char *data = (const char *)(excluded + hdr->num_excluded);
+    const size_t len = (size_t)hdr->data_len - (size_t)(data - (const char *)recs);
+
+    struct recs_snapshot *s = calloc(1, sizeof (struct recs_snapshot));
+    if( s == NULL ) {
+        return NULL;
+    }
+    s->refs = 1;
+    s->global_seqnbr = hdr->global_seqnbr;
+    s->recurrence_id = hdr->recurrence_id;
+    s->entries = calloc(hdr->num_entries + 1, sizeof (struct recording_entry *));
+    s->series = calloc(hdr->num_series + 1, sizeof (struct snapshot_series));
+    s->excluded = calloc(hdr->num_excluded + 1, sizeof (struct snapshot_excluded));
+    int ok = s->entries && s->series && s->excluded;
+
+    for (size_t i = 0; ok && i < hdr->num_entries; i++) {
+        ok = (s->entries[s->num] = _dbsnap_getrec(&recs[i], data, len)) != NULL;
+        s->num += ok;
+    }
+    for (size_t i = 0; ok && i < hdr->num_series; i++) {
+        const struct dbsnap_series *r = &series[i];
+        struct snapshot_series *ss = &s->series[s->num_series];
+        if( (ss->rule = _dbsnap_getrec(&r->rule, data, len)) == NULL ) {
+            ok = 0;
+            break;
+        }
+        s->num_series++;
+        const size_t n = ss->rule->recurrence_num;
+        if( r->cards ) {
+            ok = r->cards < len && n <= len - r->cards && (ss->cards = malloc(n)) != NULL;
+            if( ok ) {
+                memcpy(ss->cards, data + r->cards, n);
+                for (size_t k = 0; ok && k < n; k++) {
+                    ok = ss->cards[k] < max_video;
+                }
+            }
+        }
+        ss->id = r->id;
+        ss->first_seqnbr = r->first_seqnbr;
+        ss->next.idx = r->next_idx;
+        ss->ts_last = (time_t)r->ts_last;
+    }
+    for (size_t i = 0; ok && i < hdr->num_excluded; i++) {
+        const struct dbsnap_excluded *r = &excluded[i];
+        struct snapshot_excluded *se = &s->excluded[s->num_excluded];
+        const size_t n = (size_t)r->nwords * sizeof (uint64_t);
+        bitmap_init(&se->items);
+        ok = r->words < len && n <= len - r->words && (n == 0 || (se->items.words = malloc(n)) != NULL);
+        if( ok ) {
+            if( n > 0 ) {
+                memcpy(se->items.words, data + r->words, n);
+            }
+            se->items.first = r->first;
+            se->items.nwords = r->nwords;
+            se->id = r->id;
+            s->num_excluded++;
+        }
+    }
+
+    if( !ok ) {
+        recs_snapshot_put(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * Rebuild the schedule from the snapshot next to the XML DB file if there is
+ * one that matches the file. The schedule must be empty.
+ * @param xmlfile Name of the XML DB file
+ * @param[out] generation Generation of the XML DB file
+ * @return 0 if the schedule was rebuilt, -1 if the XML DB file has to be read
+ */
+int
+read_dbsnap(const char *xmlfile, unsigned *generation) {
+    char filename[300];
+    struct stat st, xst;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if( -1 == _dbsnap_name(xmlfile, "", filename, sizeof(filename)) || -1 == stat(xmlfile, &xst) ) {
+        return -1;
+    }
+    const int fd = open(filename, O_RDONLY);
+    if( fd < 0 ) {
+        if( errno != ENOENT ) {
+            logmsg(LOG_NOTICE, "Cannot open DB snapshot '%s'. (%d : %s)", filename, errno, strerror(errno));
+        }
+        return -1;
+    }
+    if( -1 == fstat(fd, &st) || st.st_size == 0 ) {
+        close(fd);
+        logmsg(LOG_NOTICE, "Ignoring DB snapshot '%s'. File is empty.", filename);
+        return -1;
+    }
+    const size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map == MAP_FAILED ) {
+        logmsg(LOG_NOTICE, "Cannot map DB snapshot '%s'. (%d : %s)", filename, errno, strerror(errno));
+        return -1;
+    }
+
+    const struct dbsnap_header *hdr = map;
+    struct recs_snapshot *s = NULL;
+    const char *reason = _dbsnap_check(hdr, size, &xst);
+    if( reason == NULL && (s = _dbsnap_build(hdr)) == NULL ) {
+        reason = "damaged recording";
+    }
+    const unsigned gen = reason == NULL ? hdr->generation : 0;
+    (void)munmap(map, size);
+
+    if( reason ) {
+        logmsg(LOG_NOTICE, "Ignoring DB snapshot '%s' (%s). Reading the XML DB instead.", filename, reason);
+        return -1;
+    }
+    const size_t num = s->num;
+    if( -1 == recs_restore(s) ) {
+        return -1;
+    }
+    *generation = gen;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    const long long ms = (long long)(t1.tv_sec - t0.tv_sec) * 1000LL + (t1.tv_nsec - t0.tv_nsec) / 1000000L;
+    logmsg(LOG_INFO, "Restored %zu recordings from DB snapshot '%s' in %lld ms.", num, filename, ms);
+    return 0;
+}
+
+/* tvdbsnap.c */
@@ -0,0 +1,92 @@
+/* =========================================================================
+ * File:        TVDBSNAP.H
+ * Description: Binary snapshot of the recording database that is read
+ *              back at startup instead of parsing the XML DB file.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+#ifndef _TVDBSNAP_H
+#define	_TVDBSNAP_H
+
+#include "recs.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every time the XML DB is written the same snapshot of the schedule is also
+ * written to <xmldb>.snap in a binary form that holds everything needed to put
+ * the schedule back as it was: the pending recordings with their sequence
+ * numbers and video streams, the rules and deleted occurrences of the repeated
+ * recordings and the sequence counters. At startup the file is mapped into
+ * memory and the schedule is rebuilt from it directly, without parsing any XML
+ * and without checking the recordings for collisions again.
+ *
+ * The file has a fixed size header followed by arrays of fixed size records and
+ * a block with the strings and other variable length data that the records
+ * refer to by offset. The header holds a checksum of the rest of the file and
+ * the size, modification time and inode of the XML DB file it was written
+ * together with. The snapshot is only used if all of it matches, so a snapshot
+ * from an older version, a damaged snapshot or one that is older than a hand
+ * edited XML DB is ignored and the XML DB is read instead. The XML DB stays the
+ * master copy and the format used to export the schedule.
+ */
+
+/*
+ * DBSNAP_VERSION integer
+ * Version of the snapshot file format
+ */
+#define DBSNAP_VERSION 1
+
+/*
+ * DBSNAP_SUFFIX string
+ * Added to the name of the XML DB file to get the name of the snapshot
+ */
+#define DBSNAP_SUFFIX ".snap"
+
+/**
+ * Write a snapshot of the schedule next to the XML DB file that has just been
+ * written from it
+ * @param xmlfile Name of the XML DB file
+ * @param s
+ * @param generation Generation of the XML DB file
+ * @return 0 on success, -1 on failure
+ */
+int
+write_dbsnap(const char *xmlfile, const struct recs_snapshot *s, unsigned generation);
+
+/**
+ * Rebuild the schedule from the snapshot next to the XML DB file if there is
+ * one that matches the file. The schedule must be empty.
+ * @param xmlfile Name of the XML DB file
+ * @param[out] generation Generation of the XML DB file
+ * @return 0 if the schedule was rebuilt, -1 if the XML DB file has to be read
+ */
+int
+read_dbsnap(const char *xmlfile, unsigned *generation);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _TVDBSNAP_H */
+
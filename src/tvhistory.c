@@ -31,24 +31,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
-#include <signal.h>
-#include <sys/wait.h>
-#include <math.h>
 #include <syslog.h>
 #include <errno.h>
-#include <sys/param.h> // Needed to get MIN()/MAX()
 #include <time.h>
+#include <sys/param.h> // Needed to get MIN()/MAX()
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <libgen.h> // Needed for dirname()
+#include <libgen.h> // Needed for basename()
 
 // XML2 lib headers
 #include <libxml2/libxml/parser.h>
 #include <libxml2/libxml/tree.h>
-#include <libxml2/libxml/xmlreader.h>
 
 #include "tvconfig.h"
 #include "tvhistory.h"
@@ -59,32 +57,136 @@
 #include "datetimeutil.h"
 #include "mailutil.h"
 #include "listhtml.h"
+#include "lockorder.h"
+#include "uhash.h"
+
+/*
+ * HISTLOG_VERSION integer
+ * Version of the history log format. Written in the first line of the log.
+ */
+#define HISTLOG_VERSION 1
+
+/*
+ * HISTLOG_NFIELDS integer
+ * Number of fields in each line of the history log
+ */
+#define HISTLOG_NFIELDS 6
+
+/*
+ * HISTIDX_MAGIC string
+ * First bytes of the history index file
+ */
+#define HISTIDX_MAGIC "TVPVRHIX"
+
+/*
+ * HISTIDX_VERSION integer
+ * Version of the history index format
+ */
+#define HISTIDX_VERSION 1
+
+/*
+ * HIST_POSTINGS_INITSIZE integer
+ * Room in a new list of entries for a title or profile
+ */
+#define HIST_POSTINGS_INITSIZE 8
 
 /**
- * Record for array of history records
+ * A recording in the history as read back from the log
  */
 struct histrec {
     char *title;
+    char *series;
     char *filepath;
     time_t ts_start;
     time_t ts_end;
     char *profile;
 };
-static struct histrec history[HISTORY_LENGTH];
-static size_t nrecs = 0;
 
 /*
-Example history file
- * 
- <tvrechistory version="1">
+ * Entry in the history index, one for each line in the log. The same layout is
+ * used in memory and in the index file.
+ */
+struct hist_entry {
+    int64_t ts_start;
+    uint64_t offset;            /* Position of the line in the log */
+    uint64_t title_hash;        /* Hash of the series title */
+    uint64_t profile_hash;      /* Hash of the profile name */
+    uint32_t len;               /* Length of the line including the newline */
+    uint32_t reserved;
+};
+
+/*
+ * Header of the history index file
+ */
+struct hist_idxheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entsize;           /* sizeof(struct hist_entry) */
+};
+
+/*
+ * Numbers of the entries with the same title or profile hash in the order they
+ * were added to the log
+ */
+struct hist_postings {
+    uint32_t *ids;
+    size_t num;
+    size_t size;
+    int ordered;                /* The entries are also in start time order */
+};
+
+/*
+ * One page from a query with the recordings read back from the log. The strings
+ * in the recordings point into buf.
+ */
+struct hist_page {
+    size_t total;               /* Number of recordings matching the query */
+    size_t first;               /* Rank of the first recording on the page */
+    size_t num;                 /* Number of recordings on the page */
+    struct histrec *recs;
+    char *buf;
+};
+
+/*
+ * The history index. hist_idx holds the entries in the order of the lines in the
+ * log and hist_bydate the entry numbers sorted on (start time, entry number).
+ * Both have room for hist_size entries.
+ */
+static struct hist_entry *hist_idx = NULL;
+static uint32_t *hist_bydate = NULL;
+static size_t hist_num = 0, hist_size = 0;
+
+/*
+ * Lists of entries by the low bits of the title and profile hashes
+ */
+static struct uhash hist_bytitle, hist_byprofile;
+
+/*
+ * The open history log and index and the length of the log
+ */
+static int hist_logfd = -1, hist_idxfd = -1;
+static off_t hist_logsize = 0;
+
+/*
+ * hist_mutex
+ * Protects the history. Recording threads add to it once the transcoding is done
+ * while clients list it.
+ */
+static pthread_mutex_t hist_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+Example of the old history file
+
+ <tvpvrdhistory version="2">
  <recording>
  <title></title>
- <start_ts></start_ts>
- <end_ts></end_ts>
- <filepath></filepath>
+ <timestampstart></timestampstart>
+ <timestampend></timestampend>
+ <filepath dir=""></filepath>
+ <profile></profile>
  </recording>
- </tvrechistory>
- 
+ </tvpvrdhistory>
+
  */
 
 #define XMLHISTDB_VERSIONNUM "2"
@@ -106,12 +208,12 @@ static const xmlChar *xmldb_nameFilepath = (xmlChar *) "filepath";
 static const xmlChar *xmldb_nameProfile = (xmlChar *) "profile";
 
 static void
-processRecord(xmlNodePtr node) {
+processRecord(xmlNodePtr node, struct histrec *hr) {
     xmlNodePtr childnode;
     xmlChar *xmldir;
     node = node->xmlChildrenNode;
     char fnamebuff[255];
-    
+
     /* Note: We only read the timestamp for the start and end since the
      * human readable form can be inferred from the timestamps
      */
@@ -121,19 +223,20 @@ processRecord(xmlNodePtr node) {
             childnode = node->xmlChildrenNode;
             if (xmlStrcmp(node->name, xmldb_nameStart) == 0) {
                 if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    history[nrecs].ts_start = xatol((char *) childnode->content);
+                    hr->ts_start = xatol((char *) childnode->content);
                 } else {
                     logmsg(LOG_NOTICE, "Corrupted history file at node: %s", node->name);
                 }
             } else if (xmlStrcmp(node->name, xmldb_nameEnd) == 0) {
                 if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    history[nrecs].ts_end = xatol((char *) childnode->content);
+                    hr->ts_end = xatol((char *) childnode->content);
                 } else {
                     logmsg(LOG_NOTICE, "Corrupted history file at node: %s", node->name);
                 }
             } else if (xmlStrcmp(node->name, xmldb_nameTitle) == 0) {
                 if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    history[nrecs].title = strdup((char *) childnode->content);
+                    free(hr->title);
+                    hr->title = strdup((char *) childnode->content);
                 } else {
                     logmsg(LOG_NOTICE, "Corrupted history file at node: %s", node->name);
                 }
@@ -141,9 +244,9 @@ processRecord(xmlNodePtr node) {
                        xmlStrcmp(node->name, xmldb_nameEndDate) == 0 ||
                        xmlStrcmp(node->name, xmldb_nameStartTime) == 0 ||
                        xmlStrcmp(node->name, xmldb_nameEndTime) == 0 ) {
-                
+
                 // Do nothing, we only read the timestamp
-                
+
             } else if (xmlStrcmp(node->name, xmldb_nameFilepath) == 0) {
                 if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
                     *fnamebuff = '\0';
@@ -151,22 +254,24 @@ processRecord(xmlNodePtr node) {
                     if( xmldir ) {
                         strncpy(fnamebuff,(char*)xmldir,sizeof(fnamebuff)-1);
                         strncat(fnamebuff,"/",sizeof(fnamebuff)-strnlen(fnamebuff,sizeof(fnamebuff))-1);
-                        strncat(fnamebuff,(char *)childnode->content,sizeof(fnamebuff)-strnlen(fnamebuff,sizeof(fnamebuff))-1);                    
+                        strncat(fnamebuff,(char *)childnode->content,sizeof(fnamebuff)-strnlen(fnamebuff,sizeof(fnamebuff))-1);
                         xmlFree(xmldir);
                     } else {
                         // version=1 old history style file
                         strncpy(fnamebuff,(char *)childnode->content,sizeof(fnamebuff)-1);
                     }
-                    history[nrecs].filepath = strdup(fnamebuff);
+                    free(hr->filepath);
+                    hr->filepath = strdup(fnamebuff);
                 } else {
                     logmsg(LOG_NOTICE, "Corrupted history file at node: %s", node->name);
                 }
             } else if (xmlStrcmp(node->name, xmldb_nameProfile) == 0) {
                 if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    history[nrecs].profile = strdup((char *) childnode->content);
+                    free(hr->profile);
+                    hr->profile = strdup((char *) childnode->content);
                 } else {
                     logmsg(LOG_NOTICE, "Corrupted history file at node: %s", node->name);
-                }                
+                }
             } else {
                 logmsg(LOG_NOTICE, "Unknown XML node name in history file: %s", node->name);
             }
@@ -176,16 +281,29 @@ processRecord(xmlNodePtr node) {
 }
 
 /**
- * Read old history file from file
+ * Free the strings of recordings read from the old history file
+ * @param hr
+ * @param num
+ */
+static void
+tvhist_free(struct histrec *hr, size_t num) {
+    for (size_t idx = 0; idx < num; ++idx) {
+        free(hr[idx].filepath);
+        free(hr[idx].title);
+        free(hr[idx].profile);
+    }
+    free(hr);
+}
+
+/**
+ * Read the old XML history file. The recordings are given latest first.
+ * @param xmlhistfile
+ * @param[out] hr Recordings read from the file
+ * @param[out] num Number of recordings
  * @return 0 on success , -1 on failure
  */
 static int
-tvhist_read(void) {
-    char xmlhistfile[256];
-
-    snprintf(xmlhistfile, sizeof (xmlhistfile) - 1, "%s/xmldb/%s", datadir, HISTORYDB_FILENAME);
-    xmlhistfile[sizeof (xmlhistfile) - 1] = '\0';
-
+tvhist_read(const char *xmlhistfile, struct histrec **hr, size_t *num) {
     xmlNodePtr node;
     xmlDocPtr doc;
     xmlChar *xmlver;
@@ -206,9 +324,9 @@ tvhist_read(void) {
 
     node = xmlDocGetRootElement(doc);
 
-    if (xmlStrcmp(node->name, xmldb_root)) {
-        logmsg(LOG_ERR, "XML file is not a proper history database file. Wrong root element. Found '%s' when expecting '%s'",
-                node->name, xmldb_root);
+    if (node == NULL || xmlStrcmp(node->name, xmldb_root)) {
+        logmsg(LOG_ERR, "XML file is not a proper history database file. Wrong root element. Expecting '%s'",
+                xmldb_root);
         xmlFreeDoc(doc);
         return -1;
     }
@@ -216,27 +334,37 @@ tvhist_read(void) {
     // Check that the version of the file is the expected
     xmlver = xmlGetProp(node, xmldb_nameVersion);
     if (xmlStrcmp(xmlver, xmldb_version)) {
-        logmsg(LOG_NOTICE, "Expected XML history DB version '%s' but found version '%s'. Will be converted to new version on save.", xmldb_version, xmlver);
+        logmsg(LOG_NOTICE, "Expected XML history DB version '%s' but found version '%s'.", xmldb_version, xmlver);
         if (xatoi((char *) xmlver) > xatoi((char *) xmldb_version)) {
             logmsg(LOG_NOTICE, "Can not handle a newer history DB version. Please upgrade daemon.");
+            xmlFree(xmlver);
             xmlFreeDoc(doc);
             return -1;
         }
     }
     xmlFree(xmlver);
-    
-    nrecs=0;
-    node = node->xmlChildrenNode;
-    while (node != NULL) {
+
+    size_t size = 0;
+    *hr = NULL;
+    *num = 0;
+    for (node = node->xmlChildrenNode; node != NULL; node = node->next) {
         if (xmlStrcmp(node->name, xmldb_nameRecording) == 0) {
-            processRecord(node);
-            ++nrecs;
-            logmsg(LOG_DEBUG,"Read history title: %s",history[nrecs-1].title);
+            if (*num == size) {
+                size = size ? 2 * size : HISTORY_LENGTH;
+                struct histrec *tmp = realloc(*hr, size * sizeof (struct histrec));
+                if (tmp == NULL) {
+                    tvhist_free(*hr, *num);
+                    xmlFreeDoc(doc);
+                    return -1;
+                }
+                *hr = tmp;
+            }
+            CLEAR((*hr)[*num]);
+            processRecord(node, &(*hr)[*num]);
+            ++*num;
         }
-        node = node->next;
     }
-       
-    
+
     xmlFreeDoc(doc);
     xmlCleanupParser();
 
@@ -244,171 +372,819 @@ tvhist_read(void) {
 }
 
 /**
- * Write history list to file
- * @return 0 on success , -1 on failure
+ * Hash of a title or profile name that does not depend on the case of the
+ * letters (FNV-1a)
+ * @param str
+ * @return Hash value
+ */
+static uint64_t
+_hist_hash(const char *str) {
+    uint64_t h = UINT64_C(14695981039346656037);
+    while( *str ) {
+        h ^= (unsigned char)tolower((unsigned char)*str++);
+        h *= UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+/**
+ * Key for a hash in the tables of entry lists. Different hashes can give the
+ * same key so the entries are always checked against the full hash.
+ * @param hash
+ * @return Key, never 0
+ */
+static unsigned
+_hist_key(uint64_t hash) {
+    const unsigned key = (unsigned)(hash ^ (hash >> 32));
+    return key ? key : 1;
+}
+
+/**
+ * Compare two entries on start time. Entries with the same start are in the
+ * order they were added.
+ * @return <0, 0, >0 if a is before, the same as or after b
+ */
+static int
+_hist_cmp(const void *a, const void *b) {
+    const uint32_t ia = *(const uint32_t *)a, ib = *(const uint32_t *)b;
+    if( hist_idx[ia].ts_start != hist_idx[ib].ts_start ) {
+        return hist_idx[ia].ts_start < hist_idx[ib].ts_start ? -1 : 1;
+    }
+    return ia < ib ? -1 : ia > ib;
+}
+
+/**
+ * Reverse of _hist_cmp() to sort the latest recordings first
+ */
+static int
+_hist_cmp_latest(const void *a, const void *b) {
+    return _hist_cmp(b, a);
+}
+
+/**
+ * Add an entry to the list for a hash
+ * @param h Table of lists
+ * @param hash
+ * @param id Entry number
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_hist_postings_add(struct uhash *h, uint64_t hash, uint32_t id) {
+    const unsigned key = _hist_key(hash);
+    struct hist_postings *p = uhash_get(h, key);
+    if( p == NULL ) {
+        p = calloc(1, sizeof (struct hist_postings));
+        if( p == NULL || -1 == uhash_put(h, key, p) ) {
+            free(p);
+            return -1;
+        }
+        p->ordered = 1;
+    }
+    if( p->num == p->size ) {
+        const size_t size = p->size ? 2 * p->size : HIST_POSTINGS_INITSIZE;
+        uint32_t *tmp = realloc(p->ids, size * sizeof (uint32_t));
+        if( tmp == NULL ) {
+            return -1;
+        }
+        p->ids = tmp;
+        p->size = size;
+    }
+    if( p->num > 0 && _hist_cmp(&p->ids[p->num-1], &id) > 0 ) {
+        p->ordered = 0;
+    }
+    p->ids[p->num++] = id;
+    return 0;
+}
+
+/**
+ * Free all lists in a table and the table itself
+ * @param h
+ */
+static void
+_hist_postings_free(struct uhash *h) {
+    for(size_t i=0; i < h->size; i++) {
+        if( h->keys[i] != 0 ) {
+            struct hist_postings *p = h->vals[i];
+            free(p->ids);
+            free(p);
+        }
+    }
+    uhash_free(h);
+}
+
+/**
+ * Add an entry to the index in memory and to the lists for its title and
+ * profile. The entry is not added to hist_bydate.
+ * @param e
+ * @return 0 on success, -1 if out of memory. The entry may still have been
+ * added to the index but not to all lists.
  */
 static int
-tvhist_write(void) {
-    char xmlhistfile[256];
-    int fd;
-
-    snprintf(xmlhistfile, sizeof (xmlhistfile) - 1, "%s/xmldb/%s", datadir, HISTORYDB_FILENAME);
-    xmlhistfile[sizeof (xmlhistfile) - 1] = '\0';
-    fd = open(xmlhistfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd == -1) {
-        logmsg(LOG_ERR, "Can't open '%s' XML history file for writing. (%d : %s) ",
-                xmlhistfile, errno, strerror(errno));
+_hist_add_entry(const struct hist_entry *e) {
+    if( hist_num == hist_size ) {
+        const size_t size = hist_size ? 2 * hist_size : 1024;
+        struct hist_entry *idx = realloc(hist_idx, size * sizeof (struct hist_entry));
+        if( idx == NULL ) {
+            return -1;
+        }
+        hist_idx = idx;
+        uint32_t *bydate = realloc(hist_bydate, size * sizeof (uint32_t));
+        if( bydate == NULL ) {
+            return -1;
+        }
+        hist_bydate = bydate;
+        hist_size = size;
+    }
+    const uint32_t id = (uint32_t)hist_num;
+    hist_idx[hist_num++] = *e;
+    if( -1 == _hist_postings_add(&hist_bytitle, e->title_hash, id) ||
+        -1 == _hist_postings_add(&hist_byprofile, e->profile_hash, id) ) {
         return -1;
     }
+    return 0;
+}
+
+/**
+ * Sort all entries on start time
+ */
+static void
+_hist_sort(void) {
+    for(size_t i=0; i < hist_num; i++) {
+        hist_bydate[i] = (uint32_t)i;
+    }
+    qsort(hist_bydate, hist_num, sizeof (uint32_t), _hist_cmp);
+}
+
+/**
+ * Position in hist_bydate of the first entry that starts at or after ts
+ * @param ts
+ * @return Position, hist_num if all entries start before ts
+ */
+static size_t
+_hist_lower(time_t ts) {
+    size_t lo = 0, hi = hist_num;
+    while( lo < hi ) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if( hist_idx[hist_bydate[mid]].ts_start < ts ) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
-    time_t now = time(NULL);
+/**
+ * Put the last added entry in its place in hist_bydate. Recordings are mostly
+ * added in time order so only a few entries have to be moved.
+ */
+static void
+_hist_insert_bydate(void) {
+    const uint32_t id = (uint32_t)(hist_num - 1);
+    size_t pos = hist_num - 1;
+    while( pos > 0 && hist_idx[hist_bydate[pos-1]].ts_start > hist_idx[id].ts_start ) {
+        pos--;
+    }
+    memmove(&hist_bydate[pos+1], &hist_bydate[pos], (hist_num - 1 - pos) * sizeof (uint32_t));
+    hist_bydate[pos] = id;
+}
 
-    // Test if the first write was ok then we assume that the rest will
-    // be ok as well. Not perfect but at least this way we will catch
-    // wrong permissions
+/**
+ * Split a log line in place into its fields and undo the escaping
+ * @param line Line without the trailing newline
+ * @param field
+ * @param maxfields
+ * @return Number of fields
+ */
+static size_t
+_hist_split(char *line, char *field[], size_t maxfields) {
+    size_t n = 0;
+    char *src = line, *dst = line;
+    field[n++] = dst;
+    while( *src ) {
+        if( *src == '\t' ) {
+            *dst++ = '\0';
+            if( n == maxfields ) {
+                return n;
+            }
+            field[n++] = dst;
+            src++;
+        } else if( *src == '\\' && src[1] ) {
+            src++;
+            *dst++ = *src == 't' ? '\t' : *src == 'n' ? '\n' : *src;
+            src++;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    return n;
+}
 
-    if (-1 == _writef(fd, 
-        "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"
-        "<?xml-stylesheet type=\"text/xsl\" href=\"%s/tvpvrd/xsl/%s\"?>\n",CONFDIR,HISTORY_XSL_FILENAME )) {
-        close(fd);
+/**
+ * Read a recording from a log line
+ * @param line Line without the trailing newline. Modified in place.
+ * @param[out] hr The recording. The strings point into the line.
+ * @return 0 on success, -1 if the line is not a valid history line
+ */
+static int
+_hist_parse(char *line, struct histrec *hr) {
+    char *field[HISTLOG_NFIELDS];
+    if( HISTLOG_NFIELDS != _hist_split(line, field, HISTLOG_NFIELDS) ) {
+        return -1;
+    }
+    char *end1, *end2;
+    hr->ts_start = (time_t)strtoll(field[0], &end1, 10);
+    hr->ts_end = (time_t)strtoll(field[1], &end2, 10);
+    if( end1 == field[0] || *end1 || end2 == field[1] || *end2 ) {
         return -1;
     }
-    _writef(fd, "<!-- Created: %s -->\n", ctime(&now));
-    _writef(fd, "<%s %s=\"%s\">\n", xmldb_root, xmldb_nameVersion, xmldb_version);
-    
-    // Convert timestamps to more human readable form
-    int syear, smonth, sday, shour, smin, ssec,
-        eyear, emonth, eday, ehour, emin, esec;
-    
-
-    char dirbuff[255];
-    for (size_t i = 0; i < nrecs; ++i) {
-        fromtimestamp(history[i].ts_start, &syear, &smonth, &sday, &shour, &smin, &ssec);
-        fromtimestamp(history[i].ts_end, &eyear, &emonth, &eday, &ehour, &emin, &esec);
-        _writef(fd, "  <%s>\n", xmldb_nameRecording);
-        _writef(fd, "    <%s>%s</%s>\n", xmldb_nameTitle, history[i].title, xmldb_nameTitle);
-        _writef(fd, "    <%s>%lld</%s>\n", xmldb_nameStart, (long long int)history[i].ts_start, xmldb_nameStart);
-        _writef(fd, "    <%s>%lld</%s>\n", xmldb_nameEnd, (long long int)history[i].ts_end, xmldb_nameEnd);
-        _writef(fd, "    <%s>%04d-%02d-%02d</%s>\n", xmldb_nameStartDate, syear, smonth, sday, xmldb_nameStartDate);
-        _writef(fd, "    <%s>%02d:%02d</%s>\n", xmldb_nameStartTime, shour, smin, xmldb_nameStartTime);
-        _writef(fd, "    <%s>%04d-%02d-%02d</%s>\n", xmldb_nameEndDate, eyear, emonth, eday, xmldb_nameEndDate);
-        _writef(fd, "    <%s>%02d:%02d</%s>\n", xmldb_nameEndTime, ehour, emin, xmldb_nameEndTime);        
-        
-        // We must make a copy since we are not safe in assuming dirname() will not modify the buffer
-        strncpy(dirbuff,history[i].filepath,sizeof(dirbuff)-1);
-        _writef(fd, "    <%s dir=\"%s\">%s</%s>\n", xmldb_nameFilepath, dirname(dirbuff), basename(history[i].filepath), xmldb_nameFilepath);
-        
-        _writef(fd, "    <%s>%s</%s>\n", xmldb_nameProfile, history[i].profile, xmldb_nameProfile);
-        _writef(fd, "  </%s>\n", xmldb_nameRecording);
-    }
-    _writef(fd, "</%s>\n", xmldb_root);
-    close(fd);
+    hr->title = field[2];
+    hr->series = field[3];
+    hr->profile = field[4];
+    hr->filepath = field[5];
     return 0;
+}
 
+/**
+ * Add a string field with escaped tabs, newlines and backslashes
+ * @param dst
+ * @param str
+ * @return End of the field
+ */
+static char *
+_hist_putstr(char *dst, const char *str) {
+    *dst++ = '\t';
+    for(; *str; str++) {
+        const char c = *str == '\t' ? 't' : *str == '\n' ? 'n' : *str;
+        if( c != *str || c == '\\' ) {
+            *dst++ = '\\';
+        }
+        *dst++ = c;
+    }
+    return dst;
 }
 
 /**
- * Free entire history vector
+ * Write the entries from first to the end of the index in memory to the index
+ * file. The file is not synced since it can be rebuilt from the log.
+ * @param first
  */
 static void
-tvhist_free(void) {
-    for (size_t idx = 0; idx < nrecs; ++idx) {
-        if (history[idx].filepath) {
-            free(history[idx].filepath);
-            history[idx].filepath = (char *) NULL;
+_hist_write_entries(size_t first) {
+    const size_t len = (hist_num - first) * sizeof (struct hist_entry);
+    const off_t pos = (off_t)(sizeof (struct hist_idxheader) + first * sizeof (struct hist_entry));
+    if( len > 0 && (ssize_t)len != pwrite(hist_idxfd, &hist_idx[first], len, pos) ) {
+        logmsg(LOG_ERR, "Cannot write history index ( %d : %s ). It will be rebuilt at next start.", errno, strerror(errno));
+        if( -1 == ftruncate(hist_idxfd, 0) ) {
+            logmsg(LOG_ERR, "Cannot truncate history index ( %d : %s )", errno, strerror(errno));
         }
-        if (history[idx].title) {
-            free(history[idx].title);
-            history[idx].title = (char *) NULL;
+    }
+}
+
+/**
+ * Append a recording to the history log and add it to the index. Must be called
+ * with hist_mutex held.
+ * @param hr
+ * @return 0 on success, -1 on failure
+ */
+static int
+_hist_append(const struct histrec *hr) {
+    const size_t maxlen = 2 * (strlen(hr->title) + strlen(hr->series) + strlen(hr->profile) +
+                               strlen(hr->filepath)) + 64;
+    char *line = malloc(maxlen);
+    if( line == NULL ) {
+        return -1;
+    }
+    char *p = line + snprintf(line, maxlen, "%lld\t%lld", (long long)hr->ts_start, (long long)hr->ts_end);
+    p = _hist_putstr(p, hr->title);
+    p = _hist_putstr(p, hr->series);
+    p = _hist_putstr(p, hr->profile);
+    p = _hist_putstr(p, hr->filepath);
+    *p++ = '\n';
+    const size_t len = (size_t)(p - line);
+
+    const ssize_t n = write(hist_logfd, line, len);
+    free(line);
+    if( n != (ssize_t)len || -1 == fdatasync(hist_logfd) ) {
+        logmsg(LOG_ERR, "Cannot write to history log ( %d : %s )", errno, strerror(errno));
+        // Remove what was written. If that fails the next line starts after it
+        // and the broken line is skipped when the log is indexed at startup.
+        struct stat st;
+        if( -1 == ftruncate(hist_logfd, hist_logsize) && 0 == fstat(hist_logfd, &st) ) {
+            hist_logsize = st.st_size;
         }
-        if (history[idx].profile) {
-            free(history[idx].profile);
-            history[idx].profile = (char *) NULL;
-        }        
+        return -1;
+    }
+
+    struct hist_entry e;
+    CLEAR(e);
+    e.ts_start = hr->ts_start;
+    e.offset = (uint64_t)hist_logsize;
+    e.len = (uint32_t)len;
+    e.title_hash = _hist_hash(hr->series);
+    e.profile_hash = _hist_hash(hr->profile);
+    hist_logsize += (off_t)len;
+    const size_t before = hist_num;
+    const int ret = _hist_add_entry(&e);
+    if( hist_num > before ) {
+        _hist_insert_bydate();
+        _hist_write_entries(before);
     }
-    nrecs = 0;
+    if( ret == -1 ) {
+        logmsg(LOG_ERR, "Out of memory when adding to the history index.");
+    }
+    return ret;
 }
 
 /**
- * Initialize history handling. The history is simply stored in a vector of history entries
+ * Index the lines in the log from the given position to the end and add them to
+ * the index file. An incomplete last line left by a crash is removed from the
+ * log.
+ * @param logname
+ * @param from Position of the first line to index
+ * @return 0 on success, -1 on failure
+ */
+static int
+_hist_scan(const char *logname, off_t from) {
+    FILE *fp = fopen(logname, "r");
+    if( fp == NULL || -1 == fseeko(fp, from, SEEK_SET) ) {
+        logmsg(LOG_ERR, "Cannot read history log '%s' ( %d : %s )", logname, errno, strerror(errno));
+        if( fp ) {
+            fclose(fp);
+        }
+        return -1;
+    }
+
+    const size_t first = hist_num;
+    char *line = NULL;
+    size_t linelen = 0;
+    ssize_t n;
+    off_t pos = from;
+    struct histrec hr;
+    struct hist_entry e;
+    int ret = 0;
+    while( (n = getline(&line, &linelen, fp)) > 0 ) {
+        if( line[n-1] != '\n' ) {
+            logmsg(LOG_NOTICE, "Removing incomplete last line in history log '%s'.", logname);
+            if( -1 == ftruncate(hist_logfd, pos) ) {
+                ret = -1;
+            }
+            break;
+        }
+        line[n-1] = '\0';
+        if( pos > 0 && *line != '#' ) {
+            CLEAR(e);
+            e.offset = (uint64_t)pos;
+            e.len = (uint32_t)n;
+            if( -1 == _hist_parse(line, &hr) ) {
+                logmsg(LOG_NOTICE, "Ignoring invalid line at offset %lld in history log '%s'.", (long long)pos, logname);
+            } else {
+                e.ts_start = hr.ts_start;
+                e.title_hash = _hist_hash(hr.series);
+                e.profile_hash = _hist_hash(hr.profile);
+                if( -1 == _hist_add_entry(&e) ) {
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+        pos += n;
+    }
+    free(line);
+    fclose(fp);
+    hist_logsize = pos;
+
+    if( hist_num > first ) {
+        logmsg(LOG_INFO, "Added %zu recordings from the history log to the index.", hist_num - first);
+        _hist_write_entries(first);
+    }
+    return ret;
+}
+
+/**
+ * Load the entries in the index file. Everything from the first entry that does
+ * not fit the log is thrown away and indexed again from the log.
+ * @return Position in the log after the last loaded entry
+ */
+static off_t
+_hist_loadidx(void) {
+    struct hist_idxheader hdr;
+    struct stat st;
+
+    CLEAR(st);
+    if( -1 == fstat(hist_idxfd, &st) || st.st_size < (off_t)sizeof (hdr) ||
+        (ssize_t)sizeof (hdr) != pread(hist_idxfd, &hdr, sizeof (hdr), 0) ||
+        memcmp(hdr.magic, HISTIDX_MAGIC, sizeof (hdr.magic)) ||
+        hdr.version != HISTIDX_VERSION || hdr.entsize != sizeof (struct hist_entry) ) {
+
+        if( st.st_size > 0 ) {
+            logmsg(LOG_NOTICE, "History index is not valid. Rebuilding it from the history log.");
+        }
+        CLEAR(hdr);
+        memcpy(hdr.magic, HISTIDX_MAGIC, sizeof (hdr.magic));
+        hdr.version = HISTIDX_VERSION;
+        hdr.entsize = sizeof (struct hist_entry);
+        if( -1 == ftruncate(hist_idxfd, 0) || (ssize_t)sizeof (hdr) != pwrite(hist_idxfd, &hdr, sizeof (hdr), 0) ) {
+            logmsg(LOG_ERR, "Cannot write history index ( %d : %s )", errno, strerror(errno));
+        }
+        return 0;
+    }
+
+    const size_t num = (size_t)(st.st_size - (off_t)sizeof (hdr)) / sizeof (struct hist_entry);
+    if( num == 0 ) {
+        return 0;
+    }
+    struct hist_entry *ent = malloc(num * sizeof (struct hist_entry));
+    if( ent == NULL ) {
+        return 0;
+    }
+    const size_t len = num * sizeof (struct hist_entry);
+    if( (ssize_t)len != pread(hist_idxfd, ent, len, sizeof (hdr)) ) {
+        free(ent);
+        return 0;
+    }
+
+    // Each line starts after the previous one and all of them are in the log
+    off_t end = 0;
+    size_t i;
+    for(i=0; i < num; i++) {
+        if( (off_t)ent[i].offset < end || ent[i].len == 0 ||
+            (off_t)(ent[i].offset + ent[i].len) > hist_logsize ||
+            -1 == _hist_add_entry(&ent[i]) ) {
+            break;
+        }
+        end = (off_t)(ent[i].offset + ent[i].len);
+    }
+    free(ent);
+    if( i < num ) {
+        logmsg(LOG_NOTICE, "History index does not match the history log after %zu recordings.", i);
+        // The entries from here are written again after the log has been indexed
+        if( -1 == ftruncate(hist_idxfd, (off_t)(sizeof (hdr) + i * sizeof (struct hist_entry))) ) {
+            logmsg(LOG_ERR, "Cannot truncate history index ( %d : %s )", errno, strerror(errno));
+        }
+    }
+    return end;
+}
+
+/**
+ * Import the recordings in the old XML history file into the log, the oldest
+ * first, and rename the file so that it is only imported once
+ * @param xmlhistfile
+ */
+static void
+_hist_import(const char *xmlhistfile) {
+    struct histrec *hr;
+    size_t num;
+    char newname[300];
+
+    if( -1 == tvhist_read(xmlhistfile, &hr, &num) ) {
+        logmsg(LOG_NOTICE, "Failed to read old history file '%s'. Not imported.", xmlhistfile);
+        return;
+    }
+    size_t imported = 0;
+    for(size_t i=num; i > 0; i--) {
+        struct histrec *r = &hr[i-1];
+        if( r->title == NULL || r->filepath == NULL || r->profile == NULL ) {
+            continue;
+        }
+        r->series = r->title;
+        if( -1 == _hist_append(r) ) {
+            break;
+        }
+        imported++;
+    }
+    tvhist_free(hr, num);
+
+    logmsg(LOG_INFO, "Imported %zu recordings from old history file '%s'.", imported, xmlhistfile);
+    snprintf(newname, sizeof (newname), "%s%s", xmlhistfile, HISTORYDB_IMPORTED_SUFFIX);
+    if( -1 == rename(xmlhistfile, newname) ) {
+        logmsg(LOG_ERR, "Cannot rename old history file '%s' ( %d : %s )", xmlhistfile, errno, strerror(errno));
+    }
+}
+
+/**
+ * Close the history log and free the index. Must be called with hist_mutex held.
+ */
+static void
+_hist_close(void) {
+    if( hist_logfd >= 0 ) {
+        _dbg_close(hist_logfd);
+        hist_logfd = -1;
+    }
+    if( hist_idxfd >= 0 ) {
+        _dbg_close(hist_idxfd);
+        hist_idxfd = -1;
+    }
+    if( hist_bytitle.keys ) {
+        _hist_postings_free(&hist_bytitle);
+        _hist_postings_free(&hist_byprofile);
+    }
+    free(hist_idx);
+    free(hist_bydate);
+    hist_idx = NULL;
+    hist_bydate = NULL;
+    hist_num = hist_size = 0;
+    hist_logsize = 0;
+}
+
+/**
+ * Open the history log and the index. Must be called with hist_mutex held.
+ * @return 0 on success, -1 on failure
+ */
+static int
+_hist_open(void) {
+    char logname[256], idxname[256], xmlhistfile[256];
+    struct stat st;
+    char hdrline[64];
+
+    snprintf(logname, sizeof (logname), "%s/xmldb/%s", datadir, HISTORYLOG_FILENAME);
+    snprintf(idxname, sizeof (idxname), "%s/xmldb/%s", datadir, HISTORYIDX_FILENAME);
+    snprintf(xmlhistfile, sizeof (xmlhistfile), "%s/xmldb/%s", datadir, HISTORYDB_FILENAME);
+
+    if( -1 == uhash_init(&hist_bytitle) || -1 == uhash_init(&hist_byprofile) ) {
+        return -1;
+    }
+
+    hist_logfd = open(logname, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( hist_logfd == -1 || -1 == fstat(hist_logfd, &st) ) {
+        logmsg(LOG_ERR, "Can't open history log '%s' ( %d : %s )", logname, errno, strerror(errno));
+        return -1;
+    }
+    if( st.st_size == 0 ) {
+        const int n = snprintf(hdrline, sizeof (hdrline), "tvpvrd-history %d\n", HISTLOG_VERSION);
+        if( n != write(hist_logfd, hdrline, (size_t)n) || -1 == fdatasync(hist_logfd) ) {
+            logmsg(LOG_ERR, "Can't write history log '%s' ( %d : %s )", logname, errno, strerror(errno));
+            return -1;
+        }
+        st.st_size = n;
+    } else {
+        int version = 0;
+        const ssize_t n = pread(hist_logfd, hdrline, sizeof (hdrline) - 1, 0);
+        hdrline[n > 0 ? n : 0] = '\0';
+        if( 1 != sscanf(hdrline, "tvpvrd-history %d", &version) || version != HISTLOG_VERSION ) {
+            logmsg(LOG_ERR, "'%s' is not a history log this version of the daemon can use.", logname);
+            return -1;
+        }
+    }
+    hist_logsize = st.st_size;
+
+    hist_idxfd = open(idxname, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( hist_idxfd == -1 ) {
+        logmsg(LOG_ERR, "Can't open history index '%s' ( %d : %s )", idxname, errno, strerror(errno));
+        return -1;
+    }
+
+    // Index whatever is in the log after the last entry in the index file
+    if( -1 == _hist_scan(logname, _hist_loadidx()) ) {
+        return -1;
+    }
+    _hist_sort();
+
+    if( hist_num == 0 && 0 == stat(xmlhistfile, &st) ) {
+        _hist_import(xmlhistfile);
+    }
+    logmsg(LOG_DEBUG, "History log has %zu recordings.", hist_num);
+    return 0;
+}
+
+/**
+ * Initialize history handling. Only the index is kept in memory and the
+ * recordings are read back from the log when they are listed.
  */
 void
 hist_init(void) {
     logmsg(LOG_DEBUG,"Calling hist_init()");
-    tvhist_free();
-    if (tvhist_read()) {
-        logmsg(LOG_NOTICE, "Failed to read old history file. Will create an empty new history file.");
-        tvhist_write();
-    } else {
-        logmsg(LOG_DEBUG, "Read history XML file.");
+    lock_acquire(&hist_mutex, LOCK_HIST);
+    _hist_close();
+    if( -1 == _hist_open() ) {
+        logmsg(LOG_ERR, "Recording history is not available.");
+        _hist_close();
     }
+    lock_release(&hist_mutex, LOCK_HIST);
+}
+
+/**
+ * Close the history log and free the index
+ */
+void
+hist_close(void) {
+    lock_acquire(&hist_mutex, LOCK_HIST);
+    _hist_close();
+    lock_release(&hist_mutex, LOCK_HIST);
 }
 
 /**
- * Add a recording to the history list
+ * Add a recording to the history log
  * @param title
+ * @param series
  * @param ts_start
  * @param ts_end
  * @param fullPathFilename
  * @param profile
- * @return 
+ * @return 0 on success, -1 on failure
  */
 int
-hist_addrec(char *title, const time_t ts_start, const time_t ts_end, char *fullPathFilename, char *profile) {
+hist_addrec(const char *title, const char *series, const time_t ts_start, const time_t ts_end,
+            const char *fullPathFilename, const char *profile) {
 
     logmsg(LOG_DEBUG,"Adding history for: title=%s",title);
-    
-    // Shift all records down one slot and free the last record
-    if (nrecs == HISTORY_LENGTH) {
-        if (history[HISTORY_LENGTH - 1].filepath) {
-            free(history[HISTORY_LENGTH - 1].filepath);
-            history[HISTORY_LENGTH - 1].filepath = (char *) NULL;
-        }
-        if (history[HISTORY_LENGTH - 1].title) {
-            free(history[HISTORY_LENGTH - 1].title);
-            history[HISTORY_LENGTH - 1].title = (char *) NULL;
-        }
-        if (history[HISTORY_LENGTH - 1].profile) {
-            free(history[HISTORY_LENGTH - 1].profile);
-            history[HISTORY_LENGTH - 1].profile = (char *) NULL;
-        }        
-
-    }
-        
-    for (size_t i = HISTORY_LENGTH - 1; i > 0; i--) {
-        memcpy(&history[i], &history[i - 1], sizeof (struct histrec));
-    }
-
-    history[0].title = strdup(title);
-    history[0].profile = strdup(profile);
-    history[0].filepath = strdup(fullPathFilename);
-    history[0].ts_start = ts_start;
-    history[0].ts_end = ts_end;
-
-    if( nrecs < HISTORY_LENGTH )
-        nrecs++;
-    
-    if( 0 == tvhist_write() ) {
-        logmsg(LOG_DEBUG, "Successfully updated history XML file. Size after update nrecs=%d",nrecs);
-    } else {
-        logmsg(LOG_ERR, "Could NOT write history XML file. Permission problems?");
+    struct histrec hr = {
+        .title = (char *)title,
+        .series = (char *)(series && *series ? series : title),
+        .filepath = (char *)fullPathFilename,
+        .ts_start = ts_start,
+        .ts_end = ts_end,
+        .profile = (char *)profile
+    };
+
+    lock_acquire(&hist_mutex, LOCK_HIST);
+    int ret = -1;
+    if( hist_logfd >= 0 ) {
+        ret = _hist_append(&hr);
+    }
+    lock_release(&hist_mutex, LOCK_HIST);
+
+    if( ret == -1 ) {
+        logmsg(LOG_ERR, "Could NOT add '%s' to the history log.", title);
     }
-    
+    return ret;
+}
+
+/**
+ * Check if an entry matches the hashes and time limits of a query
+ * @param e
+ * @param q
+ * @param th Hash of the title in the query
+ * @param ph Hash of the profile in the query
+ * @return 1 if the entry matches, 0 otherwise
+ */
+static int
+_hist_match(const struct hist_entry *e, const struct hist_query *q, uint64_t th, uint64_t ph) {
+    return (q->title == NULL || e->title_hash == th) &&
+           (q->profile == NULL || e->profile_hash == ph) &&
+           (q->from == 0 || e->ts_start >= q->from) &&
+           (q->to == 0 || e->ts_start < q->to);
+}
+
+/**
+ * Find the entries on one page of a query. The entries are found from the
+ * smallest of the start time range, the list for the title and the list for the
+ * profile. Must be called with hist_mutex held.
+ * @param q
+ * @param[out] ids Entry numbers on the page, room for q->pagesize entries
+ * @param[out] num Number of entries on the page
+ * @param[out] total Number of entries matching the query
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_hist_query(const struct hist_query *q, uint32_t *ids, size_t *num, size_t *total) {
+    const uint64_t th = q->title ? _hist_hash(q->title) : 0;
+    const uint64_t ph = q->profile ? _hist_hash(q->profile) : 0;
+    const size_t first = q->page * q->pagesize;
+    *num = *total = 0;
+
+    const size_t lo = q->from ? _hist_lower(q->from) : 0;
+    size_t hi = q->to ? _hist_lower(q->to) : hist_num;
+    if( hi < lo ) {
+        hi = lo;
+    }
+
+    const struct hist_postings *p = NULL;
+    if( q->title && (p = uhash_get(&hist_bytitle, _hist_key(th))) == NULL ) {
+        return 0;
+    }
+    if( q->profile ) {
+        const struct hist_postings *pp = uhash_get(&hist_byprofile, _hist_key(ph));
+        if( pp == NULL ) {
+            return 0;
+        }
+        if( p == NULL || pp->num < p->num ) {
+            p = pp;
+        }
+    }
+
+    if( p == NULL ) {
+        // Only limited by time so the page can be taken directly
+        *total = hi - lo;
+        for(size_t k = hi - lo - MIN(first, hi - lo); k > 0 && *num < q->pagesize; k--) {
+            ids[(*num)++] = hist_bydate[lo + k - 1];
+        }
+        return 0;
+    }
+
+    if( hi - lo <= p->num || p->ordered ) {
+        // Walk the time range or the list backwards and check each entry
+        const int bydate = hi - lo <= p->num;
+        for(size_t k = bydate ? hi : p->num; k > (bydate ? lo : 0); k--) {
+            const uint32_t id = bydate ? hist_bydate[k-1] : p->ids[k-1];
+            if( _hist_match(&hist_idx[id], q, th, ph) ) {
+                if( *total >= first && *num < q->pagesize ) {
+                    ids[(*num)++] = id;
+                }
+                (*total)++;
+            }
+        }
+        return 0;
+    }
+
+    // Check the entries in the shortest list and sort the matching ones
+    uint32_t *m = malloc((p->num ? p->num : 1) * sizeof (uint32_t));
+    if( m == NULL ) {
+        return -1;
+    }
+    size_t n = 0;
+    for(size_t k = 0; k < p->num; k++) {
+        if( _hist_match(&hist_idx[p->ids[k]], q, th, ph) ) {
+            m[n++] = p->ids[k];
+        }
+    }
+    qsort(m, n, sizeof (uint32_t), _hist_cmp_latest);
+    *total = n;
+    for(size_t k = first; k < n && *num < q->pagesize; k++) {
+        ids[(*num)++] = m[k];
+    }
+    free(m);
     return 0;
+}
 
+/**
+ * Free a page of recordings
+ * @param pg
+ */
+static void
+_hist_freepage(struct hist_page *pg) {
+    free(pg->recs);
+    free(pg->buf);
+    pg->recs = NULL;
+    pg->buf = NULL;
 }
 
 /**
- * Put a formatted version of the history list in the supplied buffer
+ * Run a query and read the recordings on the requested page from the log
+ * @param q
+ * @param[out] pg
+ * @return 0 on success, -1 on failure
+ */
+static int
+_hist_getpage(const struct hist_query *q, struct hist_page *pg) {
+    CLEAR(*pg);
+    uint32_t *ids = calloc(q->pagesize ? q->pagesize : 1, sizeof (uint32_t));
+    if( ids == NULL ) {
+        return -1;
+    }
+
+    lock_acquire(&hist_mutex, LOCK_HIST);
+    int ret = hist_logfd >= 0 ? _hist_query(q, ids, &pg->num, &pg->total) : -1;
+    if( ret == 0 && pg->num > 0 ) {
+        size_t len = 0;
+        for(size_t i=0; i < pg->num; i++) {
+            len += hist_idx[ids[i]].len;
+        }
+        pg->buf = malloc(len);
+        pg->recs = calloc(pg->num, sizeof (struct histrec));
+        if( pg->buf == NULL || pg->recs == NULL ) {
+            ret = -1;
+        }
+        char *p = pg->buf;
+        for(size_t i=0; ret == 0 && i < pg->num; i++) {
+            const struct hist_entry *e = &hist_idx[ids[i]];
+            if( (ssize_t)e->len != pread(hist_logfd, p, e->len, (off_t)e->offset) || p[e->len-1] != '\n' ) {
+                logmsg(LOG_ERR, "Cannot read history log at offset %llu ( %d : %s )",
+                       (unsigned long long)e->offset, errno, strerror(errno));
+                ret = -1;
+                break;
+            }
+            p[e->len-1] = '\0';
+            if( -1 == _hist_parse(p, &pg->recs[i]) ) {
+                logmsg(LOG_ERR, "Invalid line at offset %llu in history log.", (unsigned long long)e->offset);
+                ret = -1;
+            }
+            p += e->len;
+        }
+    }
+    lock_release(&hist_mutex, LOCK_HIST);
+
+    free(ids);
+    pg->first = q->page * q->pagesize;
+    if( ret == -1 ) {
+        _hist_freepage(pg);
+    }
+    return ret;
+}
+
+/**
+ * Put a formatted version of a page of recordings in the supplied buffer
  * @param buff Buffer to store history list in
  * @param maxlen Maximum length of buffer
+ * @param q The query the page is from
+ * @param pg
  * @return 0 on success, -1 on failure
  */
-int
-hist_listbuff(char *buff, size_t maxlen) {
+static int
+_hist_listbuff(char *buff, size_t maxlen, const struct hist_query *q, const struct hist_page *pg) {
     struct tm result;
     int sy, sm, sd, sh, smi, ss;
-    int ey, em, ed, eh, emi, es;    
     static char wday_name[7][4] = {
         "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
     };
@@ -416,32 +1192,44 @@ hist_listbuff(char *buff, size_t maxlen) {
         "Jan","Feb","Mar","Apr","May","Jun",
         "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
     };
-    
+
     char line[256];
     *buff = '\0';
-    
-    if( 0 == nrecs ) {
+
+    if( 0 == pg->total ) {
         snprintf(buff,maxlen,"(no history)\n");
         return 0;
     }
+    const size_t npages = (pg->total + q->pagesize - 1) / q->pagesize;
+    if( 0 == pg->num ) {
+        snprintf(buff,maxlen,"(no recordings on page %zu, there are %zu pages)\n", q->page + 1, npages);
+        return 0;
+    }
+    snprintf(line,sizeof(line),"Recordings %zu-%zu of %zu, page %zu of %zu\n",
+             pg->first + 1, pg->first + pg->num, pg->total, q->page + 1, npages);
+    if( strnlen(line,256) >= maxlen ) {
+        return -1;
+    }
+    strncat(buff,line,maxlen);
+    maxlen -= strnlen(line,256);
 
     char filename[255];
     char titlepadbuff[255];
     char fnamepadbuff[255];
-    for (size_t i = 0; i < nrecs && maxlen > 0 ; ++i) {
-        fromtimestamp(history[i].ts_start, &sy, &sm, &sd, &sh, &smi, &ss);
-        fromtimestamp(history[i].ts_end, &ey, &em, &ed, &eh, &emi, &es);        
-        (void)localtime_r(&history[i].ts_start, &result);        
+    for (size_t i = 0; i < pg->num && maxlen > 0 ; ++i) {
+        const struct histrec *hr = &pg->recs[i];
+        fromtimestamp(hr->ts_start, &sy, &sm, &sd, &sh, &smi, &ss);
+        (void)localtime_r(&hr->ts_start, &result);
 
-        strncpy(filename,basename(history[i].filepath),sizeof(filename));
+        strncpy(filename,basename(hr->filepath),sizeof(filename));
         filename[sizeof(filename)-1]='\0';
-        
+
         const int title_width=35;
-        strncpy(titlepadbuff,history[i].title,sizeof(titlepadbuff));
+        strncpy(titlepadbuff,hr->title,sizeof(titlepadbuff));
         titlepadbuff[title_width]='\0';
         if( -1 == xmbrpad(titlepadbuff,title_width,sizeof(titlepadbuff),' ') ) {
             logmsg(LOG_ERR,"Cannot pad history title multibyte string. Check the locale setting in config file!");
-            strncpy(titlepadbuff,history[i].title,sizeof(titlepadbuff)-2);
+            strncpy(titlepadbuff,hr->title,sizeof(titlepadbuff)-2);
             strncat(titlepadbuff,"  ",sizeof(titlepadbuff)-1);
             titlepadbuff[sizeof(titlepadbuff)-1]='\0';
         }
@@ -457,33 +1245,33 @@ hist_listbuff(char *buff, size_t maxlen) {
         }
 
         snprintf(line,sizeof(line),
-         "%02u "
-         "%s %s %02d %02d:%02d "
+         "%02zu "
+         "%s %s %02d %d %02d:%02d "
          "%s"
          "%s"
          "%s\n",
-         (int)(i+1),
-         wday_name[result.tm_wday], month_name[sm-1], sd,
+         pg->first + i + 1,
+         wday_name[result.tm_wday], month_name[sm-1], sd, sy,
          sh, smi,
          titlepadbuff,
          fnamepadbuff,
-         history[i].profile);
-        if( strnlen(line,256) > maxlen ) {
+         hr->profile);
+        if( strnlen(line,256) >= maxlen ) {
             return -1;
         }
         strncat(buff,line,maxlen);
         maxlen -= strnlen(line,256);
         *line='\0';
-    }    
+    }
     if( maxlen > 0 )
         return 0;
     else
         return -1;
 }
 
-static void
+static int
 _html_header(char *buffer, size_t maxlen, struct css_record_style *rs) {
-    snprintf(buffer, maxlen,
+    return snprintf(buffer, maxlen,
             "<tr style=\"%s\">"
             "<th style=\"%s\">#</th>\n"
             "<th style=\"%s\">Date</th>\n"
@@ -499,8 +1287,8 @@ _html_header(char *buffer, size_t maxlen, struct css_record_style *rs) {
             rs->td_r);
 }
 
-static void
-_html_row(char *buffer, size_t maxlen, struct css_record_style *rs, struct histrec *hr, size_t idx) {
+static int
+_html_row(char *buffer, size_t maxlen, struct css_record_style *rs, const struct histrec *hr, size_t idx) {
     struct tm result;
     int sy, sm, sd, sh, smi, ss;
     int ey, em, ed, eh, emi, es;
@@ -516,7 +1304,7 @@ _html_row(char *buffer, size_t maxlen, struct css_record_style *rs, struct histr
     fromtimestamp(hr->ts_end, &ey, &em, &ed, &eh, &emi, &es);
     (void) localtime_r(&hr->ts_start, &result);
 
-    snprintf(buffer, maxlen,
+    return snprintf(buffer, maxlen,
             "<tr style=\"%s\">"
             "<td style=\"%s\">%02zu</td>\n"
             "<td style=\"%s\">%s %s %d</td>\n"
@@ -532,71 +1320,120 @@ _html_row(char *buffer, size_t maxlen, struct css_record_style *rs, struct histr
             rs->td_r, basename(hr->filepath));
 }
 
-int
-hist_listhtmlbuff(char *buffer, size_t maxlen, size_t style) {
+/**
+ * Account for a piece of HTML that has been formatted at the end of the buffer.
+ * If the piece did not fit it is removed so that the buffer never ends with
+ * a partial tag.
+ * @param buffer
+ * @param maxlen
+ * @param len Current length of the buffer, updated on success
+ * @param n Return value from the snprintf() that formatted the piece
+ * @return 0 on success, -1 if the piece did not fit
+ */
+static int
+_html_append(char *buffer, size_t maxlen, size_t *len, int n) {
+    if (n < 0 || *len + (size_t)n >= maxlen) {
+        buffer[*len] = '\0';
+        return -1;
+    }
+    *len += (size_t)n;
+    return 0;
+}
+
+/**
+ * HTML version of _hist_listbuff(). Rows are formatted directly into the
+ * buffer. If the buffer is too small the list ends with the last complete row.
+ * @param buffer
+ * @param maxlen
+ * @param style
+ * @param pg
+ * @return 0 on success, -1 on failure
+ */
+static int
+_hist_listhtmlbuff(char *buffer, size_t maxlen, size_t style, const struct hist_page *pg) {
 
-    char tmpbuffer[1024];
     struct css_table_style ts;
     bzero(&ts, sizeof (struct css_table_style));
     set_listhtmlcss(&ts, style);
-    int max = maxlen;
+    size_t len = 0;
     time_t ts_tmp = time(NULL);
 
-    snprintf(buffer, max,
+    if (0 == maxlen) {
+        return -1;
+    }
+    *buffer = '\0';
+
+    int n = snprintf(buffer, maxlen,
             "<div style=\"%s\">Generated by: <strong>%s %s</strong>, %s</div>"
             "<table border=0 style=\"%s\" cellpadding=4 cellspacing=0>\n",
             ts.date, server_program_name, server_version, ctime(&ts_tmp), ts.table);
-    max -= strlen(buffer);
+    if (-1 == _html_append(buffer, maxlen, &len, n)) {
+        return -1;
+    }
 
-    _html_header(tmpbuffer, sizeof (tmpbuffer), &ts.header_row);
-    strncat(buffer, tmpbuffer, max - 1);
-    max -= strlen(tmpbuffer);
+    n = _html_header(buffer + len, maxlen - len, &ts.header_row);
+    if (-1 == _html_append(buffer, maxlen, &len, n)) {
+        return -1;
+    }
 
-    for (size_t i = 0; i < nrecs - 1 && max > 0; ++i) {
-        *tmpbuffer = '\0';
+    for (size_t i = 0; i + 1 < pg->num; ++i) {
         if (i % 2) {
-            _html_row(tmpbuffer, max, &ts.odd_row, &history[i], i);
+            n = _html_row(buffer + len, maxlen - len, &ts.odd_row, &pg->recs[i], pg->first + i + 1);
         } else {
-            _html_row(tmpbuffer, max, &ts.even_row, &history[i], i);
+            n = _html_row(buffer + len, maxlen - len, &ts.even_row, &pg->recs[i], pg->first + i + 1);
+        }
+        if (-1 == _html_append(buffer, maxlen, &len, n)) {
+            return -1;
         }
-        strncat(buffer, tmpbuffer, max);
-        max -= strnlen(tmpbuffer, sizeof (tmpbuffer));
     }
 
     // Now print the last row. This can either be a normal row with the formatting
-    // for a last row or it could be the string "(No recordings)" to indicate an empty list
+    // for a last row or it could be the string "(No history)" to indicate an empty list
 
-    if (0 == nrecs) {
-        snprintf(tmpbuffer, sizeof (tmpbuffer),
+    if (0 == pg->num) {
+        n = snprintf(buffer + len, maxlen - len,
                 "<tr><td style=\"%s\">&nbsp;</td><td style=\"%s font-style:italic;text-align:center;\" colspan=3>(No history)</td><td style=\"%s\">&nbsp;</td></tr>\n",
                 ts.last_even_row.td_l, ts.last_even_row.td_i, ts.last_even_row.td_r);
     } else {
-        if (nrecs % 2) {
-            _html_row(tmpbuffer, max, &ts.last_even_row, &history[nrecs - 1], nrecs);
+        const size_t last = pg->num - 1;
+        if (last % 2) {
+            n = _html_row(buffer + len, maxlen - len, &ts.last_odd_row, &pg->recs[last], pg->first + pg->num);
         } else {
-            _html_row(tmpbuffer, max, &ts.last_odd_row, &history[nrecs - 1], nrecs);
+            n = _html_row(buffer + len, maxlen - len, &ts.last_even_row, &pg->recs[last], pg->first + pg->num);
         }
     }
-    
-    strncat(buffer, tmpbuffer, max);
-    max -= strnlen(tmpbuffer, sizeof (tmpbuffer));
-    
-    if (max > 0)
-        return 0;
-    else
-        return -1;
+
+    return _html_append(buffer, maxlen, &len, n);
 
 }
 
+/**
+ * Put a formatted version of one page of a query in the supplied buffer
+ * @param buff Buffer to store history list in
+ * @param maxlen Maximum length of buffer
+ * @param q The query
+ * @return 0 on success, -1 on failure
+ */
 int
-hist_list(int fd) {
-    size_t const maxlen=HISTORY_LENGTH*1024;
-    
+hist_listbuff(char *buff, size_t maxlen, const struct hist_query *q) {
+    struct hist_page pg;
+    if( -1 == _hist_getpage(q, &pg) ) {
+        return -1;
+    }
+    const int ret = _hist_listbuff(buff, maxlen, q, &pg);
+    _hist_freepage(&pg);
+    return ret;
+}
+
+int
+hist_list(int fd, const struct hist_query *q) {
+    size_t const maxlen=(q->pagesize+2)*1024;
+
     char *buff = calloc(maxlen, sizeof(char));
     if( NULL == buff ) {
         return -1;
     }
-    if( -1 == hist_listbuff(buff, maxlen-1) ) {
+    if( -1 == hist_listbuff(buff, maxlen-1, q) ) {
         free(buff);
         return -1;
     }
@@ -606,9 +1443,15 @@ hist_list(int fd) {
 }
 
 int
-hist_mail(void) {    
+hist_mail(void) {
 
     size_t const maxlen=HISTORY_LENGTH*1024;
+    const struct hist_query q = {.pagesize = HISTORY_LENGTH};
+    struct hist_page pg;
+
+    if( -1 == _hist_getpage(&q, &pg) ) {
+        return -1;
+    }
 
     char *buffer_plain = calloc(maxlen, sizeof(char));
     char *buffer_html = calloc(maxlen, sizeof(char));
@@ -618,16 +1461,16 @@ hist_mail(void) {
         exit(1);
     }
 
-    if( -1 == hist_listbuff(buffer_plain, maxlen-3) ) {
+    if( -1 == _hist_listbuff(buffer_plain, maxlen-3, &q, &pg) ) {
+        _hist_freepage(&pg);
         free(buffer_plain);
         free(buffer_html);
         return -1;
     }
 
-    hist_listhtmlbuff(buffer_html, maxlen, 0);
+    _hist_listhtmlbuff(buffer_html, maxlen, 0, &pg);
+    _hist_freepage(&pg);
     strcat(buffer_plain,"\n\n");
- 
-    // snprintf(buffer_html,maxlen-1,"<div>Previous recordings:</div><pre>%s</pre>\n\n",buffer_plain);
 
     char subject[255];
     snprintf(subject,sizeof(subject),"Recording history");
@@ -635,10 +1478,10 @@ hist_mail(void) {
     int ret = sendmail_helper(subject, buffer_plain, buffer_html);
 
     free(buffer_html);
-    free(buffer_plain);    
+    free(buffer_plain);
 
     return ret;
-    
+
 }
 
 /* EOF */
@@ -25,65 +25,127 @@
 #ifndef TVHISTORY_H
 #define	TVHISTORY_H
 
+#include <time.h>
+#include <stddef.h>
+
 #ifdef	__cplusplus
 extern "C" {
 #endif
 
-/**
- * The history file itself is stored as a plain XML file in file HISTORYDB_FILENAME
- * The XSL file is a simple transformation file written in XSL to which is used to format
- * the XML file when viewed in a browser. The XSL file is stored in the config file directory
- * and referenced from the XML file. One other possibility would be to use an XSL processor
- * e.g. "xsltproc" to produce a HTML version of the XML file using the XSL. For example as
- * $> xsltproc /etc/tvpvrd/xsl/history.xsl history.xml > history.html
- * 
-*/
+/*
+ * The history is kept in two files in the xmldb directory under the datadir root.
+ *
+ * HISTORYLOG_FILENAME is an append only text file with one line for each
+ * transcoded recording:
+ *
+ *   <start>\t<end>\t<title>\t<series title>\t<profile>\t<file>\n
+ *
+ * where the times are Unix timestamps and tab, newline and backslash in the text
+ * fields are escaped with a backslash. The series title is the base title of a
+ * repeated recording and the title itself for a single recording. Lines starting
+ * with '#' are ignored. A line is only ever added at the end and each line is
+ * synced to disk before hist_addrec() returns so the log is never rewritten.
+ *
+ * HISTORYIDX_FILENAME holds one fixed size entry for each line in the log with
+ * the start time, the position of the line in the log and hashes of the series
+ * title and profile. Only the entries are kept in memory together with the
+ * entry numbers sorted on start time and lists of the entries for each series
+ * title and profile. A query finds the matching entries from the smallest of
+ * these, and only the lines on the requested page are read back from the log.
+ * The index can always be rebuilt from the log. At startup the lines after the
+ * last entry in the index are added to it, so a lost or damaged index is
+ * rebuilt and a crash between writing the log and the index is recovered from.
+ *
+ * Earlier versions kept the latest HISTORY_LENGTH recordings in the XML file
+ * HISTORYDB_FILENAME. If there is no log yet that file is imported into the log
+ * once at startup and then renamed with the HISTORYDB_IMPORTED_SUFFIX.
+ */
+#define HISTORYLOG_FILENAME "history.log"
+#define HISTORYIDX_FILENAME "history.idx"
 #define HISTORYDB_FILENAME "history.xml"
-#define HISTORY_XSL_FILENAME "history.xsl"
+#define HISTORYDB_IMPORTED_SUFFIX ".imported"
+
+/*
+ * HISTORY_LENGTH integer
+ * Number of recordings in the history mail
+ */
 #define HISTORY_LENGTH 99
 
+/*
+ * HISTORY_PAGESIZE integer
+ * Default number of recordings on each page of a history listing
+ */
+#define HISTORY_PAGESIZE 20
+
+/*
+ * HISTORY_MAXPAGESIZE integer
+ * Largest number of recordings on each page of a history listing
+ */
+#define HISTORY_MAXPAGESIZE 500
+
+/*
+ * A history query. Only recordings matching all given conditions are listed,
+ * the latest first. Titles and profiles are compared without regard to case.
+ */
+struct hist_query {
+    const char *title;          /* Series title, NULL for all recordings */
+    const char *profile;        /* Profile name, NULL for all profiles */
+    time_t from;                /* Earliest start, 0 for no limit */
+    time_t to;                  /* Start must be before this, 0 for no limit */
+    size_t page;                /* Page to list, 0 is the latest recordings */
+    size_t pagesize;            /* Number of recordings on a page */
+};
+
 /**
- * Update history file with a new recording. The actual name
- * of the history DB file is hard coded to HISTORYDB_FILENAME defined
- * above. The history file is stored in the same directory as the
- * DB file for recordings.
- * 
+ * Add a new recording at the end of the history log
+ *
  * @param title Title of recording
+ * @param series Base title if the recording is one in a series, otherwise the title
  * @param ts_start Start timestamp
  * @param ts_end End timestamp
  * @param fullPathFilename Full path to encoded file
  * @param profile Name of profile used for encoding
  * @return 0 on success, -1 on failure
- */   
+ */
 int
-hist_addrec(char *title, const time_t ts_start, const time_t ts_end, char *fullPathFilename, char *profile);
+hist_addrec(const char *title, const char *series, const time_t ts_start, const time_t ts_end,
+            const char *fullPathFilename, const char *profile);
 
 /**
- * Initialize history from file
+ * Open the history log and load its index. Any history kept in the old XML
+ * history file is imported first.
  */
 void
 hist_init(void);
 
 /**
- * Put a formatted version to the specified stream
+ * Close the history log and free the index
+ */
+void
+hist_close(void);
+
+/**
+ * Put a formatted version of one page of a query to the specified stream
  * @param fd stream descriptor
+ * @param q The query
  * @return 0 on success, -1 on failure
  */
 int
-hist_list(int fd);
+hist_list(int fd, const struct hist_query *q);
 
 /**
- * Put a formatted version of the history list in the supplied buffer
+ * Put a formatted version of one page of a query in the supplied buffer
  * @param buff
  * @param maxlen
+ * @param q The query
  * @return 0 on success, -1 on failure
  */
 int
-hist_listbuff(char *buff, size_t maxlen);
+hist_listbuff(char *buff, size_t maxlen, const struct hist_query *q);
 
 /**
- * Mail the history to the predefined address given in the tvpvrd config file
- * by the user.
+ * Mail the latest HISTORY_LENGTH recordings to the predefined address given in
+ * the tvpvrd config file by the user.
  */
 int
 hist_mail(void);
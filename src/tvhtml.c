@@ -157,11 +157,6 @@ html_cmd_output(int sockd, char *wcmd) {
     _writef(sockd, "<div class=\"displayasled_on\" id=\"cmdoutput\">\n<pre>");
 
     if( *wcmd ) {
-        // We must wait for the semaphore since since commands
-        // might alter data structures and we can only have one
-        // thread at a time accessing the data structures
-        pthread_mutex_lock(&recs_mutex);
-
         // Make _writef() do HTML encoding on any output sent
         htmlencode_flag = 1;
 
@@ -170,8 +165,6 @@ html_cmd_output(int sockd, char *wcmd) {
         // descriptor and passed back to the browser in this case.
         cmdinterp(wcmd, sockd);
         htmlencode_flag = 0;
-
-        pthread_mutex_unlock(&recs_mutex);
     }
     _writef(sockd, "</pre>\n</div> <!-- cmd_output -->\n");
 
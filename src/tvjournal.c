@@ -0,0 +1,675 @@
+/* =========================================================================
+ * File:        TVJOURNAL.C
+ * Description: Append only journal of the changes made to the recording
+ *              database since the XML DB file was last written.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+// And we need to have support for files over 2GB in size
+#define _LARGEFILE_SOURCE
+#define _LARGEFILE64_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <errno.h>
+#include <time.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "tvjournal.h"
+#include "tvconfig.h"
+#include "tvxmldb.h"
+#include "transcprofile.h"
+#include "tvplog.h"
+#include "recs.h"
+
+/*
+ * JOURNAL_MAXLINE integer
+ * Longest line in the journal. Long enough for an add record where every
+ * character in the strings has to be escaped.
+ */
+#define JOURNAL_MAXLINE 4096
+
+/*
+ * JOURNAL_MAXFIELDS integer
+ * Largest number of fields in a journal line
+ */
+#define JOURNAL_MAXFIELDS 24
+
+/*
+ * Descriptor of the open journal, -1 if no journal is open in which case each
+ * change only asks for the XML DB to be written
+ */
+static int journal_fd = -1;
+
+// Generation of the open journal
+static unsigned journal_gen = 0;
+
+// Number of changes in the open journal
+static unsigned journal_records = 0;
+
+// Set when the journal file on disk has the generation journal_gen
+static int journal_ondisk = 0;
+
+/*
+ * Generation of the oldest journal that has been rotated out and may still be
+ * on disk. Protected by xmldb_mutex.
+ */
+static unsigned journal_oldest = 0;
+
+/**
+ * Name of the journal or of a temporary file next to the XML DB
+ * @param suffix
+ * @param buffer
+ * @param maxlen
+ * @return 0 on success, -1 if the name is too long
+ */
+static int
+_journal_name(const char *suffix, char *buffer, size_t maxlen) {
+    const int len = snprintf(buffer, maxlen, "%s%s", xmldbfile, suffix);
+    return len < 0 || (size_t)len >= maxlen ? -1 : 0;
+}
+
+/**
+ * Make sure the directory entries for the XML DB and journal are on disk
+ */
+static void
+_journal_syncdir(void) {
+    char dname[256];
+    strncpy(dname, xmldbfile, sizeof(dname) - 1);
+    dname[sizeof(dname) - 1] = '\0';
+    const int fd = open(dirname(dname), O_RDONLY | O_DIRECTORY);
+    if( fd >= 0 ) {
+        (void)fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Write a whole buffer to a file
+ * @param fd
+ * @param buffer
+ * @param len
+ * @return 0 on success, -1 on failure
+ */
+static int
+_journal_write(int fd, const char *buffer, size_t len) {
+    while( len > 0 ) {
+        const ssize_t n = write(fd, buffer, len);
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Start a new empty journal for the given generation. The journal is first
+ * written to a temporary file that then replaces the old journal.
+ * @param generation
+ * @return 0 on success, -1 on failure
+ */
+static int
+_journal_create(unsigned generation) {
+    char name[300], tmpname[300], header[64];
+    if( -1 == _journal_name(".journal", name, sizeof(name)) ||
+        -1 == _journal_name(".journal.tmp", tmpname, sizeof(tmpname)) ) {
+        logmsg(LOG_ERR, "Name of journal for '%s' is too long.", xmldbfile);
+        return -1;
+    }
+
+    if( journal_fd >= 0 ) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if( fd < 0 ) {
+        logmsg(LOG_ERR, "Can't create journal '%s'. (%d : %s)", tmpname, errno, strerror(errno));
+        return -1;
+    }
+    const int len = snprintf(header, sizeof(header), "tvpvrd-journal %d %u\n", JOURNAL_VERSION, generation);
+    if( -1 == _journal_write(fd, header, (size_t)len) || -1 == fsync(fd) ) {
+        logmsg(LOG_ERR, "Can't write journal '%s'. (%d : %s)", tmpname, errno, strerror(errno));
+        close(fd);
+        (void)unlink(tmpname);
+        return -1;
+    }
+    close(fd);
+    if( -1 == rename(tmpname, name) ) {
+        logmsg(LOG_ERR, "Can't rename journal '%s'. (%d : %s)", tmpname, errno, strerror(errno));
+        (void)unlink(tmpname);
+        return -1;
+    }
+    _journal_syncdir();
+    journal_ondisk = 1;
+
+    journal_fd = open(name, O_WRONLY | O_APPEND);
+    if( journal_fd < 0 ) {
+        logmsg(LOG_ERR, "Can't open journal '%s'. (%d : %s)", name, errno, strerror(errno));
+        return -1;
+    }
+    journal_records = 0;
+    return 0;
+}
+
+/**
+ * Name of a journal that has been rotated out
+ * @param generation
+ * @param buffer
+ * @param maxlen
+ * @return 0 on success, -1 if the name is too long
+ */
+static int
+_journal_rotated_name(unsigned generation, char *buffer, size_t maxlen) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".journal.%u", generation);
+    return _journal_name(suffix, buffer, maxlen);
+}
+
+/**
+ * Rotate out the open journal and start a new one with the next generation.
+ * The rotated journal is kept until the XML DB with the new generation has been
+ * written.
+ * @return The new generation. The XML DB written from the schedule as it is now
+ * gets this generation.
+ */
+unsigned
+journal_rotate(void) {
+    char name[300], oldname[300];
+    int keep = 0;
+
+    if( journal_fd >= 0 ) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    if( journal_ondisk &&
+        0 == _journal_name(".journal", name, sizeof(name)) &&
+        0 == _journal_rotated_name(journal_gen, oldname, sizeof(oldname)) &&
+        -1 == rename(name, oldname) ) {
+        // The changes in the journal are not yet in the XML DB so it must not be
+        // replaced by a new one
+        logmsg(LOG_ERR, "Can't rotate journal '%s'. (%d : %s)", name, errno, strerror(errno));
+        keep = 1;
+    }
+    journal_ondisk = 0;
+    journal_gen++;
+    journal_records = 0;
+    if( !keep ) {
+        (void)_journal_create(journal_gen);
+    }
+    return journal_gen;
+}
+
+/**
+ * Remove the rotated journals that are older than the given generation. Called
+ * once the XML DB with that generation has been written.
+ * @param generation
+ */
+void
+journal_forget(unsigned generation) {
+    char name[300];
+    for(; journal_oldest < generation; journal_oldest++) {
+        if( 0 == _journal_rotated_name(journal_oldest, name, sizeof(name)) ) {
+            (void)unlink(name);
+        }
+    }
+}
+
+/**
+ * Write the XML DB and close the journal
+ */
+void
+journal_close(void) {
+    (void)write_xmldb();
+    if( journal_fd >= 0 ) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+}
+
+/**
+ * Append a string field to a journal line. Backslash, tab and newline are escaped
+ * since they separate the fields and lines.
+ * @param buffer
+ * @param maxlen
+ * @param[in,out] len Length of the line so far
+ * @param str
+ * @return 0 on success, -1 if the line is too long
+ */
+static int
+_journal_putstr(char *buffer, size_t maxlen, size_t *len, const char *str) {
+    if( *len + 1 >= maxlen ) {
+        return -1;
+    }
+    buffer[(*len)++] = '\t';
+    for(; *str; str++) {
+        const char c = *str == '\t' ? 't' : *str == '\n' ? 'n' : *str;
+        const int esc = c != *str || c == '\\';
+        if( *len + (size_t)esc + 1 >= maxlen ) {
+            return -1;
+        }
+        if( esc ) {
+            buffer[(*len)++] = '\\';
+        }
+        buffer[(*len)++] = c;
+    }
+    buffer[*len] = '\0';
+    return 0;
+}
+
+/**
+ * Append a number field to a journal line
+ * @param buffer
+ * @param maxlen
+ * @param[in,out] len Length of the line so far
+ * @param val
+ * @return 0 on success, -1 if the line is too long
+ */
+static int
+_journal_putnum(char *buffer, size_t maxlen, size_t *len, long long val) {
+    const int n = snprintf(buffer + *len, maxlen - *len, "\t%lld", val);
+    if( n < 0 || *len + (size_t)n >= maxlen ) {
+        return -1;
+    }
+    *len += (size_t)n;
+    return 0;
+}
+
+/**
+ * Append the key of a recording to a journal line
+ * @return 0 on success, -1 if the line is too long
+ */
+static int
+_journal_putkey(char *buffer, size_t maxlen, size_t *len, const struct rec_key *key) {
+    if( -1 == _journal_putnum(buffer, maxlen, len, (long long)key->ts_start) ||
+        -1 == _journal_putstr(buffer, maxlen, len, key->channel) ||
+        -1 == _journal_putstr(buffer, maxlen, len, key->title) ) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append a finished line to the journal and sync it to disk. Once the journal
+ * has grown to journal_compact_size changes the XML DB writer is asked to merge
+ * it. If there is no journal or the line can not be written the XML DB writer
+ * is asked to write the change instead.
+ * @param buffer
+ * @param len
+ * @return 0 on success, -1 if the change is not in the journal
+ */
+static int
+_journal_append(char *buffer, size_t len) {
+    if( journal_fd >= 0 ) {
+        buffer[len++] = '\n';
+        if( 0 == _journal_write(journal_fd, buffer, len) && 0 == fsync(journal_fd) ) {
+            journal_records++;
+            if( journal_records >= (unsigned)journal_compact_size ) {
+                request_xmldb_write();
+            }
+            return 0;
+        }
+        logmsg(LOG_ERR, "Can't write to journal for '%s'. (%d : %s)", xmldbfile, errno, strerror(errno));
+
+        // Nothing more can be appended after a partly written line
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    request_xmldb_write();
+    return -1;
+}
+
+/**
+ * Record a new recording that has been added to the schedule
+ * @param entry The recording (or the first occurrence of a repeated recording) as inserted
+ * @param video The video card the recording was added to, -1 if the card was picked by the server
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_add(const struct recording_entry *entry, int video) {
+    char buffer[JOURNAL_MAXLINE], tmpbuff[REC_MAX_NFILENAME];
+    size_t len = 1;
+    buffer[0] = 'A';
+
+    strncpy(tmpbuff, entry->filename, sizeof(tmpbuff) - 1);
+    tmpbuff[sizeof(tmpbuff) - 1] = '\0';
+
+    int err = -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, video) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, (long long)entry->ts_start) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, (long long)entry->ts_end) ||
+              -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, entry->channel) ||
+              -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, entry->title) ||
+              -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, basename(tmpbuff)) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, entry->recurrence) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, entry->recurrence_type) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, entry->recurrence_num) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, entry->recurrence_mangling) ||
+              -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, entry->recurrence_mangling_prefix) ||
+              -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, entry->recurrence_start_number);
+    for(int i=0; !err && i < REC_MAX_TPROFILES && *entry->transcoding_profiles[i]; i++) {
+        err = -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, entry->transcoding_profiles[i]);
+    }
+    if( err ) {
+        logmsg(LOG_ERR, "Recording '%s' is too large for the journal.", entry->title);
+        request_xmldb_write();
+        return -1;
+    }
+    return _journal_append(buffer, len);
+}
+
+/**
+ * Record that a recording is about to be deleted from the schedule. Must be called
+ * before the recording is removed.
+ * @param seqnbr
+ * @param allrecurrences
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_delete(unsigned seqnbr, int allrecurrences) {
+    char buffer[JOURNAL_MAXLINE];
+    struct rec_key key;
+    size_t len = 1;
+    buffer[0] = 'D';
+
+    if( -1 == get_reckey(seqnbr, &key) ) {
+        // Nothing is deleted
+        return 0;
+    }
+    if( -1 == _journal_putnum(buffer, sizeof(buffer) - 1, &len, allrecurrences ? 1 : 0) ||
+        -1 == _journal_putkey(buffer, sizeof(buffer) - 1, &len, &key) ) {
+        logmsg(LOG_ERR, "Recording '%s' is too large for the journal.", key.title);
+        request_xmldb_write();
+        return -1;
+    }
+    return _journal_append(buffer, len);
+}
+
+/**
+ * Record a change of the profile for a recording
+ * @param seqnbr
+ * @param profile
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_profile(unsigned seqnbr, const char *profile) {
+    char buffer[JOURNAL_MAXLINE];
+    struct rec_key key;
+    size_t len = 1;
+    buffer[0] = 'P';
+
+    if( -1 == get_reckey(seqnbr, &key) ) {
+        return 0;
+    }
+    if( -1 == _journal_putkey(buffer, sizeof(buffer) - 1, &len, &key) ||
+        -1 == _journal_putstr(buffer, sizeof(buffer) - 1, &len, profile) ) {
+        logmsg(LOG_ERR, "Recording '%s' is too large for the journal.", key.title);
+        request_xmldb_write();
+        return -1;
+    }
+    return _journal_append(buffer, len);
+}
+
+/**
+ * Split a journal line in place into its fields and undo the escaping
+ * @param line Line without the trailing newline
+ * @param field
+ * @param maxfields
+ * @return Number of fields
+ */
+static size_t
+_journal_split(char *line, char *field[], size_t maxfields) {
+    size_t n = 0;
+    char *src = line, *dst = line;
+    field[n++] = dst;
+    while( *src ) {
+        if( *src == '\t' ) {
+            *dst++ = '\0';
+            if( n == maxfields ) {
+                return n;
+            }
+            field[n++] = dst;
+            src++;
+        } else if( *src == '\\' && src[1] ) {
+            src++;
+            *dst++ = *src == 't' ? '\t' : *src == 'n' ? '\n' : *src;
+            src++;
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+    return n;
+}
+
+/**
+ * Read the key of a recording from three journal fields
+ * @param field
+ * @param[out] key
+ */
+static void
+_journal_getkey(char *field[], struct rec_key *key) {
+    key->ts_start = (time_t)strtoll(field[0], NULL, 10);
+    strncpy(key->channel, field[1], REC_MAX_NCHANNEL - 1);
+    key->channel[REC_MAX_NCHANNEL - 1] = '\0';
+    strncpy(key->title, field[2], REC_MAX_NTITLE - 1);
+    key->title[REC_MAX_NTITLE - 1] = '\0';
+}
+
+/**
+ * Add a recording from an add record in the journal
+ * @param field
+ * @param n Number of fields
+ * @return 0 on success, -1 on failure
+ */
+static int
+_journal_replay_add(char *field[], size_t n) {
+    char *profiles[REC_MAX_TPROFILES + 1];
+    size_t num_profiles = 0;
+    if( n < 13 ) {
+        return -1;
+    }
+    for(size_t i = 13; i < n && num_profiles < REC_MAX_TPROFILES; i++) {
+        if( transcoding_profile_exist(field[i]) ) {
+            profiles[num_profiles++] = field[i];
+        } else {
+            logmsg(LOG_NOTICE, "Transcoding profile %s does not exist. Falling back on default profile.", field[i]);
+        }
+    }
+    profiles[num_profiles] = NULL;
+
+    const int video = atoi(field[1]);
+    struct recording_entry *entry = newrec(field[5], field[6],
+                                           (time_t)strtoll(field[2], NULL, 10), (time_t)strtoll(field[3], NULL, 10),
+                                           field[4],
+                                           atoi(field[7]), atoi(field[8]), (unsigned)strtoul(field[9], NULL, 10),
+                                           atoi(field[10]), profiles);
+    if( entry == NULL ) {
+        return -1;
+    }
+    strncpy(entry->recurrence_mangling_prefix, field[11], REC_MAX_NPREFIX - 1);
+    entry->recurrence_mangling_prefix[REC_MAX_NPREFIX - 1] = '\0';
+    entry->recurrence_start_number = (unsigned)strtoul(field[12], NULL, 10);
+
+    const int ret = video >= 0 ? insertrec((unsigned)video, entry, NULL) : insertrec_any(entry, NULL);
+    if( ret <= 0 ) {
+        logmsg(LOG_ERR, "Can't add recording '%s' from journal.", field[5]);
+        freerec(entry);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply one line from the journal
+ * @param line
+ * @return 0 on success, -1 on failure
+ */
+static int
+_journal_replay_line(char *line) {
+    char *field[JOURNAL_MAXFIELDS];
+    struct rec_key key;
+    unsigned seqnbr;
+
+    const size_t n = _journal_split(line, field, JOURNAL_MAXFIELDS);
+    switch( *field[0] ) {
+        case 'A':
+            return _journal_replay_add(field, n);
+
+        case 'D':
+            if( n != 5 ) {
+                return -1;
+            }
+            _journal_getkey(&field[2], &key);
+            if( (seqnbr = find_reckey(&key)) == 0 ) {
+                logmsg(LOG_NOTICE, "Deleted recording '%s' from journal is not in the schedule.", key.title);
+                return 0;
+            }
+            return delete_recid(seqnbr, atoi(field[1])) ? 0 : -1;
+
+        case 'P':
+            if( n != 5 ) {
+                return -1;
+            }
+            _journal_getkey(&field[1], &key);
+            if( (seqnbr = find_reckey(&key)) == 0 ) {
+                logmsg(LOG_NOTICE, "Recording '%s' from journal is not in the schedule.", key.title);
+                return 0;
+            }
+            return update_profile(seqnbr, field[4]) ? 0 : -1;
+
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Apply the changes in a journal with the given generation. A last line that was
+ * not completely written before a crash is ignored.
+ * @param name
+ * @param generation
+ * @return Number of applied changes, -1 if there is no journal with this generation
+ */
+static int
+_journal_replay(const char *name, unsigned generation) {
+    FILE *fp = fopen(name, "r");
+    if( fp == NULL ) {
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t linelen = 0;
+    ssize_t n = getline(&line, &linelen, fp);
+    int version;
+    unsigned gen;
+    if( n <= 0 || 2 != sscanf(line, "tvpvrd-journal %d %u", &version, &gen) || version != JOURNAL_VERSION ) {
+        logmsg(LOG_ERR, "Journal '%s' is not a valid journal. Ignored.", name);
+        free(line);
+        fclose(fp);
+        return -1;
+    }
+    if( gen != generation ) {
+        // The XML DB was written after the journal so the changes are already in it
+        logmsg(LOG_INFO, "Journal '%s' does not belong to this version of the XML DB. Ignored.", name);
+        free(line);
+        fclose(fp);
+        return -1;
+    }
+
+    int num = 0;
+    while( (n = getline(&line, &linelen, fp)) > 0 ) {
+        if( line[n-1] != '\n' ) {
+            logmsg(LOG_NOTICE, "Ignoring incomplete last line in journal '%s'.", name);
+            break;
+        }
+        line[n-1] = '\0';
+        if( -1 == _journal_replay_line(line) ) {
+            logmsg(LOG_ERR, "Could not apply change %d from journal '%s'.", num + 1, name);
+        }
+        num++;
+    }
+    free(line);
+    fclose(fp);
+    return num;
+}
+
+/**
+ * Apply the journals on top of the XML DB that has just been read and start a
+ * new journal. The journals that were rotated out but not yet merged into the
+ * XML DB are applied first and then the journal that was open.
+ * @param generation Generation of the XML DB
+ * @param rewrite Write the XML DB even if there are no changes in the journals
+ */
+void
+init_journal(unsigned generation, int rewrite) {
+    char name[300];
+    int num = 0, n;
+    unsigned gen = generation;
+
+    while( 0 == _journal_rotated_name(gen, name, sizeof(name)) && (n = _journal_replay(name, gen)) >= 0 ) {
+        num += n;
+        gen++;
+    }
+    if( 0 == _journal_name(".journal", name, sizeof(name)) ) {
+        if( (n = _journal_replay(name, gen)) >= 0 ) {
+            num += n;
+            journal_ondisk = 1;
+        } else {
+            // A journal that does not follow the XML DB must not be rotated out
+            // as if it did
+            (void)unlink(name);
+        }
+    }
+    journal_gen = gen;
+    journal_oldest = generation;
+
+    // Rotated journals that are already merged into the XML DB
+    for(unsigned k = generation; k > 0 && 0 == _journal_rotated_name(k - 1, name, sizeof(name)) && 0 == unlink(name); k--) {
+        logmsg(LOG_DEBUG, "Removed old journal '%s'.", name);
+    }
+
+    if( num > 0 ) {
+        logmsg(LOG_INFO, "Applied %d changes from the journal to the XML DB.", num);
+    }
+    if( num > 0 || rewrite ) {
+        // This also rotates out the journal and starts a new one
+        (void)write_xmldb();
+    } else if( -1 == _journal_create(journal_gen) ) {
+        logmsg(LOG_ERR, "Without a journal each change is only saved once the XML DB has been written.");
+    }
+}
+
+/* tvjournal.c */
@@ -0,0 +1,127 @@
+/* =========================================================================
+ * File:        TVJOURNAL.H
+ * Description: Append only journal of the changes made to the recording
+ *              database since the XML DB file was last written.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+
+#ifndef _TVJOURNAL_H
+#define	_TVJOURNAL_H
+
+#include "recs.h"
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Each change of the schedule is appended as one line to the journal file next
+ * to the XML DB and synced to disk instead of writing the whole XML DB again.
+ * When the journal has grown to journal_compact_size changes the XML DB writer
+ * thread is asked to merge it. The writer rotates out the journal, renaming it
+ * to <xmldb>.journal.<generation>, starts a new one with the next generation and
+ * writes the XML DB with that generation in the background. The rotated journal
+ * is removed once the XML DB has been written. At startup the changes in the
+ * journals are applied on top of the XML DB.
+ *
+ * The XML DB and the journals all carry a generation number. The XML DB with
+ * generation g holds all changes from the journals before g so only the journals
+ * from g and on are applied to it. A crash before the new XML DB is in place
+ * then neither loses nor repeats any change.
+ *
+ * All functions except journal_forget() must be called with recs_mutex held.
+ */
+
+/*
+ * JOURNAL_VERSION integer
+ * Version of the journal file format
+ */
+#define JOURNAL_VERSION 1
+
+/**
+ * Apply the journals on top of the XML DB that has just been read and start a
+ * new journal. The journals that were rotated out but not yet merged into the
+ * XML DB are applied first and then the journal that was open.
+ * @param generation Generation of the XML DB
+ * @param rewrite Write the XML DB even if there are no changes in the journals
+ */
+void
+init_journal(unsigned generation, int rewrite);
+
+/**
+ * Write the XML DB and close the journal
+ */
+void
+journal_close(void);
+
+/**
+ * Rotate out the open journal and start a new one with the next generation.
+ * The rotated journal is kept until the XML DB with the new generation has been
+ * written.
+ * @return The new generation. The XML DB written from the schedule as it is now
+ * gets this generation.
+ */
+unsigned
+journal_rotate(void);
+
+/**
+ * Remove the rotated journals that are older than the given generation. Called
+ * by the XML DB writer with xmldb_mutex held once the XML DB with that generation
+ * has been written.
+ * @param generation
+ */
+void
+journal_forget(unsigned generation);
+
+/**
+ * Record a new recording that has been added to the schedule
+ * @param entry The recording (or the first occurrence of a repeated recording) as inserted
+ * @param video The video card the recording was added to, -1 if the card was picked by the server
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_add(const struct recording_entry *entry, int video);
+
+/**
+ * Record that a recording is about to be deleted from the schedule. Must be called
+ * before the recording is removed.
+ * @param seqnbr
+ * @param allrecurrences
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_delete(unsigned seqnbr, int allrecurrences);
+
+/**
+ * Record a change of the profile for a recording
+ * @param seqnbr
+ * @param profile
+ * @return 0 on success, -1 on failure
+ */
+int
+journal_profile(unsigned seqnbr, const char *profile);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _TVJOURNAL_H */
+
@@ -36,8 +36,8 @@ extern "C" {
 
 /*
  * VIDBUFSIZE integer
- * 300 KB Video buffer size. This is the data chunk size we will read from the
- * video stream into memory before storing it on the file in the file system.
+ * 300 KB maximum read size. This is the largest data chunk we will read from the
+ * video stream in one call into the capture buffer (see capture.c).
  * This might not look very large but when we do the select() to wait for data
  * from the card the typical size returned is 80K-180K so 300K is more than enough.
  */
@@ -113,19 +113,18 @@ extern char **client_ipadr; //[MAX_CLIENTS];
  */
 extern time_t *client_tsconn; //[MAX_CLIENTS];
 
-// The size of the memory buffer used when reading video data from the device
-extern int video_bufsize;
-
-// The video buffers (one for each capture card)
-extern char *video_buffer[];
-
 // Whether all transcoding processes should also be killed when the server stops
 extern int dokilltranscodings;
 
-// Gloabl Mutex that must be called if the routine wants to access
-// any datastructure that modifies the recordings
+// Protects the pending schedule and the ongoing recordings. The transcodings and
+// the history have their own locks. See lockorder.h for the order the locks
+// must be taken in.
 extern pthread_mutex_t recs_mutex;
 
+// Signalled (with recs_mutex held) when the pending or ongoing recordings change
+// so that the scheduler thread re-arms its timer
+extern pthread_cond_t recs_cond;
+
 void
 tvp_mem_list(int sockd);
 
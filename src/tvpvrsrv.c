@@ -102,6 +102,7 @@
 #include "utils.h"
 #include "futils.h"
 #include "tvxmldb.h"
+#include "tvjournal.h"
 #include "tvcmd.h"
 #include "freqmap.h"
 #include "stats.h"
@@ -120,6 +121,11 @@
 #include "tvplog.h"
 #include "tvhistory.h"
 #include "tvwebcmd.h"
+#include "capture.h"
+#include "benchmark.h"
+#include "livetransc.h"
+#include "mpegscan.h"
+#include "lockorder.h"
 
 /*
  * Server identification
@@ -149,9 +155,10 @@ char server_program_name[32] = {0};
 // the daemon (-t)
 int tdelay=20;
 
-// The video buffer (used when reading the video stream from the capture card)
-// One buffer for each video card. We support up to 4 simultaneous cards
-char *video_buffer[MAX_VIDEO];
+/*
+ * Benchmark to run instead of starting the server (given with --benchmark)
+ */
+static char benchmark_spec[256];
 
 
 /*
@@ -206,6 +213,7 @@ time_t *client_tsconn;
  * 2) The creation and killing of thread and thread counts
  */
 pthread_mutex_t recs_mutex          = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recs_cond            = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t socks_mutex  = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t sig_mutex    = PTHREAD_MUTEX_INITIALIZER;
 
@@ -221,6 +229,20 @@ static int *client_socket;
  */
 static int *video_idx;
 
+/*
+ * handover_vh
+ * The encoder file descriptor handed over from the previous recording on the
+ * same card. -1 if the card should be setup from scratch.
+ */
+static int *handover_vh;
+
+/*
+ * handover_seqnbr
+ * Sequence number of the recording the card was switched over to by
+ * handover_recording(). Only valid while a handover is in progress.
+ */
+static unsigned *handover_seqnbr;
+
 /*
  * ts_serverstart
  * Timestamp when server was started
@@ -248,8 +270,9 @@ char locale_name[255];
  * Setup to handle program start up argument in both short and long format for use with the
  * getopt() library function.
  */
-static const char short_options [] = "d:f:hi:l:p:vx:V:st:";
+static const char short_options [] = "b:d:f:hi:l:p:vx:V:st:";
 static const struct option long_options [] = {
+    { "benchmark", required_argument,   NULL, 'b'},
     { "daemon",  required_argument,     NULL, 'd'},
     { "xmldb",   required_argument,     NULL, 'f'},
     { "help",    no_argument,           NULL, 'h'},
@@ -327,7 +350,12 @@ parsecmdline(int argc, char **argv) {
                         " -p n,    --port=n          Override inifile and set TCP/IP listen port\n"
                         " -x file, --xawtvrc=file    Override inifile and set station file\n"
                         " -s,      --slave           Run with slave configuration\n"
-                        " -t,      --tdelay          Extra wait time when daemon is started at system power on\n",
+                        " -t,      --tdelay          Extra wait time when daemon is started at system power on\n"
+                        " -b spec, --benchmark=spec  Run benchmark and exit. spec is one of\n"
+                        "                            capture:file  Compare CPU usage of the capture modes using file as encoder\n"
+                        "                            scan:file     Compare speed of the MPEG start code scanners on file\n"
+                        "                            xmldb[:num]   Time and memory to load an XML DB with num recordings\n"
+                        "                            history[:num] Time to index and query a history log with num recordings\n",
 
                         server_program_name, server_program_name);
                 exit(EXIT_SUCCESS);
@@ -346,6 +374,13 @@ parsecmdline(int argc, char **argv) {
                 exit(EXIT_SUCCESS);
                 break;
 
+            case 'b':
+                if( optarg != NULL ) {
+                    strncpy(benchmark_spec,optarg,255);
+                    benchmark_spec[255] = '\0';
+                }
+                break;
+
             case 'i':
                 if( optarg != NULL ) {
                     strncpy(inifile,optarg,255);
@@ -457,11 +492,14 @@ init_globs(void) {
         rec_threads     = (pthread_t *) calloc(max_video,   sizeof (pthread_t));
         video_idx       =       (int *) calloc(max_video,   sizeof (int));
         abort_video     =       (int *) calloc(max_video,   sizeof (int));
+        handover_vh     =       (int *) calloc(max_video,   sizeof (int));
+        handover_seqnbr =  (unsigned *) calloc(max_video,   sizeof (unsigned));
 
-        for (unsigned i = 0; i < max_video; ++i) {
+        for (unsigned i = 0; i < max_video && video_idx && handover_vh; ++i) {
             // Index of video stream. Used to avoid local stack based variables
             // to be sent in the pthread_create() call
             video_idx[i] = (int)i;
+            handover_vh[i] = -1;
         }
     }
 
@@ -471,17 +509,13 @@ init_globs(void) {
     client_socket   =       (int *) calloc(max_clients, sizeof (int));
 
     if( is_master_server ) {
-        for(unsigned i=0; i < max_video; ++i) {
-            video_buffer[i] = calloc(VIDBUFSIZE, sizeof(char *));
-            if( video_buffer[i] == NULL ) {
-                fprintf(stderr,"Cannot allocate video buffer memory. (%d : %s)",errno,strerror(errno));
-                exit(EXIT_FAILURE);
-            }
-        }
+        // The buffers used when reading the video stream from the capture cards
+        capture_init();
     }
 
     if ( is_master_server ) {
-        if (rec_threads   == NULL || video_idx == NULL ||  abort_video   == NULL) {
+        if (rec_threads   == NULL || video_idx == NULL ||  abort_video   == NULL || handover_vh == NULL ||
+            handover_seqnbr == NULL) {
             fprintf(stderr, "FATAL: Out of memory running as master. Aborting server.");
             exit(EXIT_FAILURE);
         }
@@ -830,33 +864,289 @@ chkdirstructure(void) {
 }
 
 /*
- * Start a recording on the specified video stream immediately using the information in the
- * current recording record.
- * This function is only run in its own thread that is created in chkrec() when it decides a
- * new recording should be started. After the recording have been successfully finished
- * the transcoding is initiated.
+ * Everything we need to know about a recording once the capture has been
+ * started. Handed over between the stages of a recording (capture, post
+ * recording processing and transcoding).
  */
-void *
-startrec(void *arg) {
-    ssize_t nread, nwrite;
-    char full_filename[256], workingdir[256], short_filename[256];
-    const mode_t dmode =  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
-    const mode_t fmode =  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+struct recording_job {
+    unsigned video;
+    int vh;
+    int fh;
+    struct recording_entry *recording;
+    char full_filename[256];
+    char workingdir[256];
+    char short_filename[256];
+    int preallocated;           /* Disk space was reserved with fallocate() */
+    struct livetransc_set live; /* Transcodings done while recording, indexed by profile */
+    unsigned nlive;             /* Number of live transcodings */
+    int write_file;             /* The stream is written to the MP2 file */
+};
+
+/*
+ * Stop the live transcodings (if any) of a recording that has been aborted
+ */
+static void
+abort_live_transcoding(struct recording_job *job) {
+    unsigned filesize;
+    float avg_5load;
+    struct timeall transcode_time;
+    char updatedfilename[256];
+
+    if( job->nlive ) {
+        // Make sure the card does not keep the sink if the capture never started
+        capture_set_sink(job->video, NULL, NULL, 1);
+    }
+    for(int i=0; i < LIVETRANSC_MAX; i++) {
+        if( job->live.lt[i] ) {
+            (void)livetransc_finish(job->live.lt[i], 1, datadir, job->recording->recurrence_title,
+                                    &filesize, &transcode_time, &avg_5load, updatedfilename);
+            job->live.lt[i] = NULL;
+        }
+    }
+    job->nlive = 0;
+}
+
+/*
+ * Close the recording file and the video device and run the post recording processing
+ * and transcoding for the recording described by the job. The job and the recording
+ * are freed when done.
+ */
+static void
+finishrec(struct recording_job *job, int doabort, unsigned mp2size) {
+    const unsigned video = job->video;
+    struct recording_entry *recording = job->recording;
+    struct transcoding_profile_entry *profile = NULL;
+    int rc;
+
+    // Release the part of the preallocated space that was not used. Truncating
+    // to the current size frees any blocks reserved beyond the end of file.
+    if( job->preallocated ) {
+        struct stat st;
+        if( 0 == fstat(job->fh, &st) && -1 == ftruncate(job->fh, st.st_size) ) {
+            logmsg(LOG_ERR,"Failed to release preallocated space for '%s'. ( %d : %s )",job->full_filename,errno,strerror(errno));
+        }
+    }
+    if( -1 == _dbg_close(job->fh) ) {
+        logmsg(LOG_ERR,"Failed to close file handle of recorded file. ( % d : % s )",errno,strerror(errno));
+    }
+    if( doabort ) {
+        logmsg(LOG_ERR, "Aborted recording to '%s' due to error. (%d : %s) ",job->full_filename,errno,strerror(errno));
+        abort_live_transcoding(job);
+    } else {
+        logmsg(LOG_INFO,"Recording to '%s' stopped. End of recording time.",job->full_filename);
+    }
+
+#ifndef DEBUG_SIMULATE
+    // After a handover the encoder is still used by the next recording
+    if( job->vh != -1 ) {
+        video_close(job->vh);
+    }
+#endif
+    lock_acquire(&recs_mutex, LOCK_RECS);
+    if( ongoing_recs[video] == recording ) {
+        abort_video[video]=0;
+        ongoing_recs[video] = (struct recording_entry *)NULL;
+        pthread_cond_signal(&recs_cond);
+    }
+    lock_release(&recs_mutex, LOCK_RECS);
+
+    //-------------------------------------------------------------------------------
+    // Run post-recording optional script and wait until it has finished
+    //-------------------------------------------------------------------------------
+    if( use_postrec_processing ) {
+        logmsg(LOG_DEBUG,"Post recording processing enabled.");
+        char postrec_fullname[128];
+        snprintf(postrec_fullname,128,"%s/tvpvrd/shellscript/%s",CONFDIR,postrec_script);
+        int csfd = open(postrec_fullname,O_RDONLY) ;
+        if( -1 == csfd ) {
+            logmsg(LOG_WARNING,"Cannot open post recording script '%s' ( %d : %s )",
+                   postrec_fullname,errno,strerror(errno));
+        } else {
+            char cmd[255];
+            snprintf(cmd,255,"%s -f \"%s\" -t %ld > /dev/null 2>&1",
+                     postrec_fullname, job->full_filename,recording->ts_end-recording->ts_start);
+            logmsg(LOG_DEBUG,"Running post recording script '%s'",cmd);
+            rc = system(cmd);
+            if( rc==-1 || WEXITSTATUS(rc)) {
+                logmsg(LOG_ERR,"Post recording script '%s' ended with exit status %d",postrec_fullname,WEXITSTATUS(rc));
+            } else {
+                logmsg(LOG_INFO,"Post recording script '%s' ended normally with exit status %d",postrec_fullname,WEXITSTATUS(rc));
+            }
+        }
+    }
+
+    //-------------------------------------------------------------------------------
+    // Now do the transcoding for each profile associated with this recording
+    //-------------------------------------------------------------------------------
+    int transcoding_problem = 1 ;
+    unsigned keep_mp2_file = 0 ;
+
+    if( !doabort ) {
+
+        struct transcoding_result res[REC_MAX_TPROFILES], post[REC_MAX_TPROFILES];
+        int post_idx[REC_MAX_TPROFILES];
+        unsigned npost = 0;
+        int nprof;
+
+        transcoding_problem = 0;
+        CLEAR(res);
+
+        // The profiles transcoded while recording only have to wait for their encoders
+        // to finish. The rest are transcoded from the MP2 file. If a live transcoding
+        // failed and we have the complete MP2 file we fall back to an ordinary transcoding.
+        for(nprof=0; nprof < REC_MAX_TPROFILES && strlen(recording->transcoding_profiles[nprof]) > 0; nprof++) {
+            get_transcoding_profile(recording->transcoding_profiles[nprof],&profile);
+
+            // If any of the profiles used requires the mp2 file to be kept explicitely or
+            // that no transcoding will be done we keep the mp2 file.
+            keep_mp2_file |= profile->encoder_keep_mp2file | !profile->use_transcoding;
+            res[nprof].profile = profile;
+            if( job->live.lt[nprof] ) {
+                logmsg(LOG_NOTICE,"Finishing live transcoding using profile: %s",profile->name);
+                res[nprof].ret = livetransc_finish(job->live.lt[nprof], 0, datadir, recording->recurrence_title,
+                                                   &res[nprof].filesize, &res[nprof].transcode_time,
+                                                   &res[nprof].avg_5load, res[nprof].updatedfilename);
+                job->live.lt[nprof] = NULL;
+                if( 0 == res[nprof].ret || !job->write_file ) {
+                    continue;
+                }
+                logmsg(LOG_NOTICE,"Live transcoding failed. Transcoding MP2 file using profile: %s",profile->name);
+            } else {
+                logmsg(LOG_NOTICE,"Transcoding using profile: %s",profile->name);
+            }
+            post[npost].profile = profile;
+            post_idx[npost++] = nprof;
+        }
+        job->nlive = 0;
+
+        // Transcode the remaining profiles from the MP2 file. Running them in parallel
+        // makes the total time that of the slowest profile instead of the sum.
+        if( parallel_transcoding ) {
+            if( npost > 0 ) {
+                (void)transcode_and_move_file_parallel(datadir, job->workingdir, job->short_filename,
+                                                       recording->recurrence_title, post, npost);
+            }
+        } else {
+            for(unsigned k=0; k < npost; k++) {
+                (void)transcode_and_move_file_parallel(datadir, job->workingdir, job->short_filename,
+                                                       recording->recurrence_title, &post[k], 1);
+            }
+        }
+        for(unsigned k=0; k < npost; k++) {
+            res[post_idx[k]] = post[k];
+        }
+
+        // Statistics and history are kept per profile
+        for(int i=0; i < nprof; i++) {
+            transcoding_problem |= res[i].ret;
+            if( 0 == res[i].ret ) {
+                stats_update(recording->transcoding_profiles[i],
+                             mp2size,
+                             (unsigned)(recording->ts_end - recording->ts_start),
+                             res[i].filesize,
+                             &res[i].transcode_time, res[i].avg_5load);
+
+
+                // Updated history file with this successful transcoding
+                hist_addrec(recording->title, recording->recurrence_title, recording->ts_start, recording->ts_end,
+                            res[i].updatedfilename, res[i].profile->name);
+
+            }
+        }
+    }
+
+    if (!transcoding_problem) {
+        char tmpbuff[256], newname[512];
+
+        // Move the original mp2 file if the user asked to keep it
+        int delete_workingdir = 1;
+        if (keep_mp2_file) {
+            // Move MP2 file
+            if( use_profiledirectories ) {
+                snprintf(tmpbuff, 255, "%s/mp2/%s/%s", datadir, profile->name, job->short_filename);
+            } else {
+                snprintf(tmpbuff, 255, "%s/mp2/%s", datadir, job->short_filename);
+            }
+            tmpbuff[255] = '\0';
+
+            if (mv_and_rename(job->full_filename, tmpbuff, newname, 512)) {
+                logmsg(LOG_ERR, "Could not move '%s' to '%s'", job->full_filename, newname);
+                delete_workingdir = 0;
+            } else {
+                logmsg(LOG_INFO, "Moved '%s' to '%s'", job->full_filename, newname);
+
+                // The GOP index follows the MP2 file
+                char idxname[520], newidxname[520], dummy[520];
+                snprintf(idxname, sizeof idxname, "%s%s", job->full_filename, MPEGSCAN_INDEX_SUFFIX);
+                snprintf(newidxname, sizeof newidxname, "%s%s", newname, MPEGSCAN_INDEX_SUFFIX);
+                if( 0 == access(idxname, F_OK) && mv_and_rename(idxname, newidxname, dummy, sizeof dummy) ) {
+                    logmsg(LOG_ERR, "Could not move GOP index '%s' to '%s'", idxname, newidxname);
+                }
+            }
+        }
+
+        // Delete the temporary directory used while recording and transcoding
+        // unless there were a problem with the transcoding.
+        if (!doabort && delete_workingdir) {
+            if (removedir(job->workingdir)) {
+                logmsg(LOG_ERR, "Could not delete directory '%s'.", job->workingdir);
+            } else {
+                logmsg(LOG_INFO, "Deleted directory '%s'.", job->workingdir);
+            }
+        }
+    } else if( !doabort ) {
+        logmsg(LOG_ERR,"Transcoding error. Leaving original MP2 file under '%s'",job->full_filename);
+    }
+
+    freerec(recording);
+    free(job);
+}
+
+#ifndef DEBUG_SIMULATE
+/*
+ * Post recording worker thread used with the capture reactor. Waits until all
+ * captured data has been written and then finishes the recording.
+ */
+static void *
+postrec_worker(void *arg) {
+    struct recording_job *job = arg;
     unsigned mp2size = 0;
-    int doabort = 0 ;
 
-    // To avoid reserving ~8MB after the thread terminates we
-    // detach it. Without doing this the pthreads library would keep
-    // the exit status until the thread is joined (or detached) which would mean
-    // loosing 8MB for each created thread
     pthread_detach(pthread_self());
 
-    unsigned video = *(unsigned *) arg;
-    struct recording_entry *recording = ongoing_recs[video];
-    struct transcoding_profile_entry *profile, *tmp_profile;
+    int doabort = -1 == capture_reactor_finish(job->video, &mp2size);
+    finishrec(job, doabort, mp2size);
+
+    pthread_exit(NULL);
+    return (void *)NULL;
+}
 
-    // In case there are many profiles defined for this recording we use the profile with the
-    // highest video bitrate quality to set the HW MP2 encoder.
+/*
+ * Called by the capture reactor (in the reactor thread) when a recording has ended.
+ * Since the reactor must never block we hand the recording over to a new post
+ * recording worker thread.
+ */
+static void
+recording_captured(unsigned video, void *arg) {
+    pthread_t worker;
+    if( 0 != pthread_create(&worker, NULL, postrec_worker, arg) ) {
+        unsigned mp2size = 0;
+        logmsg(LOG_ERR, "Could not create post recording thread for video stream #%02d. Finishing recording as aborted.",video);
+        // Finish in the reactor thread but treat the recording as aborted so that no
+        // transcoding is started here. The MP2 file is kept.
+        (void)capture_reactor_finish(video, &mp2size);
+        finishrec(arg, 1, mp2size);
+    }
+}
+#endif
+
+/*
+ * In case there are many profiles defined for a recording we use the profile with
+ * the highest video bitrate quality to set the HW MP2 encoder.
+ */
+static struct transcoding_profile_entry *
+get_encoder_profile(struct recording_entry *recording) {
+    struct transcoding_profile_entry *profile, *tmp_profile;
     int chosen_profile_idx = 0 ;
     int multi_prof_flag = FALSE; // This flag gets set if we find more than one profile
                                  // Used to control the extra debug print out below
@@ -873,318 +1163,455 @@ startrec(void *arg) {
                recording->transcoding_profiles[chosen_profile_idx],
                recording->title);
     }
+    return profile;
+}
 
-    int vh = setup_video(video,profile);
-
-    abort_video[video] = 0;
-
-    if (-1 == vh) {
-
-       logmsg(LOG_ERR, "Cannot setup video stream %02d. '%s' recording aborted",video,recording->title);
-       pthread_mutex_lock(&recs_mutex);
-       free(recording);
-       ongoing_recs[video] = (struct recording_entry *)NULL;
-       pthread_mutex_unlock(&recs_mutex);
-
-       pthread_exit(NULL);
-       return (void *)NULL;
-
-    } else {
-
-        int k = (int)strnlen(recording->filename,REC_MAX_NFILENAME)-1;
-        while ( k>0 && recording->filename[k] != '.' ) {
-            k--;
-        }
-        if( k <= 0 ) {
-            logmsg(LOG_ERR,"Corrupt filename. No file extension found - recording aborted.");
 #ifndef DEBUG_SIMULATE
-            video_close(vh);
-#endif
-            pthread_mutex_lock(&recs_mutex);
-            free(recording);
-            ongoing_recs[video] = (struct recording_entry *)NULL;
-            pthread_mutex_unlock(&recs_mutex);
+/*
+ * Called by the capture (in the recording thread) when the ongoing recording on the
+ * card reaches its end time and a handover has been asked for in chkrec(). Switches
+ * the open card over to the next recording if it is still due right after the
+ * ongoing one. Returns -1 if there should be no handover.
+ */
+static int
+handover_recording(unsigned video, int vh) {
+    char channel[REC_MAX_NCHANNEL];
+    struct transcoding_profile_entry *profile;
+
+    lock_acquire(&recs_mutex, LOCK_RECS);
+    struct recording_entry *current = ongoing_recs[video];
+    struct recording_entry *next = rec_top(video);
+    if( current == NULL || next == NULL || next->ts_start - current->ts_end > handover_gap ) {
+        lock_release(&recs_mutex, LOCK_RECS);
+        return -1;
+    }
+    strncpy(channel, next->channel, REC_MAX_NCHANNEL-1);
+    channel[REC_MAX_NCHANNEL-1] = '\0';
+    profile = get_encoder_profile(next);
+    handover_seqnbr[video] = next->seqnbr;
+    lock_release(&recs_mutex, LOCK_RECS);
+
+    if( -1 == switch_video(video, vh, channel, profile) ) {
+        logmsg(LOG_ERR,"Cannot switch video stream %02d to '%s' for handover. The card will be setup again.",video,channel);
+        return -1;
+    }
+    return 0;
+}
 
-            pthread_exit(NULL);
-            return (void *)NULL;
-        }
-        recording->filename[k] = '\0';
-        snprintf(workingdir,255,"%s/vtmp/vid%d/%s",datadir,video,recording->filename);
-        workingdir[255] = '\0';
-        int rc = mkdir(workingdir,dmode);
-        if( rc ) {
+void *
+startrec(void *arg);
 
-            if( errno == EEXIST ) {
+/*
+ * The capture has cut the stream at a GOP boundary after handing the card over.
+ * Start the recording thread for the next recording with the open encoder. The
+ * rest of the stream is then captured to the new recording file without any gap.
+ * Returns 0 if the next recording now owns the encoder, -1 otherwise.
+ */
+static int
+start_handover(unsigned video, int vh) {
+    lock_acquire(&recs_mutex, LOCK_RECS);
+    struct recording_entry *current = ongoing_recs[video];
+    struct recording_entry *next = rec_top(video);
+    if( next == NULL ) {
+        lock_release(&recs_mutex, LOCK_RECS);
+        logmsg(LOG_NOTICE,"Next recording on video stream %02d was removed during the handover.",video);
+        capture_set_handover(video, NULL);
+        return -1;
+    }
+    if( next->seqnbr != handover_seqnbr[video] ) {
+        // The card was tuned for a recording that is no longer first in line
+        lock_release(&recs_mutex, LOCK_RECS);
+        logmsg(LOG_NOTICE,"Next recording on video stream %02d changed during the handover. The card will be setup again.",video);
+        capture_set_handover(video, NULL);
+        return -1;
+    }
+
+    ongoing_recs[video] = next;
+    handover_vh[video] = vh;
+    if( 0 != pthread_create(&rec_threads[video], NULL, startrec, (void *) & video_idx[video]) ) {
+        logmsg(LOG_ERR, "Could not create thread for recording.");
+        ongoing_recs[video] = current;
+        handover_vh[video] = -1;
+        lock_release(&recs_mutex, LOCK_RECS);
+        capture_set_handover(video, NULL);
+        return -1;
+    }
+    (void)journal_delete(next->seqnbr, 0);
+    remove_toprec(video);
+    lock_release(&recs_mutex, LOCK_RECS);
+    return 0;
+}
+#endif
 
-                // If the base name fails try 10 steps of a adding a number
-                int i=0;
-                while( rc && errno == EEXIST && i < 99 ) {
-                    snprintf(workingdir,255,"%s/vtmp/vid%d/%s_%02d",datadir,video,recording->filename,i+1);
-                    workingdir[255] = '\0';
-                    rc = mkdir(workingdir,dmode);
-                    ++i;
-                }
+/*
+ * Reserve disk space for the whole recording. The expected size is the remaining
+ * recording time multiplied by the learned MP2 size per minute for the profile that
+ * sets up the encoder. If no statistics have been gathered yet the nominal bitrate
+ * of the profile is used instead. The file size is kept so the file still only
+ * shows what has been recorded. Unused space is released in finishrec().
+ * Returns -1 only if there is not enough space on the disk.
+ */
+static int
+preallocate_recording(struct recording_job *job, struct transcoding_profile_entry *profile) {
+    const time_t now = time(NULL);
+    if( !preallocate_recordings || !job->write_file || job->recording->ts_end <= now ) {
+        return 0;
+    }
 
-            }
+    unsigned long long bytes_1min = stats_mp2size_1min(profile->name);
+    if( bytes_1min == 0 ) {
+        bytes_1min = (unsigned long long)(profile->encoder_video_bitrate + profile->encoder_audio_bitrate) / 8 * 60;
+    }
+    const unsigned long long size = bytes_1min * (unsigned long long)(job->recording->ts_end - now) / 60 *
+                                    (100 + PREALLOCATE_MARGIN) / 100;
+    if( size == 0 ) {
+        return 0;
+    }
 
-            if( rc ) {
+    if( -1 == fallocate(job->fh, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) ) {
+        if( errno == ENOSPC ) {
+            logmsg(LOG_ERR, "Not enough disk space for '%s' (%llu MB needed).",job->full_filename,size/(1024*1024));
+            return -1;
+        }
+        logmsg(LOG_DEBUG, "Cannot preallocate '%s'. ( %d : %s )",job->full_filename,errno,strerror(errno));
+        return 0;
+    }
+    job->preallocated = 1;
+    logmsg(LOG_DEBUG, "Preallocated %llu MB for '%s'",size/(1024*1024),job->full_filename);
+    return 0;
+}
 
-                logmsg(LOG_ERR, "Cannot create recording directory (%s). Recording aborted. ( %d : %s)  ",workingdir,errno,strerror(errno));
 #ifndef DEBUG_SIMULATE
-                video_close(vh);
-#endif
-                pthread_mutex_lock(&recs_mutex);
-                free(recording);
-                ongoing_recs[video] = (struct recording_entry *)NULL;
-                pthread_mutex_unlock(&recs_mutex);
+/*
+ * The card may have been setup ahead of the recording (see chkrec()). Wait until the
+ * recording actually starts before reading from the encoder so that the capture
+ * begins at the start time. Returns early if the recording is aborted.
+ */
+static void
+wait_recording_start(unsigned video, time_t ts_start) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if( now.tv_sec >= ts_start ) {
+        return;
+    }
+    logmsg(LOG_DEBUG,"Video card #%02d ready %d s before the recording starts.",video,(int)(ts_start - now.tv_sec));
+    while( !abort_video[video] && now.tv_sec < ts_start ) {
+        // Sleep in short steps so that an abort is noticed
+        usleep(100000);
+        clock_gettime(CLOCK_REALTIME, &now);
+    }
+}
 
-                pthread_exit(NULL);
-                return (void *)NULL;
+/*
+ * Start a live transcoding for each single pass profile of the recording if live
+ * transcoding is enabled. The capture is teed into all the encoders so the stream
+ * is only captured once. The MP2 file is then only written if the user wants to
+ * keep it, if a post recording script should be run on it or if some profile must
+ * transcode it afterwards.
+ */
+static void
+start_live_transcoding(struct recording_job *job) {
+    struct recording_entry *recording = job->recording;
+    struct transcoding_profile_entry *profile;
+    int need_mp2 = use_postrec_processing;
+
+    CLEAR(job->live);
+    job->nlive = 0;
+    job->write_file = 1;
+    if( !live_transcoding ) {
+        return;
+    }
+
+    for(int i=0; i < REC_MAX_TPROFILES && strlen(recording->transcoding_profiles[i]) > 0; i++) {
+        get_transcoding_profile(recording->transcoding_profiles[i],&profile);
+        need_mp2 |= profile->encoder_keep_mp2file | !profile->use_transcoding;
+        if( profile->use_transcoding && profile->pass == 1 ) {
+            job->live.lt[i] = livetransc_start(job->workingdir, job->short_filename, profile);
+            if( job->live.lt[i] ) {
+                job->nlive++;
+                continue;
             }
+            logmsg(LOG_ERR,"Cannot start live transcoding of '%s' using profile '%s'. Will transcode after the recording.",
+                   job->full_filename,profile->name);
         }
-        recording->filename[k] = '.';
-        snprintf(full_filename,255,"%s/%s",workingdir,recording->filename);
-        full_filename[255] = '\0';
-        strncpy(short_filename,basename(full_filename),255);
-        short_filename[255] = '\0';
-
-        int fh = open(full_filename, O_WRONLY | O_CREAT | O_TRUNC, fmode);
-        if (-1 == fh) {
-
-            logmsg(LOG_ERR, "Cannot open '%s' for writing. Recording aborted. ( %d : %s ) ",
-                   full_filename,errno,strerror(errno));
-#ifndef DEBUG_SIMULATE
-            video_close(vh);
+        if( profile->use_transcoding ) {
+            need_mp2 = 1;
+        }
+    }
+    if( job->nlive ) {
+        job->write_file = need_mp2;
+    }
+}
 #endif
-            pthread_mutex_lock(&recs_mutex);
-            free(recording);
-            ongoing_recs[video] = (struct recording_entry *)NULL;
-
-            pthread_mutex_unlock(&recs_mutex);
-            pthread_exit(NULL);
 
-        } else {
-
-#ifndef DEBUG_SIMULATE
+/*
+ * Start a recording on the specified video stream immediately using the information in the
+ * current recording record.
+ * This function is only run in its own thread that is created in chkrec() when it decides a
+ * new recording should be started. After the recording have been successfully finished
+ * the transcoding is initiated.
+ * If the capture reactor is used this thread only sets up the card and the recording file
+ * and then hands the recording over to the reactor. Once the capture has ended a new
+ * post recording worker thread takes over and does the transcoding.
+ */
+void *
+startrec(void *arg) {
+    const mode_t dmode =  S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH;
+    const mode_t fmode =  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    unsigned mp2size = 0;
+    int doabort = 0 ;
 
-            // Do the actual recording by reading chunks of data from the
-            // MP2 stream and store it in the recording file
+    // To avoid reserving ~8MB after the thread terminates we
+    // detach it. Without doing this the pthreads library would keep
+    // the exit status until the thread is joined (or detached) which would mean
+    // loosing 8MB for each created thread
+    pthread_detach(pthread_self());
 
-            logmsg(LOG_INFO,"Started recording using video card #%02d, fd=%d to '%s'.", video,vh, full_filename);
-            fd_set fds;
-            struct timeval tv;
-            int ret;
+    unsigned video = *(unsigned *) arg;
+    struct recording_entry *recording = ongoing_recs[video];
+    struct transcoding_profile_entry *profile = get_encoder_profile(recording);
+
+    // If the previous recording on this card handed the encoder over to us the card
+    // has already been switched to this recording
+    const int handover = handover_vh[video] != -1;
+    int vh;
+    if( handover ) {
+        vh = handover_vh[video];
+        handover_vh[video] = -1;
+        logmsg(LOG_DEBUG,"Recording of '%s' takes over video stream %02d from the previous recording.",
+               recording->title,video);
+    } else {
+        vh = setup_video(video,profile);
+    }
 
-            do {
-                nread = 0 ;
-                nwrite = 0 ;
+    abort_video[video] = 0;
 
-                FD_ZERO (&fds);
-                FD_SET ((unsigned)vh, &fds);
+    struct recording_job *job = calloc(1, sizeof(struct recording_job));
 
-                /* Timeout. */
-                tv.tv_sec = 10;
-                tv.tv_usec = 0;
+    if (-1 == vh || job == NULL) {
 
-                // ---------------------------------------------------------------------------------------
-                // First wait until we have some data available from the video capture card
-                // via a select() call. We only wait for the descriptor associated with this capture
-                // card. If there is no error and the call wasn't interrupted (EINTR) we go ahead
-                // and read as much data as the card wants to give us. Normally this is a whole number of
-                // frames. The data read is normally in the range ~8k to ~80k in size.
-                // ---------------------------------------------------------------------------------------
+       logmsg(LOG_ERR, "Cannot setup video stream %02d. '%s' recording aborted",video,recording->title);
+#ifndef DEBUG_SIMULATE
+       if( -1 != vh ) {
+           video_close(vh);
+       }
+#endif
+       lock_acquire(&recs_mutex, LOCK_RECS);
+       freerec(recording);
+       free(job);
+       ongoing_recs[video] = (struct recording_entry *)NULL;
+       pthread_cond_signal(&recs_cond);
+       lock_release(&recs_mutex, LOCK_RECS);
 
-                ret = select (vh + 1, &fds, NULL, NULL, &tv);
+       pthread_exit(NULL);
+       return (void *)NULL;
 
-                if (-1 == ret && EINTR == errno) {
-                    continue;
-                } else if (0 == ret ) {
-                    logmsg(LOG_ERR,"Timeout on video stream #%02d. Aborting recording to '%s'",video,full_filename);
-                    doabort = 1;
-                } else {
+    }
 
-                    nread = read(vh, video_buffer[video], VIDBUFSIZE);
-
-                    if (-1 == nread ) {
-                            switch (errno) {
-                                case EAGAIN:
-                                    // No data available so just try again
-                                    logmsg(LOG_ERR,"No data yet available from stream #%02d on fd=%d",video,vh);
-                                    continue;
-                                default:
-                                    // Serious problem.
-                                    logmsg(LOG_ERR,"Unable to read from video stream #%02d on fd=%d. ( %d : %s )",
-                                            video,vh,errno,strerror(errno));
-                                    doabort = 1;
-                            }
-                    } else {
+    job->video = video;
+    job->vh = vh;
+    job->recording = recording;
 
-                        nwrite = write(fh, video_buffer[video], (size_t)nread);
+    int k = (int)strnlen(recording->filename,REC_MAX_NFILENAME)-1;
+    while ( k>0 && recording->filename[k] != '.' ) {
+        k--;
+    }
+    if( k <= 0 ) {
+        logmsg(LOG_ERR,"Corrupt filename. No file extension found - recording aborted.");
+#ifndef DEBUG_SIMULATE
+        video_close(vh);
+#endif
+        lock_acquire(&recs_mutex, LOCK_RECS);
+        freerec(recording);
+        free(job);
+        ongoing_recs[video] = (struct recording_entry *)NULL;
+        pthread_cond_signal(&recs_cond);
+        lock_release(&recs_mutex, LOCK_RECS);
 
-                        if( -1 == nwrite ) {
-                            logmsg(LOG_ERR, "Error while writing to '%s' while recording. (%d : %s) ",
-                                    full_filename,errno,strerror(errno));
-                            doabort = 1;
-                        } else {
-                            mp2size += (unsigned)nwrite;
-                            doabort = abort_video[video];
-                        }
+        pthread_exit(NULL);
+        return (void *)NULL;
+    }
+    // The entry can still be shared with a snapshot so the file name is never
+    // written to. The working directory is named after the file name without
+    // its extension.
+    snprintf(job->workingdir,255,"%s/vtmp/vid%d/%.*s",datadir,video,k,recording->filename);
+    job->workingdir[255] = '\0';
+    int rc = mkdir(job->workingdir,dmode);
+    if( rc ) {
+
+        if( errno == EEXIST ) {
+
+            // If the base name fails try 10 steps of a adding a number
+            int i=0;
+            while( rc && errno == EEXIST && i < 99 ) {
+                snprintf(job->workingdir,255,"%s/vtmp/vid%d/%.*s_%02d",datadir,video,k,recording->filename,i+1);
+                job->workingdir[255] = '\0';
+                rc = mkdir(job->workingdir,dmode);
+                ++i;
+            }
 
-                    }
-                }
-            } while (recording->ts_end > time(NULL) && !doabort);
+        }
 
-#else
-            logmsg(LOG_INFO,"Started simulated recording to file '%s'.", full_filename);
-            _writef(fh, "Simulated writing at ts=%u\n", (unsigned)time(NULL));
-            int used_time=0;
-            time_t now;
-            do {
-                sleep(10);
-                used_time += 10;
-                now = time(NULL);
-            } while(recording->ts_end > now && !doabort);
-            if( doabort ) {
-                _writef(fh, "Simulated writing aborted by user after %d seconds at ts=%u\n", used_time, (unsigned)time(NULL));
-            } else {
-                _writef(fh, "Simulated writing ended normally after %d seconds at ts=%u\n", used_time, (unsigned)time(NULL));
-            }
-            nread = nwrite = 1; // Some dummmy values to indicate that the fake recording was successful.
+        if( rc ) {
 
+            logmsg(LOG_ERR, "Cannot create recording directory (%s). Recording aborted. ( %d : %s)  ",job->workingdir,errno,strerror(errno));
+#ifndef DEBUG_SIMULATE
+            video_close(vh);
 #endif
+            lock_acquire(&recs_mutex, LOCK_RECS);
+            freerec(recording);
+            free(job);
+            ongoing_recs[video] = (struct recording_entry *)NULL;
+            pthread_cond_signal(&recs_cond);
+            lock_release(&recs_mutex, LOCK_RECS);
 
-            if( -1 == _dbg_close(fh) ) {
-                logmsg(LOG_ERR,"Failed to close file handle of recorded file. ( % d : % s )",errno,strerror(errno));
-            }
-            if( doabort ) {
-                logmsg(LOG_ERR, "Aborted recording to '%s' due to error. (%d : %s) ",full_filename,errno,strerror(errno));
-            } else {
-                logmsg(LOG_INFO,"Recording to '%s' stopped. End of recording time.",full_filename);
-            }
+            pthread_exit(NULL);
+            return (void *)NULL;
         }
+    }
+    snprintf(job->full_filename,255,"%s/%s",job->workingdir,recording->filename);
+    job->full_filename[255] = '\0';
+    strncpy(job->short_filename,basename(job->full_filename),255);
+    job->short_filename[255] = '\0';
 
 #ifndef DEBUG_SIMULATE
+    start_live_transcoding(job);
+#else
+    job->write_file = 1;
+#endif
+    job->fh = open(job->full_filename, O_WRONLY | O_CREAT | O_TRUNC, fmode);
+    if( -1 != job->fh && -1 == preallocate_recording(job, profile) ) {
+        _dbg_close(job->fh);
+        unlink(job->full_filename);
+        removedir(job->workingdir);
+        job->fh = -1;
+        errno = ENOSPC;
+    }
+    if (-1 == job->fh) {
+
+        logmsg(LOG_ERR, "Cannot open '%s' for writing. Recording aborted. ( %d : %s ) ",
+               job->full_filename,errno,strerror(errno));
+#ifndef DEBUG_SIMULATE
+        abort_live_transcoding(job);
         video_close(vh);
 #endif
-        pthread_mutex_lock(&recs_mutex);
-        abort_video[video]=0;
+        lock_acquire(&recs_mutex, LOCK_RECS);
+        freerec(recording);
+        free(job);
         ongoing_recs[video] = (struct recording_entry *)NULL;
-        pthread_mutex_unlock(&recs_mutex);
-
-        //-------------------------------------------------------------------------------
-        // Run post-recording optional script and wait until it has finished
-        //-------------------------------------------------------------------------------
-        if( use_postrec_processing ) {
-            logmsg(LOG_DEBUG,"Post recording processing enabled.");
-            char postrec_fullname[128];
-            snprintf(postrec_fullname,128,"%s/tvpvrd/shellscript/%s",CONFDIR,postrec_script);
-            int csfd = open(postrec_fullname,O_RDONLY) ;
-            if( -1 == csfd ) {
-                logmsg(LOG_WARNING,"Cannot open post recording script '%s' ( %d : %s )",
-                       postrec_fullname,errno,strerror(errno));
-            } else {
-                char cmd[255];
-                snprintf(cmd,255,"%s -f \"%s\" -t %ld > /dev/null 2>&1",
-                         postrec_fullname, full_filename,recording->ts_end-recording->ts_start);
-                logmsg(LOG_DEBUG,"Running post recording script '%s'",cmd);
-                rc = system(cmd);
-                if( rc==-1 || WEXITSTATUS(rc)) {
-                    logmsg(LOG_ERR,"Post recording script '%s' ended with exit status %d",postrec_fullname,WEXITSTATUS(rc));
-                } else {
-                    logmsg(LOG_INFO,"Post recording script '%s' ended normally with exit status %d",postrec_fullname,WEXITSTATUS(rc));
-                }
-            }
-        }
+        pthread_cond_signal(&recs_cond);
 
-        //-------------------------------------------------------------------------------
-        // Now do the transcoding for each profile associated with this recording
-        //-------------------------------------------------------------------------------
-        int transcoding_problem = 1 ;
-        unsigned keep_mp2_file = 0 ;
+        lock_release(&recs_mutex, LOCK_RECS);
+        pthread_exit(NULL);
+        return (void *)NULL;
+    }
 
-        if( !doabort && (nread == nwrite) ) {
+#ifndef DEBUG_SIMULATE
 
-            transcoding_problem = 0;
-            unsigned mp4size=0;
-            float avg_5load;
-            struct timeall transcode_time;
-            CLEAR(transcode_time);
+    // Do the actual recording by moving chunks of data from the
+    // MP2 stream and store it in the recording file
 
-            for(int i=0; i < REC_MAX_TPROFILES && strlen(recording->transcoding_profiles[i]) > 0; i++) {
-                get_transcoding_profile(recording->transcoding_profiles[i],&profile);
+    if( !handover ) {
+        wait_recording_start(video, recording->ts_start);
+    }
+    logmsg(LOG_INFO,"Started recording using video card #%02d, fd=%d to '%s'.", video,vh, job->full_filename);
 
-                // If any of the profiles used requires the mp2 file to be kept explicitely or
-                // that no transcoding will be done we keep the mp2 file.
-                keep_mp2_file |= profile->encoder_keep_mp2file | !profile->use_transcoding;
-                char updatedfilename[256];
-                logmsg(LOG_NOTICE,"Transcoding using profile: %s",profile->name);
-                int ret = transcode_and_move_file(datadir, workingdir, short_filename,
-                                                  recording->recurrence_title,
-                                                  profile,
-                                                  &mp4size, &transcode_time, &avg_5load, updatedfilename);
-                transcoding_problem |= ret;
-                if( 0 == ret ) {
-                    stats_update(recording->transcoding_profiles[i],
-                                 mp2size,
-                                 (unsigned)(recording->ts_end - recording->ts_start),
-                                 mp4size,
-                                 &transcode_time, avg_5load);
-
-
-                    // Updated history file with this successful transcoding
-                    hist_addrec(recording->title, recording->ts_start, recording->ts_end, updatedfilename, profile->name);
+    if( job->nlive ) {
+        capture_set_sink(video, livetransc_push_set, &job->live, job->write_file);
+    }
 
-                }
-            }
+    if( capture_reactor ) {
+        if( 0 == capture_reactor_add(video, vh, job->fh, job->full_filename, recording->ts_end,
+                                     recording_captured, job) ) {
+            // The reactor now owns the recording. This thread is no longer needed.
+            pthread_exit(NULL);
+            return (void *)NULL;
         }
+        doabort = 1;
+    } else {
+        doabort = -1 == capture_stream(video, vh, job->fh, job->full_filename, recording->ts_end, &mp2size);
+        if( !doabort && capture_handover_done(video) && 0 == start_handover(video, vh) ) {
+            // The encoder now belongs to the next recording
+            job->vh = -1;
+        }
+    }
 
-        if (!transcoding_problem) {
-            char tmpbuff[256], newname[512];
+#else
+    logmsg(LOG_INFO,"Started simulated recording to file '%s'.", job->full_filename);
+    _writef(job->fh, "Simulated writing at ts=%u\n", (unsigned)time(NULL));
+    int used_time=0;
+    time_t now;
+    do {
+        sleep(10);
+        used_time += 10;
+        now = time(NULL);
+    } while(recording->ts_end > now && !doabort);
+    if( doabort ) {
+        _writef(job->fh, "Simulated writing aborted by user after %d seconds at ts=%u\n", used_time, (unsigned)time(NULL));
+    } else {
+        _writef(job->fh, "Simulated writing ended normally after %d seconds at ts=%u\n", used_time, (unsigned)time(NULL));
+    }
 
-            // Move the original mp2 file if the user asked to keep it
-            int delete_workingdir = 1;
-            if (keep_mp2_file) {
-                // Move MP2 file
-                if( use_profiledirectories ) {
-                    snprintf(tmpbuff, 255, "%s/mp2/%s/%s", datadir, profile->name, short_filename);
-                } else {
-                    snprintf(tmpbuff, 255, "%s/mp2/%s", datadir, short_filename);
-                }
-                tmpbuff[255] = '\0';
+#endif
 
-                if (mv_and_rename(full_filename, tmpbuff, newname, 512)) {
-                    logmsg(LOG_ERR, "Could not move '%s' to '%s'", full_filename, newname);
-                    delete_workingdir = 0;
-                } else {
-                    logmsg(LOG_INFO, "Moved '%s' to '%s'", full_filename, newname);
-                }
-            }
+    finishrec(job, doabort, mp2size);
 
-            // Delete the temporary directory used while recording and transcoding
-            // unless there were a problem with the transcoding.
-            if (!doabort && delete_workingdir) {
-                if (removedir(workingdir)) {
-                    logmsg(LOG_ERR, "Could not delete directory '%s'.", workingdir);
-                } else {
-                    logmsg(LOG_INFO, "Deleted directory '%s'.", workingdir);
-                }
-            }
-        } else if( !doabort ) {
-            logmsg(LOG_ERR,"Transcoding error. Leaving original MP2 file under '%s'",full_filename);
-        }
-    }
-
-    free(recording);
     pthread_exit(NULL);
     return (void *) 0;
 }
 
+/*
+ * SCHED_MAX_SLEEP integer
+ * Longest time (in seconds) the scheduler sleeps even if nothing is due
+ */
+#define SCHED_MAX_SLEEP 3600
+
+/*
+ * SCHED_SHUTDOWN_CHECK integer
+ * How often (in seconds) the scheduler checks for automatic shutdown when that
+ * is enabled
+ */
+#define SCHED_SHUTDOWN_CHECK 60
+
+/*
+ * Calculate when the scheduler has to wake up next. This is when the first
+ * pending recording on any card is due to be started, when the next occurrence
+ * of a repeated recording has to be added to the schedule or when it is time to
+ * check for automatic shutdown. Must be called with recs_mutex held.
+ * @param now
+ * @param blocked A due recording is waiting for the previous one to stop
+ * @return Time to wake up
+ */
+static time_t
+_sched_next_wakeup(time_t now, int blocked) {
+    time_t wakeup = now + SCHED_MAX_SLEEP;
+    if( shutdown_enable ) {
+        wakeup = MIN(wakeup, now + SCHED_SHUTDOWN_CHECK);
+    }
+    if( blocked ) {
+        wakeup = MIN(wakeup, now + (time_t)time_resolution);
+    }
+    for (unsigned video = 0; video < max_video; ++video) {
+        struct recording_entry *next = rec_top(video);
+        if( next ) {
+            wakeup = MIN(wakeup, next->ts_start - (time_t)time_resolution - (time_t)setup_video_lead(video));
+        }
+    }
+    const time_t refill = series_next_refill();
+    if( refill ) {
+        wakeup = MIN(wakeup, refill);
+    }
+    return MAX(wakeup, now + 1);
+}
+
 /*
  * This is the main thread that runs forever checking the list of recordings and kicks
  * of a recording thread when it is time for the recording to start.
  * This thread is started at the beginning of the server and run until the server
- * is shut down. It will loop and check every 'time_resolution second if a queued
- * recoding is due to be started. There is no argument passed to this thread.
+ * is shut down. Between the checks it sleeps on recs_cond until the next recording
+ * is due (see _sched_next_wakeup()). Any change to the pending or ongoing recordings
+ * signals recs_cond which wakes the thread up so that it can re-arm the timer.
+ * There is no argument passed to this thread.
  * The argument is only a dummy argument needed to fit the pthread() thread prototype.
  */
 void *
@@ -1202,6 +1629,8 @@ chkrec(void *arg) {
     // Do some sanity checks of time_resolution
     time_resolution = MIN(MAX(time_resolution,1),10);
 
+    time_t last_shutdown_check = 0;
+
     // The main thread that runs forever
     while (1) {
 
@@ -1212,12 +1641,25 @@ chkrec(void *arg) {
         // If the function determines that it is time to shutdown it will
         // call an external script that will do the actual shutdown. In that
         // case this function will never return.
-        check_for_shutdown();
+        now = time(NULL);
+        if( now - last_shutdown_check >= SCHED_SHUTDOWN_CHECK ) {
+            check_for_shutdown();
+            last_shutdown_check = now;
+        }
 
         // We need the current time to compare against
         now = time(NULL);
 
-        pthread_mutex_lock(&recs_mutex);
+        // Set when a recording could not be started since the previous one on
+        // the card has not stopped yet and when the schedule was changed in this
+        // pass and has to be checked again right away
+        int blocked = 0, changed = 0;
+
+        lock_acquire(&recs_mutex, LOCK_RECS);
+
+        // Add the occurrences of repeated recordings that have come within
+        // the series horizon to the queues
+        refill_series(now);
 
         // Each video has it's own queue which we check
 
@@ -1230,23 +1672,33 @@ chkrec(void *arg) {
             // this video stream
             if (num_entries[video] > 0) {
 
+#ifndef DEBUG_SIMULATE
+                // If the next recording starts right after the ongoing one on the same card
+                // the card is handed over without being closed (see handover_recording())
+                if( handover_gap > 0 && !capture_reactor && ongoing_recs[video] != NULL &&
+                    rec_top(video)->ts_start - ongoing_recs[video]->ts_end <= handover_gap ) {
+                    capture_set_handover(video, handover_recording);
+                }
+#endif
+
                 // Find out how far of we are to hae to start this recording
                 // If diff > 0 then the start time have already passed
-                diff = now - recs[REC_IDX(video, 0)]->ts_start;
+                diff = now - rec_top(video)->ts_start;
 
                 // If the recording is more than 10 min off then we consider this a missed
                 // opportunity. We remove this recording to be able to try the next one in
                 // sequence.
 
-                // Flag to keep track if we should update the XML DB file or not
-                // We only update the file in case we have actually a) ignored a recording or
-                // b) actually started a recording;
+                // Flag to keep track if the schedule was changed. This is only the case if we
+                // have actually a) ignored a recording or b) actually started a recording. The
+                // change is written to the journal before the recording is removed.
                 int update_xmldb = 0;
                 if (diff > 60 * 10) {
                     int sy,sm,sd,sh,smin,ssec;
-                    fromtimestamp(recs[REC_IDX(video, 0)]->ts_start,&sy,&sm,&sd,&sh,&smin,&ssec);
+                    fromtimestamp(rec_top(video)->ts_start,&sy,&sm,&sd,&sh,&smin,&ssec);
                     logmsg(LOG_ERR, "Time for recording of ('%s' %d-%02d-%02d %02d:%02d) on video %d is too far in the past. Recording cancelled.",
-                           recs[REC_IDX(video, 0)]->title, sy,sm,sd,sh,smin,video);
+                           rec_top(video)->title, sy,sm,sd,sh,smin,video);
+                    (void)journal_delete(rec_top(video)->seqnbr, 0);
                     delete_toprec(video);
                     update_xmldb = 1; // We removed a entry so update DB file
                 } else {
@@ -1255,7 +1707,11 @@ chkrec(void *arg) {
                     // away. It will also take a few ms to setup the card and tuner so we
                     // err on the safe side here. So in general this means that on average the
                     // recording will start ~TIME_RESOLUTION s before the scheduled time.
-                    if (diff >= -(int)time_resolution) {
+                    // If pre-warming is enabled the recording thread is started even earlier
+                    // so that the card is setup and ready when the recording starts. The
+                    // recording thread then waits for the exact start time.
+                    const int lead = (int)setup_video_lead(video);
+                    if (diff >= -(int)time_resolution - lead) {
                         volatile void  *active;
                         active = ongoing_recs[video];
 
@@ -1269,13 +1725,19 @@ chkrec(void *arg) {
                         // and try again
 
                         if ( active != NULL) {
-                            logmsg(LOG_ERR, "Can not start, '%s' using stream %02d. Previous recording (%s) has not yet stopped. Will try again.",
-                                   recs[REC_IDX(video, 0)]->title,video,ongoing_recs[video]->title);
+                            // While we are only pre-warming the card it is normal that the
+                            // previous recording is still running
+                            if (diff >= -(int)time_resolution) {
+                                logmsg(LOG_ERR, "Can not start, '%s' using stream %02d. Previous recording (%s) has not yet stopped. Will try again.",
+                                       rec_top(video)->title,video,ongoing_recs[video]->title);
+                            }
+                            blocked = 1;
                         } else {
                             // Remember what recording is currently taking place for this video stream
-                            ongoing_recs[video] = recs[REC_IDX(video, 0)];
+                            ongoing_recs[video] = rec_top(video);
 
                             // Remove it from the list of pending recordings
+                            (void)journal_delete(rec_top(video)->seqnbr, 0);
                             remove_toprec(video);
 
                             update_xmldb = 1; // We removed a entry so update DB file
@@ -1289,22 +1751,19 @@ chkrec(void *arg) {
                     }
                 }
                 if( update_xmldb ) {
-                    if (writeXMLFile(xmldbfile) >= 0 ) {
-                        char msgbuff[256];
-                        snprintf(msgbuff, 255,"Database successfully updated '%s' after recording has been done", xmldbfile);
-                        msgbuff[255] = 0 ;
-                        logmsg(LOG_INFO,msgbuff);
-                    } else {
-                        char msgbuff[256];
-                        snprintf(msgbuff, 255,"Failed to update database '%s' after recording has been done§    ", xmldbfile);
-                        msgbuff[255] = 0 ;
-                        logmsg(LOG_ERR,msgbuff);
-                    }
+                    changed = 1;
                 }
             }
         }
-        pthread_mutex_unlock(&recs_mutex);
-        sleep(time_resolution);
+
+        // Sleep until the next recording is due or the schedule is changed. If a
+        // recording was started or cancelled the queues are checked again first
+        // since a handover to the next recording might have to be set up.
+        if( !changed ) {
+            struct timespec wakeup = { _sched_next_wakeup(now, blocked), 0 };
+            (void)pthread_cond_timedwait(&recs_cond, &recs_mutex, &wakeup);
+        }
+        lock_release(&recs_mutex, LOCK_RECS);
     }
 
     // Trick to shut up the compiler warning about unused argument
@@ -1467,10 +1926,8 @@ clientsrv(void *arg) {
                     xstrtrim(buffer);
                     if( *buffer ) {
                         // Ignore empty command
-                        pthread_mutex_lock(&recs_mutex);
                         logmsg(LOG_INFO, "Client (%s) sent command: %s [len=%d]", client_ipadr[i], buffer, strlen(buffer));
                         cmdinterp(buffer, my_socket);
-                        pthread_mutex_unlock(&recs_mutex);
                     }
                 }
 
@@ -1858,6 +2315,11 @@ main(int argc, char *argv[]) {
     // Parse and set cmd line options
     parsecmdline(argc,argv);
 
+    // A benchmark runs stand alone and never starts the server
+    if( *benchmark_spec ) {
+        exit(benchmark_run(benchmark_spec));
+    }
+
     // Setup process lockfile that indicates that we are running to avoid
     // that the daemon can be started twice
     setup_lockfile();
@@ -2025,6 +2487,13 @@ main(int argc, char *argv[]) {
     // Start the thread that will be monitoring the recording list and
     // in turn setup a new thread to do a recording when the time has come
     if( is_master_server ) {
+#ifndef DEBUG_SIMULATE
+        // If enabled a single reactor thread handles the capture for all cards
+        if( capture_reactor && -1 == capture_reactor_init() ) {
+            logmsg(LOG_ERR,"Falling back to one capture thread per recording.");
+            capture_reactor = 0;
+        }
+#endif
         (void) pthread_create(&chkrec_thread, NULL, chkrec, (void *) NULL);
     }
 
@@ -2080,7 +2549,7 @@ main(int argc, char *argv[]) {
 
     logmsg(LOG_INFO,"Received signal %d. Shutting down ...",received_signal);
 
-    pthread_mutex_lock(&recs_mutex);
+    lock_acquire(&recs_mutex, LOCK_RECS);
 
     // ---------------------------------------------------------------------------------
     // Close all clients
@@ -2092,6 +2561,13 @@ main(int argc, char *argv[]) {
         }
     }
 
+    // ---------------------------------------------------------------------------------
+    // Write the changes in the journal to the XML DB
+    // ---------------------------------------------------------------------------------
+    if( is_master_server ) {
+        journal_close();
+    }
+
     // ---------------------------------------------------------------------------------
     // Shutdown all ongoing recordings
     // ---------------------------------------------------------------------------------
@@ -2106,7 +2582,7 @@ main(int argc, char *argv[]) {
         }
     }
 
-    pthread_mutex_unlock(&recs_mutex);
+    lock_release(&recs_mutex, LOCK_RECS);
 
     // Store the calculated statistics
     (void)write_stats();
@@ -42,6 +42,7 @@
 #include "mailutil.h"
 #include "xstr.h"
 #include "tvplog.h"
+#include "lockorder.h"
 
 #define RTC_WAKEUP_DEVICE "/sys/class/rtc/rtc0/wakealarm"
 #define RTC_STATUS_DEVICE "/proc/driver/rtc"
@@ -335,9 +336,9 @@ check_for_shutdown(void) {
     int nextrec_video;
     time_t nextrec_ts;
 
-    pthread_mutex_lock(&recs_mutex);
+    lock_acquire(&recs_mutex, LOCK_RECS);
     int ret=get_nextsched_rec(&nextrec, &nextrec_video, &nextrec_ts);
-    pthread_mutex_unlock(&recs_mutex);
+    lock_release(&recs_mutex, LOCK_RECS);
 
     // We need the current time to compare against
     time_t now = time(NULL);
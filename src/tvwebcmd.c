@@ -340,6 +340,42 @@ _web_cmd_addqrec(int socket, struct keypair_t *args, const size_t numargs, struc
     
 }
 
+int
+_web_cmd_histq(int socket, struct keypair_t *args, const size_t numargs, struct http_reqheaders *headers,char *login_token) {
+    char *profile, *month, *page, *title, *submit;
+
+#ifdef EXTRA_WEB_DEBUG
+    logmsg(LOG_DEBUG,"cmd_histq: sock=%d, numargs=%d",socket,numargs);
+#endif
+
+    if( -1 == get_assoc_value_s(args,numargs,"profile",&profile) ||
+        -1 == get_assoc_value_s(args,numargs,"month",&month) ||
+        -1 == get_assoc_value_s(args,numargs,"page",&page) ||
+        -1 == get_assoc_value_s(args,numargs,"title",&title) ||
+        -1 == get_assoc_value_s(args,numargs,"submit_histq",&submit) ||
+        strcmp(submit, "Search") ) {
+
+        return -1;
+
+    }
+
+    // Empty fields are left out of the history command
+    char tmpcmd[512];
+    snprintf(tmpcmd, sizeof(tmpcmd)-1, "rh%s%s%s%s%s%s %s",
+             *page ? " p=" : "", page,
+             *profile ? " @" : "", profile,
+             *month ? " month=" : "", month,
+             title);
+
+#ifdef EXTRA_WEB_DEBUG
+    logmsg(LOG_DEBUG,"cmdstring=\"%s\"",tmpcmd);
+#endif
+
+    web_main_page(socket, tmpcmd, login_token, headers->ismobile);
+    return 0;
+
+}
+
 int
 _web_cmd_default(int socket, struct keypair_t *args, const size_t numargs, struct http_reqheaders *headers,char *login_token) {
     (void) args;
@@ -372,6 +408,7 @@ init_web_cmds(void) {
         {"/","logout",0,_web_cmd_logout},
         {"/","addrec",11,_web_cmd_addrec},
         {"/","addqrec",6,_web_cmd_addqrec},
+        {"/","histq",5,_web_cmd_histq},
         {"/","delrec",3,_web_cmd_delrec},
         {"/","chwt",1,_web_cmd_chwt},
         {"/","killrec",1,_web_cmd_killrec},
@@ -387,6 +424,7 @@ init_web_cmds(void) {
         {"/","logout",0,_web_cmd_logout},
         {"/","addrec",13,_web_cmd_addrec},
         {"/","addqrec",6,_web_cmd_addqrec},
+        {"/","histq",5,_web_cmd_histq},
         {"/","delrec",3,_web_cmd_delrec},
         {"/","chwt",1,_web_cmd_chwt},
         {"/","killrec",1,_web_cmd_killrec},
@@ -124,8 +124,10 @@ web_cmd_ongoingtransc(int sockd) {
         
     } else {
         int active_transc=0;
+        char filename[256];
+        time_t start_ts;
         for (size_t i = 0; i < max_ongoing_transcoding; i++) {
-            if (ongoing_transcodings[i]) {                
+            if (0 == get_ongoing_transcoding(i, &start_ts, filename, sizeof(filename))) {
                 if (0 == active_transc % 2) {
                     _writef(sockd, "<div class=\"ongoing_transc_entry%s\">\n", num > 1 ? " halfw" : " fullw");
                 } else {
@@ -133,11 +135,11 @@ web_cmd_ongoingtransc(int sockd) {
                 }
             
                 time_t now = time(NULL);
-                int rtime = now-ongoing_transcodings[i]->start_ts;
+                int rtime = now-start_ts;
                 int rh = rtime/3600;
                 int rmin = (rtime - rh*3600)/60;
 
-                _writef(sockd, "<div class=\"displayasled_on\"><pre>(%02d:%02d)\n%s</pre></div>\n",rh,rmin,ongoing_transcodings[i]->filename);
+                _writef(sockd, "<div class=\"displayasled_on\"><pre>(%02d:%02d)\n%s</pre></div>\n",rh,rmin,filename);
                 _writef(sockd, "<div class=\"ongoing_transc_stop\"><a href=\"cmd?c=kt%%20%d\">Stop</a></div>\n",i);
                 _writef(sockd, "</div> <!-- ongoing_transc_entry -->\n");
                 active_transc++;
@@ -384,6 +386,38 @@ web_cmd_del(int sockd) {
 }
 
 
+/**
+ * Display the history search area
+ * @param sockd
+ */
+void
+web_cmd_history(int sockd) {
+    const char *profile_list[64];
+    const size_t n_profile = get_profile_names(profile_list, 64);
+
+    struct skeysval_t profile_keyval[65];
+    profile_keyval[0].key = "";
+    profile_keyval[0].val = "(all)";
+    for (size_t i = 0; i < n_profile; ++i) {
+        profile_keyval[i + 1].key = (char *) profile_list[i];
+        profile_keyval[i + 1].val = (char *) profile_list[i];
+    }
+
+    _web_cmd_module_start(sockd,"Search history");
+
+    _writef(sockd, "<form name=\"%s\" method=\"get\" action=\"histq\">\n", "id_histq_form");
+
+    html_element_select_code(sockd, "Profile:", "profile", NULL, profile_keyval, n_profile + 1, "id_hprofile");
+    html_element_input_text(sockd, "Month (yyyy-mm):", "month", "id_hmonth");
+    html_element_input_text(sockd, "Page:", "page", "id_hpage");
+    html_element_input_text(sockd, "Title:", "title", "id_htitle");
+    html_element_submit(sockd, "submit_histq", "Search", "id_histq");
+
+    _writef(sockd, "</form>\n");
+
+    _web_cmd_module_end(sockd);
+}
+
 /**
  * The full main page used when we are called from an ordinary browser, This is also
  * the place where we execute the Web-command as a side effect to get the web output
@@ -418,6 +452,7 @@ web_main_page(int sockd, char *wcmd, char *cookie_val, int mobile) {
     web_cmd_add(sockd);    
     web_cmd_qadd(sockd);
     web_cmd_del(sockd);
+    web_cmd_history(sockd);
     web_cmd_ongoingtransc(sockd);   
     _writef(sockd, "\n</div> <!-- windowcontent -->\n");
 
@@ -43,6 +43,9 @@ web_cmd_del(int sockd);
 void
 web_cmd_qadd(int sockd);
 
+void
+web_cmd_history(int sockd);
+
 void
 web_cmd_ongoingtransc(int sockd);
 
@@ -33,11 +33,16 @@
 #define _FILE_OFFSET_BITS 64
 
 // Standard headers
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <errno.h>
 #include <time.h>
+#include <libgen.h>
+#include <pthread.h>
 #include <sys/param.h>
 
 #include "config.h"
@@ -63,6 +68,11 @@
 #include "xstr.h"
 #include "tvcmd.h"
 #include "tvplog.h"
+#include "tvjournal.h"
+#include "tvdbsnap.h"
+#include "uhash.h"
+#include "bitmap.h"
+#include "lockorder.h"
 
 /* ---------------------------------------------------------------------------
  * XML File processing functions
@@ -72,13 +82,13 @@
 /*
  * Names of element in the XML file
  */
-#define XMLDB_VERSIONNUM "3"
+#define XMLDB_VERSIONNUM "4"
 
 static const xmlChar *xmldb_version =           (xmlChar *) XMLDB_VERSIONNUM;
 static const xmlChar *xmldb_root =              (xmlChar *) "tvrecdb";
 static const xmlChar *xmldb_nameVersion =       (xmlChar *) "version";
+static const xmlChar *xmldb_propnameJournal =   (xmlChar *) "journal";
 static const xmlChar *xmldb_nameRecording =     (xmlChar *) "recording";
-static const xmlChar *xmldb_nameText =          (xmlChar *) "text";
 static const xmlChar *xmldb_nameStartdate =     (xmlChar *) "startdate";
 static const xmlChar *xmldb_nameEnddate =       (xmlChar *) "enddate";
 static const xmlChar *xmldb_nameEndtime =       (xmlChar *) "endtime";
@@ -96,6 +106,8 @@ static const xmlChar *xmldb_nameTProfile =      (xmlChar *) "transcodeprofile";
 static const xmlChar *xmldb_nameRecStartNumber= (xmlChar *) "startnumber";
 static const xmlChar *xmldb_nameExcludes      = (xmlChar *) "excludes";
 static const xmlChar *xmldb_nameExcludeItem   = (xmlChar *) "excluderecord";
+static const xmlChar *xmldb_nameExcludeBitmap = (xmlChar *) "excludebitmap";
+static const xmlChar *xmldb_propnameBase      = (xmlChar *) "base";
 
 
 /*
@@ -105,21 +117,9 @@ static const xmlChar *xmldb_nameExcludeItem   = (xmlChar *) "excluderecord";
  */
 int
 parseTime(const char *atime, int *h, int *m, int *s) {
-    int ret;
-    char **field;
-
-    // Setup regex for parsing of date
-    ret = matchcmd("([0-2][0-9]):([0-5][0-9])(:([0-5][0-9]))?",atime,&field);
-
-    if (ret == 3 || ret == 5 ) {
-        *h = xatoi(field[1]);
-        *m = xatoi(field[2]);
-        if( ret == 5) {
-            *s = xatoi(field[4]);
-        } else {
-            *s = 0;
-        }
-        matchcmd_free(&field);
+    *s = 0;
+    const int ret = sscanf(atime, " %2d:%2d:%2d", h, m, s);
+    if (ret >= 2 && *h >= 0 && *h <= 29 && *m >= 0 && *m <= 59 && *s >= 0 && *s <= 59) {
         return 1;
     } else {
         *h = 0;
@@ -135,17 +135,8 @@ parseTime(const char *atime, int *h, int *m, int *s) {
  */
 int
 parseDate(const char *date, int *y, int *m, int *d) {
-    int ret;
-    char **field;
-
-    // Setup regex for parsing of date
-    ret = matchcmd("(20[0-4][0-9])-([0-1]?[0-9])-([0-3]?[0-9])",date,&field);
-
-    if (ret == 4) {
-        *y = xatoi(field[1]);
-        *m = xatoi(field[2]);
-        *d = xatoi(field[3]);
-        matchcmd_free(&field);
+    if (3 == sscanf(date, " %4d-%2d-%2d", y, m, d) &&
+        *y >= 2000 && *y <= 2049 && *m >= 0 && *m <= 19 && *d >= 0 && *d <= 39) {
         return 1;
     } else {
         *y = 0;
@@ -155,265 +146,207 @@ parseDate(const char *date, int *y, int *m, int *d) {
     }
 }
 
-static void 
-processExcludes(xmlNodePtr node,struct excluded_items *excluded) {
-    xmlNodePtr childnode;
-
-    node = node->xmlChildrenNode;
-    excluded->num = 0;
-    while (node != NULL) {
-        if (xmlStrcmp(node->name, xmldb_nameText)) {
-
-            childnode = node->xmlChildrenNode;    
-            if (xmlStrcmp(node->name, xmldb_nameExcludeItem) == 0) {
-                if (xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    int excludeditem = xatoi((char * const) childnode->content);
-                    excluded->excluded_items[excluded->num++] = excludeditem;
-                }            
-            }
-        }
-        node = node->next;
-    }    
-}
+/*
+ * The fields of a recording as they are read from the XML file
+ */
+struct xmldb_rec {
+    char filename[REC_MAX_NFILENAME+1], title[REC_MAX_NTITLE+1], channel[REC_MAX_NCHANNEL+1];
+    char recprefix[REC_MAX_NPREFIX+1];
+    char profiles[REC_MAX_TPROFILES][REC_MAX_TPROFILE_LEN];
+    size_t num_profiles;
+    int sy, sm, sd, sh, smin, ssec;
+    int ey, em, ed, eh, emin, esec;
+    int recurrence, rectype, recnbr, recmangling, startnumber;
+    struct bitmap excluded;
+};
 
 /*
- * Process a <repeat> .. </repeat> block
+ * Store the text of one element inside a <recording> in the recording.
+ * The elements inside <repeat> and <excludes> have names of their own so
+ * they are told apart by name alone. The deleted occurrences are stored as a
+ * hex bitmap (see bitmap_format()) in <excludebitmap>. Databases before
+ * version 4 have one <excluderecord> per deleted occurrence.
  */
-static void 
-processRepeatingRecording(xmlNodePtr node, int *rectype, int *recnbr, 
-                          int *recmangling, char *recprefix, int *startnumber,
-                          struct excluded_items *excluded) {
-    xmlNodePtr childnode;
+static void
+processField(xmlTextReaderPtr reader, const xmlChar *name, const char *val, struct xmldb_rec *r) {
     xmlChar *xmlval;
 
-    node = node->xmlChildrenNode;
-    while (node != NULL) {
+    if (xmlStrcmp(name, xmldb_nameStartdate) == 0) {
+        if (!parseDate(val, &r->sy, &r->sm, &r->sd)) {
+            logmsg(LOG_ERR, "Failed to parse start date in XML file.");
+        }
+    } else if (xmlStrcmp(name, xmldb_nameEnddate) == 0) {
+        if (!parseDate(val, &r->ey, &r->em, &r->ed)) {
+            logmsg(LOG_ERR, "Failed to parse end date in XML file.");
+        }
+    } else if (xmlStrcmp(name, xmldb_nameStarttime) == 0) {
+        if (!parseTime(val, &r->sh, &r->smin, &r->ssec)) {
+            logmsg(LOG_ERR, "Failed to parse start time in XML file.");
+        }
+    } else if (xmlStrcmp(name, xmldb_nameEndtime) == 0) {
+        if (!parseTime(val, &r->eh, &r->emin, &r->esec)) {
+            logmsg(LOG_ERR, "Failed to parse end time in XML file.");
+        }
+    } else if (xmlStrcmp(name, xmldb_nameTitle) == 0) {
+        strncpy(r->title, val, REC_MAX_NTITLE - 1);
+        r->title[REC_MAX_NTITLE - 1] = 0;
+    } else if (xmlStrcmp(name, xmldb_nameFilename) == 0) {
+        strncpy(r->filename, val, REC_MAX_NFILENAME - 1);
+        r->filename[REC_MAX_NFILENAME - 1] = 0;
+    } else if (xmlStrcmp(name, xmldb_nameChannel) == 0) {
+        strncpy(r->channel, val, REC_MAX_NCHANNEL - 1);
+        r->channel[REC_MAX_NCHANNEL - 1] = 0;
+    } else if (xmlStrcmp(name, xmldb_nameTProfile) == 0) {
+        if (r->num_profiles < REC_MAX_TPROFILES) {
+            strncpy(r->profiles[r->num_profiles], val, REC_MAX_TPROFILE_LEN - 1);
+            r->profiles[r->num_profiles++][REC_MAX_TPROFILE_LEN - 1] = 0;
+        }
+    } else if (xmlStrcmp(name, xmldb_nameVideo) == 0) {
+        logmsg(LOG_NOTICE,"video field in database is deprecated");
+    } else if (xmlStrcmp(name, xmldb_nameRecType) == 0) {
+        r->rectype = xatoi((char * const) val);
+    } else if (xmlStrcmp(name, xmldb_nameRecNbr) == 0) {
+        r->recnbr = xatoi((char * const) val);
+    } else if (xmlStrcmp(name, xmldb_nameRecStartNumber) == 0) {
+        r->startnumber = xatoi((char * const) val);
+    } else if (xmlStrcmp(name, xmldb_nameRecMangling) == 0) {
+        xmlval = xmlTextReaderGetAttribute(reader, xmldb_propnameRecPrefix);
+        strncpy(r->recprefix, xmlval ? (const char *) xmlval : DEFAULT_PREFIX, REC_MAX_NPREFIX - 1);
+        r->recprefix[REC_MAX_NPREFIX - 1] = 0;
+        xmlFree(xmlval);
+        r->recmangling = xatoi((char * const) val);
+    } else if (xmlStrcmp(name, xmldb_nameExcludeItem) == 0) {
+        (void)bitmap_set(&r->excluded, (unsigned)xatoi((char * const) val));
+    } else if (xmlStrcmp(name, xmldb_nameExcludeBitmap) == 0) {
+        xmlval = xmlTextReaderGetAttribute(reader, xmldb_propnameBase);
+        const int base = xmlval ? xatoi((char *) xmlval) : 0;
+        xmlFree(xmlval);
+        if( base < 0 || -1 == bitmap_parse(&r->excluded, (unsigned)base, val) ) {
+            logmsg(LOG_ERR, "Invalid list of deleted occurrences in XML file: '%s'", val);
+        }
+    } else {
+        logmsg(LOG_ERR, "Unknown XML node name: %s", name);
+    }
+}
 
-        if (xmlStrcmp(node->name, xmldb_nameText)) {
+/*
+ * Read a single <recording> from the XML file. The reader is positioned on the
+ * start of the element and is left on its end.
+ * @return 0 on success, -1 if the file is not well formed
+ */
+static int
+readRecording(xmlTextReaderPtr reader, struct xmldb_rec *r) {
+    const int depth = xmlTextReaderDepth(reader);
+    if (xmlTextReaderIsEmptyElement(reader)) {
+        return 0;
+    }
 
-            childnode = node->xmlChildrenNode;
+    while (1 == xmlTextReaderRead(reader)) {
+        const int type = xmlTextReaderNodeType(reader);
+        if (type == XML_READER_TYPE_END_ELEMENT && xmlTextReaderDepth(reader) == depth) {
+            return 0;
+        }
+        if (type != XML_READER_TYPE_ELEMENT) {
+            // Ignore text in between proper child
+            continue;
+        }
 
-            if (xmlStrcmp(node->name, xmldb_nameRecType) == 0) {
-                if (xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    *rectype = xatoi((char * const) childnode->content);
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameRecNbr) == 0) {
-                if (xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    *recnbr = xatoi((char * const) childnode->content);
-                }
-            } else if(xmlStrcmp(node->name,xmldb_nameRecStartNumber) == 0 ) {
-                if (xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    *startnumber = xatoi((char * const) childnode->content);
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameRecMangling) == 0) {
-                if (xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    xmlval = xmlGetProp(node, xmldb_propnameRecPrefix);
-                    if (xmlval != NULL) {
-                        strncpy(recprefix, (const char *) xmlval, REC_MAX_NPREFIX - 1);
-                        recprefix[REC_MAX_NPREFIX - 1] = 0;
-                        xmlFree(xmlval);
-                    } else {
-                        strncpy(recprefix, DEFAULT_PREFIX, REC_MAX_NPREFIX - 1);
-                        recprefix[REC_MAX_NPREFIX - 1] = 0;
-                    }
-                    *recmangling = xatoi((char * const) childnode->content);
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameExcludes) == 0) {
-                processExcludes(node,excluded);      
-            } else {
-                logmsg(LOG_ERR, "Unknown XML node name in repeated recording: %s", node->name);
+        const xmlChar *name = xmlTextReaderConstName(reader);
+        if (xmlStrcmp(name, xmldb_nameRecurrence) == 0) {
+            r->recurrence = 1;
+        } else if (xmlStrcmp(name, xmldb_nameExcludes) != 0) {
+            xmlChar *val = xmlTextReaderReadString(reader);
+            if (val) {
+                processField(reader, name, (const char *) val, r);
+                xmlFree(val);
             }
         }
-        node = node->next;
     }
+    return -1;
 }
 
 /*
- * Parse a single recording in the XML file. Extract the necessary fields
- * and add this as a proper entry in the list of recordings.
+ * Add a recording read from the XML file to the list of recordings
  */
 static void
-processRecording(xmlNodePtr node) {
+insertRecording(struct xmldb_rec *r) {
     char bname_buffer[512];
-    char filename[REC_MAX_NFILENAME+1], title[REC_MAX_NTITLE+1], channel[REC_MAX_NCHANNEL+1];
-    char recprefix[REC_MAX_NPREFIX+1], *profiles[REC_MAX_TPROFILES+1];
-    xmlNodePtr childnode;
-    int sy, sm, sd;
-    int ey, em, ed;
-    int sh, smin, ssec;
-    int eh, emin, esec;
+    char *profiles[REC_MAX_TPROFILES+1];
     time_t ts_start, ts_end;
     struct recording_entry *entry;
-    struct excluded_items *excluded;    
-    excluded = calloc(1,sizeof(struct excluded_items));
-    excluded->num = 0;
-
-    node = node->xmlChildrenNode;
-    
-    int recurrence = 0;
-    int rectype = 0;
-    int recnbr = 0;
-    int recmangling = 0;
-    int startnumber=0;
-    recprefix[0] = '\0';
-
-    size_t num_profiles = 0;
-    for(size_t i=0; i < REC_MAX_TPROFILES; i++) {
-        profiles[i] = calloc(1,REC_MAX_TPROFILE_LEN);
-    }
-
-    while (node != NULL) {
-
-        // Ignore text in between proper child
-        if (xmlStrcmp(node->name, xmldb_nameText)) {
-            childnode = node->xmlChildrenNode;
-            if (xmlStrcmp(node->name, xmldb_nameStartdate) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    if (!parseDate((const char *) childnode->content, &sy, &sm, &sd)) {
-                        logmsg(LOG_ERR, "Failed to parse start date in XML file.");
-                    }
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameEnddate) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
 
-                    if (!parseDate((const char *) childnode->content, &ey, &em, &ed)) {
-                        logmsg(LOG_ERR, "Failed to parse end date in XML file.");
-                    }
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameStarttime) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    if (!parseTime((const char *) childnode->content, &sh, &smin, &ssec)) {
-                        logmsg(LOG_ERR, "Failed to parse start time in XML file.");
-                    }
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameEndtime) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    if (!parseTime((const char *) childnode->content, &eh, &emin, &esec)) {
-                        logmsg(LOG_ERR, "Failed to parse end time in XML file.");
-                    }
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameTitle) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    strncpy(title, (const char *) childnode->content, REC_MAX_NTITLE - 1);
-                    title[REC_MAX_NTITLE - 1] = 0;
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameFilename) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    strncpy(filename, (const char *) childnode->content, REC_MAX_NFILENAME - 1);
-                    filename[REC_MAX_NFILENAME - 1] = 0;
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameChannel) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    strncpy(channel, (const char *) childnode->content, REC_MAX_NCHANNEL - 1);
-                    channel[REC_MAX_NCHANNEL - 1] = 0;
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameTProfile) == 0) {
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    strncpy(profiles[num_profiles], (const char *) childnode->content, REC_MAX_TPROFILE_LEN - 1);
-                    profiles[num_profiles++][REC_MAX_TPROFILE_LEN - 1] = 0;
-                }                
-            } else if (xmlStrcmp(node->name, xmldb_nameVideo) == 0) {
-                logmsg(LOG_NOTICE,"video field in database is deprecated");
-                if (childnode && xmlStrcmp(childnode->name, xmldb_nameText) == 0) {
-                    childnode = childnode->next;
-                }
-            } else if (xmlStrcmp(node->name, xmldb_nameRecurrence) == 0) {
-                recurrence = 1;
-                processRepeatingRecording(node,
-                        &rectype, &recnbr, &recmangling, recprefix, &startnumber, excluded);
-            } else {
-                logmsg(LOG_ERR, "Unknown XML node name: %s", node->name);
-            }
-        }
-        node = node->next;
-    }
-
-    strncpy(bname_buffer, filename,511);
+    strncpy(bname_buffer, r->filename,511);
     bname_buffer[511] = '\0';
-    strncpy(filename, basename(bname_buffer), REC_MAX_NFILENAME);
+    strncpy(r->filename, basename(bname_buffer), REC_MAX_NFILENAME);
 
     // Create a new recording. This means that a recurrent recording is expanded with
     // a single record for all its occurrences
-    ts_start = totimestamp(sy, sm, sd, sh, smin, ssec);
-    ts_end = totimestamp(ey, em, ed, eh, emin, esec);
+    ts_start = totimestamp(r->sy, r->sm, r->sd, r->sh, r->smin, r->ssec);
+    ts_end = totimestamp(r->ey, r->em, r->ed, r->eh, r->emin, r->esec);
 
     // A sanity check that DB is not corrupt
     if( ts_start >= ts_end ) {
-        logmsg(LOG_ERR, "Database corrupt for entry '%s'. Start time >= end time. Ignoring this recording.", title);
-        for (size_t i = 0; i < REC_MAX_TPROFILES; i++) {
-            free(profiles[i]);
-        }
-        free(excluded);
+        logmsg(LOG_ERR, "Database corrupt for entry '%s'. Start time >= end time. Ignoring this recording.", r->title);
         return;
     }
 
-
-    if (0 == num_profiles) {
+    if (0 == r->num_profiles) {
         logmsg(LOG_ERR, "No profiles defined for recording: '%s'. Adding default profile '%s' ",
-                title, default_transcoding_profile);
-        num_profiles = 1;
-        strncpy(profiles[0], default_transcoding_profile, REC_MAX_TPROFILE_LEN);
-        profiles[0][REC_MAX_TPROFILE_LEN - 1] = '\0';
-    }
-    for (size_t k = 0; k < num_profiles; k++) {
-        if (!transcoding_profile_exist(profiles[k])) {
-            logmsg(LOG_NOTICE, "Transcoding profile %s does not exist. Falling back on default profile.", profiles[k]);
-            strncpy(profiles[k], default_transcoding_profile, REC_MAX_TPROFILE_LEN - 1);
-            profiles[0][REC_MAX_TPROFILE_LEN - 1] = '\0';
+                r->title, default_transcoding_profile);
+        r->num_profiles = 1;
+        strncpy(r->profiles[0], default_transcoding_profile, REC_MAX_TPROFILE_LEN);
+        r->profiles[0][REC_MAX_TPROFILE_LEN - 1] = '\0';
+    }
+    for (size_t k = 0; k < r->num_profiles; k++) {
+        if (!transcoding_profile_exist(r->profiles[k])) {
+            logmsg(LOG_NOTICE, "Transcoding profile %s does not exist. Falling back on default profile.", r->profiles[k]);
+            strncpy(r->profiles[k], default_transcoding_profile, REC_MAX_TPROFILE_LEN - 1);
+            r->profiles[k][REC_MAX_TPROFILE_LEN - 1] = '\0';
         }
+        profiles[k] = r->profiles[k];
     }
+    profiles[r->num_profiles] = NULL;
 
-    entry = newrec(title, filename,
+    entry = newrec(r->title, r->filename,
             ts_start, ts_end,
-            channel,
-            recurrence, rectype, recnbr, recmangling,
+            r->channel,
+            r->recurrence, r->rectype, r->recnbr, r->recmangling,
             profiles);
 
-    entry->recurrence_start_number = startnumber;
+    entry->recurrence_start_number = r->startnumber;
 
-    for (size_t i = 0; i < REC_MAX_TPROFILES; i++) {
-        free(profiles[i]);
-    }
-
-    // Now insert the record in the first available queue
-    int ret;
-    size_t v = 0;
-    do {
-        ret = insertrec(v, entry, excluded);
-    } while (-1 == ret && ++v < max_video);
+    // Now insert the record on the cheapest available queue(s)
+    int ret = insertrec_any(entry, &r->excluded);
 
     if (-1 == ret) {
         logmsg(LOG_ERR, "Can't insert record '%s'. No free video queues for this recording.", entry->title);
         freerec(entry);
         entry = NULL;
+    } else if (0 == ret) {
+        // Every occurrence has been excluded so there is nothing left to record
+        freerec(entry);
+        entry = NULL;
     } else {
-        logmsg(LOG_INFO, "  -- inserted record '%s' in queue for video %d", title, v);
+        logmsg(LOG_INFO, "  -- inserted record '%s'", r->title);
     }
-
-    free(excluded);
-    
 }
 
 /**
  * processXMLFile
- * Parse the XML file with recordings and build the internal
- * memory structure
+ * Read the XML file with recordings and build the internal memory structure.
+ * The file is read as a stream and each recording is added as soon as it has
+ * been read so no document tree of the whole file is ever built.
+ * @param filename
+ * @param[out] generation Generation of the journal that belongs to the file
+ * @return 0 on success, 1 if the file is an older version that should be
+ * written again, -1 on failure
  */
 int
-readXMLFile(const char *filename) {
-    xmlNodePtr node;
-    xmlDocPtr doc;
+readXMLFile(const char *filename, unsigned *generation) {
+    xmlTextReaderPtr reader;
     xmlChar *xmlver;
     int forceUpdate=0;
-    /*
-     * 1  == Element
-     * 15 == EndElement
-     * 8  == Comment
-     * 2  == Attribute
-     * 3  == Text field
-     * 17 == XML declaration
-     * 14 == Significant White Space
-     */
+    int ret;
 
     /*
      * this initialize the library and check potential ABI mismatches
@@ -422,34 +355,36 @@ readXMLFile(const char *filename) {
      */
     LIBXML_TEST_VERSION
 
-    // Parse the XML file
-    doc = xmlParseFile(filename);
-    if (NULL == doc) {
+    // Open the XML file
+    reader = xmlReaderForFile(filename, NULL, XML_PARSE_NOBLANKS);
+    if (NULL == reader) {
         logmsg(LOG_NOTICE, "Unable to open XML Database file. Will try again in 5s: '%s' ( %d : %s )", filename,errno,strerror(errno));
         sleep(5);
-        doc = xmlParseFile(filename);
-        if (NULL == doc) {
+        reader = xmlReaderForFile(filename, NULL, XML_PARSE_NOBLANKS);
+        if (NULL == reader) {
             logmsg(LOG_ERR, "Unable to open XML Database file. Will try again in 5s: '%s' ( %d : %s )", filename,errno,strerror(errno));
             return -1;   
         }
     }
 
-    node = xmlDocGetRootElement(doc);
-
-    if (xmlStrcmp(node->name, xmldb_root)) {
+    // Find the root element
+    while ((ret = xmlTextReaderRead(reader)) == 1 && xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+        ;
+    if (ret != 1 || xmlStrcmp(xmlTextReaderConstName(reader), xmldb_root)) {
         logmsg(LOG_ERR, "XML file is not a proper recording database file. Wrong root element. Found '%s' when expecting '%s'",
-                node->name,xmldb_root);
-        xmlFreeDoc(doc);
+                ret == 1 ? (const char *) xmlTextReaderConstName(reader) : "",xmldb_root);
+        xmlFreeTextReader(reader);
         return -1;
     }
 
     // Check that the version of the file is the expected
-    xmlver = xmlGetProp(node, xmldb_nameVersion);
+    xmlver = xmlTextReaderGetAttribute(reader, xmldb_nameVersion);
     if (xmlStrcmp(xmlver, xmldb_version)) {
         logmsg(LOG_NOTICE, "Expected XML DB version '%s' but found version '%s'.",xmldb_version,xmlver);
         if( xatoi((char *)xmlver) > xatoi((char *)xmldb_version) ) {
             logmsg(LOG_NOTICE, "Can not handle a newer database version. Please upgrade daemon.");
-            xmlFreeDoc(doc);
+            xmlFree(xmlver);
+            xmlFreeTextReader(reader);
             return -1;
         } else {
             logmsg(LOG_NOTICE, "Will update XML DB to new schema automatically");
@@ -458,190 +393,527 @@ readXMLFile(const char *filename) {
     }
     xmlFree(xmlver);
 
+    // Files written before the journal was introduced have no generation
+    xmlChar *xmlgen = xmlTextReaderGetAttribute(reader, xmldb_propnameJournal);
+    *generation = xmlgen ? (unsigned)strtoul((char *)xmlgen, NULL, 10) : 0;
+    xmlFree(xmlgen);
+
+    // The record is reused for all recordings
+    struct xmldb_rec *r = malloc(sizeof (struct xmldb_rec));
+    if (r == NULL) {
+        logmsg(LOG_ERR, "Out of memory when reading XML DB file.");
+        xmlFreeTextReader(reader);
+        return -1;
+    }
 
-    node = node->xmlChildrenNode;
     size_t nodeCnt=0;
-    while (NULL != node) {
-        if (xmlStrcmp(node->name, xmldb_nameRecording) == 0) {
+    while ((ret = xmlTextReaderRead(reader)) == 1) {
+        if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT && xmlTextReaderDepth(reader) == 1 &&
+            xmlStrcmp(xmlTextReaderConstName(reader), xmldb_nameRecording) == 0) {
             ++nodeCnt;
-            processRecording(node);
+            memset(r, 0, sizeof (struct xmldb_rec));
+            bitmap_init(&r->excluded);
+            if (0 == (ret = readRecording(reader, r))) {
+                insertRecording(r);
+            }
+            bitmap_free(&r->excluded);
+            if (ret == -1) {
+                break;
+            }
         }
-        node = node->next;
     }
-    
-    if( 0 == nodeCnt ) {
+    free(r);
+
+    if (ret == -1) {
+        logmsg(LOG_ERR, "XML DB file '%s' is not well formed. Stopped after %zu recordings.", filename, nodeCnt);
+        forceUpdate = -1;
+    } else if( 0 == nodeCnt ) {
         logmsg(LOG_NOTICE, "XML DB is empty. Contains no records.");    
     }
 
-    xmlFreeDoc(doc);
+    xmlFreeTextReader(reader);
     xmlCleanupParser();
 
-    if( forceUpdate ) {
-        UPDATE_DB();
-    }
-
-    return 0;
+    return forceUpdate;
 }
 
+/* ---------------------------------------------------------------------------
+ * Writing the XML DB
+ *
+ * The XML DB is written by a background thread from a snapshot of the schedule
+ * so the callers that change the schedule never wait for the disk. Each change
+ * is already safe in the journal (see tvjournal.c) and only asks for a write.
+ * All requests that come in while a write is pending or in progress are
+ * collapsed into the next write, so deleting all episodes of a series or adding
+ * a whole file of recordings causes one write and not one per recording.
+ * ---------------------------------------------------------------------------
+ */
+
 /*
- * Write an XML representation of the internal recording arrays to the file pointed to by
- * the specified descriptor
+ * XMLDB_SETTLE_TIME integer
+ * Seconds the writer waits after the first request before it takes the snapshot
+ * so that a burst of changes ends up in the same write
  */
-int
-_writeXMLFile(const int fd) {
-    int oldhtml = htmlencode_flag;
-    htmlencode_flag = 0;
-    int ret = _writeXMLFileHTML(fd);
-    htmlencode_flag = oldhtml;
-    return ret;
+#define XMLDB_SETTLE_TIME 1
+
+/*
+ * xmldb_mutex
+ * Serializes the writes of the XML DB file. Protects xmldb_written.
+ */
+static pthread_mutex_t xmldb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Generation of the XML DB file on disk
+static unsigned xmldb_written = 0;
+
+/*
+ * xmldb_queue_mutex
+ * Protects the requests to write the XML DB and the writer statistics
+ */
+static pthread_mutex_t xmldb_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xmldb_queue_cond = PTHREAD_COND_INITIALIZER;
+
+// Number of requests since the last snapshot was taken
+static unsigned xmldb_pending = 0;
+
+// Time of the first of the pending requests
+static struct timespec xmldb_first_request;
+
+struct xmldb_stats {
+    unsigned nrequests;             /* Requests to write the XML DB */
+    unsigned nwrites;               /* Snapshots written */
+    unsigned nfailed;               /* Writes that failed */
+    unsigned last_ms;               /* From the first request to the file on disk */
+    unsigned max_ms;
+    unsigned long long total_ms;
+    unsigned last_write_ms;         /* Time to write the last snapshot */
+};
+static struct xmldb_stats xmldb_stats;
+
+/*
+ * A snapshot of the schedule that is to be written with the given generation
+ */
+struct xmldb_job {
+    unsigned generation;
+    struct recs_snapshot *snapshot;
+    struct timespec requested;
+};
+
+/**
+ * Milliseconds between two points on the monotonic clock
+ * @param t0
+ * @param t1
+ * @return ms
+ */
+static unsigned
+_xmldb_ms(const struct timespec *t0, const struct timespec *t1) {
+    const long long ms = (long long)(t1->tv_sec - t0->tv_sec) * 1000LL + (t1->tv_nsec - t0->tv_nsec) / 1000000L;
+    return ms > 0 ? (unsigned)ms : 0;
 }
 
-int
-_writeXMLFileHTML(const int fd) {
-    unsigned j, nsaved_recrec;
-    int y, m, d, h, min, sec;
-    unsigned saved_recrec[2 * MAX_ENTRIES];
-    char tmpbuff[256];
-    time_t now;
+/**
+ * Write a whole buffer to a file
+ * @param fd
+ * @param buffer
+ * @param len
+ * @return 0 on success, -1 on failure
+ */
+static int
+_xmldb_writeall(int fd, const char *buffer, size_t len) {
+    while( len > 0 ) {
+        const ssize_t n = write(fd, buffer, len);
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
 
-    nsaved_recrec = 0;
-    now = time(NULL);
+/**
+ * Write the start and end time of a recording
+ * @param fp
+ * @param e
+ */
+static void
+_xmldb_render_times(FILE *fp, const struct recording_entry *e) {
+    int y, m, d, h, min, sec;
+    fromtimestamp(e->ts_start, &y, &m, &d, &h, &min, &sec);
+    fprintf(fp, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameStartdate, y, m, d,xmldb_nameStartdate);
+    fprintf(fp, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameStarttime, h, min, sec,xmldb_nameStarttime);
+    fromtimestamp(e->ts_end, &y, &m, &d, &h, &min, &sec);
+    fprintf(fp, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameEnddate, y, m, d,xmldb_nameEnddate);
+    fprintf(fp, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameEndtime, h, min, sec,xmldb_nameEndtime);
+}
 
-    // Test if the first write was ok then we assume that the rest will
-    // be ok as well. Not perfect but at least this way we will catch
-    // wrong permissions
+/**
+ * Write an XML representation of a snapshot of the schedule. Only the first
+ * pending occurrence of a repeated recording is written together with the rule
+ * for the rest of the occurrences.
+ * @param fp
+ * @param s
+ * @param generation Generation stored in the file, 0 to leave it out
+ * @return 0 on success, -1 on failure
+ */
+static int
+_xmldb_render(FILE *fp, const struct recs_snapshot *s, unsigned generation) {
+    char tmpbuff[256];
+    const time_t now = time(NULL);
 
-    if( -1 == _writef(fd, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n") ) {
+    // The repeated recordings already written
+    struct uhash saved;
+    if( -1 == uhash_init(&saved) ) {
+        logmsg(LOG_ERR,"Out of memory when writing XML DB file.");
         return -1;
     }
-    _writef(fd, "<!-- Created: %s -->\n", ctime(&now));
-    _writef(fd, "<%s %s=\"%s\">\n",xmldb_root,xmldb_nameVersion,XMLDB_VERSIONNUM);
-
-    for (unsigned video = 0; video < max_video; video++) {
-
-        for (unsigned i = 0; i < num_entries[video]; i++) {
-
-            if (recs[REC_IDX(video, i)]->recurrence == 0) {
-                // Process a single recording
-                _writef(fd, "  <%s>\n",xmldb_nameRecording);
-                _writef(fd, "    <%s>%s</%s>\n", xmldb_nameTitle,recs[REC_IDX(video, i)]->title,xmldb_nameTitle);
-                _writef(fd, "    <%s>%s</%s>\n", xmldb_nameChannel, recs[REC_IDX(video, i)]->channel,xmldb_nameChannel);
-                _writef(fd, "    <%s>%d</%s>\n", xmldb_nameVideo,video,xmldb_nameVideo);
-                fromtimestamp(recs[REC_IDX(video, i)]->ts_start, &y, &m, &d, &h, &min, &sec);
-                _writef(fd, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameStartdate, y, m, d,xmldb_nameStartdate);
-                _writef(fd, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameStarttime, h, min, sec,xmldb_nameStarttime);
-                fromtimestamp(recs[REC_IDX(video, i)]->ts_end, &y, &m, &d, &h, &min, &sec);
-                _writef(fd, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameEnddate, y, m, d,xmldb_nameEnddate);
-                _writef(fd, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameEndtime, h, min, sec,xmldb_nameEndtime);               
-                strncpy(tmpbuff, recs[REC_IDX(video, i)]->filename, 255);
-                tmpbuff[255] = 0;
-                _writef(fd, "    <%s>%s</%s>\n",xmldb_nameFilename, basename(tmpbuff),xmldb_nameFilename);
-                for(int k=0; k < REC_MAX_TPROFILES && strlen(recs[REC_IDX(video, i)]->transcoding_profiles[k]) > 0; k++) {
-                    _writef(fd, "    <%s>%s</%s>\n",xmldb_nameTProfile, recs[REC_IDX(video, i)]->transcoding_profiles[k],
-                            xmldb_nameTProfile);
-                }
-                _writef(fd, "  </%s>\n",xmldb_nameRecording);
-            } else {
-                // Since we only store the master recurrence and not
-                // the full expanded list of recurrences we must check
-                // if we have already saved this recurrent recording.
-                // We store all the already saved recordings in
-                // the array "saved_recrec"
-                j = 0;
-                while (j < nsaved_recrec && (saved_recrec[j] != recs[REC_IDX(video, i)]->recurrence_id)) {
-                    j++;
-                }
-                if (j == nsaved_recrec) {
-                    // Not yet saved
-
-                    // Start by finding the lowest start number in the sequence, this will be th start
-                    // number that we save in the master record
-                    unsigned min_start_number = recs[REC_IDX(video, i)]->recurrence_start_number;
-                    for(unsigned k=i+1; k <  num_entries[video]; k++) {
-                        if( recs[REC_IDX(video, k)]->recurrence &&
-                            recs[REC_IDX(video, k)]->recurrence_id == recs[REC_IDX(video, i)]->recurrence_id ) {
-                            min_start_number = MIN(recs[REC_IDX(video, k)]->recurrence_start_number,min_start_number);
-                        }
-                    }
-                    saved_recrec[nsaved_recrec] = recs[REC_IDX(video, i)]->recurrence_id;
-                    nsaved_recrec++;
-
-                    _writef(fd, "  <%s>\n",xmldb_nameRecording);
-                    _writef(fd, "    <%s>%s</%s>\n",xmldb_nameTitle, recs[REC_IDX(video, i)]->recurrence_title, xmldb_nameTitle);
-                    _writef(fd, "    <%s>%s</%s>\n",xmldb_nameChannel, recs[REC_IDX(video, i)]->channel, xmldb_nameChannel);
-
-                    fromtimestamp(recs[REC_IDX(video, i)]->ts_start, &y, &m, &d, &h, &min, &sec);
-                    _writef(fd, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameStartdate, y, m, d,xmldb_nameStartdate);
-                    _writef(fd, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameStarttime, h, min, sec,xmldb_nameStarttime);
-                    fromtimestamp(recs[REC_IDX(video, i)]->ts_end, &y, &m, &d, &h, &min, &sec);
-                    _writef(fd, "    <%s>%02d-%02d-%02d</%s>\n",xmldb_nameEnddate, y, m, d,xmldb_nameEnddate);
-                    _writef(fd, "    <%s>%02d:%02d:%02d</%s>\n",xmldb_nameEndtime, h, min, sec,xmldb_nameEndtime);
-
-                    strncpy(tmpbuff, recs[REC_IDX(video, i)]->recurrence_filename, 255);
-                    tmpbuff[255] = 0;
-                    _writef(fd, "    <%s>%s</%s>\n",xmldb_nameFilename, basename(tmpbuff),xmldb_nameFilename);
-                    // FIXME: Profile
-                    _writef(fd, "    <%s>%s</%s>\n",xmldb_nameTProfile, recs[REC_IDX(video, i)]->transcoding_profiles[0], xmldb_nameTProfile);
-                    _writef(fd, "    <%s>\n",xmldb_nameRecurrence);
-                    _writef(fd, "      <%s>%d</%s>\n",xmldb_nameRecType, recs[REC_IDX(video, i)]->recurrence_type, xmldb_nameRecType);
-                    _writef(fd, "      <%s>%d</%s>\n",xmldb_nameRecNbr, recs[REC_IDX(video, i)]->recurrence_num, xmldb_nameRecNbr);
-                    _writef(fd, "      <%s prefix=\"%s\">%d</%s>\n",xmldb_nameRecMangling,
-                            recs[REC_IDX(video, i)]->recurrence_mangling_prefix,
-                            recs[REC_IDX(video, i)]->recurrence_mangling,
-                            xmldb_nameRecMangling);
-                    _writef(fd, "      <%s>%d</%s>\n",xmldb_nameRecStartNumber,min_start_number,xmldb_nameRecStartNumber);
-                    
-                    if( has_excluded_items(recs[REC_IDX(video, i)]->recurrence_id) ) {
-                        
-                        iterate_excluded_init(recs[REC_IDX(video, i)]->recurrence_id);
-                    
-                        _writef(fd, "      <%s>\n",xmldb_nameExcludes);
-                        
-                        int item_idx;
-                        while( (item_idx = next_excluded_item()) >= 0 ) {
-                            if( item_idx > (int)min_start_number )
-                                _writef(fd, "        <%s>%d</%s>\n",xmldb_nameExcludeItem,item_idx,xmldb_nameExcludeItem);                            
-                        }                        
-                    
-                        _writef(fd, "      </%s>\n",xmldb_nameExcludes);
-                    
+
+    fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
+    fprintf(fp, "<!-- Created: %s -->\n", ctime(&now));
+    if( generation > 0 ) {
+        fprintf(fp, "<%s %s=\"%s\" %s=\"%u\">\n",xmldb_root,xmldb_nameVersion,XMLDB_VERSIONNUM,
+                xmldb_propnameJournal,generation);
+    } else {
+        fprintf(fp, "<%s %s=\"%s\">\n",xmldb_root,xmldb_nameVersion,XMLDB_VERSIONNUM);
+    }
+
+    for (size_t i = 0; i < s->num; i++) {
+        const struct recording_entry *e = s->entries[i];
+
+        if (e->recurrence == 0) {
+            // Process a single recording
+            fprintf(fp, "  <%s>\n",xmldb_nameRecording);
+            fprintf(fp, "    <%s>%s</%s>\n", xmldb_nameTitle,e->title,xmldb_nameTitle);
+            fprintf(fp, "    <%s>%s</%s>\n", xmldb_nameChannel, e->channel,xmldb_nameChannel);
+            fprintf(fp, "    <%s>%u</%s>\n", xmldb_nameVideo,e->video,xmldb_nameVideo);
+            _xmldb_render_times(fp, e);
+            strncpy(tmpbuff, e->filename, 255);
+            tmpbuff[255] = 0;
+            fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameFilename, basename(tmpbuff),xmldb_nameFilename);
+            for(int k=0; k < REC_MAX_TPROFILES && strlen(e->transcoding_profiles[k]) > 0; k++) {
+                fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameTProfile, e->transcoding_profiles[k],
+                        xmldb_nameTProfile);
+            }
+            fprintf(fp, "  </%s>\n",xmldb_nameRecording);
+        } else if( uhash_get(&saved, e->recurrence_id) == NULL ) {
+            // Since we only store the master recurrence and not the full
+            // expanded list of recurrences only the first occurrence is
+            // written. The snapshot is in time order so it also has the lowest
+            // start number in the sequence which is the start number that we
+            // save in the master record.
+            (void)uhash_put(&saved, e->recurrence_id, (void *)e);
+
+            fprintf(fp, "  <%s>\n",xmldb_nameRecording);
+            fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameTitle, e->recurrence_title, xmldb_nameTitle);
+            fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameChannel, e->channel, xmldb_nameChannel);
+            _xmldb_render_times(fp, e);
+
+            strncpy(tmpbuff, e->recurrence_filename, 255);
+            tmpbuff[255] = 0;
+            fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameFilename, basename(tmpbuff),xmldb_nameFilename);
+            // FIXME: Profile
+            fprintf(fp, "    <%s>%s</%s>\n",xmldb_nameTProfile, e->transcoding_profiles[0], xmldb_nameTProfile);
+            fprintf(fp, "    <%s>\n",xmldb_nameRecurrence);
+            fprintf(fp, "      <%s>%d</%s>\n",xmldb_nameRecType, e->recurrence_type, xmldb_nameRecType);
+            fprintf(fp, "      <%s>%d</%s>\n",xmldb_nameRecNbr, e->recurrence_num, xmldb_nameRecNbr);
+            fprintf(fp, "      <%s prefix=\"%s\">%d</%s>\n",xmldb_nameRecMangling,
+                    e->recurrence_mangling_prefix,
+                    e->recurrence_mangling,
+                    xmldb_nameRecMangling);
+            fprintf(fp, "      <%s>%d</%s>\n",xmldb_nameRecStartNumber,e->recurrence_start_number,xmldb_nameRecStartNumber);
+
+            const struct bitmap *excluded = recs_snapshot_excluded(s, e->recurrence_id);
+            if( excluded ) {
+
+                fprintf(fp, "      <%s>\n",xmldb_nameExcludes);
+
+                // Occurrences before the start number are never generated again
+                // so it does not matter that they are also in the bitmap
+                char hexbuff[1024];
+                unsigned base;
+                if( 0 == bitmap_format(excluded, &base, hexbuff, sizeof(hexbuff)) ) {
+                    fprintf(fp, "        <%s %s=\"%u\">%s</%s>\n",xmldb_nameExcludeBitmap,xmldb_propnameBase,
+                            base,hexbuff,xmldb_nameExcludeBitmap);
+                } else {
+                    struct bitmap_iter bit;
+                    unsigned item_idx;
+                    bitmap_iter_init(excluded, &bit);
+                    while( bitmap_iter_next(&bit, &item_idx) ) {
+                        if( item_idx > e->recurrence_start_number )
+                            fprintf(fp, "        <%s>%u</%s>\n",xmldb_nameExcludeItem,item_idx,xmldb_nameExcludeItem);
                     }
-                    
-                    
-                    _writef(fd, "    </%s>\n",xmldb_nameRecurrence);
-                    _writef(fd, "  </%s>\n",xmldb_nameRecording);
                 }
+
+                fprintf(fp, "      </%s>\n",xmldb_nameExcludes);
+
             }
+
+            fprintf(fp, "    </%s>\n",xmldb_nameRecurrence);
+            fprintf(fp, "  </%s>\n",xmldb_nameRecording);
         }
     }
-    _writef(fd, "</%s>\n",xmldb_root);
-    return 0;
+    fprintf(fp, "</%s>\n",xmldb_root);
+    uhash_free(&saved);
+    return ferror(fp) ? -1 : 0;
 }
 
-/*
- * writeXMLFile
- * Dump internal memory structure as an XML file.
+/**
+ * Write a snapshot of the schedule to the XML DB file. The snapshot is first
+ * written and synced to a temporary file that then replaces the old file.
+ * @param filename
+ * @param s
+ * @param generation Generation stored in the file, 0 to leave it out
+ * @return 0 on success, -1 on failure
  */
-int
-writeXMLFile(const char *filename) {
-    int fd;
+static int
+_xmldb_save(const char *filename, const struct recs_snapshot *s, unsigned generation) {
+    char tmpname[300];
+    const int len = snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    if( len < 0 || (size_t)len >= sizeof(tmpname) ) {
+        logmsg(LOG_ERR, "Name of XML DB '%s' is too long.", filename);
+        return -1;
+    }
 
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd == -1) {
+    FILE *fp = fopen(tmpname, "w");
+    if( fp == NULL ) {
         logmsg(LOG_ERR, "Can't open '%s' XML data file for writing. (%d : %s) ",
-                filename,errno,strerror(errno));
+                tmpname,errno,strerror(errno));
         return -1;
     }
 
-    int ret = _writeXMLFile(fd);
-    close(fd);
-    if( -1 == ret ) {
+    // Make sure the file is on disk before it replaces the old DB
+    int ret = _xmldb_render(fp, s, generation);
+    if( 0 == ret && (0 != fflush(fp) || -1 == fsync(fileno(fp))) ) {
+        ret = -1;
+    }
+    if( 0 != fclose(fp) ) {
+        ret = -1;
+    }
+    if( -1 == ret || -1 == rename(tmpname, filename) ) {
         logmsg(LOG_ERR,"Failed to write XML data file '%s'. (%d : %s)",filename,errno,strerror(errno));
+        (void)unlink(tmpname);
         return -1;
     }
+
+    char dname[300];
+    strcpy(dname, filename);
+    const int dfd = open(dirname(dname), O_RDONLY | O_DIRECTORY);
+    if( dfd >= 0 ) {
+        (void)fsync(dfd);
+        close(dfd);
+    }
     return 0;
 }
 
+/**
+ * Take the snapshot for the next write. Must be called with recs_mutex held so
+ * that the snapshot and the rotation of the journal match.
+ * @param job
+ */
+static void
+_xmldb_prepare(struct xmldb_job *job) {
+    job->generation = journal_rotate();
+    job->snapshot = recs_snapshot_locked();
+
+    lock_acquire(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+    if( xmldb_pending > 0 ) {
+        job->requested = xmldb_first_request;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &job->requested);
+    }
+    xmldb_pending = 0;
+    lock_release(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+}
+
+/**
+ * Write the snapshot unless a later snapshot has already been written and
+ * remove the journals it replaces. Does not need recs_mutex.
+ * @param job
+ * @return 0 on success, -1 on failure
+ */
+static int
+_xmldb_run(struct xmldb_job *job) {
+    struct timespec t0, t1;
+    int ret = 0, written = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lock_acquire(&xmldb_mutex, LOCK_XMLDB);
+    if( job->snapshot == NULL ) {
+        ret = -1;
+    } else if( job->generation > xmldb_written ) {
+        ret = _xmldb_save(xmldbfile, job->snapshot, job->generation);
+        if( 0 == ret ) {
+            // The XML DB stays usable on its own if the snapshot can't be written
+            (void)write_dbsnap(xmldbfile, job->snapshot, job->generation);
+            xmldb_written = job->generation;
+            journal_forget(job->generation);
+            written = 1;
+        }
+    }
+    lock_release(&xmldb_mutex, LOCK_XMLDB);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    recs_snapshot_put(job->snapshot);
+    job->snapshot = NULL;
+
+    lock_acquire(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+    if( written ) {
+        xmldb_stats.nwrites++;
+        xmldb_stats.last_write_ms = _xmldb_ms(&t0, &t1);
+        xmldb_stats.last_ms = _xmldb_ms(&job->requested, &t1);
+        xmldb_stats.max_ms = MAX(xmldb_stats.max_ms, xmldb_stats.last_ms);
+        xmldb_stats.total_ms += xmldb_stats.last_ms;
+    } else if( -1 == ret ) {
+        xmldb_stats.nfailed++;
+    }
+    lock_release(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+
+    if( written ) {
+        logmsg(LOG_DEBUG, "Database '%s' written in %u ms.", xmldbfile, xmldb_stats.last_write_ms);
+    }
+    return ret;
+}
+
+/**
+ * Ask the writer thread to write the XML DB. Returns immediately.
+ */
+void
+request_xmldb_write(void) {
+    lock_acquire(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+    if( xmldb_pending == 0 ) {
+        clock_gettime(CLOCK_MONOTONIC, &xmldb_first_request);
+    }
+    xmldb_pending++;
+    xmldb_stats.nrequests++;
+    pthread_cond_signal(&xmldb_queue_cond);
+    lock_release(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+}
+
+/**
+ * Write the XML DB now and wait until it is on disk. Must be called with
+ * recs_mutex held.
+ * @return 0 on success, -1 on failure
+ */
+int
+write_xmldb(void) {
+    struct xmldb_job job;
+    _xmldb_prepare(&job);
+    return _xmldb_run(&job);
+}
+
+/**
+ * The XML DB writer thread
+ * @param arg
+ * @return
+ */
+static void *
+_xmldb_writer(void *arg) {
+    (void)arg;
+    pthread_detach(pthread_self());
+    for(;;) {
+        lock_acquire(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+        while( xmldb_pending == 0 ) {
+            pthread_cond_wait(&xmldb_queue_cond, &xmldb_queue_mutex);
+        }
+        lock_release(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+
+        // Let the rest of a burst of changes come in
+        sleep(XMLDB_SETTLE_TIME);
+
+        struct xmldb_job job;
+        lock_acquire(&recs_mutex, LOCK_RECS);
+        _xmldb_prepare(&job);
+        lock_release(&recs_mutex, LOCK_RECS);
+
+        // Serialize and write the snapshot without holding up the rest of the server
+        (void)_xmldb_run(&job);
+    }
+    return NULL;
+}
+
+/**
+ * Write the XML DB writer statistics to the given socket
+ * @param sockfd
+ */
+void
+xmldb_dump_stats(int sockfd) {
+    char ctitle[17] = {"XML DB writer"};
+    lock_acquire(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+    const struct xmldb_stats st = xmldb_stats;
+    const unsigned pending = xmldb_pending;
+    lock_release(&xmldb_queue_mutex, LOCK_XMLDB_QUEUE);
+
+    _writef(sockfd,"%-16s: pending=%u requests=%u writes=%u failed=%u\n",
+            ctitle, pending, st.nrequests, st.nwrites, st.nfailed);
+    *ctitle='\0'; // We only want the title on the first line
+    _writef(sockfd,"%-16s: latency last=%ums max=%ums avg=%ums, last write took %ums\n",
+            ctitle, st.last_ms, st.max_ms,
+            st.nwrites ? (unsigned)(st.total_ms / st.nwrites) : 0,
+            st.last_write_ms);
+}
+
+/**
+ * Write a snapshot of the current schedule to the file pointed to by
+ * the specified descriptor. Follows the current HTML encoding setting.
+ * @param fd
+ * @return -1 on failure, 0 otherwise
+ */
+int
+_writeXMLFileHTML(const int fd) {
+    char *buffer = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buffer, &len);
+    if( fp == NULL ) {
+        logmsg(LOG_ERR,"Out of memory when writing XML DB file.");
+        return -1;
+    }
+    struct recs_snapshot *s = recs_snapshot_get();
+    int ret = s ? _xmldb_render(fp, s, 0) : -1;
+    recs_snapshot_put(s);
+    if( 0 != fclose(fp) ) {
+        ret = -1;
+    }
+    if( 0 == ret ) {
+        if( htmlencode_flag ) {
+            char *htmlbuff = html_encode(buffer);
+            ret = _xmldb_writeall(fd, htmlbuff, strlen(htmlbuff));
+            free(htmlbuff);
+        } else {
+            ret = _xmldb_writeall(fd, buffer, len);
+        }
+    }
+    free(buffer);
+    return ret;
+}
+
+/**
+ * Write a snapshot of the current schedule to the file pointed to by
+ * the specified descriptor
+ * @param fd
+ * @return -1 on failure, 0 otherwise
+ */
+int
+_writeXMLFile(const int fd) {
+    int oldhtml = htmlencode_flag;
+    htmlencode_flag = 0;
+    int ret = _writeXMLFileHTML(fd);
+    htmlencode_flag = oldhtml;
+    return ret;
+}
+
+/*
+ * writeXMLFile
+ * Dump a snapshot of the current schedule as an XML file.
+ */
+int
+writeXMLFile(const char *filename) {
+    struct recs_snapshot *s = recs_snapshot_get();
+    const int ret = s ? _xmldb_save(filename, s, 0) : -1;
+    recs_snapshot_put(s);
+    return ret;
+}
+
 /**
  * Initialize the recording database. This is a plain text file in XML format.
  * The full structure of the DB is defined with an XML RNG (grammar) stored in the
@@ -676,7 +948,32 @@ init_tvxmldb(void) {
             logmsg(LOG_ERR, "Failed to initialize xmldb datafile, check path and permissions. (%d : %s)", errno, strerror(errno));
             exit(EXIT_FAILURE);
         }
-    }        
+    }
+
+    // The binary snapshot written together with the XML DB is much faster to
+    // read back. The XML DB is only parsed if there is no snapshot that matches it.
+    unsigned generation = 0;
+    const int from_xml = -1 == read_dbsnap(xmldbfile, &generation);
+    const int ret = from_xml ? readXMLFile(xmldbfile, &generation) : 0;
+    if( -1 == ret ) {
+        logmsg(LOG_ERR, "Failed to read xmldb datafile '%s'.", xmldbfile);
+        exit(EXIT_FAILURE);
+    }
+
+    // Apply the changes made since the file was last written
+    xmldb_written = generation;
+    init_journal(generation, ret == 1);
+
+    pthread_t writer_thread;
+    if( 0 != pthread_create(&writer_thread, NULL, _xmldb_writer, NULL) ) {
+        logmsg(LOG_ERR, "Cannot start XML DB writer thread. ( %d : %s )", errno, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Write a new snapshot so the next startup does not have to parse the XML DB
+    if( from_xml ) {
+        request_xmldb_write();
+    }
 }
 
 /* tvxmldb.c */
@@ -42,13 +42,15 @@ extern "C" {
 /**
  * Read the XML DB from eth sepcified file
  * @param filename
- * @return -1 on failure, 0 otherwise
+ * @param[out] generation Generation of the journal that belongs to the file
+ * @return -1 on failure, 1 if the file is an older version that should be
+ * written again, 0 otherwise
  */
 int
-readXMLFile(const char *filename);
+readXMLFile(const char *filename, unsigned *generation);
 
 /**
- * Write the XML DB file to the specified file name
+ * Write a snapshot of the current schedule to the specified file name
  * @param filename
  * @return -1 on failure, 0 otherwise
  */
@@ -71,6 +73,28 @@ _writeXMLFileHTML(const int fd);
  */
 int _writeXMLFile(const int fd);
 
+/**
+ * Ask the writer thread to write the XML DB. Returns immediately. All requests
+ * made before the writer takes its next snapshot are written together.
+ */
+void
+request_xmldb_write(void);
+
+/**
+ * Write the XML DB now and wait until it is on disk. Must be called with
+ * recs_mutex held.
+ * @return 0 on success, -1 on failure
+ */
+int
+write_xmldb(void);
+
+/**
+ * Write the XML DB writer statistics to the given socket
+ * @param sockfd
+ */
+void
+xmldb_dump_stats(int sockfd);
+
 /**
  * Initialize the recording database. This is a plain text file in XML format.
  * The full structure of the DB is defined with an XML RNG (grammar) stored in the
@@ -0,0 +1,227 @@
+/* =========================================================================
+ * File:        UHASH.C
+ * Description: Open addressing hash table from unsigned keys to pointers.
+ *              Used to find recordings by sequence number and series id.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "uhash.h"
+
+/*
+ * UHASH_INITSIZE integer
+ * Number of slots in a new table
+ */
+#define UHASH_INITSIZE 64
+
+/**
+ * Home slot for a key. Sequence numbers are consecutive so they are spread over
+ * the table with a multiplicative (Fibonacci) hash.
+ * @param h
+ * @param key
+ * @return Slot index
+ */
+static size_t
+_uhash_slot(const struct uhash *h, unsigned key) {
+    return (size_t)(((uint32_t)key * UINT32_C(2654435769)) >> 7) & (h->size - 1);
+}
+
+/**
+ * Allocate the slots for a table of the given size
+ * @param h
+ * @param size
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_uhash_alloc(struct uhash *h, size_t size) {
+    h->keys = calloc(size, sizeof (unsigned));
+    h->vals = calloc(size, sizeof (void *));
+    if( h->keys == NULL || h->vals == NULL ) {
+        free(h->keys);
+        free(h->vals);
+        return -1;
+    }
+    h->size = size;
+    h->num = 0;
+    return 0;
+}
+
+/**
+ * Store a key that is known not to be in the table and with room for it
+ * @param h
+ * @param key
+ * @param val
+ */
+static void
+_uhash_store(struct uhash *h, unsigned key, void *val) {
+    size_t i = _uhash_slot(h, key);
+    while( h->keys[i] != 0 ) {
+        i = (i + 1) & (h->size - 1);
+    }
+    h->keys[i] = key;
+    h->vals[i] = val;
+    h->num++;
+}
+
+/**
+ * Double the size of the table
+ * @param h
+ * @return 0 on success, -1 if out of memory
+ */
+static int
+_uhash_grow(struct uhash *h) {
+    struct uhash old = *h;
+    if( -1 == _uhash_alloc(h, old.size * 2) ) {
+        *h = old;
+        return -1;
+    }
+    for(size_t i=0; i < old.size; i++) {
+        if( old.keys[i] != 0 ) {
+            _uhash_store(h, old.keys[i], old.vals[i]);
+        }
+    }
+    free(old.keys);
+    free(old.vals);
+    return 0;
+}
+
+/**
+ * Find the slot holding a key
+ * @param h
+ * @param key
+ * @return Slot index, h->size if the key is not in the table
+ */
+static size_t
+_uhash_find(const struct uhash *h, unsigned key) {
+    size_t i = _uhash_slot(h, key);
+    while( h->keys[i] != 0 ) {
+        if( h->keys[i] == key ) {
+            return i;
+        }
+        i = (i + 1) & (h->size - 1);
+    }
+    return h->size;
+}
+
+/**
+ * Initialize an empty table
+ * @param h
+ * @return 0 on success, -1 if out of memory
+ */
+int
+uhash_init(struct uhash *h) {
+    return _uhash_alloc(h, UHASH_INITSIZE);
+}
+
+/**
+ * Free the memory used by the table. The stored pointers are not touched.
+ * @param h
+ */
+void
+uhash_free(struct uhash *h) {
+    free(h->keys);
+    free(h->vals);
+    h->keys = NULL;
+    h->vals = NULL;
+    h->size = 0;
+    h->num = 0;
+}
+
+/**
+ * Find the value stored for a key
+ * @param h
+ * @param key
+ * @return The value, NULL if the key is not in the table
+ */
+void *
+uhash_get(const struct uhash *h, unsigned key) {
+    if( key == 0 ) {
+        return NULL;
+    }
+    const size_t i = _uhash_find(h, key);
+    return i < h->size ? h->vals[i] : NULL;
+}
+
+/**
+ * Store a value for a key. Any previous value for the key is replaced.
+ * @param h
+ * @param key Must not be 0
+ * @param val
+ * @return 0 on success, -1 if out of memory
+ */
+int
+uhash_put(struct uhash *h, unsigned key, void *val) {
+    if( key == 0 ) {
+        return -1;
+    }
+    const size_t i = _uhash_find(h, key);
+    if( i < h->size ) {
+        h->vals[i] = val;
+        return 0;
+    }
+    if( (h->num + 1) * 100 > h->size * UHASH_MAXLOAD && -1 == _uhash_grow(h) ) {
+        return -1;
+    }
+    _uhash_store(h, key, val);
+    return 0;
+}
+
+/**
+ * Remove a key from the table
+ * @param h
+ * @param key
+ * @return 0 on success, -1 if the key is not in the table
+ */
+int
+uhash_del(struct uhash *h, unsigned key) {
+    if( key == 0 ) {
+        return -1;
+    }
+    size_t i = _uhash_find(h, key);
+    if( i == h->size ) {
+        return -1;
+    }
+
+    // Move back any following entry in the same probe sequence whose home slot
+    // is not between the hole and the entry itself
+    const size_t mask = h->size - 1;
+    size_t j = i;
+    for(;;) {
+        j = (j + 1) & mask;
+        if( h->keys[j] == 0 ) {
+            break;
+        }
+        const size_t home = _uhash_slot(h, h->keys[j]);
+        if( ((j - home) & mask) >= ((j - i) & mask) ) {
+            h->keys[i] = h->keys[j];
+            h->vals[i] = h->vals[j];
+            i = j;
+        }
+    }
+    h->keys[i] = 0;
+    h->vals[i] = NULL;
+    h->num--;
+    return 0;
+}
@@ -0,0 +1,102 @@
+/* =========================================================================
+ * File:        UHASH.H
+ * Description: Open addressing hash table from unsigned keys to pointers.
+ *              Used to find recordings by sequence number and series id.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef UHASH_H
+#define	UHASH_H
+
+#include <stddef.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * Linear probing hash table. The key 0 marks an empty slot and can not be
+ * stored. Deleted entries are removed by moving the following entries in the
+ * probe sequence back so no tombstones are left and lookups stay short no
+ * matter how many inserts and deletes have been made. The table doubles in size
+ * when it is more than UHASH_MAXLOAD percent full.
+ */
+struct uhash {
+    unsigned *keys;
+    void **vals;
+    size_t size;                /* Number of slots. Always a power of two. */
+    size_t num;                 /* Number of stored keys */
+};
+
+/*
+ * UHASH_MAXLOAD integer
+ * Largest fill ratio in percent before the table is grown
+ */
+#define UHASH_MAXLOAD 70
+
+/**
+ * Initialize an empty table
+ * @param h
+ * @return 0 on success, -1 if out of memory
+ */
+int
+uhash_init(struct uhash *h);
+
+/**
+ * Free the memory used by the table. The stored pointers are not touched.
+ * @param h
+ */
+void
+uhash_free(struct uhash *h);
+
+/**
+ * Find the value stored for a key
+ * @param h
+ * @param key
+ * @return The value, NULL if the key is not in the table
+ */
+void *
+uhash_get(const struct uhash *h, unsigned key);
+
+/**
+ * Store a value for a key. Any previous value for the key is replaced.
+ * @param h
+ * @param key Must not be 0
+ * @param val
+ * @return 0 on success, -1 if out of memory
+ */
+int
+uhash_put(struct uhash *h, unsigned key, void *val);
+
+/**
+ * Remove a key from the table
+ * @param h
+ * @param key
+ * @return 0 on success, -1 if the key is not in the table
+ */
+int
+uhash_del(struct uhash *h, unsigned key);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* UHASH_H */
+
@@ -0,0 +1,214 @@
+/* =========================================================================
+ * File:        URING.C
+ * Description: Minimal io_uring wrapper used by the capture code. Talks to
+ *              the kernel directly through the system calls so that no
+ *              extra library is needed.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+// We want the full POSIX and C99 standard
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/*
+ * Older C libraries do not know about the io_uring system calls. The numbers
+ * are the same on all architectures that use the generic syscall table.
+ */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+#ifndef __NR_io_uring_register
+#define __NR_io_uring_register 427
+#endif
+
+/**
+ * Setup a new ring
+ * @param r
+ * @param entries Minimum number of submission queue entries
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int
+uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(r, 0, sizeof (struct uring));
+    memset(&p, 0, sizeof (struct io_uring_params));
+
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if( r->fd < 0 ) {
+        r->fd = -1;
+        return -1;
+    }
+
+    r->features = p.features;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if( r->sq_ptr == MAP_FAILED ) {
+        r->sq_ptr = NULL;
+        uring_exit(r);
+        return -1;
+    }
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_CQ_RING);
+    if( r->cq_ptr == MAP_FAILED ) {
+        r->cq_ptr = NULL;
+        uring_exit(r);
+        return -1;
+    }
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if( r->sqes == MAP_FAILED ) {
+        r->sqes = NULL;
+        uring_exit(r);
+        return -1;
+    }
+
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Release all resources held by the ring
+ * @param r
+ */
+void
+uring_exit(struct uring *r) {
+    if( r->sqes ) {
+        munmap(r->sqes, r->sqes_len);
+    }
+    if( r->cq_ptr ) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    if( r->sq_ptr ) {
+        munmap(r->sq_ptr, r->sq_len);
+    }
+    if( r->fd >= 0 ) {
+        close(r->fd);
+    }
+    memset(r, 0, sizeof (struct uring));
+    r->fd = -1;
+}
+
+/**
+ * Get the next free submission queue entry. The entry is cleared.
+ * @param r
+ * @return Pointer to the entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r) {
+    const unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if( r->sq_local - head >= r->sq_entries ) {
+        return NULL;
+    }
+    const unsigned idx = r->sq_local & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    r->sq_array[idx] = idx;
+    r->sq_local++;
+    memset(sqe, 0, sizeof (struct io_uring_sqe));
+    return sqe;
+}
+
+/**
+ * Submit all prepared entries and optionally wait for completions
+ * @param r
+ * @param wait_nr Minimum number of completions to wait for
+ * @return Number of entries submitted, -1 on failure (errno is set)
+ */
+int
+uring_submit(struct uring *r, unsigned wait_nr) {
+    // Everything the kernel has not consumed yet is submitted. This also picks up
+    // entries left over from an earlier call that was interrupted.
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    const unsigned tosubmit = r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if( tosubmit == 0 && wait_nr == 0 ) {
+        return 0;
+    }
+    return (int)syscall(__NR_io_uring_enter, r->fd, tosubmit, wait_nr,
+                        wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/**
+ * Return the oldest completion without removing it
+ * @param r
+ * @return Pointer to the completion, NULL if there is none
+ */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r) {
+    const unsigned head = *r->cq_head;
+    if( head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) ) {
+        return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+/**
+ * Mark the completion returned by uring_peek_cqe() as consumed
+ * @param r
+ */
+void
+uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register buffers for use with the fixed read and write operations
+ * @param r
+ * @param iov
+ * @param n
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int
+uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
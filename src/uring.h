@@ -0,0 +1,129 @@
+/* =========================================================================
+ * File:        URING.H
+ * Description: Minimal io_uring wrapper used by the capture code. Talks to
+ *              the kernel directly through the system calls so that no
+ *              extra library is needed.
+ * Author:      Johan Persson (johan162@gmail.com)
+ * SVN:         $Id$
+ *
+ * Copyright (C) 2009-2014 Johan Persson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>
+ * =========================================================================
+ */
+
+#ifndef URING_H
+#define	URING_H
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * One submission/completion queue pair. The rings are shared with the kernel
+ * through mmap() and only used by a single thread.
+ */
+struct uring {
+    int fd;
+    unsigned features;          /* IORING_FEAT_* flags reported by the kernel */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local;          /* Our tail, published to the kernel at submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+/**
+ * Setup a new ring
+ * @param r
+ * @param entries Minimum number of submission queue entries
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int
+uring_init(struct uring *r, unsigned entries);
+
+/**
+ * Release all resources held by the ring
+ * @param r
+ */
+void
+uring_exit(struct uring *r);
+
+/**
+ * Get the next free submission queue entry. The entry is cleared.
+ * @param r
+ * @return Pointer to the entry, NULL if the submission queue is full
+ */
+struct io_uring_sqe *
+uring_get_sqe(struct uring *r);
+
+/**
+ * Submit all prepared entries and optionally wait for completions
+ * @param r
+ * @param wait_nr Minimum number of completions to wait for
+ * @return Number of entries submitted, -1 on failure (errno is set)
+ */
+int
+uring_submit(struct uring *r, unsigned wait_nr);
+
+/**
+ * Return the oldest completion without removing it
+ * @param r
+ * @return Pointer to the completion, NULL if there is none
+ */
+struct io_uring_cqe *
+uring_peek_cqe(struct uring *r);
+
+/**
+ * Mark the completion returned by uring_peek_cqe() as consumed
+ * @param r
+ */
+void
+uring_cqe_seen(struct uring *r);
+
+/**
+ * Register buffers for use with the fixed read and write operations
+ * @param r
+ * @param iov
+ * @param n
+ * @return 0 on success, -1 on failure (errno is set)
+ */
+int
+uring_register_buffers(struct uring *r, const struct iovec *iov, unsigned n);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#endif	/* URING_H */
+
@@ -66,7 +66,8 @@
 #include "xstr.h"
 #include "tvplog.h"
 
-int htmlencode_flag;
+// Per thread since commands from the web and from clients run at the same time
+__thread int htmlencode_flag;
 
 /**
  * Debug version of close()
@@ -36,7 +36,7 @@ extern "C" {
 #endif
 
 
-extern int htmlencode_flag;
+extern __thread int htmlencode_flag;
 
 struct keypair_t {
     char key[255];
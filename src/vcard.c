@@ -34,6 +34,7 @@
 #include <fcntl.h>
 #include <syslog.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/param.h>
 
 #include "config.h"
@@ -129,46 +130,42 @@ setup_hw_parameters(int fd, struct transcoding_profile_entry *profile) {
     return 0;
 }
 
+/*
+ * Smoothed time (in ms) it has taken to setup each card for a recording. Used to
+ * decide how early a card must be prepared before the recording starts. The size
+ * is the same as the maximum number of encoder_devices/tuner_devices.
+ */
+static unsigned setup_latency[16];
+
+/*
+ * SETUP_LATENCY_WEIGHT integer
+ * Weight (1/n) of each new measurement in the smoothed setup latency
+ */
+#define SETUP_LATENCY_WEIGHT 4
+
 /**
- * Open the video device and tune it to the correct channels for the
- * next recording. The recording to be dealt with is stored in the structure
- * ongoing_rec[] for the specified video.
+ * Tune the card to the given channel (or input source) and set the HW encoder
+ * parameters from the profile. Used both when the card is setup for a new
+ * recording and when an open card is switched over to the next recording.
+ * The file descriptors are not closed.
  *
  * @param video
+ * @param fd Encoder file descriptor
+ * @param fdtuner Tuner file descriptor (same as fd if there is no separate tuner device)
+ * @param channel
  * @param profile
- * @return
+ * @return 0 on success, -1 on failure
  */
-int
-setup_video(unsigned video,struct transcoding_profile_entry *profile) {
-#ifndef DEBUG_SIMULATE
+static int
+_tune_video(unsigned video, int fd, int fdtuner, char *channel, struct transcoding_profile_entry *profile) {
+#ifdef DEBUG_SIMULATE
+    (void)video;
+    (void)fd;
+    (void)fdtuner;
+    (void)profile;
+#else
     char infobuff[256];
-    int fdtuner = -1;
-
-    logmsg(LOG_DEBUG, "setup_video() for video=%d",video);
-
-    int fd = video_open(video,FALSE);
-    if( fd == -1 ) {
-        return -1;
-    }
-
-    if( tuner_devices[video] ) {
-        fdtuner = video_open(video,TRUE);
-        if (fdtuner == -1) {
-            logmsg(LOG_ERR, "Cannot open video tuner device '%s' ( %d : %s )",
-                   tuner_devices[video], errno, strerror(errno));
-            video_close(fd);
-            return -1;
-        }
-
-    } else {
-
-        fdtuner = fd;
-    }
-
 #endif
-    // Give the driver some breathing room after we open the device
-    // and until we start changing the settings.
-    usleep(500000);
 
     if( external_switch ) {
 
@@ -187,7 +184,6 @@ setup_video(unsigned video,struct transcoding_profile_entry *profile) {
             // Check if user actually provided a tuning, error otherwise
             if( 0 == strnlen(external_tuner_station,15) ) {
                 logmsg(LOG_CRIT,"FATAL: external_tuner_station not specified in config file");
-                video_close(fdtuner);
                 return -1;
             }
 
@@ -202,11 +198,6 @@ setup_video(unsigned video,struct transcoding_profile_entry *profile) {
 
             if( ret == -1 ) {
                 logmsg(LOG_CRIT,"FATAL: Cannot set tuner to external channel ( %d : %s )",errno,strerror(errno));
-                video_close(fd);
-                if( fdtuner != fd && fdtuner > 0 ) {
-                    video_close(fdtuner);
-                }
-
                 return -1;
             }
 
@@ -225,63 +216,46 @@ setup_video(unsigned video,struct transcoding_profile_entry *profile) {
         int csfd = open(csname,O_RDONLY) ;
         if( csfd == -1 ) {
             logmsg(LOG_CRIT,"FATAL: Cannot open channel switch script '%s' ( %d : %s )",csname,errno,strerror(errno));
-#ifndef DEBUG_SIMULATE
-            video_close(fd);
-            if( fdtuner != fd && fdtuner > 0 ) {
-                video_close(fdtuner);
-            }
-#endif
             return -1;
         }
         close(csfd);
         char cmd[255];
-        snprintf(cmd,255,"%s -s %s > /dev/null 2>&1",csname,ongoing_recs[video]->channel);
+        snprintf(cmd,255,"%s -s %s > /dev/null 2>&1",csname,channel);
         logmsg(LOG_DEBUG,"setup_video(): Running external channel switching cmd '%s'",cmd);
         int rc = system(cmd);
         if( rc==-1 || WEXITSTATUS(rc)) {
             logmsg(LOG_CRIT,"FATAL: Channel switch script ended with error code : %d ",WEXITSTATUS(rc));
-#ifndef DEBUG_SIMULATE
-            video_close(fd);
-            if( fdtuner != fd && fdtuner > 0 ) {
-                video_close(fdtuner);
-            }
-#endif
             return -1;
         }
     } else {
 #ifdef DEBUG_SIMULATE
-        logmsg(LOG_DEBUG,"Simulating channel switch to %s",ongoing_recs[video]->channel);
+        logmsg(LOG_DEBUG,"Simulating channel switch to %s",channel);
 #else
         int ret,i=2;
-        ret = video_set_channel(fdtuner, ongoing_recs[video]->channel);
+        ret = video_set_channel(fdtuner, channel);
         while( ret == -1 && errno == EBUSY && i > 0 ) {
             usleep((unsigned)(500*(3-i)));
-            ret = video_set_channel(fdtuner, ongoing_recs[video]->channel);
+            ret = video_set_channel(fdtuner, channel);
             i--;
         }
 
         if( ret == -1 ) {
-            video_close(fd);
-            if( fdtuner != fd && fdtuner > 0 ) {
-                video_close(fdtuner);
-            }
-
             return -1;
         }
 
-        if( 0 == strncmp(ongoing_recs[video]->channel,INPUT_SOURCE_PREFIX,strlen(INPUT_SOURCE_PREFIX)) ) {
+        if( 0 == strncmp(channel,INPUT_SOURCE_PREFIX,strlen(INPUT_SOURCE_PREFIX)) ) {
 
             snprintf(infobuff,255,
                     "Setting up video %d HW MP2 encoder to take input from source '%s'",
-                    video,ongoing_recs[video]->channel);
+                    video,channel);
 
         } else {
 
             unsigned int freq=0;
-            getfreqfromstr(&freq, ongoing_recs[video]->channel);
+            getfreqfromstr(&freq, channel);
             snprintf(infobuff,255,
                      "Tuner #%02d (fd=%d) set to channel '%s' @ %.3fMHz",
-                     video, fdtuner, ongoing_recs[video]->channel, freq/1000000.0
+                     video, fdtuner, channel, freq/1000000.0
             );
 
         }
@@ -291,27 +265,152 @@ setup_video(unsigned video,struct transcoding_profile_entry *profile) {
             logmsg(LOG_DEBUG,"setup_video(): Adjusting HW encoder params for fd=%d, profile '%s'",
                    fd,profile->name);
             if( -1 == setup_hw_parameters(fd, profile) ) {
-                video_close(fd);
-                if( fdtuner != fd && fdtuner > 0 ) {
-                    video_close(fdtuner);
-                }
-
                 return -1;
             }
         }
 #endif
     }
+    return 0;
+}
+
+/**
+ * Open the video device and tune it to the correct channels for the
+ * next recording. The recording to be dealt with is stored in the structure
+ * ongoing_rec[] for the specified video.
+ *
+ * @param video
+ * @param profile
+ * @return
+ */
+static int
+_setup_video(unsigned video,struct transcoding_profile_entry *profile) {
+#ifndef DEBUG_SIMULATE
+    int fdtuner = -1;
+
+    logmsg(LOG_DEBUG, "setup_video() for video=%d",video);
+
+    int fd = video_open(video,FALSE);
+    if( fd == -1 ) {
+        return -1;
+    }
+
+    if( tuner_devices[video] ) {
+        fdtuner = video_open(video,TRUE);
+        if (fdtuner == -1) {
+            logmsg(LOG_ERR, "Cannot open video tuner device '%s' ( %d : %s )",
+                   tuner_devices[video], errno, strerror(errno));
+            video_close(fd);
+            return -1;
+        }
+
+    } else {
+
+        fdtuner = fd;
+    }
+#else
+    int fd = 0, fdtuner = 0;
+#endif
+    // Give the driver some breathing room after we open the device
+    // and until we start changing the settings.
+    usleep(500000);
+
+    int ret = _tune_video(video, fd, fdtuner, ongoing_recs[video]->channel, profile);
+
 #ifndef DEBUG_SIMULATE
     if( fdtuner != fd && fdtuner > 0 ) {
         video_close(fdtuner);
     }
+    if( ret == -1 ) {
+        video_close(fd);
+        return -1;
+    }
     return fd;
-
 #else
-    return 0;
+    return ret;
 #endif
 }
 
+/**
+ * Switch an open card over to a new channel and profile without closing the
+ * encoder. Used when one recording is handed over to the next on the same card.
+ * @param video
+ * @param fd Encoder file descriptor
+ * @param channel
+ * @param profile
+ * @return 0 on success, -1 on failure
+ */
+int
+switch_video(unsigned video, int fd, char *channel, struct transcoding_profile_entry *profile) {
+    int fdtuner = fd;
+
+    logmsg(LOG_DEBUG, "switch_video() for video=%d to '%s'",video,channel);
+#ifndef DEBUG_SIMULATE
+    if( tuner_devices[video] ) {
+        fdtuner = video_open(video,TRUE);
+        if (fdtuner == -1) {
+            logmsg(LOG_ERR, "Cannot open video tuner device '%s' ( %d : %s )",
+                   tuner_devices[video], errno, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+    int ret = _tune_video(video, fd, fdtuner, channel, profile);
+
+#ifndef DEBUG_SIMULATE
+    if( fdtuner != fd ) {
+        video_close(fdtuner);
+    }
+#endif
+    return ret;
+}
+
+/**
+ * Open the video device and tune it to the correct channels for the
+ * next recording and remember how long it took
+ * @param video
+ * @param profile
+ * @return The video file descriptor, -1 on failure
+ */
+int
+setup_video(unsigned video,struct transcoding_profile_entry *profile) {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int fd = _setup_video(video, profile);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if( fd != -1 && video < sizeof(setup_latency)/sizeof(setup_latency[0]) ) {
+        const unsigned ms = (unsigned)((t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000);
+        if( setup_latency[video] == 0 ) {
+            setup_latency[video] = ms;
+        } else {
+            setup_latency[video] = (setup_latency[video] * (SETUP_LATENCY_WEIGHT-1) + ms) / SETUP_LATENCY_WEIGHT;
+        }
+        logmsg(LOG_DEBUG,"Setup of video %d took %u ms (average %u ms)",video,ms,setup_latency[video]);
+    }
+    return fd;
+}
+
+/**
+ * Return how many seconds before the start of a recording the card should be
+ * prepared. This is the configured prewarm_lead but at least twice the average
+ * time it has taken to setup the card so the lead adapts to slow cards.
+ * @param video
+ * @return Lead time in seconds, 0 if pre-warming is disabled
+ */
+unsigned
+setup_video_lead(unsigned video) {
+    if( prewarm_lead == 0 ) {
+        return 0;
+    }
+    unsigned lead = (unsigned)prewarm_lead;
+    if( video < sizeof(setup_latency)/sizeof(setup_latency[0]) ) {
+        lead = MAX(lead, (2*setup_latency[video] + 999) / 1000);
+    }
+    return MIN(lead, PREWARM_MAX_LEAD);
+}
+
 /**
  * Setup the image and audio controls for the specified video card
  * @param fd
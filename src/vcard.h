@@ -39,9 +39,37 @@ extern "C" {
 int
 setup_hw_parameters(int fd, struct transcoding_profile_entry *profile);
 
+/**
+ * Open the video device and tune it to the correct channels for the
+ * next recording. The time it takes is measured for each card.
+ * @param video
+ * @param profile
+ * @return The video file descriptor, -1 on failure
+ */
 int
 setup_video(unsigned video,struct transcoding_profile_entry *profile);
 
+/**
+ * Switch an open card over to a new channel and profile without closing the
+ * encoder
+ * @param video
+ * @param fd Encoder file descriptor
+ * @param channel
+ * @param profile
+ * @return 0 on success, -1 on failure
+ */
+int
+switch_video(unsigned video, int fd, char *channel, struct transcoding_profile_entry *profile);
+
+/**
+ * Return how many seconds before the start of a recording the card should be
+ * setup. Adapts to the measured setup time of the card.
+ * @param video
+ * @return Lead time in seconds, 0 if pre-warming is disabled
+ */
+unsigned
+setup_video_lead(unsigned video);
+
 /**
  * Set the initial parameters for the TV-card so we know that they exist
  * and have a known state in case the profiles are not allowed to change